@@ -0,0 +1,504 @@
+// Copyright (c) 2023 VMWare, Inc. All rights reserved.
+// SPDX-License-Identifier: GPL-2.0
+
+#include "Benchmark.h"
+
+#include <chrono>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+using namespace cb_endpoint::bpf_probe;
+using namespace std::chrono;
+
+static const char *WORKLOAD_NAMES[] = {"exec", "file", "tcp", "udp", "dns"};
+static const size_t WORKLOAD_COUNT = sizeof(WORKLOAD_NAMES) / sizeof(WORKLOAD_NAMES[0]);
+
+// Short enough for workers to notice the stop flag promptly
+static const int SOCKET_TIMEOUT_MS = 100;
+
+bool Benchmark::ParseWorkloads(const std::string &list, uint32_t &workloads)
+{
+    std::stringstream names(list);
+    std::string name;
+
+    workloads = 0;
+    while (std::getline(names, name, ','))
+    {
+        bool found = (name == "all");
+
+        if (found)
+        {
+            workloads |= WORKLOAD_ALL;
+        }
+
+        for (size_t i = 0; i < WORKLOAD_COUNT && !found; i++)
+        {
+            if (name == WORKLOAD_NAMES[i])
+            {
+                workloads |= (1U << i);
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            printf("Unknown workload: %s\n", name.c_str());
+            return false;
+        }
+    }
+
+    return workloads != 0;
+}
+
+Benchmark::Benchmark(IBpfApi &bpf_api, uint32_t workloads, unsigned int seconds)
+    : m_bpf_api(bpf_api)
+    , m_workloads(workloads)
+    , m_seconds(seconds)
+    , m_stop(false)
+    , m_threads()
+    , m_event_count(0)
+    , m_drop_count(0)
+    , m_elapsed_sec(0)
+    , m_consumer_cpu_sec(0)
+    , m_workload_cpu_sec(0)
+{
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+    {
+        m_stats[i].name = WORKLOAD_NAMES[i];
+        m_stats[i].ops = 0;
+        m_stats[i].started = false;
+    }
+
+    memset(m_type_count, 0, sizeof(m_type_count));
+}
+
+Benchmark::~Benchmark()
+{
+    StopWorkloads();
+}
+
+void Benchmark::OnEvent(Data data)
+{
+    m_event_count += 1;
+    m_type_count[data.data->header.type] += 1;
+
+    delete [] data.data;
+}
+
+void Benchmark::OnDropped(uint64_t drop_count)
+{
+    m_drop_count += drop_count;
+}
+
+double Benchmark::CpuSeconds(const struct rusage &usage)
+{
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Called by every workload thread on its way out
+void Benchmark::AddWorkloadCpu()
+{
+    struct rusage usage = {};
+
+    if (getrusage(RUSAGE_THREAD, &usage) == 0)
+    {
+        std::lock_guard<std::mutex> lock(m_cpu_lock);
+
+        m_workload_cpu_sec += CpuSeconds(usage);
+    }
+}
+
+bool Benchmark::StartWorkloads()
+{
+    using WorkloadFn = void (Benchmark::*)(WorkloadStats &);
+    static const WorkloadFn workload_fns[] = {
+        &Benchmark::RunExec,
+        &Benchmark::RunFile,
+        &Benchmark::RunTcp,
+        &Benchmark::RunUdp,
+        &Benchmark::RunDns,
+    };
+
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+    {
+        if (!(m_workloads & (1U << i)))
+        {
+            continue;
+        }
+
+        auto &stats = m_stats[i];
+        auto fn = workload_fns[i];
+
+        stats.started = true;
+        m_threads.emplace_back([this, &stats, fn]() {
+            (this->*fn)(stats);
+            AddWorkloadCpu();
+        });
+    }
+
+    return !m_threads.empty();
+}
+
+void Benchmark::StopWorkloads()
+{
+    m_stop = true;
+
+    for (auto &thread : m_threads)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+    m_threads.clear();
+}
+
+bool Benchmark::Run()
+{
+    struct rusage consumer_start = {};
+    struct rusage consumer_end = {};
+    struct rusage children_start = {};
+    struct rusage children_end = {};
+    bool result = true;
+
+    auto didRegister = m_bpf_api.RegisterEventCallback(
+        [this](Data data) { OnEvent(data); },
+        [this](uint64_t drop_count) { OnDropped(drop_count); });
+    if (!didRegister)
+    {
+        printf("Failed to register callback\n");
+        return false;
+    }
+
+    getrusage(RUSAGE_CHILDREN, &children_start);
+    getrusage(RUSAGE_THREAD, &consumer_start);
+
+    auto start = steady_clock::now();
+    auto deadline = start + seconds(m_seconds);
+
+    if (!StartWorkloads())
+    {
+        printf("No workload to run\n");
+        return false;
+    }
+
+    while (result && steady_clock::now() < deadline)
+    {
+        result = m_bpf_api.PollEvents() >= 0;
+    }
+
+    StopWorkloads();
+
+    // Pick up what the workload produced right before it stopped
+    auto drain_deadline = steady_clock::now() + milliseconds(IBpfApi::POLL_TIMEOUT_MS);
+    while (result && steady_clock::now() < drain_deadline)
+    {
+        result = m_bpf_api.PollEvents() >= 0;
+    }
+
+    m_elapsed_sec = duration<double>(steady_clock::now() - start).count();
+
+    getrusage(RUSAGE_THREAD, &consumer_end);
+    getrusage(RUSAGE_CHILDREN, &children_end);
+
+    m_consumer_cpu_sec = CpuSeconds(consumer_end) - CpuSeconds(consumer_start);
+
+    // Exec'd children are part of the workload
+    m_workload_cpu_sec += CpuSeconds(children_end) - CpuSeconds(children_start);
+
+    if (!result)
+    {
+        printf("Poll data Error\n");
+    }
+
+    return result;
+}
+
+void Benchmark::PrintReport() const
+{
+    double elapsed = m_elapsed_sec > 0 ? m_elapsed_sec : 1;
+    uint64_t total = m_event_count + m_drop_count;
+
+    printf("\nBenchmark ran %.2fs\n", m_elapsed_sec);
+
+    printf("\n%-8s %12s %12s\n", "workload", "ops", "ops/sec");
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+    {
+        auto &stats = m_stats[i];
+
+        if (!stats.started)
+        {
+            continue;
+        }
+
+        printf("%-8s %12lu %12.0f %s\n", stats.name, (unsigned long)stats.ops.load(),
+               stats.ops.load() / elapsed, stats.error.c_str());
+    }
+
+    printf("\n%-26s %12s %12s\n", "event", "count", "events/sec");
+    for (size_t type = 0; type < sizeof(m_type_count) / sizeof(m_type_count[0]); type++)
+    {
+        if (!m_type_count[type])
+        {
+            continue;
+        }
+
+        printf("%-26s %12lu %12.0f\n", BpfApi::TypeToString(type),
+               (unsigned long)m_type_count[type], m_type_count[type] / elapsed);
+    }
+    printf("%-26s %12lu %12.0f\n", "TOTAL", (unsigned long)m_event_count, m_event_count / elapsed);
+    printf("%-26s %12lu %11.2f%%\n", "DROPPED", (unsigned long)m_drop_count,
+           total ? 100.0 * m_drop_count / total : 0.0);
+
+    printf("\nCPU time: workload %.2fs (%.1f%%) consumer %.2fs (%.1f%%)\n",
+           m_workload_cpu_sec, 100.0 * m_workload_cpu_sec / elapsed,
+           m_consumer_cpu_sec, 100.0 * m_consumer_cpu_sec / elapsed);
+}
+
+static void SetRecvTimeout(int fd)
+{
+    struct timeval tv = {0, SOCKET_TIMEOUT_MS * 1000};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// Binds a UDP or TCP socket to 127.0.0.1, port 0 picks any free port
+static int BindLoopback(int type, uint16_t port, struct sockaddr_in &addr)
+{
+    socklen_t addr_len = sizeof(addr);
+    int fd = socket(AF_INET, type, 0);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        getsockname(fd, (struct sockaddr *)&addr, &addr_len))
+    {
+        close(fd);
+        return -1;
+    }
+
+    SetRecvTimeout(fd);
+    return fd;
+}
+
+void Benchmark::RunExec(WorkloadStats &stats)
+{
+    while (!m_stop)
+    {
+        pid_t pid = fork();
+
+        if (pid == 0)
+        {
+            execl("/bin/true", "true", (char *)nullptr);
+            _exit(127);
+        }
+
+        if (pid < 0)
+        {
+            stats.error = "fork failed";
+            break;
+        }
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        stats.ops++;
+    }
+}
+
+void Benchmark::RunFile(WorkloadStats &stats)
+{
+    char path[] = "/tmp/check_probe_bench_XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+    {
+        stats.error = "mkstemp failed";
+        return;
+    }
+    close(fd);
+
+    while (!m_stop)
+    {
+        fd = open(path, O_RDWR);
+        if (fd < 0)
+        {
+            stats.error = "open failed";
+            break;
+        }
+
+        close(fd);
+        stats.ops++;
+    }
+
+    unlink(path);
+}
+
+void Benchmark::RunTcp(WorkloadStats &stats)
+{
+    struct sockaddr_in addr;
+    int listen_fd = BindLoopback(SOCK_STREAM, 0, addr);
+
+    if (listen_fd < 0 || listen(listen_fd, 128))
+    {
+        stats.error = "cannot listen on loopback";
+        if (listen_fd >= 0)
+        {
+            close(listen_fd);
+        }
+        return;
+    }
+
+    std::thread acceptor([this, listen_fd]() {
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+
+        while (!m_stop)
+        {
+            if (poll(&pfd, 1, SOCKET_TIMEOUT_MS) > 0)
+            {
+                int fd = accept(listen_fd, nullptr, nullptr);
+
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+        }
+        AddWorkloadCpu();
+    });
+
+    while (!m_stop)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (fd < 0)
+        {
+            stats.error = "socket failed";
+            break;
+        }
+
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            stats.ops++;
+        }
+        close(fd);
+    }
+
+    acceptor.join();
+    close(listen_fd);
+}
+
+void Benchmark::RunUdp(WorkloadStats &stats)
+{
+    struct sockaddr_in addr;
+    int recv_fd = BindLoopback(SOCK_DGRAM, 0, addr);
+    char buf[64] = "check_probe";
+
+    if (recv_fd < 0)
+    {
+        stats.error = "cannot bind loopback";
+        return;
+    }
+
+    // A fresh socket per datagram so every send goes through the socket
+    // setup probes too. The flow cache zeroes the local port of sends, so
+    // these still fold into a single flow.
+    while (!m_stop)
+    {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (fd < 0)
+        {
+            stats.error = "socket failed";
+            break;
+        }
+
+        if (sendto(fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, sizeof(addr)) > 0 &&
+            recv(recv_fd, buf, sizeof(buf), 0) > 0)
+        {
+            stats.ops++;
+        }
+        close(fd);
+    }
+
+    close(recv_fd);
+}
+
+void Benchmark::RunDns(WorkloadStats &stats)
+{
+    // A query for example.com IN A
+    static const uint8_t query[] = {
+        0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x03, 'c', 'o', 'm', 0x00,
+        0x00, 0x01, 0x00, 0x01,
+    };
+    struct sockaddr_in addr;
+
+    // The probe only reports answers coming from port 53
+    int server_fd = BindLoopback(SOCK_DGRAM, 53, addr);
+    if (server_fd < 0)
+    {
+        stats.error = "cannot bind 127.0.0.1:53";
+        return;
+    }
+
+    std::thread responder([this, server_fd]() {
+        uint8_t buf[512];
+
+        while (!m_stop)
+        {
+            struct sockaddr_in peer;
+            socklen_t peer_len = sizeof(peer);
+            ssize_t len = recvfrom(server_fd, buf, sizeof(buf), 0,
+                                   (struct sockaddr *)&peer, &peer_len);
+
+            // Echo the question back marked as a response
+            if (len > 3)
+            {
+                buf[2] |= 0x80;
+                sendto(server_fd, buf, len, 0, (struct sockaddr *)&peer, peer_len);
+            }
+        }
+        AddWorkloadCpu();
+    });
+
+    while (!m_stop)
+    {
+        uint8_t answer[512];
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (fd < 0)
+        {
+            stats.error = "socket failed";
+            break;
+        }
+
+        SetRecvTimeout(fd);
+        if (sendto(fd, query, sizeof(query), 0, (struct sockaddr *)&addr, sizeof(addr)) > 0 &&
+            recv(fd, answer, sizeof(answer), 0) > 0)
+        {
+            stats.ops++;
+        }
+        close(fd);
+    }
+
+    responder.join();
+    close(server_fd);
+}
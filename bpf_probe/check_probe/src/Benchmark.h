@@ -0,0 +1,87 @@
+// Copyright (c) 2023 VMWare, Inc. All rights reserved.
+// SPDX-License-Identifier: GPL-2.0
+
+#pragma once
+
+#include "BpfApi.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace cb_endpoint {
+namespace bpf_probe {
+
+    // Drives a synthetic workload against an attached probe and counts what
+    // comes out the other end without printing it, so the numbers reflect
+    // the probe and not the terminal.
+    class Benchmark
+    {
+    public:
+        enum Workload : uint32_t
+        {
+            WORKLOAD_EXEC = 0x01,   // fork and exec /bin/true
+            WORKLOAD_FILE = 0x02,   // open and close a scratch file
+            WORKLOAD_TCP  = 0x04,   // loopback connect and accept
+            WORKLOAD_UDP  = 0x08,   // loopback datagrams from fresh sockets
+            WORKLOAD_DNS  = 0x10,   // queries and answers on 127.0.0.1:53
+            WORKLOAD_ALL  = 0x1f,
+        };
+
+        // Comma separated workload names, e.g. "exec,file,udp"
+        static bool ParseWorkloads(const std::string &list, uint32_t &workloads);
+
+        Benchmark(IBpfApi &bpf_api, uint32_t workloads, unsigned int seconds);
+        ~Benchmark();
+
+        bool Run();
+
+        void PrintReport() const;
+
+    private:
+        struct WorkloadStats
+        {
+            const char           *name;
+            std::atomic<uint64_t> ops;
+            bool                  started;
+            std::string           error;
+        };
+
+        void OnEvent(Data data);
+        void OnDropped(uint64_t drop_count);
+
+        bool StartWorkloads();
+        void StopWorkloads();
+        void AddWorkloadCpu();
+
+        void RunExec(WorkloadStats &stats);
+        void RunFile(WorkloadStats &stats);
+        void RunTcp(WorkloadStats &stats);
+        void RunUdp(WorkloadStats &stats);
+        void RunDns(WorkloadStats &stats);
+
+        static double CpuSeconds(const struct rusage &usage);
+
+        IBpfApi                  &m_bpf_api;
+        const uint32_t            m_workloads;
+        const unsigned int        m_seconds;
+
+        std::atomic<bool>         m_stop;
+        std::vector<std::thread>  m_threads;
+        WorkloadStats             m_stats[5];
+
+        uint64_t                  m_event_count;
+        uint64_t                  m_type_count[256];
+        uint64_t                  m_drop_count;
+        double                    m_elapsed_sec;
+        double                    m_consumer_cpu_sec;
+
+        std::mutex                m_cpu_lock;
+        double                    m_workload_cpu_sec;
+    };
+}
+}
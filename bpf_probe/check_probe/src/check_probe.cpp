@@ -3,6 +3,7 @@
 
 #include "BpfApi.h"
 #include "BpfProgram.h"
+#include "Benchmark.h"
 
 #include "sensor.skel.h"
 
@@ -23,6 +24,7 @@ static void PrintUsage();
 static void ParseArgs(int argc, char** argv);
 static void ReadProbeSource(const std::string &probe_source);
 static bool LoadProbe(BpfApi & bpf_api, const std::string &bpf_program);
+static void PrintLoadStats(const BpfLoadStats &stats);
 static void ProbeEventCallback(Data data);
 static void DroppedCallback(uint64_t drop_count);
 static std::string EventToBlobStrings(const data *event);
@@ -34,6 +36,9 @@ static void CompatFilePathData(std::stringstream &output,
 static std::string s_bpf_program;
 static bool read_events = false;
 static bool try_bcc_first = false;
+static std::string pin_path;
+static unsigned int benchmark_seconds = 0;
+static uint32_t benchmark_workloads = Benchmark::WORKLOAD_ALL;
 static unsigned int verbosity = 0;
 
 static int libbpf_print_fn(enum libbpf_print_level level,
@@ -78,6 +83,15 @@ int main(int argc, char *argv[])
 
     printf("Probe loaded!\n");
 
+    if (benchmark_seconds)
+    {
+        Benchmark benchmark(*bpf_api, benchmark_workloads, benchmark_seconds);
+
+        bool result = benchmark.Run();
+        benchmark.PrintReport();
+        return result ? 0 : 1;
+    }
+
     if (read_events)
     {
         auto didRegister = bpf_api->RegisterEventCallback(ProbeEventCallback,
@@ -110,6 +124,9 @@ static void PrintUsage()
     printf(" -r - read events after loading probe\n");
     printf(" -L - try loading libbpf first\n");
     printf(" -B - try loading BCC first\n");
+    printf(" -P - bpffs directory to pin and reuse libbpf programs\n");
+    printf(" -b - run the benchmark workload for this many seconds, events are counted not printed\n");
+    printf(" -w - comma separated benchmark workloads: exec,file,tcp,udp,dns or all (default)\n");
     printf(" -v - Add verbosity\n");
 }
 
@@ -122,12 +139,15 @@ static void ParseArgs(int argc, char** argv)
         {"read-events",         no_argument,       nullptr, 'r'},
         {"try-bcc-first",       no_argument,       nullptr, 'B'},
         {"try-libbpf-first",    no_argument,       nullptr, 'L'},
+        {"pin-path",            required_argument, nullptr, 'P'},
+        {"benchmark",           required_argument, nullptr, 'b'},
+        {"workload",            required_argument, nullptr, 'w'},
         {"verbose",             no_argument,       nullptr, 'v'},
         {nullptr, 0,       nullptr, 0}};
 
     while(true)
     {
-        int opt = getopt_long(argc, argv, "hp:rLBv", long_options, &option_index);
+        int opt = getopt_long(argc, argv, "hp:rLBP:b:w:v", long_options, &option_index);
         if(-1 == opt) break;
 
         switch(opt)
@@ -141,6 +161,24 @@ static void ParseArgs(int argc, char** argv)
             case 'B':
                 try_bcc_first = true;
                 break;
+            case 'P':
+                pin_path = optarg;
+                break;
+            case 'b':
+                benchmark_seconds = strtoul(optarg, nullptr, 10);
+                if (!benchmark_seconds)
+                {
+                    PrintUsage();
+                    exit(1);
+                }
+                break;
+            case 'w':
+                if (!Benchmark::ParseWorkloads(optarg, benchmark_workloads))
+                {
+                    PrintUsage();
+                    exit(1);
+                }
+                break;
             case 'p':
                 ReadProbeSource(optarg);
                 break;
@@ -203,6 +241,8 @@ static bool LoadProbe(BpfApi & bpf_api, const std::string &bpf_program)
         preferred_instance = "Libbpf";
     }
 
+    bpf_api.SetPinPath(pin_path);
+
     bool init = bpf_api.Init(bpf_program, try_bcc_first);
     if (!init)
     {
@@ -215,6 +255,11 @@ static bool LoadProbe(BpfApi & bpf_api, const std::string &bpf_program)
     printf("PreferredInstance: %s InstanceType: %s\n", preferred_instance,
            BpfApi::InstanceTypeToString(instance_type));
 
+    if (instance_type == BpfApi::ProgInstanceType::Libbpf)
+    {
+        PrintLoadStats(bpf_api.GetLoadStats());
+    }
+
     if (!BpfProgram::InstallHooks(bpf_api, BpfProgram::DEFAULT_HOOK_LIST))
     {
         printf("Failed to attach a probe hook: %s\n",
@@ -225,6 +270,25 @@ static bool LoadProbe(BpfApi & bpf_api, const std::string &bpf_program)
     return true;
 }
 
+static void PrintLoadStats(const BpfLoadStats &stats)
+{
+    printf("Load time: %.3fms (open %.3fms load %.3fms) feature cache: %s\n",
+           stats.total_ns / 1e6, stats.open_ns / 1e6, stats.load_ns / 1e6,
+           stats.features_cached ? "hit" : "miss");
+
+    if (verbosity < 1)
+    {
+        return;
+    }
+
+    for (auto &prog : stats.programs)
+    {
+        const char *state = prog.reused ? "reused" : (prog.loaded ? "verified" : "skipped");
+
+        printf("  %-45s %-8s %.3fms\n", prog.name.c_str(), state, prog.verify_ns / 1e6);
+    }
+}
+
 static void DroppedCallback(uint64_t drop_count)
 {
     std::cout << "DROPPED EVENTS:" << drop_count << std::endl;
@@ -281,6 +345,17 @@ void ProbeEventCallback(Data data)
             CompatFilePathData(output, data.data);
         }
 
+        if (data.data->header.type == EVENT_NET_FLOW_SUMMARY)
+        {
+            auto flow_data = reinterpret_cast<const net_flow_data *>(data.data);
+
+            output << " [";
+            PrintNetEvent(output, data.data);
+            output << "tx:" << flow_data->tx_packets << "/" << flow_data->tx_bytes << "B"
+                   << " rx:" << flow_data->rx_packets << "/" << flow_data->rx_bytes << "B"
+                   << " duration_ns:" << (flow_data->last_seen - flow_data->first_seen) << "]";
+        }
+
         if (data.data->header.type == EVENT_PROCESS_EXEC_RESULT)
         {
             auto exec_result = reinterpret_cast<const exec_data *>(data.data);
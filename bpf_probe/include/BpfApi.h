@@ -4,9 +4,13 @@
 #pragma once
 
 #include "bcc_sensor.h"
+#include "BpfMap.h"
 #include <functional>
+#include <map>
 #include <memory>
 #include <list>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <chrono>
 #include <sys/epoll.h>
@@ -69,6 +73,32 @@ namespace bpf_probe {
     };
     using EventList = std::list<Data>;
 
+    // Where the time went during the last libbpf Init
+    struct BpfLoadStats
+    {
+        struct Program
+        {
+            std::string name;
+            bool        loaded;     // false when its hook target is missing
+            bool        reused;     // taken from bpffs, not verified again
+            uint64_t    verify_ns;  // approximate, from the kernel's load_time
+        };
+
+        uint64_t             open_ns;
+        uint64_t             load_ns;
+        uint64_t             total_ns;
+        bool                 features_cached;
+        std::vector<Program> programs;
+
+        BpfLoadStats()
+            : open_ns(0)
+            , load_ns(0)
+            , total_ns(0)
+            , features_cached(false)
+        {
+        }
+    };
+
     class IBpfApi
     {
     public:
@@ -77,6 +107,8 @@ namespace bpf_probe {
         using DroppedCallbackFn = std::function<void(uint64_t drop_count)>;
 
         static const uint64_t POLL_TIMEOUT_MS = 300;
+        // Active UDP flows report their counters this often, idle ones are expired after it
+        static const uint64_t NET_FLOW_REPORT_NS = 30ULL * 1000 * 1000 * 1000;
         static constexpr int  MAX_PERCPU_BUFFER_SIZE = (1024 * 4096);
 
         enum class ProbeType
@@ -122,6 +154,21 @@ namespace bpf_probe {
 
         virtual libbpf_print_fn_t SetLibBpfLogCallback(libbpf_print_fn_t log_fn) = 0;
 
+        // Bulk maintenance of the probe's maps, e.g. seeding filters or
+        // resetting dedup caches. keys and values are packed arrays laid out
+        // like the map's own key and value types. Only the libbpf instance
+        // supports this.
+        virtual bool UpdateMapBatch(const char *map_name,
+                                    const void *keys,
+                                    const void *values,
+                                    uint32_t    count) = 0;
+
+        virtual bool DeleteMapBatch(const char *map_name,
+                                    const void *keys,
+                                    uint32_t    count) = 0;
+
+        virtual bool ClearMap(const char *map_name) = 0;
+
         const std::string &GetErrorMessage() const
         {
             return m_ErrorMessage;
@@ -132,6 +179,26 @@ namespace bpf_probe {
             return m_ProgInstanceType;
         }
 
+        const BpfLoadStats &GetLoadStats() const
+        {
+            return m_LoadStats;
+        }
+
+        // Where libbpf Init remembers which hook targets the kernel has.
+        // An empty path disables the cache.
+        void SetFeatureCachePath(const std::string &path)
+        {
+            m_FeatureCachePath = path;
+        }
+
+        // bpffs directory to pin programs and maps in so the next Init can
+        // reuse them without verifying again. Off by default since pinned
+        // maps are shared by every instance using the same path.
+        void SetPinPath(const std::string &path)
+        {
+            m_PinPath = path;
+        }
+
         static const char *InstanceTypeToString(const ProgInstanceType &progInstanceType)
         {
             const char *str = "Unknown";
@@ -169,6 +236,7 @@ namespace bpf_probe {
             case EVENT_FILE_CLOSE: str = "FILE_CLOSE"; break;
             case EVENT_FILE_RENAME: str = "FILE_RENAME"; break;
             case EVENT_CONTAINER_CREATE: str = "CONTAINER_CREATE"; break;
+            case EVENT_NET_FLOW_SUMMARY: str = "NET_FLOW_SUMMARY"; break;
             default: break;
             }// LCOV_EXCL_END
             return str;
@@ -195,6 +263,9 @@ namespace bpf_probe {
         EventCallbackFn             m_eventCallbackFn;
         DroppedCallbackFn           m_DroppedCallbackFn;
         ProgInstanceType            m_ProgInstanceType;
+        BpfLoadStats                m_LoadStats;
+        std::string                 m_FeatureCachePath;
+        std::string                 m_PinPath;
     };
 
     class BpfApi
@@ -204,6 +275,14 @@ namespace bpf_probe {
         using CpuList = std::vector<int>;
         using PerfReaderList = std::vector<struct perf_reader *>;
         using EpollEventData = std::unique_ptr<epoll_event[]>;
+        // Raw cgroup blob of each process, keyed on tgid
+        using TaskContextMap = std::unordered_map<uint32_t, std::string>;
+        // Time each context was first found missing from the probe's cache
+        using TaskContextStaleMap = std::unordered_map<uint32_t, uint64_t>;
+        // Programs taken from bpffs, keyed on program name
+        using PinnedProgMap = std::map<std::string, int>;
+
+        static const char *DEFAULT_FEATURE_CACHE_PATH;
 
         BpfApi();
         virtual ~BpfApi();
@@ -241,6 +320,17 @@ namespace bpf_probe {
 
         libbpf_print_fn_t SetLibBpfLogCallback(libbpf_print_fn_t log_fn) override;
 
+        bool UpdateMapBatch(const char *map_name,
+                            const void *keys,
+                            const void *values,
+                            uint32_t    count) override;
+
+        bool DeleteMapBatch(const char *map_name,
+                            const void *keys,
+                            uint32_t    count) override;
+
+        bool ClearMap(const char *map_name) override;
+
         static int default_libbpf_log(enum libbpf_print_level level,
                                       const char *format,
                                       va_list args);
@@ -250,8 +340,23 @@ namespace bpf_probe {
         bool Init_bcc(const std::string & bpf_program);
         bool Init_libbpf();
 
+        // Keeps libbpf from loading programs whose hook target is missing
+        void DisableUnusablePrograms();
+
+        // Takes programs from bpffs when a complete set of pins matches this
+        // kernel and sensor build, and points the maps at their pins
+        bool ReusePinnedObjects();
+        void PinPrograms();
+        void ClosePinnedObjects();
+        void CollectLoadStats(uint64_t load_end_ns);
+
+        bool AttachPinned(int perf_fd, const char *bpf_prog);
+
         void LookupSyscallName(const char * name, std::string & syscall_name);
 
+        // Returns nullptr and sets the error message when the map is unknown
+        BpfMap *GetMap(const char *map_name);
+
         // Returns True when kptr_restrict value was obtained
         bool GetKptrRestrict(long &kptr_restrict_value);
 
@@ -267,6 +372,17 @@ namespace bpf_probe {
         void OnEvent(bpf_probe::Data data);
         void OnDropped(uint64_t drop_count);
 
+        // Remembers or restores the task context of compact events
+        void RestoreTaskContext(bpf_probe::Data &data);
+        void ForgetTaskContext(uint32_t tgid);
+        void ClearTaskContextCache();
+
+        // Drops the contexts the probe no longer has cached
+        void ExpireTaskContexts();
+
+        // Reports and removes UDP flows that went idle
+        void ExpireNetFlows();
+
         static bool on_perf_peek(int cpu, void *cb_cookie, void *data, int data_size);
         static void on_perf_submit(void *cb_cookie, void *data, int data_size);
         static void on_perf_dropped(void *cb_cookie, uint64_t drop_count);
@@ -290,6 +406,15 @@ namespace bpf_probe {
         CpuList                     m_ncpu;
         PerfReaderList              m_perf_reader;
         EpollEventData              m_epoll_data;
+        TaskContextMap              m_task_ctx;
+        TaskContextStaleMap         m_task_ctx_stale;
+        uint64_t                    m_last_delivered_time;
+        std::map<std::string, BpfMap> m_maps;
+        uint64_t                    m_last_flow_expire;
+        uint64_t                    m_last_task_ctx_expire;
+        std::string                 m_pin_dir;
+        PinnedProgMap               m_pinned_progs;
+        std::vector<int>            m_pinned_links;
 
         // C style function pointer.
         libbpf_print_fn_t           m_log_fn;
@@ -0,0 +1,66 @@
+/* Copyright (c) 2023 VMWare, Inc. All rights reserved. */
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+
+namespace cb_endpoint {
+namespace bpf_probe {
+
+    // Remembers which kprobe and tracepoint targets the running kernel has.
+    //
+    // Finding out means reading kallsyms which is slow, so results are saved
+    // to a file and reused as long as the file format, the kernel build id
+    // and the set of loaded modules do not change.
+    class BpfFeatureCache
+    {
+    public:
+        explicit BpfFeatureCache(const std::string &path);
+
+        // Reads the saved results, returns false if they were missing or stale
+        bool Load();
+
+        // Writes the results back if anything new was probed
+        bool Save();
+
+        bool HasKprobeTarget(const std::string &func);
+
+        bool HasTracepoint(const std::string &category, const std::string &name);
+
+        // GNU build id of the running kernel, or its release and version
+        // strings when the build id is not exposed
+        const std::string &GetKernelBuildId() const
+        {
+            return m_build_id;
+        }
+
+        bool IsFromCache() const
+        {
+            return m_from_cache;
+        }
+
+        static std::string ReadKernelBuildId();
+
+        // Hash of the names of the loaded kernel modules
+        static std::string ReadModulesId();
+
+        static const char *GetTracingDir();
+
+    private:
+        bool ProbeKprobeTarget(const std::string &func);
+        void LoadKernelSymbols();
+
+        const std::string           m_path;
+        std::string                 m_build_id;
+        std::string                 m_modules_id;
+        std::map<std::string, bool> m_features;
+        std::set<std::string>       m_symbols;
+        bool                        m_symbols_loaded;
+        bool                        m_dirty;
+        bool                        m_from_cache;
+    };
+}
+}
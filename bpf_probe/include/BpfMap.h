@@ -0,0 +1,69 @@
+/* Copyright (c) 2023 VMWare, Inc. All rights reserved. */
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace cb_endpoint {
+namespace bpf_probe {
+
+    // Bulk access to a BPF map from user space.
+    //
+    // Uses the BPF_MAP_*_BATCH commands (Linux 5.6+) so a whole set of
+    // entries costs one syscall per chunk instead of one per entry. When the
+    // kernel or map type does not support them we fall back to the per
+    // element commands and remember that for the rest of this map's life.
+    class BpfMap
+    {
+    public:
+        using Buffer = std::vector<uint8_t>;
+
+        // Entries moved per batch syscall
+        static const uint32_t BATCH_SIZE = 4096;
+
+        BpfMap(int fd, uint32_t key_size, uint32_t value_size);
+
+        bool IsValid() const
+        {
+            return m_fd >= 0 && m_key_size && m_value_size;
+        }
+
+        // keys and values are packed arrays of count entries
+        bool Update(const void *keys, const void *values, uint32_t count, uint64_t flags = 0);
+
+        bool Delete(const void *keys, uint32_t count);
+
+        bool Lookup(const void *key, void *value);
+
+        // Removes one entry and returns the value it held when it was
+        // removed. Hash maps only support this from Linux 5.14, before that
+        // it is a lookup followed by a delete.
+        bool LookupAndDelete(const void *key, void *value);
+
+        // Appends every entry in the map to the packed keys and values
+        bool Dump(Buffer &keys, Buffer &values);
+
+        bool Clear();
+
+        bool UsesBatchOps() const
+        {
+            return m_use_batch;
+        }
+
+    private:
+        static bool IsUnsupported(int err);
+
+        bool UpdateEach(const uint8_t *keys, const uint8_t *values, uint32_t count, uint64_t flags);
+        bool DeleteEach(const uint8_t *keys, uint32_t count);
+        bool DumpEach(Buffer &keys, Buffer &values);
+
+        int      m_fd;
+        uint32_t m_key_size;
+        uint32_t m_value_size;
+        bool     m_use_batch;
+        bool     m_use_lookup_and_delete;
+    };
+}
+}
@@ -151,6 +151,32 @@ namespace tdd_mock {
         {
             return nullptr;
         }
+
+        bool UpdateMapBatch(const char *map_name,
+                            const void *keys,
+                            const void *values,
+                            uint32_t    count) override
+        {
+            ::mock(BPF_API_SCOPE)
+                .actualCall(__FUNCTION__);
+            return ::mock(BPF_API_SCOPE).boolReturnValue();
+        }
+
+        bool DeleteMapBatch(const char *map_name,
+                            const void *keys,
+                            uint32_t    count) override
+        {
+            ::mock(BPF_API_SCOPE)
+                .actualCall(__FUNCTION__);
+            return ::mock(BPF_API_SCOPE).boolReturnValue();
+        }
+
+        bool ClearMap(const char *map_name) override
+        {
+            ::mock(BPF_API_SCOPE)
+                .actualCall(__FUNCTION__);
+            return ::mock(BPF_API_SCOPE).boolReturnValue();
+        }
     };
 }
 }
@@ -45,6 +45,7 @@ enum event_type
     EVENT_FILE_CLOSE,
     EVENT_FILE_RENAME,
     EVENT_CONTAINER_CREATE,
+    EVENT_NET_FLOW_SUMMARY,
 };
 
 #define REPORT_FLAGS_COMPAT     0x0000
@@ -52,6 +53,9 @@ enum event_type
 #define REPORT_FLAGS_DYNAMIC    0x0001
 #define REPORT_FLAGS_DENTRY     0x0002
 #define REPORT_FLAGS_TASK_DATA  0x0004
+// Task context (cgroup blob) was omitted because user space already has it.
+// BpfApi restores it before handing the event to the client.
+#define REPORT_FLAGS_TASK_CTX_CACHED 0x0008
 
 struct data_header {
     uint64_t event_time; // Time the event collection started.  (Same across message parts.)
@@ -185,6 +189,51 @@ struct net_data {
     uint16_t remote_port;
 };
 
+// Cumulative counters of a UDP flow since it was first reported
+struct net_flow_data {
+    struct net_data net_data;
+
+    uint64_t first_seen;    // event_time clock of the packet that opened the flow
+    uint64_t last_seen;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+};
+
+#ifndef BCC_SEC
+// UDP flow maps ip_cache and ip6_cache, shared with user space to expire flows.
+// The port of the "client" side is zeroed in the key. See track_ip_flow.
+struct ip_key {
+    uint32_t pid;
+    uint16_t remote_port;
+    uint16_t local_port;
+    uint32_t remote_addr;
+    uint32_t local_addr;
+};
+
+struct ip6_key {
+    uint32_t pid;
+    uint16_t remote_port;
+    uint16_t local_port;
+    uint32_t remote_addr6[4];
+    uint32_t local_addr6[4];
+};
+
+#define FLOW_TX 0x01
+#define FLOW_RX 0x02
+struct ip_entry {
+    uint8_t  flow;
+    uint64_t first_seen;
+    uint64_t last_seen;
+    uint64_t last_report;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+};
+#endif /* BCC_SEC */
+
 struct net_data_compat {
     struct net_data net_data;
     struct extra_task_data extra;
@@ -289,6 +338,7 @@ struct _file_event {
         struct data_x      _data_x;
         struct dns_data_x  _dns_data_x;
         struct net_data_x  _net_data_x;
+        struct net_flow_data _net_flow_data;
     };
 };
 
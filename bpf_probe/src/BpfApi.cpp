@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include "BpfApi.h"
+#include "BpfFeatureCache.h"
 #include "bcc_sensor.h"
 
 #include "sensor.skel.h"
@@ -15,16 +16,24 @@
 // real libbpf from conan package
 #include <bpf/libbpf.h>
 
+#include <algorithm>
 #include <climits>
+#include <cstring>
+#include <sstream>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <chrono>
 #include <exception>
+#include <unordered_set>
 #include <boost/filesystem.hpp>
 
 #include <sys/epoll.h>
 #include <sys/resource.h>   // Only for setrlimit()
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <time.h>
+#include <unistd.h>
 
 using namespace cb_endpoint::bpf_probe;
 using namespace std::chrono;
@@ -36,6 +45,27 @@ namespace fs = boost::filesystem;
 #define DEBUG_HARVEST(BLOCK)
 //#define DEBUG_HARVEST(BLOCK) BLOCK while(0)
 
+const char *BpfApi::DEFAULT_FEATURE_CACHE_PATH = "/var/tmp/cb_bpf_probe/features";
+
+static uint64_t GetClockNs(clockid_t clock_id)
+{
+    struct timespec ts = {};
+
+    clock_gettime(clock_id, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+static uint64_t GetMonotonicNs()
+{
+    return GetClockNs(CLOCK_MONOTONIC);
+}
+
+// Same clock as the load_time the kernel reports for programs
+static uint64_t GetBootNs()
+{
+    return GetClockNs(CLOCK_BOOTTIME);
+}
+
 BpfApi::BpfApi()
     : m_BPF(nullptr)
     , m_try_libbpf(true)
@@ -50,13 +80,19 @@ BpfApi::BpfApi()
     , m_has_lru_hash(false)
     , m_skel(nullptr)
     , m_epoll_fd(-1)
+    , m_last_delivered_time(0)
+    , m_last_flow_expire(0)
+    , m_last_task_ctx_expire(0)
     , m_log_fn(nullptr)
 {
     m_ProgInstanceType = BpfApi::ProgInstanceType::Uninitialized;
+    m_FeatureCachePath = DEFAULT_FEATURE_CACHE_PATH;
 }
 
 BpfApi::~BpfApi()
 {
+    ClosePinnedObjects();
+
     if (m_skel)
     {
         sensor_bpf__destroy(m_skel);
@@ -102,6 +138,10 @@ bool BpfApi::Init_libbpf()
     // TODO: Remove when using libbpf 1.0.0+ aka BCC v0.25.0+
     (void)setrlimit(RLIMIT_MEMLOCK, &rlim_new);
 
+    auto start = steady_clock::now();
+
+    m_LoadStats = BpfLoadStats();
+
     m_skel = sensor_bpf__open();
     if (!m_skel)
     {
@@ -124,12 +164,38 @@ bool BpfApi::Init_libbpf()
         // m_skel->rodata->USE_RINGBUF = 1;
     // }
 
+    // Events of known processes may omit their context, we rebuild it in PollEvents
+    m_skel->rodata->USE_TASK_CTX_CACHE = 1;
+    m_skel->rodata->NET_FLOW_REPORT_NS = NET_FLOW_REPORT_NS;
+
+    m_LoadStats.open_ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+    DisableUnusablePrograms();
+    bool reused = ReusePinnedObjects();
+
+    auto load_start = steady_clock::now();
     if (sensor_bpf__load(m_skel))
     {
         Reset();
 
         return false;
     }
+    m_LoadStats.load_ns = duration_cast<nanoseconds>(steady_clock::now() - load_start).count();
+
+    CollectLoadStats(GetBootNs());
+
+    if (reused)
+    {
+        // The pinned cache still holds contexts delivered to whoever used
+        // the probe before us.
+        ClearTaskContextCache();
+    }
+    else if (!m_pin_dir.empty())
+    {
+        PinPrograms();
+    }
+
+    m_LoadStats.total_ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
 
     // TODO: Log if using ringbuf or perf buffer here
 
@@ -138,6 +204,270 @@ bool BpfApi::Init_libbpf()
     return true;
 }
 
+void BpfApi::DisableUnusablePrograms()
+{
+    BpfFeatureCache features(m_FeatureCachePath);
+    struct bpf_program *prog = nullptr;
+
+    m_LoadStats.features_cached = features.Load();
+
+    bpf_object__for_each_program(prog, m_skel->obj)
+    {
+        std::string section = bpf_program__section_name(prog);
+        bool usable = true;
+
+        if (section.compare(0, 7, "kprobe/") == 0)
+        {
+            usable = features.HasKprobeTarget(section.substr(7));
+        }
+        else if (section.compare(0, 10, "kretprobe/") == 0)
+        {
+            usable = features.HasKprobeTarget(section.substr(10));
+        }
+        else if (section.compare(0, 11, "tracepoint/") == 0)
+        {
+            auto sep = section.find('/', 11);
+
+            if (sep != std::string::npos)
+            {
+                usable = features.HasTracepoint(section.substr(11, sep - 11),
+                                                section.substr(sep + 1));
+            }
+        }
+
+        // Attaching would fail anyway, do not pay for verifying it
+        if (!usable)
+        {
+            IGNORE_UNUSED_RETURN_VALUE(bpf_program__set_autoload(prog, false));
+        }
+    }
+
+    IGNORE_UNUSED_RETURN_VALUE(features.Save());
+}
+
+// Names every pin directory this sensor creates under m_PinPath
+static const char *PIN_DIR_PREFIX = "sensor-";
+
+// Pins only match the exact object, config and kernel they were made with
+static std::string GetPinFingerprint(const struct sensor_bpf *skel)
+{
+    std::string build_id = BpfFeatureCache::ReadKernelBuildId();
+    uint64_t hash = 14695981039346656037ULL;
+    auto add = [&hash](const void *data, size_t len) {
+        auto bytes = static_cast<const uint8_t *>(data);
+
+        for (size_t i = 0; i < len; i++)
+        {
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        }
+    };
+
+    add(build_id.data(), build_id.size());
+    add(skel->skeleton->data, skel->skeleton->data_sz);
+    add(skel->rodata, sizeof(*skel->rodata));
+
+    std::ostringstream fingerprint;
+    fingerprint << std::hex << hash;
+    return fingerprint.str();
+}
+
+bool BpfApi::ReusePinnedObjects()
+{
+    struct bpf_program *prog = nullptr;
+    struct bpf_map *map = nullptr;
+    boost::system::error_code ec;
+    bool complete = true;
+
+    m_pin_dir.clear();
+    if (m_PinPath.empty())
+    {
+        return false;
+    }
+
+    std::string pin_name = PIN_DIR_PREFIX + GetPinFingerprint(m_skel);
+    m_pin_dir = m_PinPath + "/" + pin_name;
+
+    // Pins of other kernels or sensor builds are never used again. The pin
+    // path may be shared, so only directories named by us are removed.
+    for (fs::directory_iterator it(m_PinPath, ec), end; !ec && it != end; it.increment(ec))
+    {
+        std::string name = it->path().filename().string();
+        boost::system::error_code remove_ec;
+
+        if (name != pin_name &&
+            name.compare(0, strlen(PIN_DIR_PREFIX), PIN_DIR_PREFIX) == 0 &&
+            fs::is_directory(it->symlink_status()))
+        {
+            IGNORE_UNUSED_RETURN_VALUE(fs::remove_all(it->path(), remove_ec));
+        }
+    }
+
+    fs::create_directories(m_pin_dir + "/maps", ec);
+    fs::create_directories(m_pin_dir + "/progs", ec);
+    if (ec)
+    {
+        m_ErrorMessage = "Failed to create pin directory: " + m_pin_dir;
+        m_pin_dir.clear();
+        return false;
+    }
+
+    // libbpf reuses maps that are already pinned and pins the ones it
+    // creates. Internal maps like .rodata stay private, pinned programs
+    // hold on to their own.
+    bpf_object__for_each_map(map, m_skel->obj)
+    {
+        const char *name = bpf_map__name(map);
+
+        if (!name || strchr(name, '.'))
+        {
+            continue;
+        }
+
+        std::string path = m_pin_dir + "/maps/" + name;
+        if (!fs::exists(path))
+        {
+            complete = false;
+        }
+
+        IGNORE_UNUSED_RETURN_VALUE(bpf_map__set_pin_path(map, path.c_str()));
+    }
+
+    // Programs reference the maps they were loaded with so they may only
+    // be reused together, and only when every wanted program is there.
+    bpf_object__for_each_program(prog, m_skel->obj)
+    {
+        if (!complete)
+        {
+            break;
+        }
+
+        if (!bpf_program__autoload(prog))
+        {
+            continue;
+        }
+
+        std::string name = bpf_program__name(prog);
+        int fd = bpf_obj_get((m_pin_dir + "/progs/" + name).c_str());
+
+        if (fd < 0)
+        {
+            complete = false;
+            break;
+        }
+
+        m_pinned_progs[name] = fd;
+    }
+
+    if (!complete)
+    {
+        ClosePinnedObjects();
+        return false;
+    }
+
+    for (auto &pinned : m_pinned_progs)
+    {
+        prog = bpf_object__find_program_by_name(m_skel->obj, pinned.first.c_str());
+        IGNORE_UNUSED_RETURN_VALUE(bpf_program__set_autoload(prog, false));
+    }
+
+    return true;
+}
+
+void BpfApi::PinPrograms()
+{
+    struct bpf_program *prog = nullptr;
+
+    bpf_object__for_each_program(prog, m_skel->obj)
+    {
+        if (bpf_program__fd(prog) < 0)
+        {
+            continue;
+        }
+
+        std::string path = m_pin_dir + "/progs/" + bpf_program__name(prog);
+
+        // Left over from a partial set
+        IGNORE_UNUSED_RETURN_VALUE(unlink(path.c_str()));
+
+        // Not fatal, the next Init just verifies again
+        if (bpf_program__pin(prog, path.c_str()))
+        {
+            m_ErrorMessage = "Failed to pin: " + std::string(bpf_program__name(prog));
+        }
+    }
+}
+
+void BpfApi::ClosePinnedObjects()
+{
+    for (auto perf_fd : m_pinned_links)
+    {
+        IGNORE_UNUSED_RETURN_VALUE(bpf_close_perf_event_fd(perf_fd));
+    }
+    m_pinned_links.clear();
+
+    for (auto &pinned : m_pinned_progs)
+    {
+        close(pinned.second);
+    }
+    m_pinned_progs.clear();
+}
+
+void BpfApi::CollectLoadStats(uint64_t load_end_ns)
+{
+    struct bpf_program *prog = nullptr;
+    std::vector<std::pair<uint64_t, size_t>> starts;
+
+    bpf_object__for_each_program(prog, m_skel->obj)
+    {
+        BpfLoadStats::Program stats;
+        int fd = bpf_program__fd(prog);
+
+        stats.name = bpf_program__name(prog);
+        stats.reused = m_pinned_progs.find(stats.name) != m_pinned_progs.end();
+        stats.loaded = stats.reused || fd >= 0;
+        stats.verify_ns = 0;
+
+        if (fd >= 0)
+        {
+            struct bpf_prog_info info = {};
+            uint32_t info_len = sizeof(info);
+
+            if (bpf_obj_get_info(fd, &info, &info_len) == 0 && info.load_time)
+            {
+                starts.emplace_back(info.load_time, m_LoadStats.programs.size());
+            }
+        }
+
+        m_LoadStats.programs.push_back(stats);
+    }
+
+    // The kernel stamps load_time right before running the verifier and
+    // libbpf loads one program after the other, so each program took until
+    // the next one started.
+    std::sort(starts.begin(), starts.end());
+    for (size_t i = 0; i < starts.size(); i++)
+    {
+        uint64_t end = (i + 1 < starts.size()) ? starts[i + 1].first : load_end_ns;
+
+        if (end > starts[i].first)
+        {
+            m_LoadStats.programs[starts[i].second].verify_ns = end - starts[i].first;
+        }
+    }
+}
+
+bool BpfApi::AttachPinned(int perf_fd, const char *bpf_prog)
+{
+    if (perf_fd < 0)
+    {
+        m_ErrorMessage = "Failed to attach: " + std::string(bpf_prog);
+        return false;
+    }
+
+    m_pinned_links.push_back(perf_fd);
+    return true;
+}
+
 bool BpfApi::Init_bcc(const std::string & bpf_program)
 {
     m_BPF = std::unique_ptr<ebpf::BPF>(new ebpf::BPF());
@@ -226,6 +556,10 @@ bool BpfApi::Init(const std::string & bpf_program, bool try_bcc_first)
 void BpfApi::Reset()
 {
     m_ProgInstanceType = BpfApi::ProgInstanceType::Uninitialized;
+    m_task_ctx.clear();
+    m_task_ctx_stale.clear();
+    m_maps.clear();
+    ClosePinnedObjects();
 
     if (m_skel)
     {
@@ -397,6 +731,20 @@ bool BpfApi::AttachLibbpf(const struct libbpf_kprobe &kprobe)
         return false;
     }
 
+    // Reused from bpffs, libbpf never loaded it so attach the fd directly
+    auto pinned = m_pinned_progs.find(kprobe.bpf_prog);
+    if (pinned != m_pinned_progs.end())
+    {
+        std::string ev_name = std::string(kprobe.is_retprobe ? "r_" : "p_") + kprobe.target_func;
+
+        return AttachPinned(bpf_attach_kprobe(pinned->second,
+                                              kprobe.is_retprobe ? BPF_PROBE_RETURN : BPF_PROBE_ENTRY,
+                                              ev_name.c_str(),
+                                              kprobe.target_func,
+                                              0, 0),
+                            kprobe.bpf_prog);
+    }
+
     prog = bpf_object__find_program_by_name(m_skel->obj, kprobe.bpf_prog);
     if (prog)
     {
@@ -432,6 +780,13 @@ bool BpfApi::AttachLibbpf(const struct libbpf_tracepoint &tp)
         return false;
     }
 
+    auto pinned = m_pinned_progs.find(tp.bpf_prog);
+    if (pinned != m_pinned_progs.end())
+    {
+        return AttachPinned(bpf_attach_tracepoint(pinned->second, tp.tp_category, tp.tp_name),
+                            tp.bpf_prog);
+    }
+
     prog = bpf_object__find_program_by_name(m_skel->obj, tp.bpf_prog);
     if (prog)
     {
@@ -639,6 +994,12 @@ int BpfApi::PollEvents()
         }
     }
 
+    if (m_skel)
+    {
+        ExpireNetFlows();
+        ExpireTaskContexts();
+    }
+
     // Were events collected during this pass?
     //  This can be false even if events are available in the queuue since the peek function will cause us to stop reading
     //  events once we reach the target delta.
@@ -686,8 +1047,19 @@ int BpfApi::PollEvents()
                      m_last_event_time = event_time;
                 });
 
+                // The client owns the event after the callback
+                auto is_exit = (data.data->header.type == EVENT_PROCESS_EXIT);
+                auto tgid = data.data->header.pid;
+
+                m_last_delivered_time = std::max(m_last_delivered_time, data.GetEventTime());
+                RestoreTaskContext(data);
                 m_eventCallbackFn(std::move(data));
 
+                if (is_exit)
+                {
+                    m_task_ctx.erase(tgid);
+                    m_task_ctx_stale.erase(tgid);
+                }
             }
 
             // Erase the events that we sent
@@ -791,12 +1163,444 @@ void BpfApi::OnEvent(bpf_probe::Data data)
 
 void BpfApi::OnDropped(uint64_t drop_count)
 {
+    // A lost event may have carried context we rely on, so make the probe resend it
+    ClearTaskContextCache();
+
     if (m_DroppedCallbackFn)
     {
         m_DroppedCallbackFn(drop_count);
     }
 }
 
+static bpf_probe::data *NewFlowSummary(uint64_t now, uint32_t pid, const ip_entry &entry)
+{
+    auto event = reinterpret_cast<net_flow_data *>(new (std::nothrow) char[sizeof(net_flow_data)]);
+    if (!event)
+    {
+        return nullptr;
+    }
+
+    memset(event, 0, sizeof(*event));
+    event->net_data.header.event_time = now;
+    event->net_data.header.type = EVENT_NET_FLOW_SUMMARY;
+    event->net_data.header.state = PP_NO_EXTRA_DATA;
+    event->net_data.header.report_flags = REPORT_FLAGS_COMPAT;
+    event->net_data.header.payload = sizeof(*event);
+    event->net_data.header.pid = pid;
+    event->net_data.header.tid = pid;
+    event->net_data.protocol = IPPROTO_UDP;
+
+    event->first_seen = entry.first_seen;
+    event->last_seen = entry.last_seen;
+    event->tx_packets = entry.tx_packets;
+    event->tx_bytes = entry.tx_bytes;
+    event->rx_packets = entry.rx_packets;
+    event->rx_bytes = entry.rx_bytes;
+
+    return reinterpret_cast<bpf_probe::data *>(event);
+}
+
+//
+// Takes the flows of a flow map that saw no packet for a full report interval
+// out of the map. The probe only reports counters when a packet arrives, so
+// this is where the tail of a flow gets reported.
+//
+// The dump is a snapshot, so each candidate is checked again before it is
+// removed. A flow that saw a packet since then stays, and the entry is taken
+// with its counters as they were at removal.
+//
+template <typename KeyT>
+static void TakeIdleFlows(BpfMap &map, uint64_t now, std::vector<KeyT> &keys, std::vector<ip_entry> &entries)
+{
+    BpfMap::Buffer raw_keys;
+    BpfMap::Buffer raw_values;
+
+    if (!map.Dump(raw_keys, raw_values))
+    {
+        return;
+    }
+
+    auto all_keys = reinterpret_cast<const KeyT *>(raw_keys.data());
+    auto all_entries = reinterpret_cast<const ip_entry *>(raw_values.data());
+
+    for (size_t i = 0; i < raw_keys.size() / sizeof(KeyT); i++)
+    {
+        ip_entry entry;
+
+        if (now <= all_entries[i].last_seen ||
+            now - all_entries[i].last_seen < IBpfApi::NET_FLOW_REPORT_NS)
+        {
+            continue;
+        }
+
+        if (!map.Lookup(&all_keys[i], &entry) || entry.last_seen != all_entries[i].last_seen)
+        {
+            continue;
+        }
+
+        if (map.LookupAndDelete(&all_keys[i], &entry))
+        {
+            keys.push_back(all_keys[i]);
+            entries.push_back(entry);
+        }
+    }
+}
+
+void BpfApi::ExpireNetFlows()
+{
+    // Same clock as bpf_ktime_get_ns
+    uint64_t now = GetMonotonicNs();
+
+    if (now - m_last_flow_expire < NET_FLOW_REPORT_NS)
+    {
+        return;
+    }
+    m_last_flow_expire = now;
+
+    auto ip_map = GetMap("ip_cache");
+    if (ip_map)
+    {
+        std::vector<ip_key> keys;
+        std::vector<ip_entry> entries;
+
+        TakeIdleFlows(*ip_map, now, keys, entries);
+
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            // Nothing happened since the last summary
+            if (entries[i].last_seen <= entries[i].last_report)
+            {
+                continue;
+            }
+
+            auto event = NewFlowSummary(now, keys[i].pid, entries[i]);
+            if (event)
+            {
+                auto net_data = &reinterpret_cast<net_flow_data *>(event)->net_data;
+
+                net_data->ipver = AF_INET;
+                net_data->local_port = keys[i].local_port;
+                net_data->remote_port = keys[i].remote_port;
+                net_data->local_addr = keys[i].local_addr;
+                net_data->remote_addr = keys[i].remote_addr;
+                OnEvent(event);
+            }
+        }
+    }
+
+    auto ip6_map = GetMap("ip6_cache");
+    if (ip6_map)
+    {
+        std::vector<ip6_key> keys;
+        std::vector<ip_entry> entries;
+
+        TakeIdleFlows(*ip6_map, now, keys, entries);
+
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            if (entries[i].last_seen <= entries[i].last_report)
+            {
+                continue;
+            }
+
+            auto event = NewFlowSummary(now, keys[i].pid, entries[i]);
+            if (event)
+            {
+                auto net_data = &reinterpret_cast<net_flow_data *>(event)->net_data;
+
+                net_data->ipver = AF_INET6;
+                net_data->local_port = keys[i].local_port;
+                net_data->remote_port = keys[i].remote_port;
+                memcpy(net_data->local_addr6, keys[i].local_addr6, sizeof(net_data->local_addr6));
+                memcpy(net_data->remote_addr6, keys[i].remote_addr6, sizeof(net_data->remote_addr6));
+                OnEvent(event);
+            }
+        }
+    }
+}
+
+// Locates the cgroup blob of dynamic events that describe the current task
+static struct blob_ctx *GetCgroupBlob(bpf_probe::data *event)
+{
+    switch (event->header.type)
+    {
+    case EVENT_PROCESS_EXEC_ARG:
+        return &reinterpret_cast<exec_arg_data *>(event)->cgroup_blob;
+
+    case EVENT_PROCESS_EXIT:
+        return &reinterpret_cast<data_x *>(event)->cgroup_blob;
+
+    case EVENT_PROCESS_EXEC_PATH:
+    case EVENT_FILE_READ:
+    case EVENT_FILE_WRITE:
+    case EVENT_FILE_CREATE:
+    case EVENT_FILE_PATH:
+    case EVENT_FILE_DELETE:
+    case EVENT_FILE_CLOSE:
+    case EVENT_FILE_MMAP:
+        return &reinterpret_cast<file_path_data_x *>(event)->cgroup_blob;
+
+    case EVENT_NET_CONNECT_PRE:
+    case EVENT_NET_CONNECT_ACCEPT:
+        return &reinterpret_cast<net_data_x *>(event)->cgroup_blob;
+
+    case EVENT_NET_CONNECT_DNS_RESPONSE:
+        return &reinterpret_cast<dns_data_x *>(event)->cgroup_blob;
+
+    case EVENT_FILE_RENAME:
+        return &reinterpret_cast<rename_data_x *>(event)->cgroup_blob;
+
+    // EVENT_PROCESS_CLONE describes the child and never comes compact
+    default:
+        break;
+    }
+
+    return nullptr;
+}
+
+// The probe omits the cgroup blob of a process once we have seen it. Keep the
+// last full context of each process and append it back to compact events so
+// the client never has to know about the cache. The fixed header fields stay
+// in every event, they are part of the layout clients read and the blob is
+// most of the size anyway.
+void BpfApi::RestoreTaskContext(bpf_probe::Data &data)
+{
+    auto event = data.data;
+
+    if (!m_skel || !(event->header.report_flags & REPORT_FLAGS_DYNAMIC))
+    {
+        return;
+    }
+
+    auto cgroup_blob = GetCgroupBlob(event);
+    if (!cgroup_blob)
+    {
+        return;
+    }
+
+    uint32_t tgid = event->header.pid;
+
+    if (!(event->header.report_flags & REPORT_FLAGS_TASK_CTX_CACHED))
+    {
+        auto &task_ctx = m_task_ctx[tgid];
+
+        // The probe caches this context again
+        m_task_ctx_stale.erase(tgid);
+
+        if (cgroup_blob->size &&
+            (uint32_t)cgroup_blob->offset + cgroup_blob->size <= event->header.payload)
+        {
+            task_ctx.assign(reinterpret_cast<const char *>(event) + cgroup_blob->offset,
+                            cgroup_blob->size);
+        }
+        else
+        {
+            task_ctx.clear();
+        }
+        return;
+    }
+
+    event->header.report_flags &= ~REPORT_FLAGS_TASK_CTX_CACHED;
+
+    auto it = m_task_ctx.find(tgid);
+    if (it == m_task_ctx.end())
+    {
+        // We never saw the full context, most likely due to a drop. Deliver
+        // the event without it and make the probe resend it next time.
+        ForgetTaskContext(tgid);
+        return;
+    }
+
+    const std::string &task_ctx = it->second;
+    uint32_t payload = event->header.payload;
+
+    if (task_ctx.empty() || payload + task_ctx.size() > UINT16_MAX)
+    {
+        return;
+    }
+
+    auto restored = reinterpret_cast<bpf_probe::data *>(new (std::nothrow) char[payload + task_ctx.size()]);
+    if (!restored)
+    {
+        return;
+    }
+
+    memcpy(restored, event, payload);
+    memcpy(reinterpret_cast<char *>(restored) + payload, task_ctx.data(), task_ctx.size());
+
+    cgroup_blob = GetCgroupBlob(restored);
+    cgroup_blob->offset = static_cast<uint16_t>(payload);
+    cgroup_blob->size = static_cast<uint16_t>(task_ctx.size());
+    restored->header.payload = payload + task_ctx.size();
+
+    delete [] reinterpret_cast<char *>(event);
+    data.data = restored;
+}
+
+void BpfApi::ForgetTaskContext(uint32_t tgid)
+{
+    m_task_ctx.erase(tgid);
+    m_task_ctx_stale.erase(tgid);
+
+    auto map = m_skel ? GetMap("task_ctx_cache") : nullptr;
+    if (map)
+    {
+        map->Delete(&tgid, 1);
+    }
+}
+
+void BpfApi::ClearTaskContextCache()
+{
+    auto map = m_skel ? GetMap("task_ctx_cache") : nullptr;
+    if (map)
+    {
+        map->Clear();
+    }
+}
+
+// How often the contexts are checked against the probe's cache
+static const uint64_t TASK_CTX_EXPIRE_NS = 10ULL * 1000 * 1000 * 1000;
+
+// Contexts are normally dropped with the exit event. When exits are dropped
+// or the LRU in the probe evicts a process first, the probe sends the full
+// context again before any new compact event. Compact events it sent before
+// that may still be waiting in the sort window or the perf buffers though,
+// so a context is only dropped once every event up to the time it was found
+// missing has been delivered.
+void BpfApi::ExpireTaskContexts()
+{
+    uint64_t now = GetMonotonicNs();
+
+    if (m_task_ctx.empty() || now - m_last_task_ctx_expire < TASK_CTX_EXPIRE_NS)
+    {
+        return;
+    }
+    m_last_task_ctx_expire = now;
+
+    auto map = GetMap("task_ctx_cache");
+    BpfMap::Buffer raw_keys;
+    BpfMap::Buffer raw_values;
+
+    if (!map || !map->Dump(raw_keys, raw_values))
+    {
+        return;
+    }
+
+    auto keys = reinterpret_cast<const uint32_t *>(raw_keys.data());
+    std::unordered_set<uint32_t> cached(keys, keys + raw_keys.size() / sizeof(uint32_t));
+
+    for (auto it = m_task_ctx.begin(); it != m_task_ctx.end();)
+    {
+        auto stale = m_task_ctx_stale.find(it->first);
+
+        if (cached.count(it->first))
+        {
+            if (stale != m_task_ctx_stale.end())
+            {
+                m_task_ctx_stale.erase(stale);
+            }
+            ++it;
+        }
+        else if (stale == m_task_ctx_stale.end())
+        {
+            m_task_ctx_stale.emplace(it->first, now);
+            ++it;
+        }
+        else if (stale->second <= m_last_delivered_time)
+        {
+            m_task_ctx_stale.erase(stale);
+            it = m_task_ctx.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+BpfMap *BpfApi::GetMap(const char *map_name)
+{
+    if (!m_skel || !map_name)
+    {
+        m_ErrorMessage = "Map access requires the libbpf instance";
+        return nullptr;
+    }
+
+    auto it = m_maps.find(map_name);
+    if (it != m_maps.end())
+    {
+        return &it->second;
+    }
+
+    auto map = bpf_object__find_map_by_name(m_skel->obj, map_name);
+    if (!map)
+    {
+        m_ErrorMessage = "Failed to find map: " + std::string(map_name);
+        return nullptr;
+    }
+
+    auto result = m_maps.emplace(map_name, BpfMap(bpf_map__fd(map),
+                                                  bpf_map__key_size(map),
+                                                  bpf_map__value_size(map)));
+    return &result.first->second;
+}
+
+bool BpfApi::UpdateMapBatch(const char *map_name,
+                            const void *keys,
+                            const void *values,
+                            uint32_t    count)
+{
+    auto map = GetMap(map_name);
+    if (!map)
+    {
+        return false;
+    }
+
+    if (!map->Update(keys, values, count))
+    {
+        m_ErrorMessage = "Failed to update map: " + std::string(map_name);
+        return false;
+    }
+
+    return true;
+}
+
+bool BpfApi::DeleteMapBatch(const char *map_name,
+                            const void *keys,
+                            uint32_t    count)
+{
+    auto map = GetMap(map_name);
+    if (!map)
+    {
+        return false;
+    }
+
+    if (!map->Delete(keys, count))
+    {
+        m_ErrorMessage = "Failed to delete from map: " + std::string(map_name);
+        return false;
+    }
+
+    return true;
+}
+
+bool BpfApi::ClearMap(const char *map_name)
+{
+    auto map = GetMap(map_name);
+    if (!map)
+    {
+        return false;
+    }
+
+    if (!map->Clear())
+    {
+        m_ErrorMessage = "Failed to clear map: " + std::string(map_name);
+        return false;
+    }
+
+    return true;
+}
+
 bool BpfApi::on_perf_peek(int cpu, void *cb_cookie, void *data, int data_size)
 {
     auto bpfApi = static_cast<BpfApi*>(cb_cookie);
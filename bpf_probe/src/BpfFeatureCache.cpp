@@ -0,0 +1,309 @@
+// Copyright (c) 2023 VMWare, Inc. All rights reserved.
+// SPDX-License-Identifier: GPL-2.0
+
+#include "BpfFeatureCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#include <sys/utsname.h>
+#include <elf.h>
+
+using namespace cb_endpoint::bpf_probe;
+namespace fs = boost::filesystem;
+
+// Bumped whenever the way results are found changes, older files are probed again
+static const char *CACHE_VERSION = "2";
+
+BpfFeatureCache::BpfFeatureCache(const std::string &path)
+    : m_path(path)
+    , m_build_id(ReadKernelBuildId())
+    , m_modules_id(ReadModulesId())
+    , m_features()
+    , m_symbols()
+    , m_symbols_loaded(false)
+    , m_dirty(false)
+    , m_from_cache(false)
+{
+}
+
+std::string BpfFeatureCache::ReadKernelBuildId()
+{
+    std::ifstream notes("/sys/kernel/notes", std::ios::binary);
+    std::vector<char> buf((std::istreambuf_iterator<char>(notes)),
+                          std::istreambuf_iterator<char>());
+    size_t pos = 0;
+
+    // Kernel notes are always 4 byte aligned, even on 64 bit kernels
+    while (pos + sizeof(Elf32_Nhdr) <= buf.size())
+    {
+        Elf32_Nhdr nhdr;
+
+        memcpy(&nhdr, &buf[pos], sizeof(nhdr));
+        pos += sizeof(nhdr);
+
+        size_t name_pos = pos;
+        size_t desc_pos = name_pos + ((nhdr.n_namesz + 3) & ~3U);
+
+        pos = desc_pos + ((nhdr.n_descsz + 3) & ~3U);
+        if (pos > buf.size())
+        {
+            break;
+        }
+
+        if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 &&
+            memcmp(&buf[name_pos], "GNU", 4) == 0)
+        {
+            std::ostringstream id;
+
+            for (size_t i = 0; i < nhdr.n_descsz; i++)
+            {
+                id << std::hex << std::setw(2) << std::setfill('0')
+                   << (unsigned)(uint8_t)buf[desc_pos + i];
+            }
+            return id.str();
+        }
+    }
+
+    struct utsname uts = {};
+
+    if (uname(&uts) == 0)
+    {
+        // Only spaces would break the cache file format
+        std::string id = std::string(uts.release) + "_" + uts.version;
+
+        std::replace(id.begin(), id.end(), ' ', '_');
+        return id;
+    }
+
+    return "";
+}
+
+std::string BpfFeatureCache::ReadModulesId()
+{
+    std::ifstream modules("/proc/modules");
+    std::set<std::string> names;
+    std::string line;
+    uint64_t hash = 14695981039346656037ULL;
+
+    // Loaded modules add kprobe targets and tracepoints, so a negative
+    // result only holds while the same set is loaded.
+    while (std::getline(modules, line))
+    {
+        names.insert(line.substr(0, line.find(' ')));
+    }
+
+    for (auto &name : names)
+    {
+        for (char c : name + "\n")
+        {
+            hash = (hash ^ (uint8_t)c) * 1099511628211ULL;
+        }
+    }
+
+    std::ostringstream id;
+    id << std::hex << hash;
+    return id.str();
+}
+
+const char *BpfFeatureCache::GetTracingDir()
+{
+    if (fs::exists("/sys/kernel/tracing/events"))
+    {
+        return "/sys/kernel/tracing";
+    }
+
+    return "/sys/kernel/debug/tracing";
+}
+
+bool BpfFeatureCache::Load()
+{
+    std::ifstream file(m_path);
+    std::string key;
+    std::string value;
+
+    if (m_path.empty() || m_build_id.empty() || !file)
+    {
+        return false;
+    }
+
+    if (!(file >> key >> value) || key != "version" || value != CACHE_VERSION)
+    {
+        return false;
+    }
+
+    if (!(file >> key >> value) || key != "build_id" || value != m_build_id)
+    {
+        return false;
+    }
+
+    if (!(file >> key >> value) || key != "modules" || value != m_modules_id)
+    {
+        return false;
+    }
+
+    while (file >> key >> value)
+    {
+        m_features[key] = (value == "1");
+    }
+
+    m_from_cache = true;
+    return true;
+}
+
+bool BpfFeatureCache::Save()
+{
+    boost::system::error_code ec;
+
+    if (!m_dirty || m_path.empty() || m_build_id.empty())
+    {
+        return true;
+    }
+
+    fs::create_directories(fs::path(m_path).parent_path(), ec);
+
+    // Write a new file and rename it so a crash never leaves half a cache
+    std::string tmp_path = m_path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+
+        if (!file)
+        {
+            return false;
+        }
+
+        file << "version " << CACHE_VERSION << "\n";
+        file << "build_id " << m_build_id << "\n";
+        file << "modules " << m_modules_id << "\n";
+        for (auto &feature : m_features)
+        {
+            file << feature.first << " " << (feature.second ? 1 : 0) << "\n";
+        }
+
+        if (!file.flush())
+        {
+            return false;
+        }
+    }
+
+    fs::rename(tmp_path, m_path, ec);
+    if (ec)
+    {
+        return false;
+    }
+
+    m_dirty = false;
+    return true;
+}
+
+bool BpfFeatureCache::HasKprobeTarget(const std::string &func)
+{
+    std::string key = "kprobe:" + func;
+    auto it = m_features.find(key);
+
+    if (it != m_features.end())
+    {
+        return it->second;
+    }
+
+    LoadKernelSymbols();
+
+    // Without a symbol list we cannot tell, let the attach decide and do
+    // not remember the guess.
+    if (m_symbols.empty())
+    {
+        return true;
+    }
+
+    // Missing targets are remembered too, the cache is dropped when the
+    // loaded modules change.
+    bool found = ProbeKprobeTarget(func);
+
+    m_features[key] = found;
+    m_dirty = true;
+    return found;
+}
+
+bool BpfFeatureCache::HasTracepoint(const std::string &category, const std::string &name)
+{
+    std::string key = "tracepoint:" + category + "/" + name;
+    auto it = m_features.find(key);
+
+    if (it != m_features.end())
+    {
+        return it->second;
+    }
+
+    fs::path events_dir = fs::path(GetTracingDir()) / "events";
+
+    // tracefs is not mounted, let the attach decide
+    if (!fs::exists(events_dir))
+    {
+        return true;
+    }
+
+    bool found = fs::exists(events_dir / category / name);
+
+    m_features[key] = found;
+    m_dirty = true;
+    return found;
+}
+
+bool BpfFeatureCache::ProbeKprobeTarget(const std::string &func)
+{
+    return m_symbols.find(func) != m_symbols.end();
+}
+
+void BpfFeatureCache::LoadKernelSymbols()
+{
+    std::string line;
+
+    if (m_symbols_loaded)
+    {
+        return;
+    }
+    m_symbols_loaded = true;
+
+    // kprobes attach to any text symbol that is not blacklisted, including
+    // notrace functions. Names are visible even when kptr_restrict hides the
+    // addresses. Entries of modules carry a " [module]" suffix.
+    std::ifstream kallsyms("/proc/kallsyms");
+    while (std::getline(kallsyms, line))
+    {
+        std::istringstream fields(line);
+        std::string addr;
+        std::string type;
+        std::string name;
+
+        if ((fields >> addr >> type >> name) && (type == "t" || type == "T"))
+        {
+            m_symbols.insert(name);
+        }
+    }
+
+    // available_filter_functions is no fallback, notrace functions are missing
+    // from it. With no symbols the attach decides.
+    if (m_symbols.empty())
+    {
+        return;
+    }
+
+    // Lines are "<start>-<end> <name>", attaching to these always fails
+    std::ifstream blacklist("/sys/kernel/debug/kprobes/blacklist");
+    while (std::getline(blacklist, line))
+    {
+        std::istringstream fields(line);
+        std::string range;
+        std::string name;
+
+        if (fields >> range >> name)
+        {
+            m_symbols.erase(name);
+        }
+    }
+}
@@ -0,0 +1,272 @@
+// Copyright (c) 2023 VMWare, Inc. All rights reserved.
+// SPDX-License-Identifier: GPL-2.0
+
+#include "BpfMap.h"
+
+// real libbpf from conan package
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <errno.h>
+
+using namespace cb_endpoint::bpf_probe;
+
+#ifndef ENOTSUPP
+// Kernel internal errno some map types return for unsupported commands
+#define ENOTSUPP 524
+#endif
+
+const uint32_t BpfMap::BATCH_SIZE;
+
+BpfMap::BpfMap(int fd, uint32_t key_size, uint32_t value_size)
+    : m_fd(fd)
+    , m_key_size(key_size)
+    , m_value_size(value_size)
+    , m_use_batch(true)
+    , m_use_lookup_and_delete(true)
+{
+}
+
+// Kernels before 5.6 reject the command itself with EINVAL, newer kernels
+// reject map types without batch support with ENOTSUPP. Both fail before any
+// element is touched so it is safe to retry the whole request.
+bool BpfMap::IsUnsupported(int err)
+{
+    return err == EINVAL || err == ENOTSUPP || err == EOPNOTSUPP || err == ENOSYS;
+}
+
+bool BpfMap::Update(const void *keys, const void *values, uint32_t count, uint64_t flags)
+{
+    auto key_pos = static_cast<const uint8_t *>(keys);
+    auto value_pos = static_cast<const uint8_t *>(values);
+
+    if (!IsValid() || (count && (!keys || !values)))
+    {
+        return false;
+    }
+
+    while (count && m_use_batch)
+    {
+        DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts, .elem_flags = flags);
+        uint32_t chunk = count < BATCH_SIZE ? count : BATCH_SIZE;
+
+        if (bpf_map_update_batch(m_fd, const_cast<uint8_t *>(key_pos), const_cast<uint8_t *>(value_pos),
+                                 &chunk, &opts))
+        {
+            if (IsUnsupported(errno))
+            {
+                m_use_batch = false;
+                break;
+            }
+            return false;
+        }
+
+        key_pos += chunk * m_key_size;
+        value_pos += chunk * m_value_size;
+        count -= chunk;
+    }
+
+    return UpdateEach(key_pos, value_pos, count, flags);
+}
+
+bool BpfMap::Delete(const void *keys, uint32_t count)
+{
+    auto key_pos = static_cast<const uint8_t *>(keys);
+
+    if (!IsValid() || (count && !keys))
+    {
+        return false;
+    }
+
+    while (count && m_use_batch)
+    {
+        DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts);
+        uint32_t chunk = count < BATCH_SIZE ? count : BATCH_SIZE;
+        uint32_t done = chunk;
+
+        if (bpf_map_delete_batch(m_fd, const_cast<uint8_t *>(key_pos), &done, &opts))
+        {
+            int err = errno;
+
+            // The batch stops at a key that is already gone (LRU eviction
+            // or the probe got there first). Skip it and carry on.
+            if (err == ENOENT && done < chunk)
+            {
+                chunk = done + 1;
+            }
+            else if (IsUnsupported(err))
+            {
+                m_use_batch = false;
+                break;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        key_pos += chunk * m_key_size;
+        count -= chunk;
+    }
+
+    return DeleteEach(key_pos, count);
+}
+
+bool BpfMap::Lookup(const void *key, void *value)
+{
+    return IsValid() && key && value && bpf_map_lookup_elem(m_fd, key, value) == 0;
+}
+
+bool BpfMap::LookupAndDelete(const void *key, void *value)
+{
+    if (!IsValid() || !key || !value)
+    {
+        return false;
+    }
+
+    if (m_use_lookup_and_delete)
+    {
+        if (bpf_map_lookup_and_delete_elem(m_fd, key, value) == 0)
+        {
+            return true;
+        }
+
+        if (!IsUnsupported(errno))
+        {
+            return false;
+        }
+        m_use_lookup_and_delete = false;
+    }
+
+    // Anything the probe adds between the two calls is lost
+    return bpf_map_lookup_elem(m_fd, key, value) == 0 &&
+           (bpf_map_delete_elem(m_fd, key) == 0 || errno == ENOENT);
+}
+
+bool BpfMap::Dump(Buffer &keys, Buffer &values)
+{
+    size_t key_start = keys.size();
+    size_t value_start = values.size();
+
+    if (!IsValid())
+    {
+        return false;
+    }
+
+    if (m_use_batch)
+    {
+        // The batch token is a bucket index for hash maps and a key for
+        // arrays, so make room for the larger of the two.
+        Buffer batch(m_key_size < sizeof(uint64_t) ? sizeof(uint64_t) : m_key_size);
+        Buffer next_batch(batch.size());
+        void *in_batch = nullptr;
+
+        while (true)
+        {
+            DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts);
+            size_t key_pos = keys.size();
+            size_t value_pos = values.size();
+            uint32_t count = BATCH_SIZE;
+            int err = 0;
+
+            keys.resize(key_pos + BATCH_SIZE * m_key_size);
+            values.resize(value_pos + BATCH_SIZE * m_value_size);
+
+            if (bpf_map_lookup_batch(m_fd, in_batch, next_batch.data(),
+                                     keys.data() + key_pos, values.data() + value_pos,
+                                     &count, &opts))
+            {
+                err = errno;
+            }
+
+            if (err && err != ENOENT)
+            {
+                // Start over one element at a time, this also covers a
+                // bucket that does not fit in BATCH_SIZE (ENOSPC).
+                keys.resize(key_start);
+                values.resize(value_start);
+                if (IsUnsupported(err))
+                {
+                    m_use_batch = false;
+                }
+                return DumpEach(keys, values);
+            }
+
+            keys.resize(key_pos + count * m_key_size);
+            values.resize(value_pos + count * m_value_size);
+
+            // ENOENT marks the end of the map
+            if (err == ENOENT)
+            {
+                return true;
+            }
+
+            batch.swap(next_batch);
+            in_batch = batch.data();
+        }
+    }
+
+    return DumpEach(keys, values);
+}
+
+bool BpfMap::Clear()
+{
+    Buffer keys;
+    Buffer values;
+
+    if (!Dump(keys, values))
+    {
+        return false;
+    }
+
+    return Delete(keys.data(), static_cast<uint32_t>(keys.size() / m_key_size));
+}
+
+bool BpfMap::UpdateEach(const uint8_t *keys, const uint8_t *values, uint32_t count, uint64_t flags)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (bpf_map_update_elem(m_fd, keys + i * m_key_size, values + i * m_value_size, flags))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool BpfMap::DeleteEach(const uint8_t *keys, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (bpf_map_delete_elem(m_fd, keys + i * m_key_size) && errno != ENOENT)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool BpfMap::DumpEach(Buffer &keys, Buffer &values)
+{
+    Buffer key(m_key_size);
+    Buffer next_key(m_key_size);
+    Buffer value(m_value_size);
+    void *prev_key = nullptr;
+
+    while (bpf_map_get_next_key(m_fd, prev_key, next_key.data()) == 0)
+    {
+        key.swap(next_key);
+        prev_key = key.data();
+
+        // The entry may have been deleted since we got its key
+        if (bpf_map_lookup_elem(m_fd, key.data(), value.data()) == 0)
+        {
+            keys.insert(keys.end(), key.begin(), key.end());
+            values.insert(values.end(), value.begin(), value.end());
+        }
+    }
+
+    return errno == ENOENT;
+}
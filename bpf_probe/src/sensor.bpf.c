@@ -53,26 +53,6 @@ struct file_data_cache {
     u64 fs_magic;
 };
 
-struct ip_key {
-        uint32_t pid;
-        uint16_t remote_port;
-        uint16_t local_port;
-        uint32_t remote_addr;
-        uint32_t local_addr;
-};
-struct ip6_key {
-    uint32_t pid;
-    uint16_t remote_port;
-    uint16_t local_port;
-    uint32_t remote_addr6[4];
-    uint32_t local_addr6[4];
-};
-#define FLOW_TX 0x01
-#define FLOW_RX 0x02
-struct ip_entry {
-    u8 flow;
-};
-
 struct {
     __uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
     __uint(key_size, sizeof(u32));
@@ -82,6 +62,12 @@ struct {
 // Set to 1 when we want to change events map to be a ring buffer
 volatile const unsigned int USE_RINGBUF = 0;
 
+// Set to 1 when user space can rebuild the task context of compact events
+volatile const unsigned int USE_TASK_CTX_CACHE = 0;
+
+// How often an active UDP flow reports its counters
+volatile const unsigned long long NET_FLOW_REPORT_NS = 30000000000ULL;
+
 // This hash tracks the "observed" file-create events.  This will not be 100% accurate because we will report a
 //  file create for any file the first time it is opened with WRITE|TRUNCATE (even if it already exists).  It
 //  will however serve to de-dup some events.  (Ie.. If a program does frequent open/write/close.)
@@ -103,6 +89,7 @@ struct {
     __uint(max_entries, 10240);
 } file_write_cache SEC(".maps");
 
+// UDP flows and their counters.
 // TODO: Scale to also be per proto
 struct {
     __uint(type, BPF_MAP_TYPE_LRU_HASH);
@@ -140,6 +127,24 @@ struct {
     __uint(max_entries, 10240);
 } currsock3 SEC(".maps");
 
+// Context of a process as last delivered to user space. Keyed on the tgid
+// alone so user space can invalidate an entry without knowing the exec
+// generation, which is instead compared as part of the value.
+struct task_ctx {
+    u32 exec_gen;
+    u32 uid;
+    u32 ppid;
+    u32 mnt_ns;
+    u64 cgroup_node;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, u32);
+    __type(value, struct task_ctx);
+    __uint(max_entries, 10240);
+} task_ctx_cache SEC(".maps");
+
 // Declare scratchpad, might be better as a percpu array
 // except that won't work on sleepable prog types.
 struct {
@@ -175,7 +180,7 @@ static __always_inline void *__current_blob(void)
     return (void *)event_data;
 }
 
-static __always_inline void send_event(void *ctx, void *data, size_t data_size)
+static __always_inline long send_event(void *ctx, void *data, size_t data_size)
 {
     // if (USE_RINGBUF)
     // {
@@ -188,7 +193,7 @@ static __always_inline void send_event(void *ctx, void *data, size_t data_size)
     // {
         // Only perf buffer instance should require the event timestamp
         ((struct data*)data)->header.event_time = bpf_ktime_get_ns();
-        bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, data, data_size);
+        return bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, data, data_size);
    // }
 }
 
@@ -635,6 +640,100 @@ out:
 #define blobify_cgroup_path(blob) \
     __blobify_cgroup_path((struct task_struct *)bpf_get_current_task(), blob)
 
+// self_exec_id is bumped on every successful exec so it tells us when
+// the process context must be sent again. It was widened to u64 in 5.9,
+// reading the low 32 bits is enough on our little-endian targets.
+static __always_inline u32 __get_exec_gen(struct task_struct *task)
+{
+    struct task_struct *group_leader = NULL;
+    u32 exec_gen = 0;
+
+    BPF_CORE_READ_INTO(&group_leader, task, group_leader);
+    if (group_leader) {
+        bpf_core_read(&exec_gen, sizeof(exec_gen), &group_leader->self_exec_id);
+    }
+
+    return exec_gen;
+}
+
+// Expects the header to already be initialized for the task
+static __always_inline void __get_task_ctx(struct task_struct *task,
+                                           const struct data_header *header,
+                                           struct task_ctx *task_ctx)
+{
+    task_ctx->exec_gen = __get_exec_gen(task);
+    task_ctx->uid = header->uid;
+    task_ctx->ppid = header->ppid;
+    task_ctx->mnt_ns = header->mnt_ns;
+    task_ctx->cgroup_node = (u64)find_cgroup_node(task);
+}
+
+//
+// Same as __blobify_cgroup_path but skips the cgroup walk when user space
+// already received this exact context for the process. In that case the
+// header is flagged and a zero size blob is returned.
+//
+static __always_inline size_t __blobify_task_ctx(struct task_struct *task,
+                                                 struct data_header *header,
+                                                 char *blob)
+{
+    if (USE_TASK_CTX_CACHE) {
+        struct task_ctx task_ctx = {};
+        struct task_ctx *cached = NULL;
+        u32 tgid = header->pid;
+
+        cached = bpf_map_lookup_elem(&task_ctx_cache, &tgid);
+        if (cached) {
+            __get_task_ctx(task, header, &task_ctx);
+
+            if (cached->exec_gen == task_ctx.exec_gen &&
+                cached->uid == task_ctx.uid &&
+                cached->ppid == task_ctx.ppid &&
+                cached->mnt_ns == task_ctx.mnt_ns &&
+                cached->cgroup_node == task_ctx.cgroup_node) {
+                header->report_flags |= REPORT_FLAGS_TASK_CTX_CACHED;
+                return 0;
+            }
+        }
+    }
+
+    return __blobify_cgroup_path(task, blob);
+}
+
+#define blobify_task_ctx(header, blob) \
+    __blobify_task_ctx((struct task_struct *)bpf_get_current_task(), header, blob)
+
+static __always_inline void __task_ctx_forget(u32 tgid)
+{
+    if (USE_TASK_CTX_CACHE) {
+        bpf_map_delete_elem(&task_ctx_cache, &tgid);
+    }
+}
+
+//
+// Sends an event built with blobify_task_ctx. When the full context went
+// out we remember it. This must happen after the event timestamp is taken
+// so a compact event from another thread always sorts after the full one.
+//
+static __always_inline void send_task_event(void *ctx, void *data, size_t data_size)
+{
+    struct data_header *header = (struct data_header *)data;
+
+    if (send_event(ctx, data, data_size)) {
+        return;
+    }
+
+    if (USE_TASK_CTX_CACHE &&
+        !(header->report_flags & REPORT_FLAGS_TASK_CTX_CACHED)) {
+        struct task_ctx task_ctx = {};
+        u32 tgid = header->pid;
+
+        __get_task_ctx((struct task_struct *)bpf_get_current_task(),
+                       header, &task_ctx);
+        bpf_map_update_elem(&task_ctx_cache, &tgid, &task_ctx, BPF_ANY);
+    }
+}
+
 
 static __always_inline int __get_next_parent_dentry(struct dentry **dentry,
                                                     struct vfsmount **vfsmnt,
@@ -804,6 +903,9 @@ static void submit_exec_arg_event(void *ctx, const char **argv)
     barrier_var(blob_size);
     __init_header_dynamic(EVENT_PROCESS_EXEC_ARG, PP_ENTRY_POINT, &exec_arg_data->header);
 
+    // The process is about to change so the next event carries the full context
+    __task_ctx_forget(exec_arg_data->header.pid);
+
     blob_size = __blobify_str_array(argv, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &exec_arg_data->exec_arg_blob,
             &payload, blob_pos);
@@ -1048,12 +1150,12 @@ int BPF_KPROBE(on_security_file_free, struct file *file)
                                  blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data_x->file_blob,
                                 &payload, blob_pos);
-    blob_size = blobify_cgroup_path(blob_pos);
+    blob_size = blobify_task_ctx(&data_x->header, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data_x->cgroup_blob, &payload, blob_pos);
 
     data_x->header.payload = payload;
     if (payload <= MAX_BLOB_EVENT_SIZE) {
-        send_event(ctx, data_x, payload);
+        send_task_event(ctx, data_x, payload);
     }
 
 out_del:
@@ -1135,12 +1237,12 @@ int BPF_KPROBE(on_security_mmap_file, struct file *file, unsigned long prot, uns
     }
     blob_pos = compute_blob_ctx(blob_size, &data_x->file_blob,
                                 &payload, blob_pos);
-    blob_size = blobify_cgroup_path(blob_pos);
+    blob_size = blobify_task_ctx(&data_x->header, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data_x->cgroup_blob, &payload, blob_pos);
 
     data_x->header.payload = payload;
     if (payload <= MAX_BLOB_EVENT_SIZE) {
-        send_event(ctx, data_x, payload);
+        send_task_event(ctx, data_x, payload);
     }
 
 out:
@@ -1230,12 +1332,12 @@ int BPF_KPROBE(on_security_file_open, struct file *file)
     }
     blob_pos = compute_blob_ctx(blob_size, &data_x->file_blob,
                                 &payload, blob_pos);
-    blob_size = blobify_cgroup_path(blob_pos);
+    blob_size = blobify_task_ctx(&data_x->header, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data_x->cgroup_blob, &payload, blob_pos);
 
     data_x->header.payload = payload;
     if (payload <= MAX_BLOB_EVENT_SIZE) {
-        send_event(ctx, data_x, payload);
+        send_task_event(ctx, data_x, payload);
     }
 
 out:
@@ -1276,12 +1378,12 @@ int BPF_KPROBE(on_security_inode_unlink, struct inode *dir, struct dentry *dentr
     blob_size = __do_dentry_path_x(dentry, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data_x->file_blob,
                                 &payload, blob_pos);
-    blob_size = blobify_cgroup_path(blob_pos);
+    blob_size = blobify_task_ctx(&data_x->header, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data_x->cgroup_blob, &payload, blob_pos);
 
     data_x->header.payload = payload;
     if (payload <= MAX_BLOB_EVENT_SIZE) {
-        send_event(ctx, data_x, payload);
+        send_task_event(ctx, data_x, payload);
     }
 
     return 0;
@@ -1335,12 +1437,12 @@ int BPF_KPROBE(on_security_inode_rename, struct inode *old_dir,
     blob_size = __do_dentry_path_x(new_dentry, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data_x->new_blob,
                                 &payload, blob_pos);
-    blob_size = blobify_cgroup_path(blob_pos);
+    blob_size = blobify_task_ctx(&data_x->header, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data_x->cgroup_blob, &payload, blob_pos);
 
     data_x->header.payload = payload;
     if (payload <= MAX_BLOB_EVENT_SIZE) {
-        send_event(ctx, data_x, payload);
+        send_task_event(ctx, data_x, payload);
     }
 
 out:
@@ -1395,10 +1497,102 @@ out:
     return 0;
 }
 
-static __always_inline bool has_ip_cache(struct ip_key *ip_key, u8 flow)
+// check for system endianess
+#ifdef __BYTE_ORDER__
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define _is_big_endian() false
+#else
+#define _is_big_endian() true
+#endif
+#else
+static __always_inline bool _is_big_endian()
+{
+    unsigned int x = 1;
+    char *c = (char*) &x;
+    return ((int)*c == 0);
+}
+#endif /* __BYTE_ORDER__ */
+
+static __always_inline uint16_t _htons(uint16_t hostshort)
+{
+    if (_is_big_endian()) {
+        return hostshort;
+    } else {
+        return __builtin_bswap16(hostshort);
+    }
+}
+
+static __always_inline uint16_t _ntohs(uint16_t netshort)
+{
+    if (_is_big_endian()) {
+        return netshort;
+    } else {
+        return __builtin_bswap16(netshort);
+    }
+}
+
+#define FLOW_KNOWN  0
+#define FLOW_NEW    1
+#define FLOW_REPORT 2
+
+static __always_inline void __init_flow_entry(struct ip_entry *ip_entry, u8 flow,
+                                              u32 bytes, u64 now)
+{
+    ip_entry->flow = flow;
+    ip_entry->first_seen = now;
+    ip_entry->last_seen = now;
+    ip_entry->last_report = now;
+
+    if (flow == FLOW_RX) {
+        ip_entry->rx_packets = 1;
+        ip_entry->rx_bytes = bytes;
+    } else {
+        ip_entry->tx_packets = 1;
+        ip_entry->tx_bytes = bytes;
+    }
+}
+
+//
+// Adds a packet to a known flow. The counters are cumulative so when two
+// CPUs race on last_report we only risk a redundant summary.
+//
+static __always_inline int __account_flow(struct ip_entry *ip_entry, u8 flow,
+                                          u32 bytes, u64 now,
+                                          struct ip_entry *report)
+{
+    if (flow == FLOW_RX) {
+        __sync_fetch_and_add(&ip_entry->rx_packets, 1);
+        __sync_fetch_and_add(&ip_entry->rx_bytes, bytes);
+    } else {
+        __sync_fetch_and_add(&ip_entry->tx_packets, 1);
+        __sync_fetch_and_add(&ip_entry->tx_bytes, bytes);
+    }
+    ip_entry->last_seen = now;
+
+    if (now - ip_entry->last_report < NET_FLOW_REPORT_NS) {
+        return FLOW_KNOWN;
+    }
+
+    ip_entry->last_report = now;
+    *report = *ip_entry;
+
+    return FLOW_REPORT;
+}
+
+//
+// Accounts a packet to its flow. The "client" port is zeroed in the key and
+// the alternate key lets the reply of a request count towards the same flow.
+//
+// Returns FLOW_NEW when this packet opened the flow and should be reported,
+// FLOW_REPORT when the flow's counters were copied to report and are due,
+// FLOW_KNOWN otherwise.
+//
+static __always_inline int track_ip_flow(struct ip_key *ip_key, u8 flow, u32 bytes,
+                                         struct ip_entry *report)
 {
     struct ip_key ip_key_alternate = *ip_key;
     struct ip_entry *ip_entry = NULL;
+    u64 now = bpf_ktime_get_ns();
 
     if (flow == FLOW_RX) {
         ip_key->remote_port = 0;
@@ -1409,27 +1603,26 @@ static __always_inline bool has_ip_cache(struct ip_key *ip_key, u8 flow)
     }
 
     ip_entry = bpf_map_lookup_elem(&ip_cache, ip_key);
+    if (!ip_entry) {
+        ip_entry = bpf_map_lookup_elem(&ip_cache, &ip_key_alternate);
+    }
     if (!ip_entry) {
         struct ip_entry new_entry = {};
-        new_entry.flow = flow;
-        bpf_map_update_elem(&ip_cache, ip_key, &new_entry, BPF_NOEXIST); // insert
 
-        ip_entry = bpf_map_lookup_elem(&ip_cache, &ip_key_alternate);
-        if (!ip_entry) {
-            bpf_map_update_elem(&ip_cache, &ip_key_alternate, &new_entry, BPF_NOEXIST); // insert
-        } else {
-            return true;
-        }
-    } else {
-        return true;
+        __init_flow_entry(&new_entry, flow, bytes, now);
+        bpf_map_update_elem(&ip_cache, ip_key, &new_entry, BPF_NOEXIST); // insert
+        return FLOW_NEW;
     }
-    return false;
+
+    return __account_flow(ip_entry, flow, bytes, now, report);
 }
 
-static __always_inline bool has_ip6_cache(struct ip6_key *ip6_key, u8 flow)
+static __always_inline int track_ip6_flow(struct ip6_key *ip6_key, u8 flow, u32 bytes,
+                                          struct ip_entry *report)
 {
     struct ip6_key ip6_key_alternate = *ip6_key;
     struct ip_entry *ip_entry = NULL;
+    u64 now = bpf_ktime_get_ns();
 
     if (flow == FLOW_RX) {
         ip6_key->remote_port = 0;
@@ -1440,21 +1633,46 @@ static __always_inline bool has_ip6_cache(struct ip6_key *ip6_key, u8 flow)
     }
 
     ip_entry = bpf_map_lookup_elem(&ip6_cache, ip6_key);
+    if (!ip_entry) {
+        ip_entry = bpf_map_lookup_elem(&ip6_cache, &ip6_key_alternate);
+    }
     if (!ip_entry) {
         struct ip_entry new_entry = {};
-        new_entry.flow = flow;
+
+        __init_flow_entry(&new_entry, flow, bytes, now);
         bpf_map_update_elem(&ip6_cache, ip6_key, &new_entry, BPF_NOEXIST); // insert
+        return FLOW_NEW;
+    }
 
-        ip_entry = bpf_map_lookup_elem(&ip6_cache, &ip6_key_alternate);
-        if (!ip_entry) {
-            bpf_map_update_elem(&ip6_cache, &ip6_key_alternate, &new_entry, BPF_NOEXIST); // insert
-        } else {
-            return true;
-        }
-    } else {
-        return true;
+    return __account_flow(ip_entry, flow, bytes, now, report);
+}
+
+//
+// Turns the flow open event being built in the scratchpad into a summary of
+// the flow's counters. Nothing is sent unless the flow is due a report.
+//
+static __always_inline void send_flow_summary(void *ctx, struct net_data_x *data,
+                                              int flow_state,
+                                              const struct ip_entry *report)
+{
+    struct net_flow_data *flow_data = (struct net_flow_data *)data;
+
+    if (flow_state != FLOW_REPORT) {
+        return;
     }
-    return false;
+
+    flow_data->net_data.header.type = EVENT_NET_FLOW_SUMMARY;
+    flow_data->net_data.header.report_flags = REPORT_FLAGS_COMPAT;
+    flow_data->net_data.header.payload = sizeof(*flow_data);
+
+    flow_data->first_seen = report->first_seen;
+    flow_data->last_seen = report->last_seen;
+    flow_data->tx_packets = report->tx_packets;
+    flow_data->tx_bytes = report->tx_bytes;
+    flow_data->rx_packets = report->rx_packets;
+    flow_data->rx_bytes = report->rx_bytes;
+
+    send_event(ctx, flow_data, sizeof(*flow_data));
 }
 
 SEC("kprobe/do_exit")
@@ -1481,6 +1699,7 @@ int BPF_KPROBE(on_do_exit, long code)
     blob_pos = data_x->blob;
 
     __init_header_dynamic(EVENT_PROCESS_EXIT, PP_NO_EXTRA_DATA, &data_x->header);
+    __task_ctx_forget(data_x->header.pid);
     blob_size = blobify_cgroup_path(blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data_x->cgroup_blob, &payload, blob_pos);
     data_x->header.payload = payload;
@@ -1567,12 +1786,12 @@ static __always_inline int trace_connect_return(struct pt_regs *ctx)
     }
 
     blob_pos = data->blob;
-    blob_size = blobify_cgroup_path(blob_pos);
+    blob_size = blobify_task_ctx(&data->net_data.header, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data->cgroup_blob, &payload, blob_pos);
     data->net_data.header.payload = payload;
 
     if (payload <= MAX_BLOB_EVENT_SIZE) {
-        send_event(ctx, data, payload);
+        send_task_event(ctx, data, payload);
     }
 
     bpf_map_delete_elem(&currsock, &id);
@@ -1609,6 +1828,9 @@ int BPF_KRETPROBE(trace_skb_recv_udp)
     }
 
     struct udphdr *udphdr = NULL;
+    struct ip_entry report = {};
+    int flow_state;
+    u32 bytes;
 
     // Get a pointer to the network header and the header length.
     //  We use the header length to decide if this is IPv4 or IPv6
@@ -1623,6 +1845,9 @@ int BPF_KRETPROBE(trace_skb_recv_udp)
     udphdr = (struct udphdr *)(BPF_CORE_READ(skb, head) + BPF_CORE_READ(skb, transport_header));
     data->net_data.remote_port = BPF_CORE_READ(udphdr, source);
     data->net_data.local_port = BPF_CORE_READ(udphdr, dest);
+    // Count payload bytes like the send path does
+    bytes = _ntohs(BPF_CORE_READ(udphdr, len));
+    bytes = bytes > sizeof(struct udphdr) ? bytes - sizeof(struct udphdr) : 0;
 
     if (hdr_len == sizeof(struct iphdr)) {
         struct iphdr *iphdr = (struct iphdr *)hdr;
@@ -1642,7 +1867,9 @@ int BPF_KRETPROBE(trace_skb_recv_udp)
                    &data->net_data.remote_addr);
         bpf_probe_read(&ip_key.local_addr, sizeof(data->net_data.local_addr),
                    &data->net_data.local_addr);
-        if (has_ip_cache(&ip_key, FLOW_RX)) {
+        flow_state = track_ip_flow(&ip_key, FLOW_RX, bytes, &report);
+        if (flow_state != FLOW_NEW) {
+            send_flow_summary(ctx, data, flow_state, &report);
             return 0;
         }
     } else if (hdr_len == sizeof(struct ipv6hdr)) {
@@ -1663,64 +1890,33 @@ int BPF_KRETPROBE(trace_skb_recv_udp)
                    &data->net_data.remote_port);
         bpf_probe_read(&ip_key.local_port, sizeof(data->net_data.local_port),
                    &data->net_data.local_port);
+        // Same orientation as the event so replies match flows we sent on
         bpf_core_read(ip_key.remote_addr6,
                    sizeof(data->net_data.remote_addr6),
-                   &ipv6hdr->daddr.s6_addr32);
-        bpf_core_read(ip_key.local_addr6, sizeof(data->net_data.local_addr6),
                    &ipv6hdr->saddr.s6_addr32);
-        if (has_ip6_cache(&ip_key, FLOW_RX)) {
+        bpf_core_read(ip_key.local_addr6, sizeof(data->net_data.local_addr6),
+                   &ipv6hdr->daddr.s6_addr32);
+        flow_state = track_ip6_flow(&ip_key, FLOW_RX, bytes, &report);
+        if (flow_state != FLOW_NEW) {
+            send_flow_summary(ctx, data, flow_state, &report);
             return 0;
         }
     } else {
         return 0;
     }
 
-    blob_size = blobify_cgroup_path(blob_pos);
+    blob_size = blobify_task_ctx(&data->net_data.header, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data->cgroup_blob, &payload, blob_pos);
     data->net_data.header.payload = payload;
 
     if (payload <= MAX_BLOB_EVENT_SIZE) {
-        send_event(ctx, data, payload);
+        send_task_event(ctx, data, payload);
     }
 
 
     return 0;
 }
 
-// check for system endianess
-#ifdef __BYTE_ORDER__
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-#define _is_big_endian() false
-#else
-#define _is_big_endian() true
-#endif
-#else
-static __always_inline bool _is_big_endian()
-{
-    unsigned int x = 1;
-    char *c = (char*) &x;
-    return ((int)*c == 0);
-}
-#endif /* __BYTE_ORDER__ */
-
-static __always_inline uint16_t _htons(uint16_t hostshort)
-{
-    if (_is_big_endian()) {
-        return hostshort;
-    } else {
-        return __builtin_bswap16(hostshort);
-    }
-}
-
-static __always_inline uint16_t _ntohs(uint16_t netshort)
-{
-    if (_is_big_endian()) {
-        return netshort;
-    } else {
-        return __builtin_bswap16(netshort);
-    }
-}
-
 SEC("kretprobe/inet_csk_accept")
 int BPF_KRETPROBE(trace_accept_return)
 {
@@ -1767,12 +1963,12 @@ int BPF_KRETPROBE(trace_accept_return)
     }
 
     blob_pos = data->blob;
-    blob_size = blobify_cgroup_path(blob_pos);
+    blob_size = blobify_task_ctx(&data->net_data.header, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data->cgroup_blob, &payload, blob_pos);
     data->net_data.header.payload = payload;
 
     if (payload <= MAX_BLOB_EVENT_SIZE) {
-        send_event(ctx, data, payload);
+        send_task_event(ctx, data, payload);
     }
 
     return 0;
@@ -1865,16 +2061,18 @@ int BPF_KRETPROBE(trace_udp_recvmsg_return)
                                     &payload, blob_pos);
     }
 
-    barrier_var(payload);
-    data_x->header.payload = payload;
-
     barrier_var(payload);
 
-    blob_size = blobify_cgroup_path(blob_pos);
+    blob_size = blobify_task_ctx(&data_x->header, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data_x->cgroup_blob, &payload, blob_pos);
 
+    // Payload must cover the cgroup blob so user space can locate it
+    barrier_var(payload);
+    data_x->header.payload = payload;
+
+    barrier_var(payload);
     if (payload <= sizeof(typeof(*data_x))) {
-        send_event(ctx, data_x, payload);
+        send_task_event(ctx, data_x, payload);
     }
 
 out:
@@ -1934,6 +2132,8 @@ static int trace_udp_sendmsg_return(struct pt_regs *ctx)
     u32 payload = offsetof(typeof(*data), blob);
     char *blob_pos = data->blob;
     u16 blob_size;
+    struct ip_entry report = {};
+    int flow_state;
 
     data->net_data.protocol = IPPROTO_UDP;
     // The remote addr could be in the msghdr::msg_name or on the sock
@@ -2008,8 +2208,10 @@ static int trace_udp_sendmsg_return(struct pt_regs *ctx)
         bpf_probe_read(&ip_key.local_addr, sizeof(data->net_data.local_addr),
                        &data->net_data.local_addr);
 
-        if (has_ip_cache(&ip_key, FLOW_TX))
+        flow_state = track_ip_flow(&ip_key, FLOW_TX, ret, &report);
+        if (flow_state != FLOW_NEW)
         {
+            send_flow_summary(ctx, data, flow_state, &report);
             goto out;
         }
         break;
@@ -2033,7 +2235,9 @@ static int trace_udp_sendmsg_return(struct pt_regs *ctx)
         bpf_probe_read(ip_key.remote_addr6, sizeof(data->net_data.remote_addr6), &data->net_data.remote_addr6);
         bpf_probe_read(ip_key.local_addr6, sizeof(data->net_data.local_addr6), &data->net_data.local_addr6);
 
-        if (has_ip6_cache(&ip_key, FLOW_TX)) {
+        flow_state = track_ip6_flow(&ip_key, FLOW_TX, ret, &report);
+        if (flow_state != FLOW_NEW) {
+            send_flow_summary(ctx, data, flow_state, &report);
             goto out;
         }
         break;
@@ -2043,12 +2247,12 @@ static int trace_udp_sendmsg_return(struct pt_regs *ctx)
         goto out;
     }
 
-    blob_size = blobify_cgroup_path(blob_pos);
+    blob_size = blobify_task_ctx(&data->net_data.header, blob_pos);
     blob_pos = compute_blob_ctx(blob_size, &data->cgroup_blob, &payload, blob_pos);
     data->net_data.header.payload = payload;
 
     if (payload <= sizeof(typeof(*data))) {
-        send_event(ctx, data, payload);
+        send_task_event(ctx, data, payload);
     }
 
 out:
@@ -0,0 +1,219 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+// Copyright (c) 2023 VMware, Inc. All rights reserved.
+
+#pragma once
+
+#include "raw_event.h"
+
+#ifndef __KERNEL__
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+//
+// Compact event format for read()
+//
+// The reader opts in with CB_DRIVER_REQUEST_SET_WIRE_FORMAT. A read then returns
+//  back to back records instead of CB_EVENT_UM structs. Every record starts with a
+//  CB_COMPACT_RECORD whose size covers the whole record, so a reader can skip
+//  types it does not know.
+//
+// An event record is a CB_COMPACT_EVENT, then the fixed body for its type (none for
+//  exits and discovery markers), then any variable data such as a command line.
+//
+// Paths are interned. The first time a path is used, or after its id went to
+//  another path, a CB_COMPACT_TYPE_PATH record defining the id comes before the
+//  event using it. Ids run from 1 to CB_COMPACT_PATH_IDS and 0 means no path. The
+//  ids are forgotten whenever the device is opened or the format is set.
+//
+// The shared memory ring always uses the CB_EVENT_UM layout.
+//
+
+#pragma pack(push, 1)
+
+#define CB_WIRE_FORMAT_LEGACY       0
+#define CB_WIRE_FORMAT_COMPACT      1
+
+#define CB_COMPACT_VERSION          1
+#define CB_COMPACT_TYPE_PATH        0xff
+#define CB_COMPACT_PATH_IDS         4096
+
+struct CB_COMPACT_RECORD {
+    uint16_t          size;
+    uint8_t           version;
+    uint8_t           type;         // CB_EVENT_TYPE or CB_COMPACT_TYPE_PATH
+};
+
+// Followed by the NUL terminated path
+struct CB_COMPACT_PATH {
+    struct CB_COMPACT_RECORD header;
+    uint16_t          id;
+};
+
+struct CB_COMPACT_EVENT {
+    struct CB_COMPACT_RECORD header;
+    uint64_t          event_time;
+    AllProcessDetails process_details;
+    uint16_t          path_id;      // procInfo.path
+    uint8_t           path_found;
+};
+
+// Followed by the command line
+struct CB_COMPACT_PROCESS_START {
+    uint32_t          uid;
+    int32_t           start_action;
+    uint8_t           observed;
+};
+
+// Followed by the command line
+struct CB_COMPACT_DISCOVER {
+    uint32_t          uid;
+    uint8_t           observed;
+    ProcessDetails    exec;
+    ProcessDetails    exec_parent;
+};
+
+struct CB_COMPACT_MODULE_LOAD {
+    uint16_t          path_id;
+    int64_t           baseaddress;
+    uint64_t          device;
+    uint64_t          inode;
+};
+
+struct CB_COMPACT_FILE {
+    uint16_t          path_id;
+    uint64_t          device;
+    uint64_t          inode;
+    uint64_t          fs_magic;
+};
+
+struct CB_COMPACT_SOCK_ADDR {
+    uint16_t          family;
+    uint16_t          port;         // Network byte order
+    uint8_t           addr[16];     // The first 4 bytes for AF_INET
+};
+
+// Followed by the proxy server name
+struct CB_COMPACT_NETWORK {
+    int32_t           protocol;
+    struct CB_COMPACT_SOCK_ADDR local;
+    struct CB_COMPACT_SOCK_ADDR remote;
+    uint16_t          actual_port;
+};
+
+// Followed by qname_size bytes of query name and then record_count CB_DNS_RECORDs
+struct CB_COMPACT_DNS {
+    uint16_t          xid;
+    uint32_t          status;
+    uint16_t          qtype;
+    uint16_t          qname_size;
+    uint16_t          record_count;
+    uint16_t          nscount;
+    uint16_t          arcount;
+};
+
+// Followed by the path of the blocked process
+struct CB_COMPACT_BLOCK {
+    uint32_t          block_type;
+    uint32_t          failure_reason;
+    uint32_t          failure_details;
+    uint32_t          uid;
+};
+
+struct CB_COMPACT_HEARTBEAT {
+    uint64_t          user_memory;
+    uint64_t          user_memory_peak;
+    uint64_t          kernel_memory;
+    uint64_t          kernel_memory_peak;
+};
+
+#pragma pack(pop)
+
+// Returns the record at the start of buf, or NULL if len does not hold a whole
+//  record of this version
+static inline const struct CB_COMPACT_RECORD *cb_compact_record(const char *buf, size_t len)
+{
+    const struct CB_COMPACT_RECORD *record = (const struct CB_COMPACT_RECORD *)buf;
+
+    if (len < sizeof(*record) ||
+        record->size < sizeof(*record) ||
+        record->size > len ||
+        record->version != CB_COMPACT_VERSION)
+    {
+        return NULL;
+    }
+
+    return record;
+}
+
+// Returns the fixed body of an event record, or NULL if the record is too short
+//  for a body of body_size
+static inline const void *cb_compact_body(const struct CB_COMPACT_RECORD *record, size_t body_size)
+{
+    if (record->type == CB_COMPACT_TYPE_PATH ||
+        record->size < sizeof(struct CB_COMPACT_EVENT) + body_size)
+    {
+        return NULL;
+    }
+
+    return (const char *)record + sizeof(struct CB_COMPACT_EVENT);
+}
+
+// Returns what follows the first fixed_size bytes of the record and its size
+static inline const char *cb_compact_tail(const struct CB_COMPACT_RECORD *record, size_t fixed_size, size_t *size)
+{
+    *size = record->size > fixed_size ? record->size - fixed_size : 0;
+
+    return *size ? (const char *)record + fixed_size : NULL;
+}
+
+#ifndef __KERNEL__
+
+// The reader side of the path interning
+struct cb_compact_paths {
+    char *path[CB_COMPACT_PATH_IDS + 1];
+};
+
+static inline void cb_compact_paths_reset(struct cb_compact_paths *paths)
+{
+    int i;
+
+    for (i = 0; i <= CB_COMPACT_PATH_IDS; ++i)
+    {
+        free(paths->path[i]);
+        paths->path[i] = NULL;
+    }
+}
+
+// Stores the path of a CB_COMPACT_TYPE_PATH record, returns 0 or -1 if the record
+//  is not valid
+static inline int cb_compact_paths_define(struct cb_compact_paths *paths, const struct CB_COMPACT_RECORD *record)
+{
+    const struct CB_COMPACT_PATH *path_record = (const struct CB_COMPACT_PATH *)record;
+    const char                   *path;
+    size_t                        size;
+    char                         *copy;
+
+    if (record->type != CB_COMPACT_TYPE_PATH || record->size < sizeof(*path_record) ||
+        path_record->id == 0 || path_record->id > CB_COMPACT_PATH_IDS)
+    {
+        return -1;
+    }
+
+    path = cb_compact_tail(record, sizeof(*path_record), &size);
+    if (!path || path[size - 1] != '\0' || !(copy = strdup(path)))
+    {
+        return -1;
+    }
+
+    free(paths->path[path_record->id]);
+    paths->path[path_record->id] = copy;
+    return 0;
+}
+
+static inline const char *cb_compact_paths_lookup(const struct cb_compact_paths *paths, uint16_t id)
+{
+    return id <= CB_COMPACT_PATH_IDS ? paths->path[id] : NULL;
+}
+
+#endif
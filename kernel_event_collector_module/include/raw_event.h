@@ -105,6 +105,8 @@ typedef enum CB_EVENT_TYPE {
   CB_EVENT_TYPE_PROCESS_START_EXEC = 33, /* internal type (not sent to user space) */
   CB_EVENT_TYPE_PROCESS_LAST_EXIT = 34,
 
+  CB_EVENT_TYPE_RATE_LIMIT = 35,
+
   CB_EVENT_TYPE_MAX
 } CB_EVENT_TYPE;
 
@@ -197,6 +199,15 @@ typedef struct _CB_EVENT_HEARTBEAT {
     size_t kernel_memory_peak;
 } CB_EVENT_HEARTBEAT, *PCB_EVENT_HEARTBEAT;
 
+// Events a process sent faster than event_class_rate allows are left out,
+//  this reports how many were left out of each class since the last report.
+typedef struct _CB_EVENT_RATE_LIMIT {
+    uint64_t since;     // Windows time of the first event left out
+    uint32_t network;
+    uint32_t file;
+    uint32_t other;
+} CB_EVENT_RATE_LIMIT, *PCB_EVENT_RATE_LIMIT;
+
 typedef struct _CB_EVENT_FILE_GENERIC CB_EVENT_FILE_CREATE,
     *PCB_EVENT_FILE_CREATE;
 typedef struct _CB_EVENT_FILE_GENERIC CB_EVENT_FILE_DELETE,
@@ -417,6 +428,7 @@ typedef struct CB_EVENT {
         CB_EVENT_DNS_RESPONSE dnsResponse;
         CB_EVENT_BLOCK_RESPONSE blockResponse;
         CB_EVENT_HEARTBEAT heartbeat;
+        CB_EVENT_RATE_LIMIT rateLimit;
     };
 
     unsigned long canary;
@@ -435,6 +447,46 @@ struct CB_EVENT_UM_BLOB {
     char              blob[PATH_MAX * 2];
 };
 
+// Shared memory event ring
+//
+// Mapping the event device gives one header page followed by a data area of
+//  data_size bytes (the mapping length minus the header page, a power of two of
+//  at least CB_EVENT_RING_MIN_DATA_SIZE). The kernel appends records at head and
+//  user space consumes them at tail. Both are running byte counts, the position
+//  in the data area is the count & (data_size - 1).
+//
+// Each record is a CB_EVENT_RING_RECORD followed by a CB_EVENT_UM exactly as
+//  read() would return it, and the next record starts at the following
+//  CB_EVENT_RING_ALIGN boundary. A record never wraps, the space left at the end
+//  of the data area is filled with a CB_EVENT_RING_PAD record instead.
+//
+// The kernel publishes head with release semantics after the record is written,
+//  user space must read head with acquire semantics and store tail with release
+//  semantics once it is done with the records.
+#define CB_EVENT_RING_VERSION        1
+#define CB_EVENT_RING_ALIGN          8
+#define CB_EVENT_RING_MIN_DATA_SIZE  (1 << 16)
+#define CB_EVENT_RING_PAD            0x1
+
+struct CB_EVENT_RING_HEADER {
+    uint32_t          version;
+    uint32_t          data_offset;  // Offset of the data area from the start of the mapping
+    uint64_t          data_size;
+    uint64_t          dropped;      // Events that did not fit in the ring
+    uint8_t           reserved0[40];
+
+    // Kept on their own cache lines since each side spins on the other's index
+    uint64_t          head;         // Written by the kernel
+    uint8_t           reserved1[56];
+    uint64_t          tail;         // Written by user space
+    uint8_t           reserved2[56];
+};
+
+struct CB_EVENT_RING_RECORD {
+    uint32_t          size;         // Header plus event size, not including alignment
+    uint32_t          flags;
+};
+
 typedef struct _CB_EVENT_DYNAMIC {
   size_t size;
   unsigned long data;
@@ -505,6 +557,7 @@ typedef enum CB_DRIVER_REQUEST {
   CB_DRIVER_REQUEST_CONFIG = 15, // one way
   CB_DRIVER_REQUEST_SET_BANNED_INODE_WITHOUT_KILL = 16, // one way but called multiple times
   CB_DRIVER_REQUEST_WEBPROXY_ENABLED = 17, // one way
+  CB_DRIVER_REQUEST_SET_WIRE_FORMAT = 18, // one way, see compact_event.h
 
   CB_DRIVER_REQUEST_MAX
 
@@ -10,12 +10,6 @@
 #include <linux/gfp.h>
 #include <linux/spinlock.h>
 
-// Enable lock debug output
-// #define DEADLOCK_DBG
-
-// We have the option to use rw locks or standard spinlocks
-// #define CB_ENABLE_RWLOCK
-
 // We have the option to either disable interrupts or not
 // #define CB_ENABLE_GFP_BASED_LOCKS
 
@@ -39,8 +33,27 @@
         LOCK_SAVE(LOCK, FLAGS)
 #endif
 
+// Interrupts are only left disabled if the lock was taken
+#define TRYLOCK_SAVE(LOCK, FLAGS, TRYLOCK) \
+    ({\
+        bool __locked;\
+        local_irq_save(FLAGS);\
+        __locked = TRYLOCK(LOCK);\
+        if (!__locked) {\
+            local_irq_restore(FLAGS);\
+        } \
+        __locked;\
+    })
+
+#ifdef CB_ENABLE_GFP_BASED_LOCKS
+    #define TRYLOCK_OP(LOCK, FLAGS, CONTEXT, TRYLOCK) \
+        (IS_ATOMIC(CONTEXT) ? TRYLOCK_SAVE(LOCK, FLAGS, TRYLOCK) : TRYLOCK(LOCK))
+#else
+    #define TRYLOCK_OP(LOCK, FLAGS, CONTEXT, TRYLOCK) \
+        TRYLOCK_SAVE(LOCK, FLAGS, TRYLOCK)
+#endif
+
 #ifdef CB_ENABLE_RWLOCK
-    #define LOCK_TYPE            rwlock_t
     #define LOCK_INIT            rwlock_init
     #define LOCK_UNLOCKED        RW_LOCK_UNLOCKED
 
@@ -49,15 +62,16 @@
     #define READ_UNLOCK_SAVE     read_unlock_irqrestore
     #define READ_UNLOCK_NO_SAVE  read_unlock
     #define READ_CAN_LOCK(LOCK)  read_can_lock(LOCK)
+    #define READ_TRYLOCK         read_trylock
 
     #define WRITE_LOCK_SAVE      write_lock_irqsave
     #define WRITE_LOCK_NO_SAVE   write_lock
     #define WRITE_UNLOCK_SAVE    write_unlock_irqrestore
     #define WRITE_UNLOCK_NO_SAVE write_unlock
     #define WRITE_CAN_LOCK(LOCK) write_can_lock(LOCK)
+    #define WRITE_TRYLOCK        write_trylock
 #else
     // checkpatch-ignore: USE_LOCKDEP
-    #define LOCK_TYPE            spinlock_t
     #define LOCK_INIT            spin_lock_init
     #define LOCK_UNLOCKED        SPIN_LOCK_UNLOCKED
 
@@ -66,12 +80,14 @@
     #define READ_UNLOCK_SAVE     spin_unlock_irqrestore
     #define READ_UNLOCK_NO_SAVE  spin_unlock
     #define READ_CAN_LOCK(LOCK)  !spin_is_locked(LOCK)
+    #define READ_TRYLOCK         spin_trylock
 
     #define WRITE_LOCK_SAVE      spin_lock_irqsave
     #define WRITE_LOCK_NO_SAVE   spin_lock
     #define WRITE_UNLOCK_SAVE    spin_unlock_irqrestore
     #define WRITE_UNLOCK_NO_SAVE spin_unlock
     #define WRITE_CAN_LOCK(LOCK) !spin_is_locked(LOCK)
+    #define WRITE_TRYLOCK        spin_trylock
     // checkpatch-no-ignore: USE_LOCKDEP
 #endif
 
@@ -88,119 +104,183 @@
 
 
 
-typedef struct {
-    LOCK_TYPE sp;
-    pid_t create_pid;
-    pid_t owner_pid;
-    unsigned long flags;
-} linuxSpinlock_t;
-
-void ec_spinlock_init(uint64_t *sp, ProcessContext *context)
+void ec_spinlock_inline_init(ec_spinlock_t *lock, ProcessContext *context)
 {
-    linuxSpinlock_t *new_spinlock = ec_mem_alloc(sizeof(linuxSpinlock_t), context);
-
-    if (new_spinlock)
-    {
-        SPINLOCK_INIT(new_spinlock->sp);
-        new_spinlock->create_pid = ec_gettid(current);
-        new_spinlock->owner_pid  = 0;
-        new_spinlock->flags      = 0;
-        *sp = (uint64_t)new_spinlock;
-    } else
-    {
-        pr_err("%s failed initialize spinlock pid=%d\n", __func__, ec_gettid(current));
-        *sp = 0;
-    }
+    SPINLOCK_INIT(lock->sp);
+    lock->flags = 0;
+    DO_FOR_DEBUG({
+        lock->create_pid = ec_gettid(current);
+        lock->owner_pid  = 0;
+    });
 }
 
-void ec_write_lock(uint64_t *sp, ProcessContext *context)
+void ec_spinlock_inline_destroy(ec_spinlock_t *lock, ProcessContext *context)
 {
-    linuxSpinlock_t *spinlockp = (linuxSpinlock_t *)*sp;
-    pid_t tid = ec_gettid(current);
+    DO_FOR_DEBUG({
+        if (!WRITE_CAN_LOCK(&lock->sp))
+        {
+            pr_err("%s LOCKED and being destroyed pid=%d owner=%d\n", __func__, ec_gettid(current), lock->owner_pid);
+        }
+    });
+}
 
+void ec_write_lock_inline(ec_spinlock_t *lock, ProcessContext *context)
+{
     DO_FOR_DEBUG({
-        if (spinlockp->owner_pid == tid && !WRITE_CAN_LOCK(&spinlockp->sp))
+        pid_t tid = ec_gettid(current);
+
+        if (lock->owner_pid == tid && !WRITE_CAN_LOCK(&lock->sp))
         {
-            pr_err("%s already LOCKED pid=%d owner=%d\n", __func__, tid, spinlockp->owner_pid);
+            pr_err("%s already LOCKED pid=%d owner=%d\n", __func__, tid, lock->owner_pid);
         }
     });
 
-    WRITE_LOCK(&spinlockp->sp, spinlockp->flags, context);
+    WRITE_LOCK(&lock->sp, lock->flags, context);
     PUSH_GFP_MODE(context, CB_ATOMIC);
 
-    if (spinlockp->owner_pid == 0)
-    {
-        spinlockp->owner_pid = tid;
-    }
+    DO_FOR_DEBUG({
+        if (lock->owner_pid == 0)
+        {
+            lock->owner_pid = ec_gettid(current);
+        }
+    });
 }
 
-void ec_write_unlock(uint64_t *sp, ProcessContext *context)
+void ec_write_unlock_inline(ec_spinlock_t *lock, ProcessContext *context)
 {
-    linuxSpinlock_t *spinlockp = (linuxSpinlock_t *)*sp;
-
     DO_FOR_DEBUG({
-        if ((spinlockp->owner_pid != 0 && spinlockp->owner_pid != ec_gettid(current)) ||
-            WRITE_CAN_LOCK(&spinlockp->sp))
+        if ((lock->owner_pid != 0 && lock->owner_pid != ec_gettid(current)) ||
+            WRITE_CAN_LOCK(&lock->sp))
         {
-            pr_err("%s already UNLOCKED pid=%d owner=%d\n", __func__, ec_gettid(current), spinlockp->owner_pid);
+            pr_err("%s already UNLOCKED pid=%d owner=%d\n", __func__, ec_gettid(current), lock->owner_pid);
         }
+        lock->owner_pid = 0;
     });
 
-    spinlockp->owner_pid = 0;
-
     POP_GFP_MODE(context);
-    WRITE_UNLOCK(&spinlockp->sp, spinlockp->flags, context);
+    WRITE_UNLOCK(&lock->sp, lock->flags, context);
 }
 
-void ec_read_lock(uint64_t *sp, ProcessContext *context)
+void ec_read_lock_inline(ec_spinlock_t *lock, ProcessContext *context)
 {
-    linuxSpinlock_t *spinlockp = (linuxSpinlock_t *)*sp;
-    pid_t tid = ec_gettid(current);
-
     DO_FOR_DEBUG({
-        if (spinlockp->owner_pid == tid && !READ_CAN_LOCK(&spinlockp->sp))
+        pid_t tid = ec_gettid(current);
+
+        if (lock->owner_pid == tid && !READ_CAN_LOCK(&lock->sp))
         {
-            pr_err("%s already LOCKED pid=%d owner=%d\n", __func__, tid, spinlockp->owner_pid);
+            pr_err("%s already LOCKED pid=%d owner=%d\n", __func__, tid, lock->owner_pid);
         }
     });
 
-    READ_LOCK(&spinlockp->sp, spinlockp->flags, context);
+    READ_LOCK(&lock->sp, lock->flags, context);
     PUSH_GFP_MODE(context, CB_ATOMIC);
 
-    if (spinlockp->owner_pid == 0)
-    {
-        spinlockp->owner_pid = tid;
-    }
+    DO_FOR_DEBUG({
+        if (lock->owner_pid == 0)
+        {
+            lock->owner_pid = ec_gettid(current);
+        }
+    });
 }
 
-void ec_read_unlock(uint64_t *sp, ProcessContext *context)
+void ec_read_unlock_inline(ec_spinlock_t *lock, ProcessContext *context)
 {
-    linuxSpinlock_t *spinlockp = (linuxSpinlock_t *)*sp;
-
     DO_FOR_DEBUG({
-        if ((spinlockp->owner_pid != 0 && spinlockp->owner_pid != ec_gettid(current)) ||
-            WRITE_CAN_LOCK(&spinlockp->sp))//If write can lock, we can not have the read lock.  (Best I can do.)
+        if ((lock->owner_pid != 0 && lock->owner_pid != ec_gettid(current)) ||
+            WRITE_CAN_LOCK(&lock->sp))//If write can lock, we can not have the read lock.  (Best I can do.)
         {
-            pr_err("%s already UNLOCKED pid=%d owner=%d\n", __func__, ec_gettid(current), spinlockp->owner_pid);
+            pr_err("%s already UNLOCKED pid=%d owner=%d\n", __func__, ec_gettid(current), lock->owner_pid);
         }
+        lock->owner_pid = 0;
     });
 
-    spinlockp->owner_pid = 0;
-
     POP_GFP_MODE(context);
-    READ_UNLOCK(&spinlockp->sp, spinlockp->flags, context);
+    READ_UNLOCK(&lock->sp, lock->flags, context);
 }
 
-void ec_spinlock_destroy(uint64_t *sp, ProcessContext *context)
+// The flags are only stored once the lock is held, they belong to the owner
+bool ec_write_trylock_inline(ec_spinlock_t *lock, ProcessContext *context)
+{
+    unsigned long flags = 0;
+
+    if (!TRYLOCK_OP(&lock->sp, flags, context, WRITE_TRYLOCK))
+    {
+        return false;
+    }
+
+    lock->flags = flags;
+    PUSH_GFP_MODE(context, CB_ATOMIC);
+
+    DO_FOR_DEBUG({
+        if (lock->owner_pid == 0)
+        {
+            lock->owner_pid = ec_gettid(current);
+        }
+    });
+    return true;
+}
+
+bool ec_read_trylock_inline(ec_spinlock_t *lock, ProcessContext *context)
 {
-    linuxSpinlock_t *spinlockp = (linuxSpinlock_t *)*sp;
+    unsigned long flags = 0;
+
+    if (!TRYLOCK_OP(&lock->sp, flags, context, READ_TRYLOCK))
+    {
+        return false;
+    }
+
+    lock->flags = flags;
+    PUSH_GFP_MODE(context, CB_ATOMIC);
 
     DO_FOR_DEBUG({
-        if (!WRITE_CAN_LOCK(&spinlockp->sp))
+        if (lock->owner_pid == 0)
         {
-            pr_err("%s LOCKED and being destroyed pid=%d owner=%d\n", __func__, ec_gettid(current), spinlockp->owner_pid);
+            lock->owner_pid = ec_gettid(current);
         }
     });
+    return true;
+}
+
+void ec_spinlock_init(uint64_t *sp, ProcessContext *context)
+{
+    ec_spinlock_t *new_spinlock = ec_mem_alloc(sizeof(ec_spinlock_t), context);
+
+    if (new_spinlock)
+    {
+        ec_spinlock_inline_init(new_spinlock, context);
+        *sp = (uint64_t)new_spinlock;
+    } else
+    {
+        pr_err("%s failed initialize spinlock pid=%d\n", __func__, ec_gettid(current));
+        *sp = 0;
+    }
+}
+
+void ec_write_lock(uint64_t *sp, ProcessContext *context)
+{
+    ec_write_lock_inline((ec_spinlock_t *)*sp, context);
+}
+
+void ec_write_unlock(uint64_t *sp, ProcessContext *context)
+{
+    ec_write_unlock_inline((ec_spinlock_t *)*sp, context);
+}
+
+void ec_read_lock(uint64_t *sp, ProcessContext *context)
+{
+    ec_read_lock_inline((ec_spinlock_t *)*sp, context);
+}
+
+void ec_read_unlock(uint64_t *sp, ProcessContext *context)
+{
+    ec_read_unlock_inline((ec_spinlock_t *)*sp, context);
+}
+
+void ec_spinlock_destroy(uint64_t *sp, ProcessContext *context)
+{
+    ec_spinlock_t *spinlockp = (ec_spinlock_t *)*sp;
+
+    ec_spinlock_inline_destroy(spinlockp, context);
     //  pr_err("%s sp=%p\n", __FUNCTION__, spinlockp);
-    ec_mem_free((linuxSpinlock_t *)spinlockp);
+    ec_mem_free(spinlockp);
 }
@@ -4,8 +4,45 @@
 
 #pragma once
 
+#include <linux/spinlock.h>
+
 #include "process-context.h"
 
+// Enable lock debug output
+// #define DEADLOCK_DBG
+
+// We have the option to use rw locks or standard spinlocks
+// #define CB_ENABLE_RWLOCK
+
+#ifdef CB_ENABLE_RWLOCK
+    #define EC_LOCK_TYPE         rwlock_t
+#else
+    #define EC_LOCK_TYPE         spinlock_t
+#endif
+
+// A lock that lives inside the structure it protects. The uint64_t locks below are
+// one of these allocated by ec_spinlock_init. The owner tracking is only kept with
+// DEADLOCK_DBG.
+typedef struct ec_spinlock {
+    EC_LOCK_TYPE  sp;
+    unsigned long flags;
+#ifdef DEADLOCK_DBG
+    pid_t         create_pid;
+    pid_t         owner_pid;
+#endif
+} ec_spinlock_t;
+
+void ec_spinlock_inline_init(ec_spinlock_t *lock, ProcessContext *context);
+void ec_spinlock_inline_destroy(ec_spinlock_t *lock, ProcessContext *context);
+void ec_write_lock_inline(ec_spinlock_t *lock, ProcessContext *context);
+void ec_write_unlock_inline(ec_spinlock_t *lock, ProcessContext *context);
+void ec_read_lock_inline(ec_spinlock_t *lock, ProcessContext *context);
+void ec_read_unlock_inline(ec_spinlock_t *lock, ProcessContext *context);
+
+// Take the lock only if it is free, returns false without waiting otherwise
+bool ec_write_trylock_inline(ec_spinlock_t *lock, ProcessContext *context);
+bool ec_read_trylock_inline(ec_spinlock_t *lock, ProcessContext *context);
+
 //-------------------------------------------------
 // Linux utility functions for locking
 //
@@ -27,6 +27,10 @@ static const struct _ec_procs proc_callbacks[] = {
     { "events-avg",               ec_proc_show_events_avg,          NULL                            },
     { "events-detail",            ec_proc_show_events_det,          NULL                            },
     { "events-reset",             NULL,                             ec_proc_show_events_rst         },
+    { "events-types",             ec_proc_show_events_types,        NULL                            },
+    { "events-classes",           ec_proc_show_events_classes,      NULL                            },
+    { "events-latency",           ec_proc_show_events_latency,      NULL                            },
+    { "events-shards",            ec_proc_show_events_shards,       NULL                            },
     { "net-track",                ec_net_track_show,                NULL                            },
     { "net-track-purge",          NULL,                             ec_net_track_purge              },
     { "proc-track-table",         ec_proc_track_show_table,         NULL                            },
@@ -36,6 +40,8 @@ static const struct _ec_procs proc_callbacks[] = {
     { "mem-detail",               ec_proc_current_memory_det,       NULL                            },
     { "active-hooks",             ec_show_active_hooks,             NULL                            },
     { "file-cache",               ec_path_cache_show,               NULL                            },
+    { "path-strings",             ec_path_strings_show,             NULL                            },
+    { "path-buffers",             ec_path_buffers_show,             NULL                            },
 
 #ifdef HOOK_SELECTOR
     { "syscall-clone",            ec_get_syscall_clone,             ec_set_syscall_clone            },
@@ -0,0 +1,320 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (c) 2023 VMware, Inc. All rights reserved.
+
+#include "compact-event.h"
+#include "mem-alloc.h"
+
+#include <linux/jhash.h>
+
+typedef struct compact_writer {
+    char *pos;
+    char *end;
+    bool  overflow;
+} CompactWriter;
+
+CompactPathTable *ec_compact_paths_alloc(ProcessContext *context)
+{
+    CompactPathTable *paths = ec_mem_valloc(sizeof(CompactPathTable), context);
+
+    if (paths)
+    {
+        memset(paths, 0, sizeof(CompactPathTable));
+    }
+
+    return paths;
+}
+
+void ec_compact_paths_free(CompactPathTable *paths, ProcessContext *context)
+{
+    if (paths)
+    {
+        ec_compact_paths_clear(paths, context);
+        ec_mem_free(paths);
+    }
+}
+
+void ec_compact_paths_clear(CompactPathTable *paths, ProcessContext *context)
+{
+    int i;
+
+    for (i = 0; i < CB_COMPACT_PATH_IDS; ++i)
+    {
+        ec_mem_put(paths->slot[i].path);
+        paths->slot[i].path = NULL;
+    }
+}
+
+static void *__ec_compact_reserve(CompactWriter *writer, size_t size)
+{
+    char *p = writer->pos;
+
+    if (writer->overflow || size > writer->end - writer->pos)
+    {
+        writer->overflow = true;
+        return NULL;
+    }
+
+    writer->pos += size;
+    return p;
+}
+
+static void __ec_compact_put(CompactWriter *writer, const void *data, size_t size)
+{
+    void *p = __ec_compact_reserve(writer, size);
+
+    if (p && size)
+    {
+        memcpy(p, data, size);
+    }
+}
+
+static void __ec_compact_sock_addr(struct CB_COMPACT_SOCK_ADDR *out, const CB_SOCK_ADDR *in)
+{
+    memset(out, 0, sizeof(*out));
+    out->family = in->sa_addr.sa_family;
+
+    if (out->family == AF_INET)
+    {
+        out->port = in->as_in4.sin_port;
+        memcpy(out->addr, &in->as_in4.sin_addr, sizeof(in->as_in4.sin_addr));
+    } else if (out->family == AF_INET6)
+    {
+        out->port = in->as_in6.sin6_port;
+        memcpy(out->addr, &in->as_in6.sin6_addr, sizeof(in->as_in6.sin6_addr));
+    }
+}
+
+// Returns the id of path, writing a CB_COMPACT_TYPE_PATH record first if the reader
+//  does not have it under that id yet. Each path hashes to a single slot, a path
+//  that lands on a taken slot replaces it and the reader gets the new definition.
+static uint16_t __ec_compact_intern(CompactPathTable *paths, CompactWriter *writer, char *path, uint16_t path_size, ProcessContext *context)
+{
+    struct CB_COMPACT_PATH *record;
+    uint32_t                len;
+    uint32_t                hash;
+    uint32_t                index;
+
+    if (!path || !path_size)
+    {
+        return 0;
+    }
+
+    len   = strnlen(path, path_size);
+    hash  = jhash(path, len, 0);
+    index = hash % CB_COMPACT_PATH_IDS;
+
+    if (paths->slot[index].path == path ||
+        (paths->slot[index].path &&
+         paths->slot[index].hash == hash &&
+         paths->slot[index].len  == len &&
+         memcmp(paths->slot[index].path, path, len) == 0))
+    {
+        return index + 1;
+    }
+
+    record = __ec_compact_reserve(writer, sizeof(*record) + len + 1);
+    if (!record)
+    {
+        return 0;
+    }
+
+    record->header.size    = sizeof(*record) + len + 1;
+    record->header.version = CB_COMPACT_VERSION;
+    record->header.type    = CB_COMPACT_TYPE_PATH;
+    record->id             = index + 1;
+    memcpy(record + 1, path, len);
+    ((char *)(record + 1))[len] = '\0';
+
+    ec_mem_put(paths->slot[index].path);
+    paths->slot[index].path = ec_mem_get(path, context);
+    paths->slot[index].hash = hash;
+    paths->slot[index].len  = len;
+
+    return index + 1;
+}
+
+int ec_compact_serialize_event(CompactPathTable *paths, struct CB_EVENT *msg, char *buf, size_t size, ProcessContext *context)
+{
+    CompactWriter            writer  = { buf, buf + size, false };
+    struct CB_COMPACT_EVENT *event;
+    char                    *start;
+    uint16_t                 path_id;
+    uint16_t                 type_path_id = 0;
+    int                      xcode        = -ENXIO;
+
+    TRY_SET(paths && msg, -EINVAL);
+
+    // Path definitions have to come before the event that uses them
+    path_id = __ec_compact_intern(paths, &writer, msg->procInfo.path, msg->procInfo.path_size, context);
+
+    switch (msg->eventType)
+    {
+    case CB_EVENT_TYPE_MODULE_LOAD:
+        type_path_id = __ec_compact_intern(paths, &writer, msg->moduleLoad.path, msg->moduleLoad.path_size, context);
+        break;
+
+    case CB_EVENT_TYPE_FILE_CREATE:
+    case CB_EVENT_TYPE_FILE_DELETE:
+    case CB_EVENT_TYPE_FILE_OPEN:
+    case CB_EVENT_TYPE_FILE_WRITE:
+    case CB_EVENT_TYPE_FILE_CLOSE:
+        type_path_id = __ec_compact_intern(paths, &writer, msg->fileGeneric.path, msg->fileGeneric.path_size, context);
+        break;
+
+    default:
+        break;
+    }
+
+    start = writer.pos;
+    event = __ec_compact_reserve(&writer, sizeof(*event));
+    TRY(event);
+
+    event->header.version  = CB_COMPACT_VERSION;
+    event->header.type     = (uint8_t)msg->eventType;
+    event->event_time      = msg->procInfo.event_time;
+    event->process_details = msg->procInfo.all_process_details;
+    event->path_id         = path_id;
+    event->path_found      = msg->procInfo.path_found;
+
+    switch (msg->eventType)
+    {
+    case CB_EVENT_TYPE_PROCESS_START:
+        {
+            struct CB_COMPACT_PROCESS_START body = {
+                .uid          = msg->processStart.uid,
+                .start_action = msg->processStart.start_action,
+                .observed     = msg->processStart.observed,
+            };
+
+            __ec_compact_put(&writer, &body, sizeof(body));
+            __ec_compact_put(&writer, msg->processStart.path, msg->processStart.path ? msg->processStart.path_size : 0);
+        }
+        break;
+
+    case CB_EVENT_TYPE_DISCOVER:
+        {
+            struct CB_COMPACT_DISCOVER body = {
+                .uid         = msg->processDiscover.uid,
+                .observed    = msg->processDiscover.observed,
+                .exec        = msg->processDiscover.exec,
+                .exec_parent = msg->processDiscover.exec_parent,
+            };
+
+            __ec_compact_put(&writer, &body, sizeof(body));
+            __ec_compact_put(&writer, msg->processDiscover.path, msg->processDiscover.path ? msg->processDiscover.path_size : 0);
+        }
+        break;
+
+    case CB_EVENT_TYPE_MODULE_LOAD:
+        {
+            struct CB_COMPACT_MODULE_LOAD body = {
+                .path_id     = type_path_id,
+                .baseaddress = msg->moduleLoad.baseaddress,
+                .device      = msg->moduleLoad.device,
+                .inode       = msg->moduleLoad.inode,
+            };
+
+            __ec_compact_put(&writer, &body, sizeof(body));
+        }
+        break;
+
+    case CB_EVENT_TYPE_FILE_CREATE:
+    case CB_EVENT_TYPE_FILE_DELETE:
+    case CB_EVENT_TYPE_FILE_OPEN:
+    case CB_EVENT_TYPE_FILE_WRITE:
+    case CB_EVENT_TYPE_FILE_CLOSE:
+        {
+            struct CB_COMPACT_FILE body = {
+                .path_id  = type_path_id,
+                .device   = msg->fileGeneric.device,
+                .inode    = msg->fileGeneric.inode,
+                .fs_magic = msg->fileGeneric.fs_magic,
+            };
+
+            __ec_compact_put(&writer, &body, sizeof(body));
+        }
+        break;
+
+    case CB_EVENT_TYPE_NET_CONNECT_PRE:
+    case CB_EVENT_TYPE_NET_CONNECT_POST:
+    case CB_EVENT_TYPE_NET_ACCEPT:
+    case CB_EVENT_TYPE_WEB_PROXY:
+        {
+            struct CB_COMPACT_NETWORK body = {
+                .protocol    = msg->netConnect.protocol,
+                .actual_port = msg->netConnect.actual_port,
+            };
+
+            __ec_compact_sock_addr(&body.local, &msg->netConnect.localAddr);
+            __ec_compact_sock_addr(&body.remote, &msg->netConnect.remoteAddr);
+            __ec_compact_put(&writer, &body, sizeof(body));
+            __ec_compact_put(&writer, msg->netConnect.actual_server, msg->netConnect.actual_server ? msg->netConnect.server_size : 0);
+        }
+        break;
+
+    case CB_EVENT_TYPE_DNS_RESPONSE:
+        {
+            struct CB_COMPACT_DNS body = {
+                .xid          = msg->dnsResponse.xid,
+                .status       = msg->dnsResponse.status,
+                .qtype        = msg->dnsResponse.qtype,
+                .qname_size   = strnlen(msg->dnsResponse.qname, DNS_MAX_NAME),
+                .record_count = msg->dnsResponse.records ? msg->dnsResponse.record_count : 0,
+                .nscount      = msg->dnsResponse.nscount,
+                .arcount      = msg->dnsResponse.arcount,
+            };
+
+            __ec_compact_put(&writer, &body, sizeof(body));
+            __ec_compact_put(&writer, msg->dnsResponse.qname, body.qname_size);
+            __ec_compact_put(&writer, msg->dnsResponse.records, body.record_count * sizeof(CB_DNS_RECORD));
+        }
+        break;
+
+    case CB_EVENT_TYPE_PROCESS_BLOCKED:
+        {
+            struct CB_COMPACT_BLOCK body = {
+                .block_type      = msg->blockResponse.blockType,
+                .failure_reason  = msg->blockResponse.failureReason,
+                .failure_details = msg->blockResponse.failureReasonDetails,
+                .uid             = msg->blockResponse.uid,
+            };
+
+            __ec_compact_put(&writer, &body, sizeof(body));
+            __ec_compact_put(&writer, msg->blockResponse.path, msg->blockResponse.path ? msg->blockResponse.path_size : 0);
+        }
+        break;
+
+    case CB_EVENT_TYPE_HEARTBEAT:
+        {
+            struct CB_COMPACT_HEARTBEAT body = {
+                .user_memory        = msg->heartbeat.user_memory,
+                .user_memory_peak   = msg->heartbeat.user_memory_peak,
+                .kernel_memory      = msg->heartbeat.kernel_memory,
+                .kernel_memory_peak = msg->heartbeat.kernel_memory_peak,
+            };
+
+            __ec_compact_put(&writer, &body, sizeof(body));
+        }
+        break;
+
+    case CB_EVENT_TYPE_RATE_LIMIT:
+        __ec_compact_put(&writer, &msg->rateLimit, sizeof(msg->rateLimit));
+        break;
+
+    default:
+        break;
+    }
+
+    TRY_MSG(!writer.overflow, DL_ERROR, "%s: event type %d does not fit in %zu bytes", __func__, msg->eventType, size);
+
+    event->header.size = writer.pos - start;
+    return writer.pos - buf;
+
+CATCH_DEFAULT:
+    // Path definitions may have been cut off, so make the reader get them again
+    if (paths)
+    {
+        ec_compact_paths_clear(paths, context);
+    }
+    return xcode;
+}
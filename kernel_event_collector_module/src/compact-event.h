@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+// Copyright (c) 2023 VMware, Inc. All rights reserved.
+
+#pragma once
+
+#include "priv.h"
+#include "compact_event.h"
+
+// The paths the reader has been sent, slot N holds the path with id N + 1. Each
+//  slot keeps a reference to the path so the pointer can not be reused for
+//  another string while it is in the table.
+typedef struct compact_path_table {
+    struct {
+        char     *path;
+        uint32_t  hash;
+        uint32_t  len;
+    } slot[CB_COMPACT_PATH_IDS];
+} CompactPathTable;
+
+CompactPathTable *ec_compact_paths_alloc(ProcessContext *context);
+void ec_compact_paths_free(CompactPathTable *paths, ProcessContext *context);
+void ec_compact_paths_clear(CompactPathTable *paths, ProcessContext *context);
+
+// Writes msg as compact records into buf, returns the bytes written or a negative error
+int ec_compact_serialize_event(CompactPathTable *paths, struct CB_EVENT *msg, char *buf, size_t size, ProcessContext *context);
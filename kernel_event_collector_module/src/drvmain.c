@@ -37,6 +37,24 @@ uint64_t g_enableHooks __read_mostly = HOOK_MASK;
 uid_t    g_edr_server_uid __read_mostly = (uid_t)-1;
 bool     g_exiting __read_mostly;
 uint32_t g_max_queue_size = DEFAULT_QUEUE_SIZE * 3;
+
+// Percent of max_queue_size held back for each EC_EVENT_CLASS, the rest is shared.
+//  The default keeps a quarter of the queue for process events.
+uint32_t g_event_class_quota[EC_EVENT_CLASS_MAX] = { 25, 0, 0, 0, 0 };
+
+// Events per second a single process may send of each EC_EVENT_CLASS, 0 is unlimited.
+//  Process and DNS events are never limited.
+uint32_t g_event_class_rate[EC_EVENT_CLASS_MAX] = { 0, 0, 0, 0, 0 };
+
+// A sleeping reader is woken once this many events are queued or the first of them
+//  has waited wakeup_delay_us. The batch shrinks when events arrive slowly, and a
+//  batch of 1 or a delay of 0 wakes the reader for every event.
+uint32_t g_wakeup_batch = 64;
+uint32_t g_wakeup_delay_us = 1000;
+
+// The reader may open the device up to this many times to read events in parallel,
+//  the events of a process always go to the same file. Only read at load time.
+uint32_t g_reader_shards = 1;
 uint32_t ec_prsock_buflen __read_mostly;
 bool     g_run_self_tests __read_mostly;
 bool     g_enable_hook_tracking __read_mostly;
@@ -55,6 +73,11 @@ CB_DRIVER_CONFIG g_driver_config  __read_mostly = {
 // checkpatch-ignore: SYMBOLIC_PERMS
 module_param_named(traceLevel, g_traceLevel, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 module_param_named(max_queue_size, g_max_queue_size, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+module_param_array_named(event_class_quota, g_event_class_quota, uint, NULL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+module_param_array_named(event_class_rate, g_event_class_rate, uint, NULL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+module_param_named(wakeup_batch, g_wakeup_batch, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+module_param_named(wakeup_delay_us, g_wakeup_delay_us, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+module_param_named(reader_shards, g_reader_shards, uint, S_IRUSR | S_IRGRP);
 module_param_named(ec_prsock_buflen, ec_prsock_buflen, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 module_param_named(run_self_tests, g_run_self_tests, bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 module_param_named(enable_hook_tracking, g_enable_hook_tracking, bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
@@ -45,12 +45,22 @@ PCB_EVENT ec_factory_alloc_event(
     }
 
     // This will return a NULL event if we are configured to not send this event type
-    event = ec_alloc_event(eventType, context);
+    //  or the process is sending this class of event faster than allowed
+    if (ec_process_tracking_check_rate(process_handle, eventType, context))
+    {
+        event = ec_alloc_event(eventType, context);
+    }
 
     // We still call this even for a NULL event to give the process_tracking a chance
     //  to clean up any private data
     ec_process_tracking_set_event_info(process_handle, eventType, event, context);
 
+    // Let the first event through after a while of suppression carry a report
+    if (event && ec_event_class(eventType) != EC_EVENT_CLASS_PROCESS)
+    {
+        ec_event_send_rate_limit(process_handle, false, context);
+    }
+
     return event;
 }
 
@@ -172,9 +182,14 @@ void ec_event_send_exit(
     bool            was_last_active_process,
     ProcessContext *context)
 {
+    PCB_EVENT event;
+
+    // The process will not send anything else, so report everything left out now
+    ec_event_send_rate_limit(process_handle, true, context);
+
     // We need to know if this is the last running proccess when we allocate
     //  the event because we may not be sending exits for all forks
-    PCB_EVENT  event                = ec_factory_alloc_event(
+    event = ec_factory_alloc_event(
         process_handle,
         was_last_active_process ? CB_EVENT_TYPE_PROCESS_LAST_EXIT : CB_EVENT_TYPE_PROCESS_EXIT,
         0,              // No message will be printed
@@ -197,6 +212,34 @@ void ec_event_send_exit(
     }
 }
 
+void ec_event_send_rate_limit(
+    ProcessHandle  *process_handle,
+    bool            flush,
+    ProcessContext *context)
+{
+    CB_EVENT_RATE_LIMIT report;
+    PCB_EVENT           event;
+
+    CANCEL_VOID(ec_process_tracking_peek_rate_report(process_handle, flush, &report));
+
+    // Not through the factory so the report is never limited itself. The counts are
+    //  kept for the next report unless this one makes it to the queue.
+    event = ec_alloc_event(CB_EVENT_TYPE_RATE_LIMIT, context);
+    CANCEL_VOID(event);
+
+    ec_process_tracking_fill_event_info(process_handle, event, context);
+    event->rateLimit = report;
+
+    TRACE(DL_PROCESS, "RATE LIMIT of %d left out %u network, %u file and %u other events",
+          ec_process_posix_identity(process_handle)->posix_details.pid,
+          report.network, report.file, report.other);
+
+    if (ec_send_event(event, context) == 0)
+    {
+        ec_process_tracking_clear_rate_report(process_handle, &report);
+    }
+}
+
 void ec_event_send_block(
     ProcessHandle * process_handle,
     uint32_t        type,
@@ -458,6 +501,7 @@ const char *ec_EventType_ToString(int event_type)
     case CB_EVENT_TYPE_PROCESS_START_FORK: return "FORK"; break;
     case CB_EVENT_TYPE_PROCESS_START_EXEC: return "EXEC"; break;
     case CB_EVENT_TYPE_PROCESS_LAST_EXIT: return "LAST EXIT"; break;
+    case CB_EVENT_TYPE_RATE_LIMIT: return "RATE LIMIT"; break;
     default:
         break;
     }
@@ -25,6 +25,10 @@ void ec_event_send_exit(ProcessHandle  *process_handle,
                         bool             was_last_active_process,
                         ProcessContext  *context);
 
+void ec_event_send_rate_limit(ProcessHandle  *process_handle,
+                              bool             flush,
+                              ProcessContext  *context);
+
 void ec_event_send_block(ProcessHandle  *process_handle,
                          uint32_t          type,
                          uint32_t          reason,
@@ -20,6 +20,7 @@ static HashTbl __read_mostly s_file_hash_table = {
     .key_len     = sizeof(FILE_PROCESS_KEY),
     .key_offset  = offsetof(FILE_PROCESS_VALUE, key),
     .delete_callback = __ec_file_tracking_delete_callback,
+    .resizable = true,
 };
 
 bool ec_file_tracking_init(ProcessContext *context)
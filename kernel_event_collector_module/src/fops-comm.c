@@ -18,6 +18,12 @@
 #include <linux/workqueue.h>
 #include <linux/jiffies.h>
 #include <linux/ioctl.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/list_sort.h>
+#include <linux/hrtimer.h>
+#include <linux/hash.h>
 
 #include "priv.h"
 #include "cb-banning.h"
@@ -29,6 +35,7 @@
 #include "netfilter.h"
 #include "InodeState.h"
 #include "event-factory.h"
+#include "compact-event.h"
 
 const char DRIVER_NAME[] = CB_APP_MODULE_NAME;
 #define MINOR_COUNT 1
@@ -38,6 +45,7 @@ int ec_device_open(struct inode *inode, struct file *filep);
 int ec_device_release(struct inode *inode, struct file *filep);
 ssize_t ec_device_read(struct file *f, char __user *buf, size_t count, loff_t *offset);
 unsigned int ec_device_poll(struct file *filep, struct poll_table_struct *poll);
+int ec_device_mmap(struct file *filep, struct vm_area_struct *vma);
 long ec_device_unlocked_ioctl(struct file *filep, unsigned int cmd, unsigned long arg);
 int __ec_DoAction(ProcessContext *context, uint32_t action);
 void ec_user_comm_clear_queue(ProcessContext *context);
@@ -48,25 +56,48 @@ void __ec_apply_legacy_driver_config(uint32_t eventFilter);
 void __ec_apply_driver_config(CB_DRIVER_CONFIG *config);
 char *__ec_driver_config_option_to_string(CB_CONFIG_OPTION config_option);
 void __ec_print_driver_config(char *msg, CB_DRIVER_CONFIG *config);
-void __ec_transfer_from_input_queue(void);
-int __ec_copy_cbevent_to_user(char __user *ubuf, size_t count, ProcessContext *context);
+void __ec_transfer_from_input_queue(uint32_t shard_id);
+bool __ec_enqueue_event(CB_EVENT_NODE *eventNode);
+void __ec_dequeue_event(CB_EVENT_NODE *eventNode);
+void __ec_record_dwell(CB_EVENT_NODE *eventNode);
+bool __ec_input_queues_empty(uint32_t shard_id);
+bool __ec_output_queues_empty(uint32_t shard_id);
+void __ec_class_limits(EC_EVENT_CLASS event_class, uint64_t size, uint64_t *reserved, uint64_t *shared);
+ssize_t ec_read_events(uint32_t shard_id, char __user *ubuf, size_t count, ProcessContext *context);
+ssize_t __ec_copy_events_to_user(uint32_t shard_id, char __user *ubuf, size_t count, ProcessContext *context);
+int ec_obtain_next_cbevent(uint32_t shard_id, struct CB_EVENT **cb_event, size_t count, ProcessContext *context);
 int __ec_precompute_payload(struct CB_EVENT *cb_event);
+int __ec_serialize_event(struct CB_EVENT *msg, uint16_t payload, char *buf);
+bool __ec_ring_write_event(struct CB_EVENT *msg, uint16_t payload, ProcessContext *context);
+bool __ec_ring_has_events(void);
+void __ec_count_sent_event(CB_EVENT_TYPE eventType);
 void __ec_stats_work_task(struct work_struct *work);
+void __ec_fold_cpu_stats(uint32_t interval);
+int ec_set_wire_format(uint32_t shard_id, uint32_t wire_format, ProcessContext *context);
+struct reader_shard_t;
+void __ec_wake_up_reader_batched(struct reader_shard_t *shard, CB_EVENT_TYPE eventType, ProcessContext *context);
+static enum hrtimer_restart __ec_wakeup_timer_fn(struct hrtimer *timer);
 
 // checkpatch-ignore: CONST_STRUCT
 struct file_operations driver_fops = {
     .owner          = THIS_MODULE,
     .read           = ec_device_read,
     .poll           = ec_device_poll,
+    .mmap           = ec_device_mmap,
     .open           = ec_device_open,
     .release        = ec_device_release,
     .unlocked_ioctl = ec_device_unlocked_ioctl,
 };
 // checkpatch-no-ignore: CONST_STRUCT
 
-static LIST_HEAD(msg_queue);
-
-static LLIST_HEAD(msg_queue_in);
+// Producers push onto the queue of the CPU they run on so hooks on different
+//  CPUs never touch the same cache line. The reader of a shard merges its queues
+//  by enqueue_time into the msg_queue of the shard, which keeps the order events
+//  were sent in.
+struct event_cpu_queue_t
+{
+    struct llist_head      msg_queue_in[EC_READER_SHARDS_MAX];
+};
 
 static const uint64_t MAX_VALID_INTERVALS =   60;
 #define  MAX_INTERVALS           62
@@ -105,6 +136,11 @@ typedef struct CB_EVENT_STATS {
     // The number of times the list has carried over. (This helps us calculate the average
     //  later by knowing how many are valid.)
     uint64_t        validStats;
+
+    // The longest any event waited in the queue (ns) and the deepest the queue got in
+    //  each interval. Unlike stats these are not running sums.
+    uint64_t        max_dwell[MAX_INTERVALS];
+    uint64_t        high_water[MAX_INTERVALS];
 } CB_EVENT_STATS, *PCB_EVENT_STATS;
 
 const static struct {
@@ -134,23 +170,66 @@ const static struct {
 #define valid_stats         (s_fops_data.event_stats.validStats)
 #define tx_ready            (s_fops_data.event_stats.tx_ready)
 #define tx_queued_t         (s_fops_data.event_stats.stats[current_stat][0])
-#define tx_dropped          (s_fops_data.event_stats.stats[current_stat][1])
-#define tx_pdropped         (s_fops_data.event_stats.stats[current_stat][2])
-#define tx_total            (s_fops_data.event_stats.stats[current_stat][3])
-#define tx_process          (s_fops_data.event_stats.stats[current_stat][4])
-#define tx_modload          (s_fops_data.event_stats.stats[current_stat][5])
-#define tx_file             (s_fops_data.event_stats.stats[current_stat][6])
-#define tx_net              (s_fops_data.event_stats.stats[current_stat][7])
-#define tx_dns              (s_fops_data.event_stats.stats[current_stat][8])
-#define tx_proxy            (s_fops_data.event_stats.stats[current_stat][9])
-#define tx_block            (s_fops_data.event_stats.stats[current_stat][10])
-#define tx_other            (s_fops_data.event_stats.stats[current_stat][11])
+
+// The event counters are bumped from every CPU, so they are kept per CPU as running
+//  totals and folded into the current interval by __ec_stats_work_task.
+#define TX_DROPPED          1
+#define TX_PDROPPED         2
+#define TX_TOTAL            3
+#define TX_PROCESS          4
+#define TX_MODLOAD          5
+#define TX_FILE             6
+#define TX_NET              7
+#define TX_DNS              8
+#define TX_PROXY            9
+#define TX_BLOCK            10
+#define TX_OTHER            11
+#define TX_STATS            12
+
+#define ec_tx_stat_inc(STAT) this_cpu_inc(s_fops_data.cpu_stats->tx[STAT])
 
 #define mem_user            (s_fops_data.event_stats.stats[current_stat][12])
 #define mem_user_peak       (s_fops_data.event_stats.stats[current_stat][13])
 #define mem_kernel          (s_fops_data.event_stats.stats[current_stat][14])
 #define mem_kernel_peak     (s_fops_data.event_stats.stats[current_stat][15])
 
+// Queue dwell time is counted in log2 buckets of microseconds. Bucket 0 is under
+//  1us, bucket N under 2^N us, and the last one takes everything slower.
+#define LATENCY_BUCKETS     24
+
+struct event_cpu_stats_t
+{
+    uint64_t               tx[TX_STATS];
+
+    // Lifetime totals per event type, shown by events-types
+    uint64_t               enqueued[CB_EVENT_TYPE_MAX];
+    uint64_t               dequeued[CB_EVENT_TYPE_MAX];
+    uint64_t               dropped[CB_EVENT_TYPE_MAX];
+
+    uint64_t               class_dropped[EC_EVENT_CLASS_MAX];
+
+    // Lifetime dwell time histograms, shown by events-latency
+    uint64_t               latency[EC_EVENT_CLASS_MAX][LATENCY_BUCKETS];
+
+    // Extremes of the current interval, folded and cleared by __ec_stats_work_task
+    uint64_t               max_dwell;
+    uint64_t               high_water;
+
+    // Lifetime totals per reader shard, shown by events-shards
+    uint64_t               shard_enqueued[EC_READER_SHARDS_MAX];
+    uint64_t               shard_dequeued[EC_READER_SHARDS_MAX];
+    uint64_t               shard_sent[EC_READER_SHARDS_MAX];
+    uint64_t               shard_wakeups[EC_READER_SHARDS_MAX];
+};
+
+#define ec_type_stat_inc(STAT, TYPE) \
+    do { \
+        if ((unsigned int)(TYPE) < CB_EVENT_TYPE_MAX) \
+        { \
+            this_cpu_inc(s_fops_data.cpu_stats->STAT[TYPE]); \
+        } \
+    } while (0)
+
 static struct  fops_config_t
 {
     // Our device special major number
@@ -159,19 +238,87 @@ static struct  fops_config_t
     uint64_t               reader_pid_lock;
     pid_t                  reader_pid;
 
+    // Open files of the reader, it stays connected until the last one is released
+    int                    reader_files;
+
     // Flag to identify if the queue is enabled
     bool                   enabled;
     struct delayed_work    stats_work;
     uint32_t               stats_work_delay;
-    wait_queue_head_t      wq;
     bool                   need_wakeup;
-    uint32_t               high_queue_size;
 } s_fops_config __read_mostly;
 
-static struct fops_data_t
+// The shared memory ring the reader maps. Hooks on any CPU may send events, so
+//  they take ring_lock to act as the single producer.
+struct event_ring_t
+{
+    uint64_t                     ring_lock;
+    struct CB_EVENT_RING_HEADER *header;
+    char                        *data;
+    uint64_t                     data_size;
+    atomic_t                     map_count;
+
+    // The shard of the file that mapped the ring, it is woken for ring events
+    struct reader_shard_t       *shard;
+};
+
+// Big enough for many events, and always for the largest one
+#define STAGING_BUFFER_SIZE   (64 * 1024)
+
+// Lets events collect while the reader sleeps so it gets fewer, larger reads. The
+//  reader is woken once target events are pending or the timer runs out.
+struct reader_wakeup_t
+{
+    struct hrtimer         timer;
+    atomic_t               timer_armed;
+    atomic_t               pending;
+    uint32_t               target;
+    uint64_t               last_wakeup;
+};
+
+// The reader may open the device several times and each file reads one shard.
+//  Events go to the shard picked by their process so one file still sees the
+//  events of a process in order. Events for a shard nobody opened go to shard 0.
+struct reader_shard_t
 {
+    // Protects msg_queue between the reader and clearing the queue
     uint64_t               lock;
+    struct mutex           read_lock;
+    char                  *staging;
+
+    // Events in the order they were sent. Classes only decide which events are
+    //  let in, so the events of a process are never reordered.
+    struct list_head       msg_queue;
+
+    // Events taken from the CPU queues that are too new for the last transfer horizon.
+    //  An older event may still be on its way from another CPU, so they wait here.
+    struct list_head       msg_held;
+    wait_queue_head_t      wq;
+    struct reader_wakeup_t wakeup;
+    atomic_t               files;
+
+    // What read() hands out, CB_WIRE_FORMAT_LEGACY or CB_WIRE_FORMAT_COMPACT. Both
+    //  are only changed with read_lock held.
+    uint32_t               wire_format;
+    CompactPathTable      *paths;
+};
+
+static struct fops_data_t
+{
     CB_EVENT_STATS         event_stats;
+    struct event_ring_t    ring;
+    struct event_cpu_queue_t __percpu *cpu_queues;
+    struct event_cpu_stats_t __percpu *cpu_stats;
+
+    // Per CPU totals at the last reset of the interval stats
+    uint64_t               tx_base[TX_STATS];
+
+    // Queued events per class, and how many of them are using the shared capacity
+    struct percpu_counter  class_queued[EC_EVENT_CLASS_MAX];
+    struct percpu_counter  shared_queued;
+
+    struct reader_shard_t  shard[EC_READER_SHARDS_MAX];
+    uint32_t               nr_shards;
 } s_fops_data;
 
 #define STAT_INTERVAL    15
@@ -195,7 +342,8 @@ bool ec_is_reader_connected(void)
     return s_fops_config.reader_pid != 0;
 }
 
-bool __ec_connect_reader(ProcessContext *context)
+// Adds an open file of the reader, first_file tells if it is the only one
+static bool __ec_connect_reader_file(bool *first_file, ProcessContext *context)
 {
     ec_write_lock(&s_fops_config.reader_pid_lock, context);
 
@@ -210,6 +358,41 @@ bool __ec_connect_reader(ProcessContext *context)
     }
 
     s_fops_config.reader_pid = context->pid;
+    ++s_fops_config.reader_files;
+    if (first_file)
+    {
+        *first_file = s_fops_config.reader_files == 1;
+    }
+
+    ec_write_unlock(&s_fops_config.reader_pid_lock, context);
+
+    return true;
+}
+
+bool __ec_connect_reader(ProcessContext *context)
+{
+    return __ec_connect_reader_file(NULL, context);
+}
+
+// Drops one open file of the reader, the reader is disconnected with the last one
+bool __ec_release_reader(pid_t pid, ProcessContext *context)
+{
+    ec_write_lock(&s_fops_config.reader_pid_lock, context);
+
+    if (s_fops_config.reader_pid != pid)
+    {
+        ec_write_unlock(&s_fops_config.reader_pid_lock, context);
+
+        return false;
+    }
+
+    if (--s_fops_config.reader_files <= 0)
+    {
+        TRACE(DL_INFO, "Disconnecting from %d", s_fops_config.reader_pid);
+
+        s_fops_config.reader_pid   = 0;
+        s_fops_config.reader_files = 0;
+    }
 
     ec_write_unlock(&s_fops_config.reader_pid_lock, context);
 
@@ -229,7 +412,8 @@ bool ec_disconnect_reader(pid_t pid, ProcessContext *context)
 
     TRACE(DL_INFO, "Disconnecting from %d", s_fops_config.reader_pid);
 
-    s_fops_config.reader_pid = 0;
+    s_fops_config.reader_pid   = 0;
+    s_fops_config.reader_files = 0;
 
     ec_write_unlock(&s_fops_config.reader_pid_lock, context);
 
@@ -241,11 +425,102 @@ bool __ec_is_process_connected_reader(pid_t pid)
     return s_fops_config.reader_pid == pid;
 }
 
+// A shard with a staging buffer is fully set up, the rest can not fail
+static void __ec_shards_shutdown(ProcessContext *context)
+{
+    int i;
+
+    for (i = 0; i < s_fops_data.nr_shards; ++i)
+    {
+        struct reader_shard_t *shard = &s_fops_data.shard[i];
+
+        if (!shard->staging)
+        {
+            continue;
+        }
+
+        hrtimer_cancel(&shard->wakeup.timer);
+        ec_spinlock_destroy(&shard->lock, context);
+        ec_mem_free(shard->staging);
+        shard->staging = NULL;
+        ec_compact_paths_free(shard->paths, context);
+        shard->paths = NULL;
+    }
+}
+
+static bool __ec_shards_init(ProcessContext *context)
+{
+    int i;
+
+    s_fops_data.nr_shards = clamp_t(uint32_t, g_reader_shards, 1, EC_READER_SHARDS_MAX);
+
+    for (i = 0; i < s_fops_data.nr_shards; ++i)
+    {
+        struct reader_shard_t *shard = &s_fops_data.shard[i];
+
+        shard->staging = ec_mem_valloc(STAGING_BUFFER_SIZE, context);
+        TRY_MSG(shard->staging, DL_ERROR, "%s: failed to allocate staging buffer", __func__);
+
+        ec_spinlock_init(&shard->lock, context);
+        mutex_init(&shard->read_lock);
+        INIT_LIST_HEAD(&shard->msg_queue);
+        INIT_LIST_HEAD(&shard->msg_held);
+        init_waitqueue_head(&shard->wq);
+        atomic_set(&shard->files, 0);
+        shard->wire_format = CB_WIRE_FORMAT_LEGACY;
+        shard->paths       = NULL;
+
+        hrtimer_init(&shard->wakeup.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        shard->wakeup.timer.function = __ec_wakeup_timer_fn;
+        atomic_set(&shard->wakeup.timer_armed, 0);
+        atomic_set(&shard->wakeup.pending, 0);
+        shard->wakeup.target      = 1;
+        shard->wakeup.last_wakeup = ktime_to_ns(ktime_get());
+    }
+
+    TRACE(DL_INIT, "%s: %u reader shards", __func__, s_fops_data.nr_shards);
+    return true;
+
+CATCH_DEFAULT:
+    __ec_shards_shutdown(context);
+    return false;
+}
+
 bool ec_user_comm_initialize(ProcessContext *context)
 {
     size_t kernel_mem;
+    int    cpu;
+    int    i;
 
-    ec_spinlock_init(&s_fops_data.lock, context);
+    s_fops_data.cpu_queues = ec_alloc_percpu(struct event_cpu_queue_t, GFP_MODE(context));
+    TRY_MSG(s_fops_data.cpu_queues, DL_ERROR, "%s: failed to allocate per-CPU queues", __func__);
+
+    for_each_possible_cpu(cpu)
+    {
+        struct event_cpu_queue_t *queue = per_cpu_ptr(s_fops_data.cpu_queues, cpu);
+
+        for (i = 0; i < EC_READER_SHARDS_MAX; ++i)
+        {
+            init_llist_head(&queue->msg_queue_in[i]);
+        }
+    }
+
+    for (i = 0; i < EC_EVENT_CLASS_MAX; ++i)
+    {
+        ec_percpu_counter_init(&s_fops_data.class_queued[i], 0, GFP_MODE(context));
+    }
+    ec_percpu_counter_init(&s_fops_data.shared_queued, 0, GFP_MODE(context));
+
+    s_fops_data.cpu_stats = ec_alloc_percpu(struct event_cpu_stats_t, GFP_MODE(context));
+    TRY_STEP_MSG(QUEUES, s_fops_data.cpu_stats, DL_ERROR, "%s: failed to allocate per-CPU stats", __func__);
+    memset(s_fops_data.tx_base, 0, sizeof(s_fops_data.tx_base));
+
+    TRY_STEP(STATS, __ec_shards_init(context));
+
+    ec_spinlock_init(&s_fops_data.ring.ring_lock, context);
+    s_fops_data.ring.header = NULL;
+    s_fops_data.ring.shard  = &s_fops_data.shard[0];
+    atomic_set(&s_fops_data.ring.map_count, 0);
 
     current_stat = 0;
     valid_stats  = 0;
@@ -259,17 +534,29 @@ bool ec_user_comm_initialize(ProcessContext *context)
     mem_kernel_peak = kernel_mem;
 
     s_fops_config.need_wakeup = true;
-    init_waitqueue_head(&s_fops_config.wq);
 
     // Initialize a workque struct to police the hashtable
     s_fops_config.stats_work_delay = msecs_to_jiffies(STAT_INTERVAL * 1000);
     INIT_DELAYED_WORK(&s_fops_config.stats_work, __ec_stats_work_task);
     schedule_delayed_work(&s_fops_config.stats_work, s_fops_config.stats_work_delay);
 
-    // high water mark is 75% of queue size
-    s_fops_config.high_queue_size = g_max_queue_size * .75;
-
     return true;
+
+CATCH_STATS:
+    free_percpu(s_fops_data.cpu_stats);
+    s_fops_data.cpu_stats = NULL;
+
+CATCH_QUEUES:
+    for (i = 0; i < EC_EVENT_CLASS_MAX; ++i)
+    {
+        percpu_counter_destroy(&s_fops_data.class_queued[i]);
+    }
+    percpu_counter_destroy(&s_fops_data.shared_queued);
+    free_percpu(s_fops_data.cpu_queues);
+    s_fops_data.cpu_queues = NULL;
+
+CATCH_DEFAULT:
+    return false;
 }
 
 bool ec_user_devnode_init(ProcessContext *context)
@@ -304,6 +591,8 @@ void ec_user_devnode_close(ProcessContext *context)
 
 void ec_user_comm_shutdown(ProcessContext *context)
 {
+    int i;
+
     /**
      * Calling the sync flavor gives the guarantee that on the return of the
      * routine, work is not pending and not executing on any CPU.
@@ -311,9 +600,19 @@ void ec_user_comm_shutdown(ProcessContext *context)
      * Its supposed to work even if the work schedules itself.
      */
     cancel_delayed_work_sync(&s_fops_config.stats_work);
+    __ec_shards_shutdown(context);
 
     percpu_counter_destroy(&tx_ready);
-    ec_spinlock_destroy(&s_fops_data.lock, context);
+    for (i = 0; i < EC_EVENT_CLASS_MAX; ++i)
+    {
+        percpu_counter_destroy(&s_fops_data.class_queued[i]);
+    }
+    percpu_counter_destroy(&s_fops_data.shared_queued);
+    ec_spinlock_destroy(&s_fops_data.ring.ring_lock, context);
+    free_percpu(s_fops_data.cpu_queues);
+    s_fops_data.cpu_queues = NULL;
+    free_percpu(s_fops_data.cpu_stats);
+    s_fops_data.cpu_stats = NULL;
 }
 
 bool ec_user_comm_enable(ProcessContext *context)
@@ -334,25 +633,29 @@ void ec_user_comm_disable(ProcessContext *context)
     ec_fops_comm_wake_up_reader(context);
 }
 
-void __ec_clear_tx_queue(ProcessContext *context)
+void __ec_clear_tx_queue(uint32_t shard_id, ProcessContext *context)
 {
-    struct list_head *eventNode;
-    struct list_head *safeNode;
+    struct reader_shard_t *shard = &s_fops_data.shard[shard_id];
+    struct list_head      *eventNode;
+    struct list_head      *safeNode;
 
-    __ec_transfer_from_input_queue();
+    __ec_transfer_from_input_queue(shard_id);
+    list_splice_tail_init(&shard->msg_held, &shard->msg_queue);
 
-    list_for_each_safe(eventNode, safeNode, &msg_queue)
+    list_for_each_safe(eventNode, safeNode, &shard->msg_queue)
     {
         list_del_init(eventNode);
         // Coverity thinks that we are freeing a bad pointer here because of the container_of
         // coverity[address_free:SUPPRESS]
+        __ec_dequeue_event(container_of(eventNode, CB_EVENT_NODE, listEntry));
         ec_free_event(&(container_of(eventNode, CB_EVENT_NODE, listEntry)->data), context);
-        percpu_counter_dec(&tx_ready);
     }
 }
 
 void ec_user_comm_clear_queue(ProcessContext *context)
 {
+    uint32_t i;
+
     TRACE(DL_INFO, "%s: clear queues", __func__);
 
     // Clearing the queue can trigger sending an exit event which will hang when ec_send_event
@@ -362,22 +665,42 @@ void ec_user_comm_clear_queue(ProcessContext *context)
     // We need to lock here to protect access between the event reader thread and user action to clear the queue
     //  1) Events are inserted into the a lockless list, so they are not affected by this lock.
     //  2) If we do not lock, the two threads can race to access the same list of events
-    ec_write_lock(&s_fops_data.lock, context);
-    __ec_clear_tx_queue(context);
+    for (i = 0; i < s_fops_data.nr_shards; ++i)
+    {
+        ec_write_lock(&s_fops_data.shard[i].lock, context);
+        __ec_clear_tx_queue(i, context);
+        ec_write_unlock(&s_fops_data.shard[i].lock, context);
+    }
 
-    ec_write_unlock(&s_fops_data.lock, context);
     ENABLE_SEND_EVENTS(context);
 }
 
+// Picks the shard for the events of a process by its tgid
+static uint8_t __ec_event_shard(struct CB_EVENT *msg)
+{
+    uint32_t shard_id;
+
+    if (s_fops_data.nr_shards <= 1)
+    {
+        return 0;
+    }
+
+    shard_id = hash_32((uint32_t)msg->procInfo.all_process_details.array[FORK].pid, 32) % s_fops_data.nr_shards;
+
+    // Nobody would read it there
+    return atomic_read(&s_fops_data.shard[shard_id].files) ? shard_id : 0;
+}
+
 // Coverity thinks that we leak the event because we use containerof to get the list node.  Tell it that this
 //  will free the event
 // coverity[+free : arg-0]
 int ec_send_event(struct CB_EVENT *msg, ProcessContext *context)
 {
     int                result     = -1;
-    uint64_t           readyCount = 0;
     int                payload;
     CB_EVENT_NODE      *eventNode;
+    CB_EVENT_TYPE      eventType;
+    struct reader_shard_t *shard;
 
     TRY(ALLOW_SEND_EVENTS(context));
 
@@ -385,6 +708,7 @@ int ec_send_event(struct CB_EVENT *msg, ProcessContext *context)
     TRY(msg && ec_is_reader_connected());
 
     eventNode = container_of(msg, CB_EVENT_NODE, data);
+    eventType = msg->eventType;
     payload = __ec_precompute_payload(msg);
 
     // Should not happen but it can
@@ -394,20 +718,22 @@ int ec_send_event(struct CB_EVENT *msg, ProcessContext *context)
 
     eventNode->payload = (uint16_t)payload;
 
-    readyCount = percpu_counter_read_positive(&tx_ready);
-
-    if (readyCount < g_max_queue_size)
+    // A mapped ring replaces the queue. The event is written out once here and
+    //  freed, the reader picks it up without a syscall.
+    if (s_fops_data.ring.header)
+    {
+        shard = READ_ONCE(s_fops_data.ring.shard);
+        if (__ec_ring_write_event(msg, eventNode->payload, context))
+        {
+            ec_free_event(msg, context);
+            msg = NULL;
+        }
+    } else
     {
-        if (readyCount < s_fops_config.high_queue_size
-            || msg->eventType == CB_EVENT_TYPE_PROCESS_START
-            || msg->eventType == CB_EVENT_TYPE_DISCOVER
-            || msg->eventType == CB_EVENT_TYPE_DISCOVER_COMPLETE
-            || msg->eventType == CB_EVENT_TYPE_DISCOVER_FLUSH
-            || msg->eventType == CB_EVENT_TYPE_PROCESS_EXIT
-            || msg->eventType == CB_EVENT_TYPE_PROCESS_LAST_EXIT)
+        eventNode->shard = __ec_event_shard(msg);
+        shard = &s_fops_data.shard[eventNode->shard];
+        if (__ec_enqueue_event(eventNode))
         {
-            llist_add(&(eventNode->llistEntry), &msg_queue_in);
-            percpu_counter_inc(&tx_ready);
             msg = NULL;
         }
     }
@@ -416,7 +742,7 @@ int ec_send_event(struct CB_EVENT *msg, ProcessContext *context)
     TRY(!msg);
 
     // If we enqueued the event wake up the reader task if we are allowed to
-    ec_fops_comm_wake_up_reader(context);
+    __ec_wake_up_reader_batched(shard, eventType, context);
 
     result = 0;
 
@@ -424,16 +750,13 @@ CATCH_DEFAULT:
     if (msg)
     {
         // If we still have an event at this point free it now
-        ++tx_dropped;
-
-        if (msg->eventType == CB_EVENT_TYPE_PROCESS_START
-            || msg->eventType == CB_EVENT_TYPE_DISCOVER
-            || msg->eventType == CB_EVENT_TYPE_DISCOVER_COMPLETE
-            || msg->eventType == CB_EVENT_TYPE_DISCOVER_FLUSH
-            || msg->eventType == CB_EVENT_TYPE_PROCESS_EXIT
-            || msg->eventType == CB_EVENT_TYPE_PROCESS_LAST_EXIT)
+        ec_tx_stat_inc(TX_DROPPED);
+        ec_type_stat_inc(dropped, msg->eventType);
+        this_cpu_inc(s_fops_data.cpu_stats->class_dropped[ec_event_class(msg->eventType)]);
+
+        if (ec_event_class(msg->eventType) == EC_EVENT_CLASS_PROCESS)
         {
-            ++tx_pdropped;
+            ec_tx_stat_inc(TX_PDROPPED);
         }
 
         ec_free_event(msg, context);
@@ -442,193 +765,663 @@ CATCH_DEFAULT:
     return result;
 }
 
+EC_EVENT_CLASS ec_event_class(CB_EVENT_TYPE eventType)
+{
+    switch (eventType)
+    {
+    case CB_EVENT_TYPE_PROCESS_START:
+    case CB_EVENT_TYPE_DISCOVER:
+    case CB_EVENT_TYPE_DISCOVER_COMPLETE:
+    case CB_EVENT_TYPE_DISCOVER_FLUSH:
+    case CB_EVENT_TYPE_PROCESS_EXIT:
+    case CB_EVENT_TYPE_PROCESS_LAST_EXIT:
+        return EC_EVENT_CLASS_PROCESS;
+
+    case CB_EVENT_TYPE_NET_CONNECT_PRE:
+    case CB_EVENT_TYPE_NET_CONNECT_POST:
+    case CB_EVENT_TYPE_NET_ACCEPT:
+    case CB_EVENT_TYPE_WEB_PROXY:
+        return EC_EVENT_CLASS_NETWORK;
+
+    case CB_EVENT_TYPE_DNS_RESPONSE:
+        return EC_EVENT_CLASS_DNS;
+
+    case CB_EVENT_TYPE_FILE_CREATE:
+    case CB_EVENT_TYPE_FILE_DELETE:
+    case CB_EVENT_TYPE_FILE_WRITE:
+    case CB_EVENT_TYPE_FILE_CLOSE:
+    case CB_EVENT_TYPE_FILE_OPEN:
+        return EC_EVENT_CLASS_FILE;
+
+    default:
+        return EC_EVENT_CLASS_OTHER;
+    }
+}
+
+// Splits size into the part held back for event_class and the part every class
+//  shares. Quotas are percentages, if they add up to more than 100 they are scaled
+//  down so the reserved parts still fit.
+void __ec_class_limits(EC_EVENT_CLASS event_class, uint64_t size, uint64_t *reserved, uint64_t *shared)
+{
+    uint64_t total = 0;
+    int      i;
+
+    for (i = 0; i < EC_EVENT_CLASS_MAX; ++i)
+    {
+        total += g_event_class_quota[i];
+    }
+
+    *reserved = total ? size * g_event_class_quota[event_class] / max_t(uint64_t, total, 100) : 0;
+    *shared   = total < 100 ? size * (100 - total) / 100 : 0;
+}
+
+// An event first uses the capacity reserved for its class. Once that is full it
+//  competes for the shared capacity with every other class, so a storm of one
+//  kind of event can not starve the classes with a quota.
+bool __ec_enqueue_event(CB_EVENT_NODE *eventNode)
+{
+    EC_EVENT_CLASS event_class = ec_event_class(eventNode->data.eventType);
+    uint64_t       reserved;
+    uint64_t       shared;
+    uint64_t       depth;
+    unsigned long  flags;
+
+    __ec_class_limits(event_class, g_max_queue_size, &reserved, &shared);
+
+    if (percpu_counter_read_positive(&s_fops_data.class_queued[event_class]) < reserved)
+    {
+        eventNode->from_shared = false;
+    } else if (percpu_counter_read_positive(&s_fops_data.shared_queued) < shared)
+    {
+        eventNode->from_shared = true;
+        percpu_counter_inc(&s_fops_data.shared_queued);
+    } else
+    {
+        return false;
+    }
+
+    eventNode->event_class  = event_class;
+    percpu_counter_inc(&s_fops_data.class_queued[event_class]);
+    percpu_counter_inc(&tx_ready);
+    ec_type_stat_inc(enqueued, eventNode->data.eventType);
+    this_cpu_inc(s_fops_data.cpu_stats->shard_enqueued[eventNode->shard]);
+
+    // The approximate count is good enough for a high-water mark
+    depth = percpu_counter_read_positive(&tx_ready);
+    if (depth > this_cpu_read(s_fops_data.cpu_stats->high_water))
+    {
+        this_cpu_write(s_fops_data.cpu_stats->high_water, depth);
+    }
+
+    // Stamped and pushed with interrupts off, so each CPU queue stays in time order
+    //  and an event is on its queue right after it is stamped
+    local_irq_save(flags);
+    eventNode->enqueue_time = ktime_to_ns(ktime_get());
+    llist_add(&eventNode->llistEntry, &this_cpu_ptr(s_fops_data.cpu_queues)->msg_queue_in[eventNode->shard]);
+    local_irq_restore(flags);
+
+    return true;
+}
+
+// Called for every event that leaves msg_queue
+void __ec_dequeue_event(CB_EVENT_NODE *eventNode)
+{
+    percpu_counter_dec(&s_fops_data.class_queued[eventNode->event_class]);
+    if (eventNode->from_shared)
+    {
+        percpu_counter_dec(&s_fops_data.shared_queued);
+    }
+    percpu_counter_dec(&tx_ready);
+    this_cpu_inc(s_fops_data.cpu_stats->shard_dequeued[eventNode->shard]);
+}
+
+// Called as the reader takes an event off msg_queue
+void __ec_record_dwell(CB_EVENT_NODE *eventNode)
+{
+    uint64_t dwell  = ktime_to_ns(ktime_get()) - eventNode->enqueue_time;
+    int      bucket = min_t(int, fls64(div_u64(dwell, NSEC_PER_USEC)), LATENCY_BUCKETS - 1);
+
+    this_cpu_inc(s_fops_data.cpu_stats->latency[eventNode->event_class][bucket]);
+    if (dwell > this_cpu_read(s_fops_data.cpu_stats->max_dwell))
+    {
+        this_cpu_write(s_fops_data.cpu_stats->max_dwell, dwell);
+    }
+}
+
+bool __ec_output_queues_empty(uint32_t shard_id)
+{
+    return list_empty(&s_fops_data.shard[shard_id].msg_queue) &&
+           list_empty(&s_fops_data.shard[shard_id].msg_held);
+}
+
+bool __ec_input_queues_empty(uint32_t shard_id)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        if (!llist_empty(&per_cpu_ptr(s_fops_data.cpu_queues, cpu)->msg_queue_in[shard_id]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void ec_fops_comm_wake_up_reader(ProcessContext *context)
 {
+    uint32_t i;
+
     /* Wake up the reader task if we are allowed to. We want to avoid calling wake_up unnecessarily because it
      * uses a lock, which slows us down in send_event, which is called by all our hooks.
      */
-    if ((waitqueue_active(&s_fops_config.wq)) && ALLOW_WAKE_UP(context))
+    for (i = 0; i < s_fops_data.nr_shards; ++i)
     {
-        wake_up(&s_fops_config.wq);
-        TRACE(DL_COMMS, "wakeup");
-    } else
+        if ((waitqueue_active(&s_fops_data.shard[i].wq)) && ALLOW_WAKE_UP(context))
+        {
+            wake_up(&s_fops_data.shard[i].wq);
+            TRACE(DL_COMMS, "wakeup");
+        } else
+        {
+            TRACE(DL_COMMS, "no wakeup");
+        }
+    }
+}
+
+// Wakes the reader and sizes the next batch to what arrived since the last wakeup.
+//  A batch should fill in about wakeup_delay_us, at low rates that is one event and
+//  the reader is woken right away.
+static void __ec_wake_up_batch(struct reader_shard_t *shard)
+{
+    struct reader_wakeup_t *wakeup  = &shard->wakeup;
+    uint64_t                now     = ktime_to_ns(ktime_get());
+    uint64_t                elapsed = max_t(uint64_t, now - wakeup->last_wakeup, 1);
+    uint64_t                pending = atomic_xchg(&wakeup->pending, 0);
+    uint64_t                fits    = div64_u64(pending * READ_ONCE(g_wakeup_delay_us) * NSEC_PER_USEC, elapsed);
+
+    // Move half way so a single burst does not swing the target
+    wakeup->target      = clamp_t(uint64_t, (wakeup->target + fits + 1) / 2, 1, max_t(uint32_t, READ_ONCE(g_wakeup_batch), 1));
+    wakeup->last_wakeup = now;
+
+    this_cpu_inc(s_fops_data.cpu_stats->shard_wakeups[shard - s_fops_data.shard]);
+    wake_up(&shard->wq);
+}
+
+static enum hrtimer_restart __ec_wakeup_timer_fn(struct hrtimer *timer)
+{
+    struct reader_shard_t *shard = container_of(timer, struct reader_shard_t, wakeup.timer);
+
+    atomic_set(&shard->wakeup.timer_armed, 0);
+    if (waitqueue_active(&shard->wq))
+    {
+        __ec_wake_up_batch(shard);
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+// The agent acts on these, so they never wait for a batch
+static bool __ec_is_latency_critical(CB_EVENT_TYPE eventType)
+{
+    return ec_event_class(eventType) == EC_EVENT_CLASS_PROCESS ||
+           eventType == CB_EVENT_TYPE_PROCESS_BLOCKED ||
+           eventType == CB_EVENT_TYPE_HEARTBEAT;
+}
+
+// Unlocked, it only needs to tell when waiting for a batch could cost events
+static bool __ec_queue_filling_up(void)
+{
+    struct CB_EVENT_RING_HEADER *header = s_fops_data.ring.header;
+
+    if (header)
+    {
+        return READ_ONCE(header->head) - READ_ONCE(header->tail) > s_fops_data.ring.data_size / 2;
+    }
+
+    return percpu_counter_read_positive(&tx_ready) > g_max_queue_size / 2;
+}
+
+// The batched form of ec_fops_comm_wake_up_reader for the send path
+void __ec_wake_up_reader_batched(struct reader_shard_t *shard, CB_EVENT_TYPE eventType, ProcessContext *context)
+{
+    struct reader_wakeup_t *wakeup   = &shard->wakeup;
+    uint32_t                delay_us = READ_ONCE(g_wakeup_delay_us);
+    int                     pending;
+
+    // A reader that is not asleep finds the event on its next read
+    if (!waitqueue_active(&shard->wq) || !ALLOW_WAKE_UP(context))
     {
         TRACE(DL_COMMS, "no wakeup");
+        return;
     }
+
+    pending = atomic_inc_return(&wakeup->pending);
+
+    if (READ_ONCE(g_wakeup_batch) <= 1 || !delay_us ||
+        pending >= READ_ONCE(wakeup->target) ||
+        __ec_is_latency_critical(eventType) ||
+        __ec_queue_filling_up())
+    {
+        __ec_wake_up_batch(shard);
+        TRACE(DL_COMMS, "wakeup");
+        return;
+    }
+
+    // The first event of a batch starts the clock
+    if (!atomic_xchg(&wakeup->timer_armed, 1))
+    {
+        hrtimer_start(&wakeup->timer, ns_to_ktime((uint64_t)delay_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+    }
+    TRACE(DL_COMMS, "wakeup deferred");
+}
+
+// The shard the file was bound to on open
+static uint32_t __ec_file_shard(struct file *filp)
+{
+    struct reader_shard_t *shard = filp->private_data;
+
+    return shard ? shard - s_fops_data.shard : 0;
 }
 
 ssize_t ec_device_read(struct file *f,  char __user *ubuf, size_t count, loff_t *offset)
 {
     ssize_t xcode = -ENOMEM;
-    u32 total_copied = 0;
-    size_t total_bytes_copied = 0;
     DECLARE_NON_ATOMIC_CONTEXT(context, ec_getpid(current));
 
     TRACE(DL_COMMS, "%s: start read", __func__);
 
     BEGIN_MODULE_DISABLE_CHECK_IF_DISABLED_GOTO(&context, CATCH_DEFAULT);
 
-    // Perform once copy to user outside loop first to more easily
-    // propagate correct errno value.
-    xcode = __ec_copy_cbevent_to_user(ubuf, count, &context);
+    xcode = ec_read_events(__ec_file_shard(f), ubuf, count, &context);
 
-    // Multi-copy logic begins here.
-    TRY(xcode > 0);
-    count -= xcode;
-    ubuf += xcode;
-    total_copied += 1;
-    total_bytes_copied += xcode;
+CATCH_DEFAULT:
+    FINISH_MODULE_DISABLE_CHECK(&context);
 
-    while (total_copied < MAX_BULK_COPY_EVENTS)
-    {
-        // Prevent running on CPU for too long and
-        // soft lockups.
-        cond_resched();
+    return xcode;
+}
+
+// Fills as much of the user buffer as the queue allows. Events are serialized
+//  into the staging buffer and copied out one staging buffer at a time.
+ssize_t ec_read_events(uint32_t shard_id, char __user *ubuf, size_t count, ProcessContext *context)
+{
+    struct reader_shard_t *shard = &s_fops_data.shard[shard_id];
+    ssize_t                xcode;
+
+    // Threads reading the same shard may call read at the same time, they share its staging buffer
+    CANCEL(mutex_lock_interruptible(&shard->read_lock) == 0, -EINTR);
+    xcode = __ec_copy_events_to_user(shard_id, ubuf, count, context);
+    mutex_unlock(&shard->read_lock);
+
+    return xcode;
+}
+
+// Switches read() of a shard to wire_format. The interned paths are forgotten either
+//  way so the reader can reset its own table at the same time.
+int ec_set_wire_format(uint32_t shard_id, uint32_t wire_format, ProcessContext *context)
+{
+    struct reader_shard_t *shard = &s_fops_data.shard[shard_id];
 
-        // Stop copying if we have an incoming signal
-        if (signal_pending(current))
+    CANCEL(wire_format == CB_WIRE_FORMAT_LEGACY || wire_format == CB_WIRE_FORMAT_COMPACT, -EINVAL);
+
+    mutex_lock(&shard->read_lock);
+
+    if (wire_format == CB_WIRE_FORMAT_COMPACT && !shard->paths)
+    {
+        shard->paths = ec_compact_paths_alloc(context);
+        if (!shard->paths)
         {
-            break;
+            mutex_unlock(&shard->read_lock);
+            TRACE(DL_ERROR, "%s: failed to allocate path table", __func__);
+            return -ENOMEM;
         }
+    } else if (shard->paths)
+    {
+        ec_compact_paths_clear(shard->paths, context);
+    }
+
+    shard->wire_format = wire_format;
+
+    mutex_unlock(&shard->read_lock);
+
+    TRACE(DL_INFO, "%s: read() of shard %u uses the %s format", __func__, shard_id, wire_format == CB_WIRE_FORMAT_COMPACT ? "compact" : "legacy");
+    return 0;
+}
 
-        // Check if reader still connected
-        if (!ec_is_reader_connected())
+ssize_t __ec_copy_events_to_user(uint32_t shard_id, char __user *ubuf, size_t count, ProcessContext *context)
+{
+    struct reader_shard_t *shard   = &s_fops_data.shard[shard_id];
+    char                  *staging = shard->staging;
+    size_t                 staged  = 0;
+    size_t                 copied  = 0;
+    ssize_t                xcode   = 0;
+
+    while (true)
+    {
+        struct CB_EVENT *msg        = NULL;
+        size_t           user_room  = count - copied - staged;
+        size_t           stage_room = STAGING_BUFFER_SIZE - staged;
+        int              rc;
+
+        rc = ec_obtain_next_cbevent(shard_id, &msg, min(user_room, stage_room), context);
+        if (rc > 0)
         {
-            break;
+            CB_EVENT_TYPE eventType = msg->eventType;
+
+            // The compact records of an event never take more than its payload
+            if (shard->wire_format == CB_WIRE_FORMAT_COMPACT)
+            {
+                rc = ec_compact_serialize_event(shard->paths, msg, staging + staged, rc, context);
+            } else
+            {
+                rc = __ec_serialize_event(msg, (uint16_t)rc, staging + staged);
+            }
+            ec_free_event(msg, context);
+            if (rc <= 0)
+            {
+                xcode = rc;
+                break;
+            }
+
+            staged += rc;
+            __ec_count_sent_event(eventType);
+            this_cpu_inc(s_fops_data.cpu_stats->shard_sent[shard_id]);
+            continue;
         }
 
-        // should account for room available in buffer
-        xcode = __ec_copy_cbevent_to_user(ubuf, count, &context);
-        if (xcode <= 0)
+        // The next event does not fit in what is left of the staging buffer
+        //  but the caller has room for it, so flush and carry on.
+        if (rc == -EFAULT && staged && stage_room < user_room)
         {
-            // Add detailed logging here for unit tests
-            break;
+            TRY_SET_MSG(!copy_to_user(ubuf + copied, staging, staged), -ENXIO,
+                        DL_ERROR, "%s: copy to user failed", __func__);
+            copied += staged;
+            staged  = 0;
+
+            // Prevent running on CPU for too long and soft lockups
+            cond_resched();
+
+            // Stop copying if we have an incoming signal or the reader went away
+            if (signal_pending(current) || !ec_is_reader_connected())
+            {
+                break;
+            }
+            continue;
         }
-        count -= xcode;
-        ubuf += xcode;
-        total_copied += 1;
-        total_bytes_copied += xcode;
+
+        // Report why nothing was read (normally -EAGAIN for an empty queue)
+        xcode = rc;
+        break;
+    }
+
+    if (staged)
+    {
+        TRY_SET_MSG(!copy_to_user(ubuf + copied, staging, staged), -ENXIO,
+                    DL_ERROR, "%s: copy to user failed", __func__);
+        copied += staged;
+        staged  = 0;
     }
-    xcode = total_bytes_copied;
 
 CATCH_DEFAULT:
-    FINISH_MODULE_DISABLE_CHECK(&context);
+    // The staged path definitions never reached the reader, so send them all
+    //  again rather than let later events refer to ids it does not have
+    if (xcode == -ENXIO && shard->paths)
+    {
+        ec_compact_paths_clear(shard->paths, context);
+    }
 
-    return xcode;
+    // Events already handed over win over an error with a later one, the
+    //  error will come back on the next read if it persists.
+    return copied ? copied : xcode;
 }
 
-int ec_obtain_next_cbevent(struct CB_EVENT **cb_event, size_t count, ProcessContext *context)
+int ec_obtain_next_cbevent(uint32_t shard_id, struct CB_EVENT **cb_event, size_t count, ProcessContext *context)
 {
+    struct reader_shard_t *shard = &s_fops_data.shard[shard_id];
     CB_EVENT_NODE *eventNode = NULL;
     int xcode = -EFAULT;
 
-    // Handle the case we are near the end of the buffer
-    // after copying multiple events to userspace.
-    TRY_STEP(UNLOCKED, count >= sizeof(struct CB_EVENT_UM));
+    // Handle the case we are near the end of the buffer
+    // after copying multiple events to userspace.
+    TRY_STEP(UNLOCKED, count >= sizeof(struct CB_EVENT_UM));
+
+    // We need to lock here to protect access between the event reader thread and user action to clear the queue
+    //  1) Events are inserted into the a lockless list, so they are not affected by this lock.
+    //  2) If we do not lock, the two threads can race to access the same list of events
+    ec_write_lock(&shard->lock, context);
+
+    // Whatever is still on the CPU queues is newer than every event in msg_queue
+    if (list_empty(&shard->msg_queue))
+    {
+        __ec_transfer_from_input_queue(shard_id);
+    }
+
+    eventNode = list_first_entry_or_null(&shard->msg_queue, CB_EVENT_NODE, listEntry);
+
+    TRY_SET_MSG(eventNode, -EAGAIN, DL_COMMS, "%s: empty queue", __func__);
+
+    if (count >= eventNode->payload &&
+        eventNode->payload >= sizeof(struct CB_EVENT_UM))
+    {
+        // when we know for sure we can send this event
+        *cb_event = &eventNode->data;
+        xcode = eventNode->payload;
+
+        list_del_init(&eventNode->listEntry);
+        __ec_dequeue_event(eventNode);
+        __ec_record_dwell(eventNode);
+    }
+
+CATCH_DEFAULT:
+    ec_write_unlock(&shard->lock, context);
+
+CATCH_UNLOCKED:
+    return xcode;
+}
+
+void __ec_count_sent_event(CB_EVENT_TYPE eventType)
+{
+    ec_tx_stat_inc(TX_TOTAL);
+    ec_type_stat_inc(dequeued, eventType);
+
+    switch (eventType)
+    {
+    case CB_EVENT_TYPE_PROCESS_START:
+    case CB_EVENT_TYPE_DISCOVER:
+    case CB_EVENT_TYPE_DISCOVER_COMPLETE:
+    case CB_EVENT_TYPE_DISCOVER_FLUSH:
+    case CB_EVENT_TYPE_PROCESS_EXIT:
+    case CB_EVENT_TYPE_PROCESS_LAST_EXIT:
+        ec_tx_stat_inc(TX_PROCESS);
+        break;
+
+    case CB_EVENT_TYPE_MODULE_LOAD:
+        ec_tx_stat_inc(TX_MODLOAD);
+        break;
+
+    case CB_EVENT_TYPE_FILE_CREATE:
+    case CB_EVENT_TYPE_FILE_DELETE:
+    case CB_EVENT_TYPE_FILE_WRITE:
+    case CB_EVENT_TYPE_FILE_CLOSE:
+    case CB_EVENT_TYPE_FILE_OPEN:
+        ec_tx_stat_inc(TX_FILE);
+        break;
+
+    case CB_EVENT_TYPE_NET_CONNECT_PRE:
+    case CB_EVENT_TYPE_NET_CONNECT_POST:
+    case CB_EVENT_TYPE_NET_ACCEPT:
+        ec_tx_stat_inc(TX_NET);
+        break;
+
+    case CB_EVENT_TYPE_DNS_RESPONSE:
+        ec_tx_stat_inc(TX_DNS);
+        break;
+
+    case CB_EVENT_TYPE_WEB_PROXY:
+        ec_tx_stat_inc(TX_PROXY);
+        break;
+
+    case CB_EVENT_TYPE_PROCESS_BLOCKED:
+    case CB_EVENT_TYPE_PROCESS_NOT_BLOCKED:
+        ec_tx_stat_inc(TX_BLOCK);
+        break;
+
+    case CB_EVENT_TYPE_PROC_ANALYZE:
+    case CB_EVENT_TYPE_HEARTBEAT:
+    case CB_EVENT_TYPE_RATE_LIMIT:
+    case CB_EVENT_TYPE_MAX:
+    case CB_EVENT_TYPE_UNKNOWN:
+    default:
+        ec_tx_stat_inc(TX_OTHER);
+        break;
+    }
+}
+
+static int __ec_compare_enqueue_time(void *priv, struct list_head *a, struct list_head *b)
+{
+    uint64_t time_a = list_entry(a, CB_EVENT_NODE, listEntry)->enqueue_time;
+    uint64_t time_b = list_entry(b, CB_EVENT_NODE, listEntry)->enqueue_time;
+
+    return time_a > time_b ? 1 : (time_a < time_b ? -1 : 0);
+}
+
+// Moves the events of the sorted list from onto the sorted list to, keeping it sorted.
+//  Events with the same time keep the order they had, those already on to first.
+static void __ec_merge_by_enqueue_time(struct list_head *from, struct list_head *to)
+{
+    struct list_head *pos;
+    CB_EVENT_NODE    *node;
+    CB_EVENT_NODE    *next;
+
+    CANCEL_VOID(!list_empty(from));
+
+    // Find the place of the oldest new event from the end, normally it goes last
+    node = list_first_entry(from, CB_EVENT_NODE, listEntry);
+    pos  = to->prev;
+    while (pos != to && list_entry(pos, CB_EVENT_NODE, listEntry)->enqueue_time > node->enqueue_time)
+    {
+        pos = pos->prev;
+    }
+
+    list_for_each_entry_safe(node, next, from, listEntry)
+    {
+        while (pos->next != to && list_entry(pos->next, CB_EVENT_NODE, listEntry)->enqueue_time <= node->enqueue_time)
+        {
+            pos = pos->next;
+        }
+        list_move(&node->listEntry, pos);
+        pos = &node->listEntry;
+    }
+}
+
+// Another CPU may have stamped an event but not yet pushed it. Both happen with its
+//  interrupts off, so this is far longer than the gap normally lasts.
+#define TRANSFER_MARGIN_NS    (20 * NSEC_PER_USEC)
+
+// Merges the CPU queues of a shard into its msg_queue. Only events stamped at least
+//  TRANSFER_MARGIN_NS before the transfer started are moved over, newer ones wait in
+//  msg_held for a later transfer. Events stamped before then should already be on
+//  their CPU queue, but that is not guaranteed (an NMI or a preempted vCPU can stretch
+//  the gap), so the order across CPUs is best effort.
+void __ec_transfer_from_input_queue(uint32_t shard_id)
+{
+    struct reader_shard_t *shard   = &s_fops_data.shard[shard_id];
+    uint64_t               horizon = ktime_to_ns(ktime_get()) - TRANSFER_MARGIN_NS;
+    CB_EVENT_NODE         *node;
+    CB_EVENT_NODE         *next;
+    LIST_HEAD(tempList);
+    int  cpu;
+    int  nonEmpty = 0;
+
+    for_each_possible_cpu(cpu)
+    {
+        LIST_HEAD(cpuList);
+        struct llist_head *queue  = &per_cpu_ptr(s_fops_data.cpu_queues, cpu)->msg_queue_in[shard_id];
+        struct llist_node *l_node = NULL;
 
-    // We need to lock here to protect access between the event reader thread and user action to clear the queue
-    //  1) Events are inserted into the a lockless list, so they are not affected by this lock.
-    //  2) If we do not lock, the two threads can race to access the same list of events
-    ec_write_lock(&s_fops_data.lock, context);
-    __ec_transfer_from_input_queue();
+        // Skip the xchg on the queues of idle CPUs
+        if (llist_empty(queue))
+        {
+            continue;
+        }
 
-    eventNode = list_first_entry_or_null(&msg_queue, CB_EVENT_NODE, listEntry);
+        // Move the input queue into a temporary list (no lock required)
+        l_node = llist_del_all(queue);
+        if (!l_node)
+        {
+            continue;
+        }
 
-    TRY_SET_MSG(eventNode, -EAGAIN, DL_COMMS, "%s: empty queue", __func__);
+        // Move the contents of the input queue into a temporary list
+        //  This reverses the order because the input queue is implemented as a stack
+        while (l_node)
+        {
+            node   = llist_entry(l_node, CB_EVENT_NODE, llistEntry);
+            l_node = llist_next(l_node);
+            list_add(&node->listEntry, &cpuList);
+        }
 
-    if (count >= eventNode->payload &&
-        eventNode->payload >= sizeof(struct CB_EVENT_UM))
-    {
-        // when we know for sure we can send this event
-        *cb_event = &eventNode->data;
-        xcode = eventNode->payload;
+        list_splice_tail(&cpuList, &tempList);
+        ++nonEmpty;
+    }
 
-        list_del_init(&eventNode->listEntry);
-        percpu_counter_dec(&tx_ready);
+    // Each CPU list is already in order, merge them. list_sort is stable so
+    //  events with the same time keep the order they had on their CPU.
+    if (nonEmpty > 1)
+    {
+        list_sort(NULL, &tempList, __ec_compare_enqueue_time);
     }
 
-CATCH_DEFAULT:
-    ec_write_unlock(&s_fops_data.lock, context);
+    __ec_merge_by_enqueue_time(&tempList, &shard->msg_held);
 
-CATCH_UNLOCKED:
-    return xcode;
+    list_for_each_entry_safe(node, next, &shard->msg_held, listEntry)
+    {
+        if (node->enqueue_time > horizon)
+        {
+            break;
+        }
+        list_move_tail(&node->listEntry, &shard->msg_queue);
+    }
 }
 
-int __ec_copy_cbevent_to_user(char __user *ubuf, size_t count, ProcessContext *context)
+static inline void __ec_serialize_blob(char **p, const void *blob, size_t size)
 {
-    char __user *p;
-    int rc;
-    uint16_t payload;
-    int xcode = -EAGAIN;
-    struct CB_EVENT *msg = NULL;
-    struct CB_EVENT_UM __user *msg_user = (struct CB_EVENT_UM __user *)ubuf;
-
-    // You *must* ask for at least 1 packet
-
-    rc = ec_obtain_next_cbevent(&msg, count, context);
-    if (rc < 0)
+    if (blob && size)
     {
-        xcode = rc;
-        goto CATCH_DEFAULT;
+        memcpy(*p, blob, size);
+        *p += size;
     }
+}
 
-    payload = (uint16_t)rc;
-    p = ubuf + sizeof(struct CB_EVENT_UM);
-
-    // Payload hdr
-    rc = put_user(payload, &msg_user->payload);
-    TRY_STEP(COPY_FAIL, !rc);
+// Writes the event as user space sees it into buf, which must hold payload bytes.
+//  The blobs land at the offsets set by __ec_precompute_payload and the kernel
+//  pointers are zeroed.
+int __ec_serialize_event(struct CB_EVENT *msg, uint16_t payload, char *buf)
+{
+    struct CB_EVENT_UM *msg_um = (struct CB_EVENT_UM *)buf;
+    char *p = buf + sizeof(struct CB_EVENT_UM);
 
-    // Write the main event to user
-    rc = copy_to_user(&msg_user->event, msg, sizeof(*msg));
-    TRY_STEP(COPY_FAIL, !rc);
+    msg_um->payload = payload;
+    memcpy(&msg_um->event, msg, sizeof(*msg));
 
-    // Proc Path
-    if (msg->procInfo.path && msg->procInfo.path_size)
-    {
-        rc = copy_to_user(p, msg->procInfo.path, msg->procInfo.path_size);
-        TRY_STEP(COPY_FAIL, !rc);
-        p += msg->procInfo.path_size;
-    }
-    // Always zero it out kaddrs
-    rc = put_user(0, &msg_user->event.procInfo.path);
-    TRY_STEP(COPY_FAIL, !rc);
+    __ec_serialize_blob(&p, msg->procInfo.path, msg->procInfo.path_size);
+    msg_um->event.procInfo.path = NULL;
 
-    // Use switch for now to allow us to extend in the future
     switch (msg->eventType)
     {
     case CB_EVENT_TYPE_PROCESS_START:
-        if (msg->processStart.path && msg->processStart.path_size)
-        {
-            rc = copy_to_user(p, msg->processStart.path, msg->processStart.path_size);
-            TRY_STEP(COPY_FAIL, !rc);
-            p += msg->processStart.path_size;
-        }
-        rc = put_user(0, &msg_user->event.processStart.path);
-        TRY_STEP(COPY_FAIL, !rc);
+        __ec_serialize_blob(&p, msg->processStart.path, msg->processStart.path_size);
+        msg_um->event.processStart.path = NULL;
         break;
 
     case CB_EVENT_TYPE_DISCOVER:
-        if (msg->processDiscover.path && msg->processDiscover.path_size)
-        {
-            rc = copy_to_user(p, msg->processDiscover.path, msg->processDiscover.path_size);
-            TRY_STEP(COPY_FAIL, !rc);
-            p += msg->processDiscover.path_size;
-        }
-        rc = put_user(0, &msg_user->event.processDiscover.path);
-        TRY_STEP(COPY_FAIL, !rc);
+        __ec_serialize_blob(&p, msg->processDiscover.path, msg->processDiscover.path_size);
+        msg_um->event.processDiscover.path = NULL;
         break;
 
     case CB_EVENT_TYPE_MODULE_LOAD:
-        if (msg->moduleLoad.path && msg->moduleLoad.path_size)
-        {
-            rc = copy_to_user(p, msg->moduleLoad.path, msg->moduleLoad.path_size);
-            TRY_STEP(COPY_FAIL, !rc);
-
-            p += msg->moduleLoad.path_size;
-        }
-        rc = put_user(0, &msg_user->event.moduleLoad.path);
-        TRY_STEP(COPY_FAIL, !rc);
+        __ec_serialize_blob(&p, msg->moduleLoad.path, msg->moduleLoad.path_size);
+        msg_um->event.moduleLoad.path = NULL;
         break;
 
     case CB_EVENT_TYPE_FILE_CREATE:
@@ -636,171 +1429,258 @@ int __ec_copy_cbevent_to_user(char __user *ubuf, size_t count, ProcessContext *c
     case CB_EVENT_TYPE_FILE_OPEN:
     case CB_EVENT_TYPE_FILE_WRITE:
     case CB_EVENT_TYPE_FILE_CLOSE:
-        if (msg->fileGeneric.path && msg->fileGeneric.path_size)
-        {
-            rc = copy_to_user(p, msg->fileGeneric.path, msg->fileGeneric.path_size);
-            TRY_STEP(COPY_FAIL, !rc);
-            p += msg->fileGeneric.path_size;
-        }
-        rc = put_user(0, &msg_user->event.fileGeneric.path);
-        TRY_STEP(COPY_FAIL, !rc);
+        __ec_serialize_blob(&p, msg->fileGeneric.path, msg->fileGeneric.path_size);
+        msg_um->event.fileGeneric.path = NULL;
         break;
 
     case CB_EVENT_TYPE_DNS_RESPONSE:
-        if (msg->dnsResponse.records && msg->dnsResponse.record_count)
-        {
-            rc = copy_to_user(p, msg->dnsResponse.records,
-                              msg->dnsResponse.record_count * sizeof(CB_DNS_RECORD));
-            TRY_STEP(COPY_FAIL, !rc);
-            p += msg->dnsResponse.record_count * sizeof(CB_DNS_RECORD);
-        }
-        rc = put_user(0, &msg_user->event.dnsResponse.records);
-        TRY_STEP(COPY_FAIL, !rc);
+        __ec_serialize_blob(&p, msg->dnsResponse.records,
+                            msg->dnsResponse.record_count * sizeof(CB_DNS_RECORD));
+        msg_um->event.dnsResponse.records = NULL;
         break;
 
     case CB_EVENT_TYPE_NET_CONNECT_PRE:
     case CB_EVENT_TYPE_NET_CONNECT_POST:
     case CB_EVENT_TYPE_NET_ACCEPT:
     case CB_EVENT_TYPE_WEB_PROXY:
-        if (msg->netConnect.actual_server && msg->netConnect.server_size)
-        {
-            rc = copy_to_user(p, msg->netConnect.actual_server,
-                              msg->netConnect.server_size);
-            TRY_STEP(COPY_FAIL, !rc);
-
-            p += msg->netConnect.server_size;
-        }
-        rc = put_user(0, &msg_user->event.netConnect.actual_server);
-        TRY_STEP(COPY_FAIL, !rc);
+        __ec_serialize_blob(&p, msg->netConnect.actual_server, msg->netConnect.server_size);
+        msg_um->event.netConnect.actual_server = NULL;
         break;
 
     case CB_EVENT_TYPE_PROCESS_BLOCKED:
-        if (msg->blockResponse.path && msg->blockResponse.path_size)
-        {
-            rc = copy_to_user(p, msg->blockResponse.path, msg->blockResponse.path_size);
-            TRY_STEP(COPY_FAIL, !rc);
-
-            p += msg->blockResponse.path_size;
-        }
-        rc = put_user(0, &msg_user->event.blockResponse.path);
-        TRY_STEP(COPY_FAIL, !rc);
+        __ec_serialize_blob(&p, msg->blockResponse.path, msg->blockResponse.path_size);
+        msg_um->event.blockResponse.path = NULL;
         break;
 
     default:
         break;
     }
 
-    if (p - ubuf != payload)
+    if (p - buf != payload)
     {
         TRACE(DL_ERROR, "%s: Offset:%u Payload:%u", __func__,
-              (unsigned int)(p - ubuf), payload);
-        xcode = -ENXIO;
-        goto CATCH_DEFAULT;
+              (unsigned int)(p - buf), payload);
+        return -ENXIO;
     }
 
-    xcode = payload;
-
-    ++tx_total;
+    return payload;
+}
 
-    switch (msg->eventType)
+// Appends the event to the mapped ring. Returns false if there is no ring or it
+//  has no room, the caller counts that as a drop.
+bool __ec_ring_write_event(struct CB_EVENT *msg, uint16_t payload, ProcessContext *context)
+{
+    struct event_ring_t         *ring = &s_fops_data.ring;
+    struct CB_EVENT_RING_RECORD *record;
+    uint64_t                     head;
+    uint64_t                     tail;
+    uint64_t                     pos;
+    uint64_t                     pad;
+    uint64_t                     reserved;
+    uint64_t                     shared;
+    uint32_t                     size = sizeof(struct CB_EVENT_RING_RECORD) + payload;
+    uint32_t                     aligned_size = ALIGN(size, CB_EVENT_RING_ALIGN);
+    bool                         written = false;
+
+    ec_write_lock(&ring->ring_lock, context);
+    TRY(ring->header);
+
+    head  = ring->header->head;
+    tail  = smp_load_acquire(&ring->header->tail);
+    pos   = head & (ring->data_size - 1);
+    pad   = (pos + aligned_size > ring->data_size) ? ring->data_size - pos : 0;
+
+    // The ring does not track usage per class, so a class may fill the shared
+    //  part plus its own quota
+    __ec_class_limits(ec_event_class(msg->eventType), ring->data_size, &reserved, &shared);
+
+    // The tail comes from user space, do not trust it to be sane
+    TRY_DO(head - tail <= ring->data_size && head - tail + pad + aligned_size <= reserved + shared,
+           {
+               ++ring->header->dropped;
+           });
+
+    if (pad)
     {
-    case CB_EVENT_TYPE_PROCESS_START:
-    case CB_EVENT_TYPE_DISCOVER:
-    case CB_EVENT_TYPE_DISCOVER_COMPLETE:
-    case CB_EVENT_TYPE_DISCOVER_FLUSH:
-    case CB_EVENT_TYPE_PROCESS_EXIT:
-    case CB_EVENT_TYPE_PROCESS_LAST_EXIT:
-        ++tx_process;
-        break;
+        record = (struct CB_EVENT_RING_RECORD *)(ring->data + pos);
+        record->size  = (uint32_t)pad;
+        record->flags = CB_EVENT_RING_PAD;
+        head += pad;
+        pos   = 0;
+    }
 
-    case CB_EVENT_TYPE_MODULE_LOAD:
-        ++tx_modload;
-        break;
+    record = (struct CB_EVENT_RING_RECORD *)(ring->data + pos);
+    record->size  = size;
+    record->flags = 0;
+    TRY(__ec_serialize_event(msg, payload, (char *)(record + 1)) == payload);
 
-    case CB_EVENT_TYPE_FILE_CREATE:
-    case CB_EVENT_TYPE_FILE_DELETE:
-    case CB_EVENT_TYPE_FILE_WRITE:
-    case CB_EVENT_TYPE_FILE_CLOSE:
-    case CB_EVENT_TYPE_FILE_OPEN:
-        ++tx_file;
-        break;
+    // Publish the record only once it is complete
+    smp_store_release(&ring->header->head, head + aligned_size);
+    ec_type_stat_inc(enqueued, msg->eventType);
+    __ec_count_sent_event(msg->eventType);
+    written = true;
 
-    case CB_EVENT_TYPE_NET_CONNECT_PRE:
-    case CB_EVENT_TYPE_NET_CONNECT_POST:
-    case CB_EVENT_TYPE_NET_ACCEPT:
-        ++tx_net;
-        break;
+CATCH_DEFAULT:
+    ec_write_unlock(&ring->ring_lock, context);
+    return written;
+}
 
-    case CB_EVENT_TYPE_DNS_RESPONSE:
-        ++tx_dns;
-        break;
+bool __ec_ring_has_events(void)
+{
+    struct CB_EVENT_RING_HEADER *header = s_fops_data.ring.header;
 
-    case CB_EVENT_TYPE_WEB_PROXY:
-        ++tx_proxy;
-        break;
+    // Unlocked, poll only needs a hint and the reader will look again
+    return header && smp_load_acquire(&header->head) != READ_ONCE(header->tail);
+}
 
-    case CB_EVENT_TYPE_PROCESS_BLOCKED:
-    case CB_EVENT_TYPE_PROCESS_NOT_BLOCKED:
-        ++tx_block;
-        break;
+static void __ec_ring_vm_open(struct vm_area_struct *vma)
+{
+    atomic_inc(&s_fops_data.ring.map_count);
+}
 
-    case CB_EVENT_TYPE_PROC_ANALYZE:
-    case CB_EVENT_TYPE_HEARTBEAT:
-    case CB_EVENT_TYPE_MAX:
-    case CB_EVENT_TYPE_UNKNOWN:
-    default:
-        ++tx_other;
-        break;
+static void __ec_ring_vm_close(struct vm_area_struct *vma)
+{
+    void *ring_mem = vma->vm_private_data;
+
+    DECLARE_NON_ATOMIC_CONTEXT(context, ec_getpid(current));
+
+    if (!atomic_dec_and_test(&s_fops_data.ring.map_count))
+    {
+        return;
     }
 
-CATCH_COPY_FAIL:
-    // Check the result
-    if (rc)
+    // Producers check the header under the lock, so once it is cleared nobody
+    //  touches the memory again.
+    ec_write_lock(&s_fops_data.ring.ring_lock, &context);
+    s_fops_data.ring.header = NULL;
+    s_fops_data.ring.data   = NULL;
+    ec_write_unlock(&s_fops_data.ring.ring_lock, &context);
+
+    TRACE(DL_INFO, "%s: event ring unmapped", __func__);
+    vfree(ring_mem);
+}
+
+static const struct vm_operations_struct s_ring_vm_ops = {
+    .open  = __ec_ring_vm_open,
+    .close = __ec_ring_vm_close,
+};
+
+int ec_device_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    unsigned long                size      = vma->vm_end - vma->vm_start;
+    unsigned long                data_size = size - PAGE_SIZE;
+    struct CB_EVENT_RING_HEADER *header    = NULL;
+    int                          xcode     = -EINVAL;
+
+    DECLARE_NON_ATOMIC_CONTEXT(context, ec_getpid(current));
+
+    TRY_SET_MSG(__ec_is_process_connected_reader(context.pid), -EPERM,
+                DL_ERROR, "%s: mmap refused for pid[%d]; reader_pid[%d]", __func__, context.pid, s_fops_config.reader_pid);
+
+    TRY_MSG(vma->vm_pgoff == 0 && size > PAGE_SIZE && is_power_of_2(data_size) && data_size >= CB_EVENT_RING_MIN_DATA_SIZE,
+            DL_ERROR, "%s: bad ring size %lu", __func__, size);
+
+    // Checked again when the ring is installed
+    TRY_SET(!s_fops_data.ring.header, -EBUSY);
+
+    header = vmalloc_user(size);
+    TRY_SET_MSG(header, -ENOMEM, DL_ERROR, "%s: failed to allocate %lu bytes", __func__, size);
+
+    header->version     = CB_EVENT_RING_VERSION;
+    header->data_offset = PAGE_SIZE;
+    header->data_size   = data_size;
+
+    TRY_STEP_SET(FREE, !remap_vmalloc_range(vma, header, 0), -EAGAIN);
+
+    vma->vm_ops          = &s_ring_vm_ops;
+    vma->vm_private_data = header;
+
+    ec_write_lock(&s_fops_data.ring.ring_lock, &context);
+    if (s_fops_data.ring.header)
     {
-        TRACE(DL_ERROR, "%s: copy to user failed rc=%d", __func__, rc);
-        xcode = -ENXIO;
+        ec_write_unlock(&s_fops_data.ring.ring_lock, &context);
+        xcode = -EBUSY;
+
+        // The failed mmap unmaps the pages, they hold their own references
+        vma->vm_ops = NULL;
+        goto CATCH_FREE;
     }
 
-    // When we start pausing tasks we will want to handle waking
-    // them when we have an issue with userspace.
+    s_fops_data.ring.data       = (char *)header + PAGE_SIZE;
+    s_fops_data.ring.data_size  = data_size;
+    s_fops_data.ring.shard      = &s_fops_data.shard[__ec_file_shard(filp)];
+    atomic_set(&s_fops_data.ring.map_count, 1);
+    s_fops_data.ring.header     = header;
+    ec_write_unlock(&s_fops_data.ring.ring_lock, &context);
 
-CATCH_DEFAULT:
-    ec_free_event(msg, context);
+    TRACE(DL_INFO, "%s: mapped %lu byte event ring for pid[%d]", __func__, data_size, context.pid);
+    return 0;
 
+CATCH_FREE:
+    vfree(header);
+
+CATCH_DEFAULT:
     return xcode;
 }
 
-void __ec_transfer_from_input_queue(void)
+// Binds a new file of the reader to the shard with the fewest files
+static struct reader_shard_t *__ec_bind_shard(bool *first_file)
 {
-    LIST_HEAD(tempList);
-    struct llist_node *l_node = NULL;
+    struct reader_shard_t *shard = &s_fops_data.shard[0];
+    uint32_t               i;
+
+    for (i = 1; i < s_fops_data.nr_shards; ++i)
+    {
+        if (atomic_read(&s_fops_data.shard[i].files) < atomic_read(&shard->files))
+        {
+            shard = &s_fops_data.shard[i];
+        }
+    }
 
-    // Move the input queue into a temporary list (no lock required)
-    l_node = llist_del_all(&msg_queue_in);
+    *first_file = atomic_inc_return(&shard->files) == 1;
+    return shard;
+}
 
-    CANCEL_VOID(l_node);
+// Hands the events left on a shard whose last file closed to shard 0, where new
+//  events of its processes go from now on. They are merged by time so each process
+//  still sees its events in order.
+static void __ec_unbind_shard(struct reader_shard_t *shard, ProcessContext *context)
+{
+    struct reader_shard_t *target = &s_fops_data.shard[0];
+    LIST_HEAD(moved);
 
-    // Move the contents of the input queue into a temporary list
-    //  This reverses the order because the input queue is implemented as a stack
-    while (l_node)
-    {
-        CB_EVENT_NODE *node = llist_entry(l_node, CB_EVENT_NODE, llistEntry);
+    CANCEL_VOID(shard != target);
 
-        l_node = llist_next(l_node);
-        list_add(&node->listEntry, &tempList);
-    }
+    ec_write_lock(&shard->lock, context);
+    __ec_transfer_from_input_queue(shard - s_fops_data.shard);
+    list_splice_tail_init(&shard->msg_queue, &moved);
+    list_splice_tail_init(&shard->msg_held, &moved);
+    ec_write_unlock(&shard->lock, context);
 
-    // Splice the list onto the end of the real tx_queue
-    list_splice_tail(&tempList, &msg_queue);
+    CANCEL_VOID(!list_empty(&moved));
+
+    // Held events are handed out on the next transfer once they are old enough
+    ec_write_lock(&target->lock, context);
+    __ec_merge_by_enqueue_time(&moved, &target->msg_held);
+    ec_write_unlock(&target->lock, context);
+
+    if (waitqueue_active(&target->wq))
+    {
+        wake_up(&target->wq);
+    }
 }
 
 int ec_device_open(struct inode *inode, struct file *filp)
 {
+    struct reader_shard_t *shard;
+    bool                   first_reader_file = false;
+    bool                   first_shard_file;
+
     DECLARE_NON_ATOMIC_CONTEXT(context, ec_getpid(current));
 
     TRACE(DL_INFO, "%s: attempting to connect to device from pid[%d]", __func__, context.pid);
 
-    if (!__ec_connect_reader(&context))
+    if (!__ec_connect_reader_file(&first_reader_file, &context))
     {
         // The ec_device_release call is called asynchronously from the reader closing
         //  the device.  The test-app rapidly closes and reopens the device.
@@ -808,17 +1688,28 @@ int ec_device_open(struct inode *inode, struct file *filp)
         // This brief sleep allows us to recheck in this case, and possibly still
         //  connect.
         usleep_range(10000, 11000);
-        if (!__ec_connect_reader(&context))
+        if (!__ec_connect_reader_file(&first_reader_file, &context))
         {
             TRACE(DL_WARNING, "%s: refusing connection to device from pid[%d]; already connected to pid[%d]", __func__, context.pid, s_fops_config.reader_pid);
             return -ECONNREFUSED;
         }
     }
 
-    TRACE(DL_INFO, "%s: connected to device from pid[%d]", __func__, context.pid);
+    shard = __ec_bind_shard(&first_shard_file);
+    filp->private_data = shard;
+
+    TRACE(DL_INFO, "%s: connected to device from pid[%d] on shard %ld", __func__, context.pid, (long)(shard - s_fops_data.shard));
+
+    // The first file of a shard starts with the legacy format and no interned paths.
+    //  Other files of the shard may be reading it, so theirs is left alone.
+    if (first_shard_file)
+    {
+        ec_set_wire_format(shard - s_fops_data.shard, CB_WIRE_FORMAT_LEGACY, &context);
+    }
 
-    // When a new reader connects, send discovery events
-    if (g_module_state_info.module_enabled)
+    // When a new reader connects, send discovery events. The other files of the
+    //  reader share them through the shards.
+    if (first_reader_file && g_module_state_info.module_enabled)
     {
         ec_event_send_discover_flush(&context);
         ec_process_tracking_send_process_discovery(&context);
@@ -829,13 +1720,26 @@ int ec_device_open(struct inode *inode, struct file *filp)
 
 int ec_device_release(struct inode *inode, struct file *filp)
 {
-    pid_t pid = ec_getpid(current);
+    pid_t                  pid   = ec_getpid(current);
+    struct reader_shard_t *shard = filp->private_data;
 
     DECLARE_NON_ATOMIC_CONTEXT(context, pid);
 
     TRACE(DL_INFO, "%s: releasing device from pid[%d]; reader_pid[%d]", __func__, ec_getpid(current), s_fops_config.reader_pid);
 
-    if (!ec_disconnect_reader(pid, &context))
+    // The shard counts follow the open files, not the reader. The file goes away
+    //  even when the release is refused below, for example after ec_disconnect_reader
+    //  already let go of a reader that exited.
+    if (shard)
+    {
+        filp->private_data = NULL;
+        if (atomic_dec_and_test(&shard->files))
+        {
+            __ec_unbind_shard(shard, &context);
+        }
+    }
+
+    if (!__ec_release_reader(pid, &context))
     {
         TRACE(DL_INFO, "%s: refusing to disconnect from pid[%d]; reader_pid[%d]", __func__, ec_getpid(current), s_fops_config.reader_pid);
         return -ECONNREFUSED;
@@ -846,8 +1750,9 @@ int ec_device_release(struct inode *inode, struct file *filp)
 
 unsigned int ec_device_poll(struct file *filp, struct poll_table_struct *pts)
 {
-    int  xcode      = 0;
-    bool msg_queued = false;
+    int      xcode      = 0;
+    bool     msg_queued = false;
+    uint32_t shard_id   = __ec_file_shard(filp);
 
     DECLARE_NON_ATOMIC_CONTEXT(context, ec_getpid(current));
 
@@ -855,14 +1760,15 @@ unsigned int ec_device_poll(struct file *filp, struct poll_table_struct *pts)
 
     // Check if messages are available. llist_empty is not guaranteed to be correct but that's ok,
     // the reader will try again.
-    msg_queued = !llist_empty(&msg_queue_in) || !list_empty(&msg_queue);
+    msg_queued = !__ec_input_queues_empty(shard_id) || !__ec_output_queues_empty(shard_id) ||
+                 (s_fops_data.ring.shard == &s_fops_data.shard[shard_id] && __ec_ring_has_events());
 
     TRY_MSG(!msg_queued, DL_COMMS, "%s: msg queued so not waiting", __func__);
 
     // We should call poll_wait here if we want the kernel to actually
     // sleep when waiting for us. This adds us to the list of devices being waited on.
     TRACE(DL_COMMS, "%s: waiting for data", __func__);
-    poll_wait(filp, &s_fops_config.wq, pts);
+    poll_wait(filp, &s_fops_data.shard[shard_id].wq, pts);
 
 CATCH_DEFAULT:
     // If comms have been disabled while we were waiting send POLLHUP
@@ -1119,6 +2025,12 @@ long ec_device_unlocked_ioctl(struct file *filep, unsigned int cmd_in, unsigned
         }
         break;
 
+    case CB_DRIVER_REQUEST_SET_WIRE_FORMAT:
+        {
+            return ec_set_wire_format(__ec_file_shard(filep), data.value, &context);
+        }
+        break;
+
     case CB_DRIVER_REQUEST_SET_LOG_LEVEL:
         {
             g_traceLevel = data.value;
@@ -1251,6 +2163,55 @@ void __ec_print_driver_config(char *msg, CB_DRIVER_CONFIG *config)
     }
 }
 
+static void __ec_sum_cpu_stats(uint64_t *tx)
+{
+    int cpu;
+    int i;
+
+    memset(tx, 0, sizeof(uint64_t) * TX_STATS);
+    for_each_possible_cpu(cpu)
+    {
+        struct event_cpu_stats_t *cpu_stats = per_cpu_ptr(s_fops_data.cpu_stats, cpu);
+
+        for (i = 0; i < TX_STATS; ++i)
+        {
+            tx[i] += cpu_stats->tx[i];
+        }
+    }
+}
+
+// Stores the per CPU event counters in the given interval
+void __ec_fold_cpu_stats(uint32_t interval)
+{
+    uint64_t tx[TX_STATS];
+    uint64_t max_dwell  = 0;
+    uint64_t high_water = percpu_counter_read_positive(&tx_ready);
+    int      cpu;
+    int      i;
+
+    __ec_sum_cpu_stats(tx);
+
+    // Index 0 is tx_queued_t, which comes from tx_ready
+    for (i = 1; i < TX_STATS; ++i)
+    {
+        s_fops_data.event_stats.stats[interval][i] = tx[i] - s_fops_data.tx_base[i];
+    }
+
+    // Clearing these can race with an update on another CPU, which loses at most
+    //  one sample.
+    for_each_possible_cpu(cpu)
+    {
+        struct event_cpu_stats_t *cpu_stats = per_cpu_ptr(s_fops_data.cpu_stats, cpu);
+
+        max_dwell             = max(max_dwell, cpu_stats->max_dwell);
+        high_water            = max(high_water, cpu_stats->high_water);
+        cpu_stats->max_dwell  = 0;
+        cpu_stats->high_water = 0;
+    }
+    s_fops_data.event_stats.max_dwell[interval]  = max_dwell;
+    s_fops_data.event_stats.high_water[interval] = high_water;
+}
+
 void __ec_stats_work_task(struct work_struct *work)
 {
     uint32_t         curr   = s_fops_data.event_stats.curr;
@@ -1270,6 +2231,7 @@ void __ec_stats_work_task(struct work_struct *work)
     //  is new in this variable to the current stat.
 
     tx_queued_t += ready0;
+    __ec_fold_cpu_stats(curr);
 
     // Copy over the current total to the next interval
     for (i = 0; i < NUM_STATS; ++i)
@@ -1284,6 +2246,9 @@ void __ec_stats_work_task(struct work_struct *work)
     mem_kernel      = kernel_mem;
     mem_kernel_peak = (kernel_mem > kernel_mem_peak ? kernel_mem : kernel_mem_peak);
 
+    // Processes that went quiet after being rate limited get their report from here
+    ec_process_tracking_flush_rate_reports(&context);
+
     schedule_delayed_work(&s_fops_config.stats_work, s_fops_config.stats_work_delay);
 }
 
@@ -1384,6 +2349,7 @@ ssize_t ec_proc_show_events_rst(struct file *file, const char *buf, size_t size,
     // I do not need to zero out everything, just the new active interval
     current_stat = 0;
     valid_stats  = 0;
+    __ec_sum_cpu_stats(s_fops_data.tx_base);
     for (i = 0; i < NUM_STATS; ++i)
     {
         // We make sure the first and last interval are 0 for the average calculations
@@ -1397,6 +2363,199 @@ ssize_t ec_proc_show_events_rst(struct file *file, const char *buf, size_t size,
     return size;
 }
 
+static const char *const EVENT_TYPE_NAMES[CB_EVENT_TYPE_MAX] = {
+    [CB_EVENT_TYPE_UNKNOWN]             = "Unknown",
+    [CB_EVENT_TYPE_PROCESS_START]       = "ProcessStart",
+    [CB_EVENT_TYPE_PROCESS_EXIT]        = "ProcessExit",
+    [CB_EVENT_TYPE_MODULE_LOAD]         = "ModuleLoad",
+    [CB_EVENT_TYPE_DISCOVER]            = "Discover",
+    [CB_EVENT_TYPE_DISCOVER_COMPLETE]   = "DiscoverComplete",
+    [CB_EVENT_TYPE_DISCOVER_FLUSH]      = "DiscoverFlush",
+    [CB_EVENT_TYPE_FILE_CREATE]         = "FileCreate",
+    [CB_EVENT_TYPE_FILE_DELETE]         = "FileDelete",
+    [CB_EVENT_TYPE_FILE_WRITE]          = "FileWrite",
+    [CB_EVENT_TYPE_FILE_CLOSE]          = "FileClose",
+    [CB_EVENT_TYPE_FILE_OPEN]           = "FileOpen",
+    [CB_EVENT_TYPE_NET_CONNECT_PRE]     = "NetConnectPre",
+    [CB_EVENT_TYPE_NET_CONNECT_POST]    = "NetConnectPost",
+    [CB_EVENT_TYPE_NET_ACCEPT]          = "NetAccept",
+    [CB_EVENT_TYPE_DNS_RESPONSE]        = "DnsResponse",
+    [CB_EVENT_TYPE_PROC_ANALYZE]        = "ProcAnalyze",
+    [CB_EVENT_TYPE_PROCESS_BLOCKED]     = "ProcessBlocked",
+    [CB_EVENT_TYPE_PROCESS_NOT_BLOCKED] = "ProcessNotBlocked",
+    [CB_EVENT_TYPE_WEB_PROXY]           = "WebProxy",
+    [CB_EVENT_TYPE_HEARTBEAT]           = "Heartbeat",
+    [CB_EVENT_TYPE_PROCESS_LAST_EXIT]   = "ProcessLastExit",
+    [CB_EVENT_TYPE_RATE_LIMIT]          = "RateLimit",
+};
+
+// Print lifetime per event type counters, these are not cleared by events-reset
+int ec_proc_show_events_types(struct seq_file *m, void *v)
+{
+    int type;
+    int cpu;
+
+    seq_printf(m, " %17s | %10s | %10s | %10s |\n", "Type", "Enqueued", "Dequeued", "Dropped");
+
+    for (type = 0; type < CB_EVENT_TYPE_MAX; ++type)
+    {
+        uint64_t enqueued = 0;
+        uint64_t dequeued = 0;
+        uint64_t dropped  = 0;
+
+        if (!EVENT_TYPE_NAMES[type])
+        {
+            continue;
+        }
+
+        for_each_possible_cpu(cpu)
+        {
+            struct event_cpu_stats_t *cpu_stats = per_cpu_ptr(s_fops_data.cpu_stats, cpu);
+
+            enqueued += cpu_stats->enqueued[type];
+            dequeued += cpu_stats->dequeued[type];
+            dropped  += cpu_stats->dropped[type];
+        }
+
+        seq_printf(m, " %17s | %10llu | %10llu | %10llu |\n", EVENT_TYPE_NAMES[type], enqueued, dequeued, dropped);
+    }
+
+    return 0;
+}
+
+static const char *const EVENT_CLASS_NAMES[EC_EVENT_CLASS_MAX] = {
+    [EC_EVENT_CLASS_PROCESS] = "Process",
+    [EC_EVENT_CLASS_NETWORK] = "Network",
+    [EC_EVENT_CLASS_DNS]     = "DNS",
+    [EC_EVENT_CLASS_FILE]    = "File",
+    [EC_EVENT_CLASS_OTHER]   = "Other",
+};
+
+// Print the queue capacity held back for each class and what was dropped
+int ec_proc_show_events_classes(struct seq_file *m, void *v)
+{
+    uint64_t reserved;
+    uint64_t shared = 0;
+    int      event_class;
+    int      cpu;
+
+    seq_printf(m, " %8s | %6s | %10s | %10s | %10s |\n", "Class", "Quota%", "Reserved", "Queued", "Dropped");
+
+    for (event_class = 0; event_class < EC_EVENT_CLASS_MAX; ++event_class)
+    {
+        uint64_t dropped = 0;
+
+        __ec_class_limits(event_class, g_max_queue_size, &reserved, &shared);
+
+        for_each_possible_cpu(cpu)
+        {
+            dropped += per_cpu_ptr(s_fops_data.cpu_stats, cpu)->class_dropped[event_class];
+        }
+
+        seq_printf(m, " %8s | %6u | %10llu | %10lld | %10llu |\n",
+                   EVENT_CLASS_NAMES[event_class],
+                   g_event_class_quota[event_class],
+                   reserved,
+                   percpu_counter_sum_positive(&s_fops_data.class_queued[event_class]),
+                   dropped);
+    }
+
+    seq_printf(m, " %8s | %6s | %10llu | %10lld | %10s |\n",
+               "Shared", "", shared, percpu_counter_sum_positive(&s_fops_data.shared_queued), "");
+
+    return 0;
+}
+
+// Print how long events waited in the queue before the reader took them. The
+//  histograms are lifetime totals, the extremes are per stats interval.
+int ec_proc_show_events_latency(struct seq_file *m, void *v)
+{
+    uint32_t    curr    = s_fops_data.event_stats.curr;
+    uint32_t    valid   = min(s_fops_data.event_stats.validStats, MAX_VALID_INTERVALS);
+    uint32_t    start   = (MAX_INTERVALS + curr - valid) % MAX_INTERVALS;
+    int         bucket;
+    int         event_class;
+    int         cpu;
+    int         i;
+
+    seq_printf(m, " %12s |", "Latency us");
+    for (event_class = 0; event_class < EC_EVENT_CLASS_MAX; ++event_class)
+    {
+        seq_printf(m, " %10s |", EVENT_CLASS_NAMES[event_class]);
+    }
+    seq_puts(m, "\n");
+
+    for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+    {
+        if (bucket < LATENCY_BUCKETS - 1)
+        {
+            seq_printf(m, " < %10llu |", 1ULL << bucket);
+        } else
+        {
+            seq_printf(m, " %12s |", "slower");
+        }
+
+        for (event_class = 0; event_class < EC_EVENT_CLASS_MAX; ++event_class)
+        {
+            uint64_t count = 0;
+
+            for_each_possible_cpu(cpu)
+            {
+                count += per_cpu_ptr(s_fops_data.cpu_stats, cpu)->latency[event_class][bucket];
+            }
+            seq_printf(m, " %10llu |", count);
+        }
+        seq_puts(m, "\n");
+    }
+
+    seq_printf(m, "\n %19s | %12s | %10s |\n", "Timestamp", "Max Dwell us", "High Water");
+    for (i = 0; i < valid; ++i)
+    {
+        uint32_t interval = (start + i) % MAX_INTERVALS;
+
+        seq_printf(m, " %19lld | %12llu | %10llu |\n",
+                   ec_to_windows_timestamp(&s_fops_data.event_stats.time[interval]),
+                   div_u64(s_fops_data.event_stats.max_dwell[interval], NSEC_PER_USEC),
+                   s_fops_data.event_stats.high_water[interval]);
+    }
+
+    return 0;
+}
+
+int ec_proc_show_events_shards(struct seq_file *m, void *v)
+{
+    uint32_t i;
+    int      cpu;
+
+    seq_printf(m, " %5s | %5s | %10s | %12s | %12s | %10s | %5s |\n",
+               "Shard", "Files", "Queued", "Enqueued", "Sent", "Wakeups", "Batch");
+
+    for (i = 0; i < s_fops_data.nr_shards; ++i)
+    {
+        struct reader_shard_t *shard    = &s_fops_data.shard[i];
+        uint64_t               enqueued = 0;
+        uint64_t               dequeued = 0;
+        uint64_t               sent     = 0;
+        uint64_t               wakeups  = 0;
+
+        for_each_possible_cpu(cpu)
+        {
+            struct event_cpu_stats_t *stats = per_cpu_ptr(s_fops_data.cpu_stats, cpu);
+
+            enqueued += stats->shard_enqueued[i];
+            dequeued += stats->shard_dequeued[i];
+            sent     += stats->shard_sent[i];
+            wakeups  += stats->shard_wakeups[i];
+        }
+
+        seq_printf(m, " %5u | %5d | %10llu | %12llu | %12llu | %10llu | %5u |\n",
+                   i, atomic_read(&shard->files), enqueued > dequeued ? enqueued - dequeued : 0,
+                   enqueued, sent, wakeups, READ_ONCE(shard->wakeup.target));
+    }
+
+    return 0;
+}
+
 int ec_proc_current_memory_avg(struct seq_file *m, void *v)
 {
     // I add MAX_INTERVALS to some of the items below so that when I subtract 1 it will
@@ -1603,6 +2762,7 @@ int __ec_precompute_payload(struct CB_EVENT *cb_event)
         break;
 
     case CB_EVENT_TYPE_HEARTBEAT:
+    case CB_EVENT_TYPE_RATE_LIMIT:
         break;
 
     // Internal To The Kernel
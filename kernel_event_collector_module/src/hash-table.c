@@ -3,12 +3,13 @@
 // Copyright (c) 2016-2019 Carbon Black, Inc. All rights reserved.
 
 #include "priv.h"
+#include <linux/rculist_nulls.h>
 #include "hash-table.h"
 #include "cb-spinlock.h"
 #include "mem-alloc.h"
 
 typedef struct hash_table_node {
-    struct list_head link;
+    struct hlist_nulls_node link;
     u32 hash;
     u32 activity;
     HashTbl *hashTblp;
@@ -16,10 +17,30 @@ typedef struct hash_table_node {
 
 static const size_t HASH_NODE_SZ = sizeof(HashTableNode);
 
+// A resizable table grows once there are more than HASHTBL_GROW_LOAD entries per
+//  bucket and shrinks once there are fewer than one per HASHTBL_SHRINK_LOAD buckets
+#define HASHTBL_GROW_LOAD      2
+#define HASHTBL_SHRINK_LOAD    4
+#define HASHTBL_RESIZE_RANGE   16
+
+// Buckets moved between reschedule points while resizing
+#define HASHTBL_REHASH_BATCH   64
+
+// One lookup in this many per cpu samples the chain length
+#define HASHTBL_CHAIN_SAMPLE   64
+
+#define HASHTBL_STAT(t, field) this_cpu_inc((t)->stats->field)
+
+// Most buckets one add looks at and most entries it evicts when over the budget
+#define HASHTBL_CLOCK_SCAN     64
+#define HASHTBL_CLOCK_EVICT    8
+
 bool __ec_hashtbl_proc_initialize(HashTbl *hashTblp, ProcessContext *context);
 void __ec_hashtbl_proc_shutdown(HashTbl *hashTblp, ProcessContext *context);
 void __ec_hashtbl_cache_delete_cb(void *value, ProcessContext *context);
 void __ec_hashtbl_print_callback(void *data, ProcessContext *context);
+static void __ec_hashtbl_resize_work(struct work_struct *work);
+static void __ec_hashtbl_shrinker_register(HashTbl *hashTblp);
 
 static inline void *__ec_get_datap(const HashTbl *hashTblp, HashTableNode *nodep)
 {
@@ -30,6 +51,24 @@ inline HashTableNode *__ec_get_nodep(const HashTbl *hashTblp, void *datap)
     return (HashTableNode *)((char *)datap - HASH_NODE_SZ);
 }
 
+// Lookups walk the buckets under rcu_read_lock, so a node leaves its bucket with
+//  hlist_nulls_del_rcu. That keeps next for readers still on the node and poisons
+//  pprev, which is how a node that is not in a bucket is recognized.
+static inline bool __ec_hashtbl_node_linked(HashTableNode *nodep)
+{
+    return READ_ONCE(nodep->link.pprev) != LIST_POISON2;
+}
+
+static void __ec_hashtbl_unlink(HashTbl *hashTblp, HashTableList *list, HashTableNode *nodep, ProcessContext *context)
+{
+    hlist_nulls_del_rcu(&nodep->link);
+    --list->itemCount;
+    percpu_counter_dec(&hashTblp->tableInstance);
+
+    // The memory is freed after a grace period, see free_rcu
+    ec_mem_cache_disown(nodep, context);
+}
+
 static __read_mostly struct {
     uint64_t         lock;
     struct list_head list;
@@ -68,32 +107,190 @@ void ec_hashtbl_shutdown(ProcessContext *context)
     ec_spinlock_destroy(&s_hashtbl.lock, context);
 }
 
+// Keys are struct fields compared as words, padding included like memcmp would
 static inline u32 ec_hashtbl_hash_key(HashTbl *hashTblp,
-                   unsigned char *key)
+                   const void *key)
 {
+    if (unlikely(hashTblp->hash_callback))
+    {
+        return hashTblp->hash_callback(key, hashTblp->key_len, hashTblp->secret);
+    }
+
+    if (likely(hashTblp->word_keys))
+    {
+        switch (hashTblp->key_len)
+        {
+        case sizeof(u32):
+            return jhash_1word(*(const u32 *)key, hashTblp->secret);
+        case sizeof(u64):
+            return (u32)hash_64(*(const u64 *)key ^ hashTblp->secret, 32);
+        case 2 * sizeof(u64):
+        case 3 * sizeof(u64):
+            return jhash2((const u32 *)key, hashTblp->key_len / sizeof(u32), hashTblp->secret);
+        default:
+            break;
+        }
+    }
+
     return jhash(key, hashTblp->key_len, hashTblp->secret);
 }
+
+static inline bool ec_hashtbl_key_equal(HashTbl *hashTblp, const void *key, const void *other)
+{
+    if (unlikely(hashTblp->compare_callback))
+    {
+        return hashTblp->compare_callback(key, other, hashTblp->key_len);
+    }
+
+    if (likely(hashTblp->word_keys))
+    {
+        const u64 *a = (const u64 *)key;
+        const u64 *b = (const u64 *)other;
+
+        switch (hashTblp->key_len)
+        {
+        case sizeof(u32):
+            return *(const u32 *)key == *(const u32 *)other;
+        case sizeof(u64):
+            return a[0] == b[0];
+        case 2 * sizeof(u64):
+            return ((a[0] ^ b[0]) | (a[1] ^ b[1])) == 0;
+        case 3 * sizeof(u64):
+            return ((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2])) == 0;
+        default:
+            break;
+        }
+    }
+
+    return memcmp(key, other, hashTblp->key_len) == 0;
+}
+
+// The built in key functions read the key as aligned words
+static bool __ec_hashtbl_word_keys(HashTbl *hashTblp)
+{
+    size_t align;
+
+    switch (hashTblp->key_len)
+    {
+    case sizeof(u32):
+        align = sizeof(u32);
+        break;
+    case sizeof(u64):
+    case 2 * sizeof(u64):
+    case 3 * sizeof(u64):
+        align = sizeof(u64);
+        break;
+    default:
+        return false;
+    }
+
+    // Nodes are at least word aligned, so the key is aligned if its offset in the node is
+    return (HASH_NODE_SZ + hashTblp->key_offset) % align == 0;
+}
 static inline int ec_hashtbl_bkt_index(HashTbl *hashTblp, u32 hash)
 {
-    return hash & (hashTblp->numberOfBuckets - 1);
+    return hash & (hashTblp->numberOfLocks - 1);
 }
 
-static void ec_hashtbl_bkt_read_lock(HashTableBkt *bkt, ProcessContext *context)
+// The bucket lists may be replaced by a resize, holding a bucket lock also holds
+//  rcu_read_lock so the lists stay valid until it is unlocked. A lock that is not
+//  free on the first try counts as contended.
+static void ec_hashtbl_bkt_read_lock(HashTbl *hashTblp, HashTableBkt *bkt, ProcessContext *context)
 {
-    ec_read_lock(&bkt->lock, context);
+    if (!ec_read_trylock_inline(&bkt->lock, context))
+    {
+        HASHTBL_STAT(hashTblp, contended);
+        ec_read_lock_inline(&bkt->lock, context);
+    }
+    rcu_read_lock();
 }
 static void ec_hashtbl_bkt_read_unlock(HashTableBkt *bkt, ProcessContext *context)
 {
-    ec_read_unlock(&bkt->lock, context);
+    rcu_read_unlock();
+    ec_read_unlock_inline(&bkt->lock, context);
 }
 
-static void ec_hashtbl_bkt_write_lock(HashTableBkt *bkt, ProcessContext *context)
+static void ec_hashtbl_bkt_write_lock(HashTbl *hashTblp, HashTableBkt *bkt, ProcessContext *context)
 {
-    ec_write_lock(&bkt->lock, context);
+    if (!ec_write_trylock_inline(&bkt->lock, context))
+    {
+        HASHTBL_STAT(hashTblp, contended);
+        ec_write_lock_inline(&bkt->lock, context);
+    }
+    rcu_read_lock();
 }
 static void ec_hashtbl_bkt_write_unlock(HashTableBkt *bkt, ProcessContext *context)
 {
-    ec_write_unlock(&bkt->lock, context);
+    rcu_read_unlock();
+    ec_write_unlock_inline(&bkt->lock, context);
+}
+
+// Lists of consecutive generations end in different nulls values
+static inline unsigned long __ec_hashtbl_nulls(HashTableBuckets *buckets, uint64_t index)
+{
+    return (unsigned long)(index << 1) | (buckets->generation & 1);
+}
+
+static HashTableBuckets *__ec_hashtbl_buckets_alloc(uint64_t size, uint32_t generation, ProcessContext *context)
+{
+    uint64_t          i;
+    HashTableBuckets *buckets = ec_mem_valloc(sizeof(HashTableBuckets) + size * sizeof(HashTableList), context);
+
+    if (buckets)
+    {
+        buckets->size       = size;
+        buckets->generation = generation;
+        for (i = 0; i < size; ++i)
+        {
+            INIT_HLIST_NULLS_HEAD(&buckets->list[i].head, __ec_hashtbl_nulls(buckets, i));
+            buckets->list[i].itemCount = 0;
+        }
+    }
+
+    return buckets;
+}
+
+// Returns the list that holds hash. The caller is either in a resizeSeq read section
+//  under rcu_read_lock, or uses __ec_hashtbl_list_locked.
+static HashTableList *__ec_hashtbl_list(HashTbl *hashTblp, u32 hash, unsigned long *nulls)
+{
+    HashTableBuckets *buckets = rcu_dereference(hashTblp->buckets);
+    HashTableBuckets *future  = rcu_dereference(hashTblp->future);
+    uint64_t          index   = hash & (buckets->size - 1);
+
+    if (future && index < READ_ONCE(hashTblp->rehashIndex))
+    {
+        buckets = future;
+        index   = hash & (future->size - 1);
+    }
+
+    if (nulls)
+    {
+        *nulls = __ec_hashtbl_nulls(buckets, index);
+    }
+
+    return &buckets->list[index];
+}
+
+// Called with the bucket lock for hash held, which keeps the list from moving
+static HashTableList *__ec_hashtbl_list_locked(HashTbl *hashTblp, u32 hash)
+{
+    HashTableList *list;
+    unsigned int   seq;
+
+    do {
+        seq  = read_seqcount_begin(&hashTblp->resizeSeq);
+        list = __ec_hashtbl_list(hashTblp, hash, NULL);
+    } while (read_seqcount_retry(&hashTblp->resizeSeq, seq));
+
+    return list;
+}
+
+static size_t __ec_hashtbl_base_size(HashTbl *hashTblp, uint64_t numberOfBuckets)
+{
+    return sizeof(HashTbl) +
+        hashTblp->numberOfLocks * sizeof(HashTableBkt) +
+        sizeof(HashTableBuckets) + numberOfBuckets * sizeof(HashTableList);
 }
 
 bool ec_hashtbl_init(
@@ -103,6 +300,7 @@ bool ec_hashtbl_init(
     unsigned int i;
     size_t tableSize;
     unsigned char *tbl_storage_p  = NULL;
+    HashTableBuckets *buckets = NULL;
 
     CANCEL_MSG(hashTblp, false, DL_ERROR, "%s: HashTbl NULL", __func__);
     CANCEL_MSG(!hashTblp->initialized, false, DL_ERROR, "%s: HashTbl already initialized", __func__);
@@ -118,7 +316,30 @@ bool ec_hashtbl_init(
         TRACE(DL_ERROR, "%s: Increase bucket size to %llu", __func__, hashTblp->numberOfBuckets);
     }
 
-    tableSize = hashTblp->numberOfBuckets * sizeof(HashTableBkt);
+    if (hashTblp->resizable)
+    {
+        // The locks are sized to minBuckets, so by default a table keeps one lock per
+        //  configured bucket and only grows. A lower minBuckets trades write lock
+        //  contention for memory when the table shrinks.
+        if (!hashTblp->minBuckets)
+        {
+            hashTblp->minBuckets = hashTblp->numberOfBuckets;
+        }
+        if (!hashTblp->maxBuckets)
+        {
+            hashTblp->maxBuckets = hashTblp->numberOfBuckets * HASHTBL_RESIZE_RANGE;
+        }
+        hashTblp->minBuckets = roundup_pow_of_two(min(hashTblp->minBuckets, hashTblp->numberOfBuckets));
+        hashTblp->maxBuckets = roundup_pow_of_two(max(hashTblp->maxBuckets, hashTblp->numberOfBuckets));
+    } else
+    {
+        hashTblp->minBuckets = hashTblp->numberOfBuckets;
+        hashTblp->maxBuckets = hashTblp->numberOfBuckets;
+    }
+
+    // The table never gets smaller than the number of locks
+    hashTblp->numberOfLocks = hashTblp->minBuckets;
+    tableSize = hashTblp->numberOfLocks * sizeof(HashTableBkt);
 
     //Since we're not in an atomic context this is an acceptable alternative to
     //kmalloc however, it should be noted that this is a little less efficient. The reason for this is
@@ -135,10 +356,26 @@ bool ec_hashtbl_init(
     HASHTBL_PRINT("Cache=%s elemsize=%llu\n", hashTblp->name, hashTblp->datasize);
 
     hashTblp->tablePtr = (HashTableBkt *)tbl_storage_p;
-    hashTblp->base_size   = tableSize + sizeof(HashTbl);
+    hashTblp->base_size   = __ec_hashtbl_base_size(hashTblp, hashTblp->numberOfBuckets);
     ec_percpu_counter_init(&hashTblp->tableInstance, 0, GFP_MODE(context));
 
+    buckets = __ec_hashtbl_buckets_alloc(hashTblp->numberOfBuckets, 0, context);
+    TRY_MSG(buckets, DL_ERROR, "%s: Failed to allocate %llu buckets", __func__, hashTblp->numberOfBuckets);
+    RCU_INIT_POINTER(hashTblp->buckets, buckets);
+    RCU_INIT_POINTER(hashTblp->future, NULL);
+    hashTblp->rehashIndex = 0;
+    seqcount_init(&hashTblp->resizeSeq);
+    atomic_set(&hashTblp->resizing, 0);
+    INIT_WORK(&hashTblp->resizeWork, __ec_hashtbl_resize_work);
+    hashTblp->resizeCount = 0;
+    memset(hashTblp->resizeHistory, 0, sizeof(hashTblp->resizeHistory));
+
+    hashTblp->stats = ec_alloc_percpu(HashTableStats, GFP_MODE(context));
+    TRY_MSG(hashTblp->stats, DL_ERROR, "%s: Failed to allocate stats", __func__);
+    ec_hashtbl_reset_stats(hashTblp);
+
     hashTblp->hash_cache.delete_callback = __ec_hashtbl_cache_delete_cb;
+    hashTblp->hash_cache.free_rcu        = true;
     if (hashTblp->printval_callback)
     {
         hashTblp->hash_cache.printval_callback = __ec_hashtbl_print_callback;
@@ -149,11 +386,21 @@ bool ec_hashtbl_init(
 
     // Make hash more random
     get_random_bytes(&hashTblp->secret, sizeof(hashTblp->secret));
+    hashTblp->word_keys = __ec_hashtbl_word_keys(hashTblp);
+
+    hashTblp->entryBudget = hashTblp->maxEntries;
+    if (hashTblp->maxBytes)
+    {
+        uint64_t entries = max_t(uint64_t, hashTblp->maxBytes / (hashTblp->datasize + HASH_NODE_SZ), 1);
+
+        hashTblp->entryBudget = hashTblp->entryBudget ? min(hashTblp->entryBudget, entries) : entries;
+    }
+    hashTblp->clockHand = 0;
+    atomic_set(&hashTblp->sweeping, 0);
 
-    for (i = 0; i < hashTblp->numberOfBuckets; i++)
+    for (i = 0; i < hashTblp->numberOfLocks; i++)
     {
-        ec_spinlock_init(&hashTblp->tablePtr[i].lock, context);
-        INIT_LIST_HEAD(&hashTblp->tablePtr[i].head);
+        ec_spinlock_inline_init(&hashTblp->tablePtr[i].lock, context);
     }
 
     INIT_LIST_HEAD(&hashTblp->genTables);
@@ -163,6 +410,11 @@ bool ec_hashtbl_init(
 
     __ec_hashtbl_proc_initialize(hashTblp, context);
 
+    if (hashTblp->reclaimable)
+    {
+        __ec_hashtbl_shrinker_register(hashTblp);
+    }
+
     HASHTBL_PRINT("Size=%lu NumberOfBuckets=%llu\n", tableSize, hashTblp->numberOfBuckets);
     HASHTBL_PRINT("ADDR=%p TADDR=%p OFFSET=%lu\n", hashTblp, hashTblp->tablePtr, sizeof(HashTbl));
 
@@ -170,6 +422,10 @@ bool ec_hashtbl_init(
     return true;
 
 CATCH_DEFAULT:
+    free_percpu(hashTblp->stats);
+    hashTblp->stats = NULL;
+    ec_mem_free(buckets);
+    RCU_INIT_POINTER(hashTblp->buckets, NULL);
     ec_mem_free(tbl_storage_p);
     percpu_counter_destroy(&hashTblp->tableInstance);
     hashTblp->tablePtr = NULL;
@@ -195,6 +451,16 @@ void ec_hashtbl_destroy(HashTbl *hashTblp, ProcessContext *context)
 
     hashTblp->initialized = false;
 
+    // Waits for a shrink that is running
+    if (hashTblp->shrinkerRegistered)
+    {
+        unregister_shrinker(&hashTblp->shrinker);
+        hashTblp->shrinkerRegistered = false;
+    }
+
+    // A resize that already started runs to the end
+    cancel_work_sync(&hashTblp->resizeWork);
+
     __ec_hashtbl_proc_shutdown(hashTblp, context);
 
     __ec_hashtbl_for_each(hashTblp, __ec_hashtbl_delete_callback, NULL, true, context);
@@ -203,15 +469,19 @@ void ec_hashtbl_destroy(HashTbl *hashTblp, ProcessContext *context)
         percpu_counter_sum_positive(&hashTblp->tableInstance),
         ec_mem_cache_get_allocated_count(&hashTblp->hash_cache, context));
 
-    for (i = 0; i < hashTblp->numberOfBuckets; i++)
+    for (i = 0; i < hashTblp->numberOfLocks; i++)
     {
-        ec_spinlock_destroy(&hashTblp->tablePtr[i].lock, context);
+        ec_spinlock_inline_destroy(&hashTblp->tablePtr[i].lock, context);
     }
 
 
     percpu_counter_destroy(&hashTblp->tableInstance);
     ec_mem_cache_destroy(&hashTblp->hash_cache, context);
+    ec_mem_free(rcu_dereference_protected(hashTblp->buckets, 1));
+    RCU_INIT_POINTER(hashTblp->buckets, NULL);
     ec_mem_free(hashTblp->tablePtr);
+    free_percpu(hashTblp->stats);
+    hashTblp->stats = NULL;
 }
 
 void ec_hashtbl_clear(HashTbl *hashTblp, ProcessContext *context)
@@ -235,65 +505,87 @@ void ec_hashtbl_read_for_each(HashTbl *hashTblp, hashtbl_for_each_cb callback, v
     __ec_hashtbl_for_each(hashTblp, callback, priv, false, context);
 }
 
+static int __ec_hashtbl_for_each_list(HashTbl *hashTblp, HashTableList *list, uint64_t index, hashtbl_for_each_cb callback, void *priv, bool haveWriteLock, ProcessContext *context)
+{
+    struct hlist_nulls_node *pos;
+    struct hlist_nulls_node *next;
+
+    for (pos = list->head.first; !is_a_nulls(pos); pos = next)
+    {
+        HashTableNode *nodep = hlist_nulls_entry(pos, HashTableNode, link);
+
+        next = pos->next;
+
+        switch ((*callback)(hashTblp, __ec_get_datap(hashTblp, nodep), priv, context))
+        {
+        case ACTION_DELETE:
+            // This should never be called with only a read lock
+            BUG_ON(!haveWriteLock);
+            __ec_hashtbl_unlink(hashTblp, list, nodep, context);
+            break;
+        case ACTION_STOP:
+            return ACTION_STOP;
+        case ACTION_PRINT:
+            TRACE(DL_INFO, "bucket: %llu, active: %u", index, nodep->activity);
+            break;
+        case ACTION_CONTINUE:
+        default:
+            break;
+        }
+    }
+
+    return ACTION_CONTINUE;
+}
+
+// Walks every list under each bucket lock. During a resize the lists for a lock are
+//  the ones not moved yet in the old buckets and all of them in the new buckets.
 void __ec_hashtbl_for_each(HashTbl *hashTblp, hashtbl_for_each_cb callback, void *priv, bool haveWriteLock, ProcessContext *context)
 {
-    unsigned int i;
-    uint64_t numberOfBuckets;
+    uint64_t i;
+    uint64_t numberOfLocks;
     HashTableBkt *ec_hashtbl_tbl  = NULL;
 
     if (!hashTblp) return;
 
     ec_hashtbl_tbl = hashTblp->tablePtr;
-    numberOfBuckets  = hashTblp->numberOfBuckets;
+    numberOfLocks  = hashTblp->numberOfLocks;
 
-    // May need to walk the lists too
-    for (i = 0; i < numberOfBuckets; ++i)
+    for (i = 0; i < numberOfLocks; ++i)
     {
-        HashTableBkt *bucketp = &ec_hashtbl_tbl[i];
-        HashTableNode *nodep = 0, *next = 0;
+        HashTableBkt     *bucketp = &ec_hashtbl_tbl[i];
+        HashTableBuckets *buckets;
+        HashTableBuckets *future;
+        uint64_t          rehashIndex;
+        uint64_t          j;
+        unsigned int      seq;
+        int               action  = ACTION_CONTINUE;
 
         if (haveWriteLock)
         {
-            ec_hashtbl_bkt_write_lock(bucketp, context);
+            ec_hashtbl_bkt_write_lock(hashTblp, bucketp, context);
         } else
         {
-            ec_hashtbl_bkt_read_lock(bucketp, context);
+            ec_hashtbl_bkt_read_lock(hashTblp, bucketp, context);
         }
 
-        if (!list_empty(&bucketp->head))
+        do {
+            seq         = read_seqcount_begin(&hashTblp->resizeSeq);
+            buckets     = rcu_dereference(hashTblp->buckets);
+            future      = rcu_dereference(hashTblp->future);
+            rehashIndex = READ_ONCE(hashTblp->rehashIndex);
+        } while (read_seqcount_retry(&hashTblp->resizeSeq, seq));
+
+        for (j = i; j < buckets->size && action != ACTION_STOP; j += numberOfLocks)
         {
-            list_for_each_entry_safe(nodep, next, &bucketp->head, link)
+            if (!future || j >= rehashIndex)
             {
-
-                switch ((*callback)(hashTblp, __ec_get_datap(hashTblp, nodep), priv, context))
-                {
-                case ACTION_DELETE:
-                    // This should never be called with only a read lock
-                    BUG_ON(!haveWriteLock);
-                    list_del_init(&nodep->link);
-                    --bucketp->itemCount;
-                    percpu_counter_dec(&hashTblp->tableInstance);
-                    ec_mem_cache_disown(nodep, context);
-                    break;
-                case ACTION_STOP:
-                    if (haveWriteLock)
-                    {
-                        ec_hashtbl_bkt_write_unlock(bucketp, context);
-                    } else
-                    {
-                        ec_hashtbl_bkt_read_unlock(bucketp, context);
-                    }
-                    goto Exit;
-                    break;
-                case ACTION_PRINT:
-                    TRACE(DL_INFO, "bucket: %u, active: %u", i, nodep->activity);
-                    break;
-                case ACTION_CONTINUE:
-                default:
-                    break;
-                }
+                action = __ec_hashtbl_for_each_list(hashTblp, &buckets->list[j], j, callback, priv, haveWriteLock, context);
             }
         }
+        for (j = i; future && j < future->size && action != ACTION_STOP; j += numberOfLocks)
+        {
+            action = __ec_hashtbl_for_each_list(hashTblp, &future->list[j], j, callback, priv, haveWriteLock, context);
+        }
 
         if (haveWriteLock)
         {
@@ -302,57 +594,311 @@ void __ec_hashtbl_for_each(HashTbl *hashTblp, hashtbl_for_each_cb callback, void
         {
             ec_hashtbl_bkt_read_unlock(bucketp, context);
         }
+
+        if (action == ACTION_STOP)
+        {
+            break;
+        }
     }
 
-Exit:
     // Signal the callback we are done.  It may need to clean up something in the context
     (*callback)(hashTblp, NULL, priv, context);
     return;
 }
 
-#define LRU_REORDERLIMIT 10
+// A hit counts towards the activity used by the LRU eviction, or sets the reference
+//  bit for the CLOCK eviction. The bit is only written when clear to keep lookups of
+//  hot entries from dirtying their cache line.
+static inline void __ec_hashtbl_touch(HashTbl *hashTblp, HashTableNode *nodep)
+{
+    if (hashTblp->entryBudget)
+    {
+        if (!READ_ONCE(nodep->activity))
+        {
+            WRITE_ONCE(nodep->activity, 1);
+        }
+    } else
+    {
+        // Racy, but it is only a hint for the eviction
+        nodep->activity += 1;
+    }
+}
 
-HashTableNode *__ec_hashtbl_lookup(HashTbl *hashTblp, struct list_head *head, u32 hash, const void *key)
+// Called with the bucket locked. Entries are never moved within a bucket because a
+//  reader walking it under RCU could miss the moved entry.
+HashTableNode *__ec_hashtbl_lookup(HashTbl *hashTblp, HashTableList *list, u32 hash, const void *key)
 {
     HashTableNode *tableNode = NULL;
-    HashTableNode *nextNode = NULL;
-    HashTableNode *prevNode = NULL;
+    struct hlist_nulls_node *pos;
 
-    list_for_each_entry_safe(tableNode, nextNode, head, link)
+    hlist_nulls_for_each_entry(tableNode, pos, &list->head, link)
     {
         if (hash == tableNode->hash &&
-            memcmp(key, __ec_get_key_ptr(hashTblp, __ec_get_datap(hashTblp, tableNode)), hashTblp->key_len) == 0)
-        {
-            // 1. The cache entry's activity counter is incremented
-            // 2. The previous (higher ranking) entry's activity counter is decremented
-            // 3. If the difference between the two activity counters is geater than
-            //    LRU_REORDERLIMIT the two entries are swapped
-            tableNode->activity += 1;
-            if (prevNode)
+            ec_hashtbl_key_equal(hashTblp, key, __ec_get_key_ptr(hashTblp, __ec_get_datap(hashTblp, tableNode))))
+        {
+            __ec_hashtbl_touch(hashTblp, tableNode);
+            return tableNode;
+        }
+    }
+
+    return NULL;
+}
+
+// Counts a lookup from the outside and every HASHTBL_CHAIN_SAMPLE of them the length
+//  of the list it walked
+static inline void __ec_hashtbl_count_lookup(HashTbl *hashTblp, HashTableList *list, bool hit)
+{
+    if ((this_cpu_inc_return(hashTblp->stats->lookups) & (HASHTBL_CHAIN_SAMPLE - 1)) == 0)
+    {
+        int bin = min_t(int, fls64(READ_ONCE(list->itemCount)), HASHTBL_CHAIN_BINS - 1);
+
+        this_cpu_inc(hashTblp->stats->chain[bin]);
+    }
+
+    if (hit)
+    {
+        HASHTBL_STAT(hashTblp, hits);
+    } else
+    {
+        HASHTBL_STAT(hashTblp, misses);
+    }
+}
+
+// Called under rcu_read_lock, returns the node with a reference taken. A node that
+//  is being deleted may still be seen until the grace period ends, it is skipped
+//  once its last reference is gone or it has left the bucket. A miss is only trusted
+//  if no bucket was moved by a resize while looking.
+static HashTableNode *__ec_hashtbl_lookup_rcu(HashTbl *hashTblp, u32 hash, const void *key, ProcessContext *context)
+{
+    HashTableNode *tableNode = NULL;
+    HashTableList *list;
+    struct hlist_nulls_node *pos;
+    unsigned long  nulls;
+    unsigned int   seq;
+
+restart:
+    seq  = read_seqcount_begin(&hashTblp->resizeSeq);
+    list = __ec_hashtbl_list(hashTblp, hash, &nulls);
+
+    hlist_nulls_for_each_entry_rcu(tableNode, pos, &list->head, link)
+    {
+        if (hash == tableNode->hash &&
+            ec_hashtbl_key_equal(hashTblp, key, __ec_get_key_ptr(hashTblp, __ec_get_datap(hashTblp, tableNode))) &&
+            ec_mem_cache_get_unless_zero(tableNode, context))
+        {
+            if (__ec_hashtbl_node_linked(tableNode))
+            {
+                __ec_hashtbl_touch(hashTblp, tableNode);
+                __ec_hashtbl_count_lookup(hashTblp, list, true);
+                return tableNode;
+            }
+            ec_mem_cache_put(tableNode, context);
+        }
+    }
+
+    if (get_nulls_value(pos) != nulls || read_seqcount_retry(&hashTblp->resizeSeq, seq))
+    {
+        goto restart;
+    }
+
+    __ec_hashtbl_count_lookup(hashTblp, list, false);
+    return NULL;
+}
+
+// Picks the entry to evict from a full bucket, the least active one and the oldest
+//  of those. Activity is halved on every pass so entries that were busy once do not
+//  stay forever.
+static HashTableNode *__ec_hashtbl_lru_victim(HashTableList *list)
+{
+    HashTableNode *tableNode = NULL;
+    HashTableNode *victim    = NULL;
+    struct hlist_nulls_node *pos;
+
+    hlist_nulls_for_each_entry(tableNode, pos, &list->head, link)
+    {
+        if (!victim || tableNode->activity <= victim->activity)
+        {
+            victim = tableNode;
+        }
+        tableNode->activity /= 2;
+    }
+
+    return victim;
+}
+
+// Sweeps the clock hand over up to scan buckets, clearing reference bits and
+//  evicting up to count entries that had none. The activity of a table with an LRU
+//  size is halved instead, so busy entries survive more passes. Only one CPU sweeps
+//  at a time, the others carry on over budget for a moment rather than wait.
+//  Returns the number of entries evicted.
+static uint64_t __ec_hashtbl_clock_evict(HashTbl *hashTblp, uint64_t count, uint64_t scan, ProcessContext *context)
+{
+    uint64_t scanned = 0;
+    uint64_t evicted = 0;
+
+    if (atomic_cmpxchg(&hashTblp->sweeping, 0, 1) != 0)
+    {
+        return 0;
+    }
+
+    while (evicted < count && scanned++ < scan)
+    {
+        HashTableBuckets        *buckets;
+        HashTableBuckets        *future;
+        HashTableBkt            *bucketp;
+        HashTableList           *list;
+        struct hlist_nulls_node *pos;
+        struct hlist_nulls_node *next;
+        uint64_t                 rehashIndex;
+        uint64_t                 index = hashTblp->clockHand;
+        unsigned int             seq;
+
+        bucketp = &hashTblp->tablePtr[ec_hashtbl_bkt_index(hashTblp, index)];
+        ec_hashtbl_bkt_write_lock(hashTblp, bucketp, context);
+
+        do {
+            seq         = read_seqcount_begin(&hashTblp->resizeSeq);
+            buckets     = rcu_dereference(hashTblp->buckets);
+            future      = rcu_dereference(hashTblp->future);
+            rehashIndex = READ_ONCE(hashTblp->rehashIndex);
+        } while (read_seqcount_retry(&hashTblp->resizeSeq, seq));
+
+        // The hand goes around the current buckets, a resize may have shrunk them
+        hashTblp->clockHand = index + 1 < buckets->size ? index + 1 : 0;
+
+        if (index < buckets->size && (!future || index >= rehashIndex))
+        {
+            list = &buckets->list[index];
+            for (pos = list->head.first; evicted < count && !is_a_nulls(pos); pos = next)
             {
-                if (prevNode->activity > 0)
+                HashTableNode *nodep = hlist_nulls_entry(pos, HashTableNode, link);
+
+                next = pos->next;
+                if (nodep->activity)
                 {
-                    prevNode->activity -= 1;
-                }
-                if (tableNode->activity > prevNode->activity &&
-                    tableNode->activity - prevNode->activity > LRU_REORDERLIMIT)
+                    // Second chance
+                    nodep->activity /= 2;
+                } else
                 {
-                    list_del_init(&tableNode->link);
-                    list_add_tail(&tableNode->link, &prevNode->link);
+                    __ec_hashtbl_unlink(hashTblp, list, nodep, context);
+                    ++evicted;
                 }
             }
-            return tableNode;
         }
-        prevNode = tableNode;
+
+        ec_hashtbl_bkt_write_unlock(bucketp, context);
     }
 
-    return NULL;
+    atomic_set(&hashTblp->sweeping, 0);
+    return evicted;
+}
+
+// Memory pressure takes cold entries from tables that opt in with reclaimable, with
+//  the same sweep as the budget
+static unsigned long __ec_hashtbl_shrink_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    HashTbl *hashTblp = container_of(shrinker, HashTbl, shrinker);
+
+    if (!hashTblp->initialized)
+    {
+        return 0;
+    }
+
+    return percpu_counter_read_positive(&hashTblp->tableInstance);
+}
+
+static unsigned long __ec_hashtbl_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    HashTbl *hashTblp = container_of(shrinker, HashTbl, shrinker);
+    uint64_t reclaimed;
+
+    // Reclaim may have been entered from an allocation, do not allocate more
+    DECLARE_ATOMIC_CONTEXT(context, ec_getpid(current));
+
+    if (!hashTblp->initialized)
+    {
+        return SHRINK_STOP;
+    }
+
+    // A bucket holds an entry or two, so scanning as many buckets as we were asked
+    //  for entries looks at about the right number
+    reclaimed = __ec_hashtbl_clock_evict(hashTblp, sc->nr_to_scan, max_t(uint64_t, sc->nr_to_scan, HASHTBL_CLOCK_SCAN), &context);
+    this_cpu_add(hashTblp->stats->reclaimed, reclaimed);
+    ec_mem_cache_add_reclaimed(&hashTblp->hash_cache, reclaimed);
+
+    // Entries freed earlier may still sit in the per cpu magazines
+    ec_mem_cache_drain(&hashTblp->hash_cache, &context);
+
+    return reclaimed ? reclaimed : SHRINK_STOP;
+}
+
+#ifndef EC_SHRINKER_COUNT_SCAN
+// Older kernels ask for the count and the scan through one callback
+static int __ec_hashtbl_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    if (sc->nr_to_scan)
+    {
+        __ec_hashtbl_shrink_scan(shrinker, sc);
+    }
+
+    return __ec_hashtbl_shrink_count(shrinker, sc);
+}
+#endif
+
+static void __ec_hashtbl_shrinker_register(HashTbl *hashTblp)
+{
+    memset(&hashTblp->shrinker, 0, sizeof(hashTblp->shrinker));
+#ifdef EC_SHRINKER_COUNT_SCAN
+    hashTblp->shrinker.count_objects = __ec_hashtbl_shrink_count;
+    hashTblp->shrinker.scan_objects  = __ec_hashtbl_shrink_scan;
+#else
+    hashTblp->shrinker.shrink        = __ec_hashtbl_shrink;
+#endif
+    hashTblp->shrinker.seeks         = DEFAULT_SEEKS;
+
+    // The table works without it, only unregister what was registered
+#ifdef EC_SHRINKER_COUNT_SCAN
+    hashTblp->shrinkerRegistered = register_shrinker(&hashTblp->shrinker) == 0;
+    if (!hashTblp->shrinkerRegistered)
+    {
+        TRACE(DL_WARNING, "%s: failed to register shrinker for %s", __func__, hashTblp->name);
+    }
+#else
+    register_shrinker(&hashTblp->shrinker);
+    hashTblp->shrinkerRegistered = true;
+#endif
+}
+
+// Called after the entry count changed, hands a resize to the work queue once the
+//  load leaves the range for the current size
+static void __ec_hashtbl_check_load(HashTbl *hashTblp)
+{
+    s64      items;
+    uint64_t size;
+
+    if (!hashTblp->resizable || !hashTblp->initialized || atomic_read(&hashTblp->resizing))
+    {
+        return;
+    }
+
+    items = percpu_counter_read_positive(&hashTblp->tableInstance);
+    size  = READ_ONCE(hashTblp->numberOfBuckets);
+
+    if ((items > size * HASHTBL_GROW_LOAD && size < hashTblp->maxBuckets) ||
+        (items * HASHTBL_SHRINK_LOAD < size && size > hashTblp->minBuckets))
+    {
+        if (atomic_cmpxchg(&hashTblp->resizing, 0, 1) == 0)
+        {
+            schedule_work(&hashTblp->resizeWork);
+        }
+    }
 }
 
 int __ec_hashtbl_add(HashTbl *hashTblp, void *datap, bool forceUnique, ProcessContext *context)
 {
     uint64_t bucket_indx;
     HashTableBkt *bucketp = NULL;
+    HashTableList *list;
     HashTableNode *nodep;
     char *key_str;
     void *key;
@@ -374,35 +920,57 @@ int __ec_hashtbl_add(HashTbl *hashTblp, void *datap, bool forceUnique, ProcessCo
         ec_mem_free(key_str);
     }
 
-    ec_hashtbl_bkt_write_lock(bucketp, context);
+    ec_hashtbl_bkt_write_lock(hashTblp, bucketp, context);
+    list = __ec_hashtbl_list_locked(hashTblp, nodep->hash);
 
-    if (hashTblp->lruSize > 0 && bucketp->itemCount >= hashTblp->lruSize)
+    if (forceUnique)
     {
-        // Evict from the LRU
-        //  Note this happens before we enforce uniqueness, which may result in evicting an item without adding a new item.
-
-        // If there are nodes in this bucket then evict one.
-        HashTableNode *tableNode = list_last_entry(&bucketp->head, HashTableNode, link);
-        void          *datap     = __ec_get_datap(hashTblp, tableNode);
+        HashTableNode *old_node = __ec_hashtbl_lookup(hashTblp, list, nodep->hash, key);
 
-        ec_hashtbl_del_lockheld(hashTblp, bucketp, datap, context);
+        TRY_DO(!old_node, {
+            HASHTBL_STAT(hashTblp, exists);
+            ret = -EEXIST;
+        });
     }
 
-    if (forceUnique)
+    if (hashTblp->lruSize > 0 && list->itemCount >= hashTblp->lruSize)
     {
-        HashTableNode *old_node = __ec_hashtbl_lookup(hashTblp, &bucketp->head, nodep->hash, key);
+        // Evict from the LRU
+        // If there are nodes in this bucket then evict one.
+        HashTableNode *tableNode = __ec_hashtbl_lru_victim(list);
 
-        TRY_DO(!old_node, { ret = -EEXIST; });
+        if (tableNode)
+        {
+            ec_hashtbl_del_lockheld(hashTblp, bucketp, __ec_get_datap(hashTblp, tableNode), context);
+            HASHTBL_STAT(hashTblp, evictions);
+        }
     }
 
-    list_add(&nodep->link, &bucketp->head);
-    ++bucketp->itemCount;
+    hlist_nulls_add_head_rcu(&nodep->link, &list->head);
+    ++list->itemCount;
     percpu_counter_inc(&hashTblp->tableInstance);
+    HASHTBL_STAT(hashTblp, inserts);
     ec_mem_cache_get(nodep, context);
 
 CATCH_DEFAULT:
     ec_hashtbl_bkt_write_unlock(bucketp, context);
 
+    if (!ret)
+    {
+        // The compare only sums the per cpu counts when close to the budget
+        if (hashTblp->entryBudget && percpu_counter_compare(&hashTblp->tableInstance, hashTblp->entryBudget) > 0)
+        {
+            s64      items   = percpu_counter_read_positive(&hashTblp->tableInstance);
+            uint64_t evicted = __ec_hashtbl_clock_evict(hashTblp,
+                                                        clamp_t(s64, items - hashTblp->entryBudget, 1, HASHTBL_CLOCK_EVICT),
+                                                        HASHTBL_CLOCK_SCAN,
+                                                        context);
+
+            this_cpu_add(hashTblp->stats->evictions, evicted);
+        }
+        __ec_hashtbl_check_load(hashTblp);
+    }
+
     return ret;
 }
 
@@ -416,6 +984,38 @@ int ec_hashtbl_add_safe(HashTbl *hashTblp, void *datap, ProcessContext *context)
     return __ec_hashtbl_add(hashTblp, datap, true, context);
 }
 
+// Turns a reference on datap into what the table hands out. The handle callback
+//  reads data that writers change under the bucket lock, so it is called with
+//  bucketp locked, or already locked by the caller if bucketp is NULL.
+static void *__ec_hashtbl_handle(HashTbl *hashTblp, HashTableBkt *bucketp, void *datap, ProcessContext *context)
+{
+    void *handle;
+
+    if (!hashTblp->handle_callback)
+    {
+        return datap;
+    }
+
+    if (bucketp)
+    {
+        ec_hashtbl_bkt_read_lock(hashTblp, bucketp, context);
+    }
+    handle = hashTblp->handle_callback(datap, context);
+    if (bucketp)
+    {
+        ec_hashtbl_bkt_read_unlock(bucketp, context);
+    }
+
+    if (!handle)
+    {
+        // If we failed to get a handle, we want to release the reference and return NULL
+        ec_hashtbl_put(hashTblp, datap, context);
+    }
+
+    // We want to return the handle
+    return handle;
+}
+
 void *ec_hashtbl_find(HashTbl *hashTblp, void *key, ProcessContext *context)
 {
     u32 hash;
@@ -443,29 +1043,23 @@ void *ec_hashtbl_find(HashTbl *hashTblp, void *key, ProcessContext *context)
         ec_mem_free(key_str);
     }
 
-    ec_hashtbl_bkt_read_lock(bucketp, context);
-    nodep = __ec_hashtbl_lookup(hashTblp, &bucketp->head, hash, key);
-    if (nodep && hashTblp->find_verify_callback)
-    {
-        if (!hashTblp->find_verify_callback(
-                __ec_get_datap(hashTblp, nodep),
-                key,
-                context))
-        {
-            // If we failed the verify then reject this node
-            nodep = NULL;
-        }
-    }
-    if (nodep)
+    rcu_read_lock();
+    nodep = __ec_hashtbl_lookup_rcu(hashTblp, hash, key, context);
+    rcu_read_unlock();
+
+    CANCEL(nodep, NULL);
+
+    // The reference keeps the entry alive from here on
+    datap = __ec_get_datap(hashTblp, nodep);
+    if (hashTblp->find_verify_callback &&
+        !hashTblp->find_verify_callback(datap, key, context))
     {
-        datap = ec_hashtbl_get(
-            hashTblp,
-            __ec_get_datap(hashTblp, nodep),
-            context);
+        // If we failed the verify then reject this node
+        ec_hashtbl_put(hashTblp, datap, context);
+        return NULL;
     }
-    ec_hashtbl_bkt_read_unlock(bucketp, context);
 
-    return datap;
+    return __ec_hashtbl_handle(hashTblp, bucketp, datap, context);
 }
 
 void *ec_hashtbl_get(HashTbl *hashTblp, void *datap, ProcessContext *context)
@@ -473,21 +1067,8 @@ void *ec_hashtbl_get(HashTbl *hashTblp, void *datap, ProcessContext *context)
     CANCEL(hashTblp && datap, NULL);
 
     ec_mem_cache_get(__ec_get_nodep(hashTblp, datap), context);
-    if (hashTblp->handle_callback)
-    {
-        void *handle = hashTblp->handle_callback(datap, context);
 
-        if (!handle)
-        {
-            // If we failed to get a handle, we want to release the reference and return NULL
-            ec_hashtbl_put(hashTblp, datap, context);
-        }
-
-        // We want to return the handle
-        datap = handle;
-    }
-
-    return datap;
+    return __ec_hashtbl_handle(hashTblp, NULL, datap, context);
 }
 
 int64_t ec_hashtbl_ref_count(HashTbl *hashTblp, void *datap, ProcessContext *context)
@@ -512,13 +1093,9 @@ int ec_hashtbl_del_lockheld(HashTbl *hashTblp, HashTableBkt *bucketp, void *data
     HashTableNode *nodep = __ec_get_nodep(hashTblp, datap);
 
     // This protects against ec_hashtbl_del being called twice for the same datap
-    if (!list_empty(&nodep->link))
+    if (__ec_hashtbl_node_linked(nodep))
     {
-        list_del_init(&nodep->link);
-        --bucketp->itemCount;
-        percpu_counter_dec(&hashTblp->tableInstance);
-
-        ec_mem_cache_disown(nodep, context);
+        __ec_hashtbl_unlink(hashTblp, __ec_hashtbl_list_locked(hashTblp, nodep->hash), nodep, context);
 
         return 0;
     } else
@@ -550,8 +1127,8 @@ void *ec_hashtbl_del_by_key(HashTbl *hashTblp, void *key, ProcessContext *contex
     bucket_indx = ec_hashtbl_bkt_index(hashTblp, hash);
     bucketp = &(hashTblp->tablePtr[bucket_indx]);
 
-    ec_hashtbl_bkt_write_lock(bucketp, context);
-    nodep = __ec_hashtbl_lookup(hashTblp, &bucketp->head, hash, key);
+    ec_hashtbl_bkt_write_lock(hashTblp, bucketp, context);
+    nodep = __ec_hashtbl_lookup(hashTblp, __ec_hashtbl_list_locked(hashTblp, hash), hash, key);
     if (nodep)
     {
         datap = __ec_get_datap(hashTblp, nodep);
@@ -563,6 +1140,11 @@ void *ec_hashtbl_del_by_key(HashTbl *hashTblp, void *key, ProcessContext *contex
     }
     ec_hashtbl_bkt_write_unlock(bucketp, context);
 
+    if (datap)
+    {
+        __ec_hashtbl_check_load(hashTblp);
+    }
+
     // caller must put or free (if no reference count)
     return datap;
 }
@@ -581,9 +1163,11 @@ void ec_hashtbl_del(HashTbl *hashTblp, void *datap, ProcessContext *context)
     bucket_indx = ec_hashtbl_bkt_index(hashTblp, nodep->hash);
     bucketp = &(hashTblp->tablePtr[bucket_indx]);
 
-    ec_hashtbl_bkt_write_lock(bucketp, context);
+    ec_hashtbl_bkt_write_lock(hashTblp, bucketp, context);
     ec_hashtbl_del_lockheld(hashTblp, bucketp, datap, context);
     ec_hashtbl_bkt_write_unlock(bucketp, context);
+
+    __ec_hashtbl_check_load(hashTblp);
 }
 
 int64_t ec_hashtbl_get_count(HashTbl *hashTblp, ProcessContext *context)
@@ -606,7 +1190,10 @@ void *ec_hashtbl_alloc(HashTbl *hashTblp, ProcessContext *context)
     nodep->activity = 0;
     nodep->hash = 0;
     nodep->hashTblp = hashTblp;
-    INIT_LIST_HEAD(&nodep->link);
+
+    // Not in a bucket yet
+    nodep->link.next  = NULL;
+    nodep->link.pprev = LIST_POISON2;
     return __ec_get_datap(hashTblp, nodep);
 }
 
@@ -666,6 +1253,7 @@ bool __ec_hashtbl_bkt_lock(bool haveWriteLock, HashTbl *hashTblp, void *key, voi
     u32 hash;
     uint64_t bucket_indx;
     HashTableBkt *bucketp;
+    HashTableList *list;
     HashTableNode *nodep;
 
     if (!hashTblp || !key || !datap || !bkt)
@@ -681,13 +1269,15 @@ bool __ec_hashtbl_bkt_lock(bool haveWriteLock, HashTbl *hashTblp, void *key, voi
 
     if (haveWriteLock)
     {
-        ec_hashtbl_bkt_write_lock(bucketp, context);
+        ec_hashtbl_bkt_write_lock(hashTblp, bucketp, context);
     } else
     {
-        ec_hashtbl_bkt_read_lock(bucketp, context);
+        ec_hashtbl_bkt_read_lock(hashTblp, bucketp, context);
     }
 
-    nodep = __ec_hashtbl_lookup(hashTblp, &bucketp->head, hash, key);
+    list = __ec_hashtbl_list_locked(hashTblp, hash);
+    nodep = __ec_hashtbl_lookup(hashTblp, list, hash, key);
+    __ec_hashtbl_count_lookup(hashTblp, list, nodep);
     if (!nodep)
     {
         if (haveWriteLock)
@@ -755,7 +1345,7 @@ void ec_hashtbl_read_lock(HashTbl *hashTblp, void *key, ProcessContext *context)
 
     if (bucketp)
     {
-        ec_hashtbl_bkt_read_lock(bucketp, context);
+        ec_hashtbl_bkt_read_lock(hashTblp, bucketp, context);
     }
 }
 
@@ -775,7 +1365,7 @@ void ec_hashtbl_write_lock(HashTbl *hashTblp, void *key, ProcessContext *context
 
     if (bucketp)
     {
-        ec_hashtbl_bkt_write_lock(bucketp, context);
+        ec_hashtbl_bkt_write_lock(hashTblp, bucketp, context);
     }
 }
 
@@ -789,6 +1379,160 @@ void ec_hashtbl_write_unlock(HashTbl *hashTblp, void *key, ProcessContext *conte
     }
 }
 
+// Moves the entries of one old bucket to the new buckets. Readers that were on the
+//  moved entries notice from resizeSeq, or from ending on another list, and look again.
+static void __ec_hashtbl_migrate_bucket(HashTbl *hashTblp, HashTableBuckets *buckets, HashTableBuckets *future, uint64_t index, ProcessContext *context)
+{
+    HashTableBkt  *bucketp = &hashTblp->tablePtr[ec_hashtbl_bkt_index(hashTblp, index)];
+    HashTableList *from    = &buckets->list[index];
+
+    ec_hashtbl_bkt_write_lock(hashTblp, bucketp, context);
+    write_seqcount_begin(&hashTblp->resizeSeq);
+
+    while (!hlist_nulls_empty(&from->head))
+    {
+        HashTableNode *nodep = hlist_nulls_entry(from->head.first, HashTableNode, link);
+        HashTableList *to    = &future->list[nodep->hash & (future->size - 1)];
+
+        hlist_nulls_del_rcu(&nodep->link);
+        hlist_nulls_add_head_rcu(&nodep->link, &to->head);
+        --from->itemCount;
+        ++to->itemCount;
+    }
+    WRITE_ONCE(hashTblp->rehashIndex, index + 1);
+
+    write_seqcount_end(&hashTblp->resizeSeq);
+    ec_hashtbl_bkt_write_unlock(bucketp, context);
+}
+
+// Runs from the work queue so no hook ever waits for a resize. Buckets are moved one
+//  at a time under their own lock and lookups keep working throughout.
+static void __ec_hashtbl_resize(HashTbl *hashTblp, uint64_t size, ProcessContext *context)
+{
+    HashTableBuckets *buckets = rcu_dereference_protected(hashTblp->buckets, 1);
+    HashTableBuckets *future;
+    HashTableResize  *resize;
+    uint64_t          from    = buckets->size;
+    unsigned long     started = jiffies;
+    unsigned long     flags;
+    uint64_t          i;
+
+    future = __ec_hashtbl_buckets_alloc(size, buckets->generation + 1, context);
+    CANCEL_VOID_MSG(future, DL_WARNING, "%s: %s failed to allocate %llu buckets", __func__, hashTblp->name, size);
+
+    HASHTBL_PRINT("%s: resize %llu -> %llu\n", hashTblp->name, from, size);
+
+    local_irq_save(flags);
+    write_seqcount_begin(&hashTblp->resizeSeq);
+    hashTblp->rehashIndex = 0;
+    rcu_assign_pointer(hashTblp->future, future);
+    write_seqcount_end(&hashTblp->resizeSeq);
+    local_irq_restore(flags);
+
+    for (i = 0; i < from; ++i)
+    {
+        __ec_hashtbl_migrate_bucket(hashTblp, buckets, future, i, context);
+        if ((i + 1) % HASHTBL_REHASH_BATCH == 0)
+        {
+            cond_resched();
+        }
+    }
+
+    local_irq_save(flags);
+    write_seqcount_begin(&hashTblp->resizeSeq);
+    rcu_assign_pointer(hashTblp->buckets, future);
+    RCU_INIT_POINTER(hashTblp->future, NULL);
+    hashTblp->rehashIndex = 0;
+    WRITE_ONCE(hashTblp->numberOfBuckets, size);
+    hashTblp->base_size = __ec_hashtbl_base_size(hashTblp, size);
+    write_seqcount_end(&hashTblp->resizeSeq);
+    local_irq_restore(flags);
+
+    // Nobody can be looking at the old buckets after a grace period
+    synchronize_rcu();
+    ec_mem_free(buckets);
+
+    resize = &hashTblp->resizeHistory[hashTblp->resizeCount % HASHTBL_RESIZE_HISTORY];
+    resize->from        = from;
+    resize->to          = size;
+    resize->items       = percpu_counter_sum_positive(&hashTblp->tableInstance);
+    resize->started     = started;
+    resize->duration_ms = jiffies_to_msecs(jiffies - started);
+    ++hashTblp->resizeCount;
+}
+
+static uint64_t __ec_hashtbl_target_size(HashTbl *hashTblp)
+{
+    s64      items = percpu_counter_sum_positive(&hashTblp->tableInstance);
+    uint64_t size  = hashTblp->numberOfBuckets;
+
+    while (items > size * HASHTBL_GROW_LOAD && size < hashTblp->maxBuckets)
+    {
+        size *= 2;
+    }
+    while (items * HASHTBL_SHRINK_LOAD < size && size > hashTblp->minBuckets)
+    {
+        size /= 2;
+    }
+
+    return size;
+}
+
+static void __ec_hashtbl_resize_work(struct work_struct *work)
+{
+    HashTbl *hashTblp = container_of(work, HashTbl, resizeWork);
+    uint64_t size     = __ec_hashtbl_target_size(hashTblp);
+
+    DECLARE_NON_ATOMIC_CONTEXT(context, ec_getpid(current));
+
+    if (size != hashTblp->numberOfBuckets)
+    {
+        __ec_hashtbl_resize(hashTblp, size, &context);
+    }
+
+    atomic_set(&hashTblp->resizing, 0);
+}
+
+void ec_hashtbl_get_stats(HashTbl *hashTblp, HashTableStats *stats)
+{
+    int cpu;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    CANCEL_VOID(hashTblp && hashTblp->stats);
+
+    for_each_possible_cpu(cpu)
+    {
+        HashTableStats *cpu_stats = per_cpu_ptr(hashTblp->stats, cpu);
+
+        stats->lookups   += cpu_stats->lookups;
+        stats->hits      += cpu_stats->hits;
+        stats->misses    += cpu_stats->misses;
+        stats->inserts   += cpu_stats->inserts;
+        stats->exists    += cpu_stats->exists;
+        stats->evictions += cpu_stats->evictions;
+        stats->reclaimed += cpu_stats->reclaimed;
+        stats->contended += cpu_stats->contended;
+        for (i = 0; i < HASHTBL_CHAIN_BINS; ++i)
+        {
+            stats->chain[i] += cpu_stats->chain[i];
+        }
+    }
+}
+
+// A cpu counting while it is reset may keep that count, good enough for statistics
+void ec_hashtbl_reset_stats(HashTbl *hashTblp)
+{
+    int cpu;
+
+    CANCEL_VOID(hashTblp && hashTblp->stats);
+
+    for_each_possible_cpu(cpu)
+    {
+        memset(per_cpu_ptr(hashTblp->stats, cpu), 0, sizeof(HashTableStats));
+    }
+}
+
 struct counter {
     uint64_t itemCount;
     uint64_t bucketCount;
@@ -800,16 +1544,26 @@ void ec_hastable_bkt_show(HashTbl *hashTblp, hastable_print_func _print, void *m
 {
     int bucket_index = 0;
     int output_size = 0;
-    struct counter *items = ec_mem_valloc(sizeof(struct counter) * hashTblp->numberOfBuckets, context);
+    uint64_t numberOfBuckets = READ_ONCE(hashTblp->numberOfBuckets);
+    HashTableBuckets *buckets;
+    struct counter *items = ec_mem_valloc(sizeof(struct counter) * numberOfBuckets, context);
+
+    CANCEL_VOID(items);
 
     memset(items, 0, ec_mem_size(items));
 
-    for (; bucket_index < hashTblp->numberOfBuckets; ++bucket_index)
+    // Only the current buckets are counted while a resize is moving entries out of them
+    rcu_read_lock();
+    buckets = rcu_dereference(hashTblp->buckets);
+    numberOfBuckets = min(numberOfBuckets, buckets->size);
+
+    for (; bucket_index < numberOfBuckets; ++bucket_index)
     {
         int write_index = 0;
-        uint64_t itemCount = hashTblp->tablePtr[bucket_index].itemCount;
+        uint64_t itemCount = buckets->list[bucket_index].itemCount;
+        HashTableBkt *bucketp = &hashTblp->tablePtr[ec_hashtbl_bkt_index(hashTblp, bucket_index)];
 
-        ec_read_lock(&hashTblp->tablePtr[bucket_index].lock, context);
+        ec_read_lock_inline(&bucketp->lock, context);
         for (; write_index < output_size; ++write_index)
         {
             if (itemCount == items[write_index].itemCount)
@@ -829,13 +1583,14 @@ void ec_hastable_bkt_show(HashTbl *hashTblp, hastable_print_func _print, void *m
                 break;
             }
         }
-        ec_read_unlock(&hashTblp->tablePtr[bucket_index].lock, context);
+        ec_read_unlock_inline(&bucketp->lock, context);
         if (items[write_index].bucketCount++ == 0)
         {
             items[write_index].itemCount = itemCount;
             ++output_size;
         }
     }
+    rcu_read_unlock();
 
     _print(m, "%20s : %20s\n", "Bucket Depth", "Total Buckets");
     for (bucket_index = 0; bucket_index < output_size; ++bucket_index)
@@ -851,12 +1606,72 @@ int __ec_hashtbl_show(struct seq_file *m, void *v)
     DECLARE_NON_ATOMIC_CONTEXT(context, ec_getpid(current));
 
     HashTbl *hashTblp = (HashTbl *)m->private;
+    HashTableStats stats;
+    uint64_t i;
 
     seq_printf(m, "%20s : %20s\n", "Name", hashTblp->name);
     seq_printf(m, "%20s : %20llu\n", "Bucket Count", hashTblp->numberOfBuckets);
     seq_printf(m, "%20s : %20zu\n", "Table Size", hashTblp->base_size);
     seq_printf(m, "%20s : %20llu\n", "LRU Size", hashTblp->lruSize);
+    if (hashTblp->entryBudget)
+    {
+        seq_printf(m, "%20s : %20llu\n", "Entry Budget", hashTblp->entryBudget);
+    }
     seq_printf(m, "%20s : %20lld\n", "Item Count", percpu_counter_sum_positive(&hashTblp->tableInstance));
+    if (hashTblp->resizable)
+    {
+        seq_printf(m, "%20s : %20llu\n", "Min Buckets", hashTblp->minBuckets);
+        seq_printf(m, "%20s : %20llu\n", "Max Buckets", hashTblp->maxBuckets);
+        seq_printf(m, "%20s : %20llu\n", "Resizes", hashTblp->resizeCount);
+        seq_printf(m, "%20s : %20s\n", "Resizing", atomic_read(&hashTblp->resizing) ? "yes" : "no");
+
+        // Newest first
+        for (i = 0; i < min_t(uint64_t, hashTblp->resizeCount, HASHTBL_RESIZE_HISTORY); ++i)
+        {
+            HashTableResize *resize = &hashTblp->resizeHistory[(hashTblp->resizeCount - 1 - i) % HASHTBL_RESIZE_HISTORY];
+
+            seq_printf(m, "%20s : %llu -> %llu buckets, %llu items, took %u ms, %u s ago\n",
+                "Resize",
+                resize->from,
+                resize->to,
+                resize->items,
+                resize->duration_ms,
+                jiffies_to_msecs(jiffies - resize->started) / MSEC_PER_SEC);
+        }
+    }
+    seq_puts(m, "\n");
+
+    ec_hashtbl_get_stats(hashTblp, &stats);
+    seq_printf(m, "%20s : %20llu\n", "Lookups", stats.lookups);
+    seq_printf(m, "%20s : %20llu\n", "Hits", stats.hits);
+    seq_printf(m, "%20s : %20llu\n", "Misses", stats.misses);
+    seq_printf(m, "%20s : %20llu\n", "Inserts", stats.inserts);
+    seq_printf(m, "%20s : %20llu\n", "Already Exists", stats.exists);
+    seq_printf(m, "%20s : %20llu\n", "Evictions", stats.evictions);
+    if (hashTblp->reclaimable)
+    {
+        seq_printf(m, "%20s : %20llu\n", "Reclaimed", stats.reclaimed);
+    }
+    seq_printf(m, "%20s : %20llu\n", "Lock Contended", stats.contended);
+    seq_puts(m, "\n");
+
+    seq_printf(m, "%20s : %20s\n", "Sampled Chain", "Lookups");
+    for (i = 0; i < HASHTBL_CHAIN_BINS; ++i)
+    {
+        char range[24];
+
+        if (i == 0)
+        {
+            snprintf(range, sizeof(range), "0");
+        } else if (i == HASHTBL_CHAIN_BINS - 1)
+        {
+            snprintf(range, sizeof(range), "%u+", 1U << (i - 1));
+        } else
+        {
+            snprintf(range, sizeof(range), "%u-%u", 1U << (i - 1), (1U << i) - 1);
+        }
+        seq_printf(m, "%20s : %20llu\n", range, stats.chain[i]);
+    }
     seq_puts(m, "\n");
 
     ec_hastable_bkt_show(hashTblp, (hastable_print_func)seq_printf, m, &context);
@@ -869,10 +1684,20 @@ int __ec_hashtbl_open(struct inode *inode, struct file *file)
     return single_open(file, __ec_hashtbl_show, PDE_DATA(inode));
 }
 
+// Any write resets the statistics of the table
+ssize_t __ec_hashtbl_write(struct file *file, const char __user *buf, size_t size, loff_t *ppos)
+{
+    HashTbl *hashTblp = (HashTbl *)((struct seq_file *)file->private_data)->private;
+
+    ec_hashtbl_reset_stats(hashTblp);
+    return size;
+}
+
 static const struct file_operations ec_fops = {
     .owner      = THIS_MODULE,
     .open       = __ec_hashtbl_open,
     .read       = seq_read,
+    .write      = __ec_hashtbl_write,
     .release    = single_release,
 };
 
@@ -880,7 +1705,7 @@ bool __ec_hashtbl_proc_initialize(HashTbl *hashTblp, ProcessContext *context)
 {
     CANCEL(hashTblp, false);
 
-    if (!proc_create_data(hashTblp->name, 0400, g_cb_hashtbl_proc_dir, &ec_fops, hashTblp))
+    if (!proc_create_data(hashTblp->name, 0600, g_cb_hashtbl_proc_dir, &ec_fops, hashTblp))
     {
         TRACE(DL_ERROR, "Failed to create proc directory entry %s", hashTblp->name);
     }
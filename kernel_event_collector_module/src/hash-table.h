@@ -6,10 +6,15 @@
 
 #include <linux/hash.h>
 #include <linux/list.h>
+#include <linux/list_nulls.h>
+#include <linux/mm.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 
 #include "version.h"
 #include "percpu-util.h"
 #include "mem-cache.h"
+#include "cb-spinlock.h"
 
 #define  ACTION_CONTINUE   0
 #define  ACTION_STOP       1
@@ -33,19 +38,67 @@ typedef void *(*hashtbl_handle_cb)(void *datap, ProcessContext *context);
 typedef void (*hashtbl_printval_cb)(void *datap, ProcessContext *context);
 typedef bool (*hashtbl_find_verify_cb)(void *datap, void *key, ProcessContext *context);
 
-// We need a pointer to the end of the bucket list for the LRU, so use list here instead of hlist
-// since hlist does not provide a pointer to the end (see list.h)
+// Optionally replace how keys are hashed and compared. Without them a table with a
+// 4, 8, 16 or 24 byte key uses built in word sized versions, any other size uses
+// jhash and memcmp.
+typedef u32 (*hashtbl_hash_cb)(const void *key, int key_len, u32 secret);
+typedef bool (*hashtbl_compare_cb)(const void *key, const void *other, int key_len);
+
+// Locks every bucket whose index is the same modulo the number of locks. A resize
+// never takes the table below the number of locks, so an entry keeps its lock
+// while it is moved between buckets.
 typedef struct hashbtl_bkt {
-    uint64_t lock;
-    struct list_head head;
-    uint64_t itemCount;
+    ec_spinlock_t lock;
 } HashTableBkt;
 
+// The lists end in a nulls marker naming the bucket, so a lookup that followed an
+// entry into another bucket during a resize can tell and start over.
+typedef struct hashtbl_list {
+    struct hlist_nulls_head head;
+    uint64_t itemCount;
+} HashTableList;
+
+typedef struct hashtbl_buckets {
+    uint64_t size;
+    uint32_t generation;
+    HashTableList list[];
+} HashTableBuckets;
+
+#define HASHTBL_RESIZE_HISTORY  8
+
+typedef struct hashtbl_resize {
+    uint64_t      from;
+    uint64_t      to;
+    uint64_t      items;
+    unsigned long started;      // jiffies
+    unsigned int  duration_ms;
+} HashTableResize;
+
+// Bin N of the chain histogram counts lists of 2^(N-1) to 2^N - 1 entries, bin 0
+//  empty lists and the last bin everything longer
+#define HASHTBL_CHAIN_BINS      8
+
+// Counted per cpu and summed when read. Every lookup counts as a hit or a miss, the
+//  chain histogram only samples some of them.
+typedef struct hashtbl_stats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t exists;            // ec_hashtbl_add_safe found the key already there
+    uint64_t evictions;
+    uint64_t reclaimed;         // Evicted for the shrinker
+    uint64_t contended;         // A bucket lock was not free on the first try
+    uint64_t chain[HASHTBL_CHAIN_BINS];
+} HashTableStats;
+
 typedef struct hashtbl {
     HashTableBkt *tablePtr;
+    uint64_t   numberOfLocks;
+    HashTableBuckets __rcu *buckets;
     struct list_head   genTables;
     const char *name;
-    uint64_t   numberOfBuckets;
+    uint64_t   numberOfBuckets; // Initial size, then the current size
     uint64_t   datasize;
     uint64_t   lruSize;
     uint32_t   secret;
@@ -58,9 +111,45 @@ typedef struct hashtbl {
     size_t base_size;
     bool debug_logging;
     hashtbl_delete_cb delete_callback; // Delete private data in object
-    hashtbl_handle_cb handle_callback; // Generate a private handle to the object (get ref counts, etc..)
+    hashtbl_handle_cb handle_callback; // Generate a private handle to the object (get ref counts, etc..), called with the bucket locked
     hashtbl_printval_cb printval_callback; // Debug print of object
-    hashtbl_find_verify_cb find_verify_callback; // Verify found object matches extra criteria (called locked without increasing ref)
+    hashtbl_find_verify_cb find_verify_callback; // Verify found object matches extra criteria (called holding a ref, not locked)
+    hashtbl_hash_cb hash_callback; // Hash a key
+    hashtbl_compare_cb compare_callback; // Compare two keys, only called when the hashes match
+    bool word_keys; // Set by ec_hashtbl_init when the built in key functions can be used
+
+    // Opt in to growing and shrinking with the load. The bounds default to
+    //  numberOfBuckets and numberOfBuckets * HASHTBL_RESIZE_RANGE, set a lower
+    //  minBuckets to let the table shrink below its configured size.
+    bool       resizable;
+    uint64_t   minBuckets;
+    uint64_t   maxBuckets;
+
+    // Opt in to a budget for the whole table instead of lruSize per bucket. Adding past
+    //  it evicts with a CLOCK sweep over the buckets, a lookup marks an entry as used
+    //  and the sweep skips it once. The byte budget counts the entries themselves.
+    uint64_t   maxEntries;
+    size_t     maxBytes;
+    uint64_t   entryBudget; // Set by ec_hashtbl_init from the two above
+    uint64_t   clockHand;
+    atomic_t   sweeping;
+
+    // Opt in to giving up cold entries when the system is short of memory. Only for
+    //  tables whose entries can be built again on a miss.
+    bool       reclaimable;
+    bool       shrinkerRegistered;
+    struct shrinker shrinker;
+
+    // Resize state, buckets below rehashIndex have been moved to future
+    HashTableBuckets __rcu *future;
+    uint64_t   rehashIndex;
+    seqcount_t resizeSeq;
+    atomic_t   resizing;
+    struct work_struct resizeWork;
+    uint64_t   resizeCount;
+    HashTableResize resizeHistory[HASHTBL_RESIZE_HISTORY];
+
+    HashTableStats __percpu *stats;
 } HashTbl;
 
 bool ec_hashtbl_startup(ProcessContext *context);
@@ -103,6 +192,11 @@ void ec_hashtbl_clear(HashTbl *tblp, ProcessContext *context);
 void ec_hashtbl_write_for_each(HashTbl *hashTblp, hashtbl_for_each_cb callback, void *priv, ProcessContext *context);
 void ec_hashtbl_read_for_each(HashTbl *hashTblp, hashtbl_for_each_cb callback, void *priv, ProcessContext *context);
 int ec_hashtbl_show_proc_cache(struct seq_file *m, void *v);
+
+// Sums the counters of every cpu into stats, writing to the proc file of the table
+//  also resets them
+void ec_hashtbl_get_stats(HashTbl *hashTblp, HashTableStats *stats);
+void ec_hashtbl_reset_stats(HashTbl *hashTblp);
 size_t ec_hashtbl_get_memory(ProcessContext *context);
 void ec_hashtbl_debug_on(void);
 void ec_hashtbl_debug_off(void);
@@ -175,6 +175,7 @@ bool ec_logger_should_log(CB_EVENT_TYPE eventType)
     case CB_EVENT_TYPE_PROCESS_NOT_BLOCKED:
     case CB_EVENT_TYPE_HEARTBEAT:
     case CB_EVENT_TYPE_WEB_PROXY:
+    case CB_EVENT_TYPE_RATE_LIMIT:
         return true;
 
     default:
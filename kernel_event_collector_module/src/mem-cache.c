@@ -4,6 +4,8 @@
 
 #include "priv.h"
 
+#include <linux/rcupdate.h>
+
 #include "mem-cache.h"
 #include "mem-alloc.h"
 
@@ -15,6 +17,8 @@ static struct
 {
     uint64_t          lock;
     struct list_head  list;
+    struct shrinker   shrinker;
+    bool              shrinker_registered;
 } s_mem_cache;
 
 typedef struct cache_buffer {
@@ -22,14 +26,37 @@ typedef struct cache_buffer {
     struct list_head  list;
     CB_MEM_CACHE *cache;
 
+    // The cpu whose allocation list has this object, -1 when not tracked
+    int cpu;
+
     // This tracks the owners of this object
     atomic64_t refcnt;
     bool is_owned;
+
+    // Defers the free for caches with free_rcu
+    struct rcu_head rcu;
 } cache_buffer_t;
 
 #define CACHE_BUFFER_MAGIC   0xDEADBEEF
 static const size_t CACHE_BUFFER_SZ = sizeof(cache_buffer_t);
 
+// Objects each cpu keeps for the next alloc instead of handing them back to the
+//  kmem cache. Only touched with interrupts off on the cpu that owns it, except
+//  by ec_mem_cache_destroy once nobody uses the cache. A cache keeps at most
+//  CB_MEM_CACHE_MAGAZINE_BYTES per cpu, so page sized objects are not kept at all.
+#define CB_MEM_CACHE_MAGAZINE        16
+#define CB_MEM_CACHE_MAGAZINE_BYTES  4096
+
+struct cb_mem_cache_cpu {
+    uint32_t          count;
+    cache_buffer_t   *objects[CB_MEM_CACHE_MAGAZINE];
+
+    // Allocations made on this cpu while g_enable_mem_cache_tracking is on. An
+    //  object freed on another cpu still takes this lock, but most are not.
+    ec_spinlock_t     lock;
+    struct list_head  allocation_list;
+};
+
 #ifdef MEM_DEBUG
     struct list_head mem_debug_list = LIST_HEAD_INIT(mem_debug_list);
 
@@ -48,16 +75,26 @@ static inline cache_buffer_t *__ec_get_bufferp(const void *value)
 // Get the size of this string, and subtract the `\0`
 #define MEM_CACHE_PREFIX_LEN   (sizeof(MEM_CACHE_PREFIX) - 1)
 
+static void __ec_mem_cache_shrinker_register(void);
+
 bool ec_mem_cache_init(ProcessContext *context)
 {
     INIT_LIST_HEAD(&s_mem_cache.list);
     // ec_spinlock_init calls ec_mem_alloc, all initialization needs to happen before this call
     ec_spinlock_init(&s_mem_cache.lock, context);
+    __ec_mem_cache_shrinker_register();
     return true;
 }
 
 void ec_mem_cache_shutdown(ProcessContext *context)
 {
+    // Waits for a shrink that is running
+    if (s_mem_cache.shrinker_registered)
+    {
+        unregister_shrinker(&s_mem_cache.shrinker);
+        s_mem_cache.shrinker_registered = false;
+    }
+
     // cp_spinlock_destroy calls ec_mem_free, this must be called before other shutdown
     ec_spinlock_destroy(&s_mem_cache.lock, context);
 
@@ -68,12 +105,14 @@ bool ec_mem_cache_create(CB_MEM_CACHE *cache, const char *name, size_t size, Pro
 {
     if (cache)
     {
+        int cpu;
+
         cache->object_size = size;
+        cache->magazine_size = min_t(size_t, CB_MEM_CACHE_MAGAZINE, CB_MEM_CACHE_MAGAZINE_BYTES / (size + CACHE_BUFFER_SZ));
         // prefix the cache name with a unique prefix to avoid conflicts with cbr
         cache->name[0] = 0;
         strncat(cache->name, MEM_CACHE_PREFIX, CB_MEM_CACHE_NAME_LEN);
         strncat(cache->name, name, CB_MEM_CACHE_NAME_LEN - MEM_CACHE_PREFIX_LEN);
-        INIT_LIST_HEAD(&cache->allocation_list);
 
         cache->kmem_cache = kmem_cache_create(
             cache->name,
@@ -82,27 +121,259 @@ bool ec_mem_cache_create(CB_MEM_CACHE *cache, const char *name, size_t size, Pro
             SLAB_HWCACHE_ALIGN,
             NULL);
         ec_percpu_counter_init(&cache->allocated_count, 0, GFP_MODE(context));
+        atomic64_set(&cache->reclaimed, 0);
 
+        cache->cpu_cache = ec_alloc_percpu(struct cb_mem_cache_cpu, GFP_MODE(context));
+        if (unlikely(!cache->cpu_cache) && cache->kmem_cache)
+        {
+            kmem_cache_destroy(cache->kmem_cache);
+            cache->kmem_cache = NULL;
+        }
 
         if (likely(cache->kmem_cache))
         {
-            ec_spinlock_init(&cache->lock, context);
+            for_each_possible_cpu(cpu)
+            {
+                struct cb_mem_cache_cpu *cpu_cache = per_cpu_ptr(cache->cpu_cache, cpu);
+
+                cpu_cache->count = 0;
+                ec_spinlock_inline_init(&cpu_cache->lock, context);
+                INIT_LIST_HEAD(&cpu_cache->allocation_list);
+            }
+
             ec_write_lock(&s_mem_cache.lock, context);
             list_add(&cache->node, &s_mem_cache.list);
             ec_write_unlock(&s_mem_cache.lock, context);
 
             return true;
         }
+        percpu_counter_destroy(&cache->allocated_count);
     }
     return false;
 }
 
+// Keeps the object for the next alloc on this cpu, returns false if there is no room
+static bool __ec_mem_cache_magazine_push(CB_MEM_CACHE *cache, cache_buffer_t *cache_buffer)
+{
+    struct cb_mem_cache_cpu *cpu_cache;
+    unsigned long            flags;
+    bool                     pushed = false;
+
+    // A stale pointer to a free object should fail the magic check
+    cache_buffer->magic = 0;
+
+    local_irq_save(flags);
+    cpu_cache = this_cpu_ptr(cache->cpu_cache);
+    if (cpu_cache->count < cache->magazine_size)
+    {
+        cpu_cache->objects[cpu_cache->count++] = cache_buffer;
+        pushed = true;
+    }
+    local_irq_restore(flags);
+
+    return pushed;
+}
+
+static cache_buffer_t *__ec_mem_cache_magazine_pop(CB_MEM_CACHE *cache)
+{
+    struct cb_mem_cache_cpu *cpu_cache;
+    cache_buffer_t          *cache_buffer = NULL;
+    unsigned long            flags;
+
+    local_irq_save(flags);
+    cpu_cache = this_cpu_ptr(cache->cpu_cache);
+    if (cpu_cache->count)
+    {
+        cache_buffer = cpu_cache->objects[--cpu_cache->count];
+    }
+    local_irq_restore(flags);
+
+    return cache_buffer;
+}
+
+static void __ec_mem_cache_magazine_drain(CB_MEM_CACHE *cache, struct cb_mem_cache_cpu *cpu_cache)
+{
+    while (cpu_cache->count)
+    {
+        kmem_cache_free(cache->kmem_cache, (void *)cpu_cache->objects[--cpu_cache->count]);
+    }
+}
+
+// Runs on every cpu with interrupts off
+static void __ec_mem_cache_drain_local(void *info)
+{
+    CB_MEM_CACHE *cache = info;
+
+    __ec_mem_cache_magazine_drain(cache, this_cpu_ptr(cache->cpu_cache));
+}
+
+void ec_mem_cache_drain(CB_MEM_CACHE *cache, ProcessContext *context)
+{
+    CANCEL_VOID(cache && cache->kmem_cache);
+
+    on_each_cpu(__ec_mem_cache_drain_local, cache, 1);
+}
+
+int64_t ec_mem_cache_get_cached_count(CB_MEM_CACHE *cache, ProcessContext *context)
+{
+    int64_t cached = 0;
+    int     cpu;
+
+    CANCEL(cache && cache->cpu_cache, 0);
+
+    // Racy, the other cpus keep changing their magazines
+    for_each_possible_cpu(cpu)
+    {
+        cached += READ_ONCE(per_cpu_ptr(cache->cpu_cache, cpu)->count);
+    }
+
+    return cached;
+}
+
+// Memory pressure empties the magazines of every cache. The lock is taken on each
+//  cpu instead of around on_each_cpu, which can not wait with interrupts off.
+static void __ec_mem_cache_drain_all_local(void *info)
+{
+    CB_MEM_CACHE *cache;
+
+    DECLARE_ATOMIC_CONTEXT(context, 0);
+
+    ec_write_lock(&s_mem_cache.lock, &context);
+    list_for_each_entry(cache, &s_mem_cache.list, node)
+    {
+        __ec_mem_cache_magazine_drain(cache, this_cpu_ptr(cache->cpu_cache));
+    }
+    ec_write_unlock(&s_mem_cache.lock, &context);
+}
+
+static unsigned long __ec_mem_cache_shrink_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    CB_MEM_CACHE *cache;
+    unsigned long cached = 0;
+
+    DECLARE_ATOMIC_CONTEXT(context, ec_getpid(current));
+
+    ec_write_lock(&s_mem_cache.lock, &context);
+    list_for_each_entry(cache, &s_mem_cache.list, node)
+    {
+        cached += ec_mem_cache_get_cached_count(cache, &context);
+    }
+    ec_write_unlock(&s_mem_cache.lock, &context);
+
+    return cached;
+}
+
+static unsigned long __ec_mem_cache_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    unsigned long cached = __ec_mem_cache_shrink_count(shrinker, sc);
+
+    if (!cached)
+    {
+        return SHRINK_STOP;
+    }
+
+    on_each_cpu(__ec_mem_cache_drain_all_local, NULL, 1);
+    return cached;
+}
+
+#ifndef EC_SHRINKER_COUNT_SCAN
+// Older kernels ask for the count and the scan through one callback
+static int __ec_mem_cache_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    if (sc->nr_to_scan)
+    {
+        __ec_mem_cache_shrink_scan(shrinker, sc);
+    }
+
+    return __ec_mem_cache_shrink_count(shrinker, sc);
+}
+#endif
+
+static void __ec_mem_cache_shrinker_register(void)
+{
+    memset(&s_mem_cache.shrinker, 0, sizeof(s_mem_cache.shrinker));
+#ifdef EC_SHRINKER_COUNT_SCAN
+    s_mem_cache.shrinker.count_objects = __ec_mem_cache_shrink_count;
+    s_mem_cache.shrinker.scan_objects  = __ec_mem_cache_shrink_scan;
+#else
+    s_mem_cache.shrinker.shrink        = __ec_mem_cache_shrink;
+#endif
+    s_mem_cache.shrinker.seeks         = DEFAULT_SEEKS;
+
+    // The caches work without it, only unregister what was registered
+#ifdef EC_SHRINKER_COUNT_SCAN
+    s_mem_cache.shrinker_registered = register_shrinker(&s_mem_cache.shrinker) == 0;
+    if (!s_mem_cache.shrinker_registered)
+    {
+        TRACE(DL_WARNING, "%s: failed to register shrinker", __func__);
+    }
+#else
+    register_shrinker(&s_mem_cache.shrinker);
+    s_mem_cache.shrinker_registered = true;
+#endif
+}
+
+void ec_mem_cache_add_reclaimed(CB_MEM_CACHE *cache, uint64_t count)
+{
+    if (cache && count)
+    {
+        atomic64_add(count, &cache->reclaimed);
+    }
+}
+
+static void __ec_mem_cache_free_buffer(CB_MEM_CACHE *cache, cache_buffer_t *cache_buffer)
+{
+    if (!__ec_mem_cache_magazine_push(cache, cache_buffer))
+    {
+        kmem_cache_free(cache->kmem_cache, (void *)cache_buffer);
+    }
+}
+
+static void __ec_mem_cache_track(CB_MEM_CACHE *cache, cache_buffer_t *cache_buffer, ProcessContext *context)
+{
+    struct cb_mem_cache_cpu *cpu_cache;
+
+    // Any list will do, this one is just the least likely to be contended
+    cache_buffer->cpu = raw_smp_processor_id();
+    cpu_cache = per_cpu_ptr(cache->cpu_cache, cache_buffer->cpu);
+
+    ec_write_lock_inline(&cpu_cache->lock, context);
+    list_add(&cache_buffer->list, &cpu_cache->allocation_list);
+    ec_write_unlock_inline(&cpu_cache->lock, context);
+}
+
+// Tracking may have been turned on or off since the object was allocated
+static void __ec_mem_cache_untrack(CB_MEM_CACHE *cache, cache_buffer_t *cache_buffer, ProcessContext *context)
+{
+    struct cb_mem_cache_cpu *cpu_cache;
+
+    if (cache_buffer->cpu < 0)
+    {
+        return;
+    }
+
+    cpu_cache = per_cpu_ptr(cache->cpu_cache, cache_buffer->cpu);
+
+    ec_write_lock_inline(&cpu_cache->lock, context);
+    list_del_init(&cache_buffer->list);
+    ec_write_unlock_inline(&cpu_cache->lock, context);
+    cache_buffer->cpu = -1;
+}
+
 uint64_t ec_mem_cache_destroy(CB_MEM_CACHE *cache, ProcessContext *context)
 {
     uint64_t allocated_count = 0;
 
     if (likely(cache && cache->kmem_cache))
     {
+        int cpu;
+
+        // Let the deferred frees finish so they are not counted as leaks
+        if (cache->free_rcu)
+        {
+            rcu_barrier();
+        }
+
         // cache->node only needs to be deleted from the list if cache->kmem_cache was allocated
         // otherwise it was never added to s_mem_cache.list and may have invalid next and prev pointers
         ec_write_lock(&s_mem_cache.lock, context);
@@ -115,13 +386,14 @@ uint64_t ec_mem_cache_destroy(CB_MEM_CACHE *cache, ProcessContext *context)
             TRACE(DL_ERROR, "Destroying Memory Cache (%s) with %lld allocated items.",
                    cache->name, (unsigned long long)allocated_count);
 
-            if (g_enable_mem_cache_tracking)
+            for_each_possible_cpu(cpu)
             {
+                struct cb_mem_cache_cpu *cpu_cache = per_cpu_ptr(cache->cpu_cache, cpu);
                 struct cache_buffer *cache_buffer = NULL;
                 void *value = NULL;
 
-                ec_write_lock(&cache->lock, context);
-                list_for_each_entry(cache_buffer, &cache->allocation_list, list)
+                ec_write_lock_inline(&cpu_cache->lock, context);
+                list_for_each_entry(cache_buffer, &cpu_cache->allocation_list, list)
                 {
                     if (likely(cache_buffer))
                     {
@@ -136,13 +408,22 @@ uint64_t ec_mem_cache_destroy(CB_MEM_CACHE *cache, ProcessContext *context)
                         }
                     }
                 }
-                ec_write_unlock(&cache->lock, context);
-
+                ec_write_unlock_inline(&cpu_cache->lock, context);
             }
         }
 
+        // Nothing can be using the cache now, so the other cpus are left alone
+        for_each_possible_cpu(cpu)
+        {
+            struct cb_mem_cache_cpu *cpu_cache = per_cpu_ptr(cache->cpu_cache, cpu);
+
+            __ec_mem_cache_magazine_drain(cache, cpu_cache);
+            ec_spinlock_inline_destroy(&cpu_cache->lock, context);
+        }
+        free_percpu(cache->cpu_cache);
+        cache->cpu_cache = NULL;
+
         percpu_counter_destroy(&cache->allocated_count);
-        ec_spinlock_destroy(&cache->lock, context);
 
         kmem_cache_destroy(cache->kmem_cache);
         cache->kmem_cache = NULL;
@@ -171,7 +452,11 @@ void *ec_mem_cache_alloc(CB_MEM_CACHE *cache, ProcessContext *context)
 
     if (likely(cache && cache->kmem_cache))
     {
-        value = kmem_cache_alloc(cache->kmem_cache, CHECK_GFP(context));
+        value = __ec_mem_cache_magazine_pop(cache);
+        if (!value)
+        {
+            value = kmem_cache_alloc(cache->kmem_cache, CHECK_GFP(context));
+        }
         if (value)
         {
             cache_buffer_t *cache_buffer = (cache_buffer_t *)value;
@@ -183,12 +468,11 @@ void *ec_mem_cache_alloc(CB_MEM_CACHE *cache, ProcessContext *context)
             atomic64_set(&cache_buffer->refcnt, 1);
 
             cache_buffer->cache = cache;
+            cache_buffer->cpu   = -1;
             percpu_counter_inc(&cache->allocated_count);
             if (g_enable_mem_cache_tracking)
             {
-                ec_write_lock(&cache->lock, context);
-                list_add(&cache_buffer->list, &cache->allocation_list);
-                ec_write_unlock(&cache->lock, context);
+                __ec_mem_cache_track(cache, cache_buffer, context);
             }
 
             value = __ec_get_valuep(cache_buffer);
@@ -229,6 +513,15 @@ bool ec_mem_cache_is_owned(void *value, ProcessContext *context)
     return false;
 }
 
+static void __ec_mem_cache_free_rcu(struct rcu_head *rcu)
+{
+    cache_buffer_t *cache_buffer = container_of(rcu, cache_buffer_t, rcu);
+    CB_MEM_CACHE   *cache        = cache_buffer->cache;
+
+    __ec_mem_cache_free_buffer(cache, cache_buffer);
+    percpu_counter_dec(&cache->allocated_count);
+}
+
 void __ec_mem_cache_release(cache_buffer_t *cache_buffer, ProcessContext *context)
 {
     if (likely(cache_buffer && cache_buffer->cache))
@@ -244,16 +537,17 @@ void __ec_mem_cache_release(cache_buffer_t *cache_buffer, ProcessContext *contex
                 cache->delete_callback(value, context);
             }
 
-            if (g_enable_mem_cache_tracking)
-            {
-                ec_write_lock(&cache->lock, context);
-                list_del_init(&cache_buffer->list);
-                ec_write_unlock(&cache->lock, context);
-            }
+            __ec_mem_cache_untrack(cache, cache_buffer, context);
 
             if (likely(cache_buffer->cache->kmem_cache))
             {
-                kmem_cache_free(cache->kmem_cache, (void *)cache_buffer);
+                if (cache->free_rcu)
+                {
+                    // Readers may still be looking at it, __ec_mem_cache_free_rcu does the count
+                    call_rcu(&cache_buffer->rcu, __ec_mem_cache_free_rcu);
+                    return;
+                }
+                __ec_mem_cache_free_buffer(cache, cache_buffer);
             } else
             {
                     TRACE(DL_ERROR, "Cache %s already destroyed.  Failed to free memory: %p",
@@ -287,6 +581,25 @@ void ec_mem_cache_get(void *value, ProcessContext *context)
     }
 }
 
+bool ec_mem_cache_get_unless_zero(void *value, ProcessContext *context)
+{
+    if (value)
+    {
+        cache_buffer_t *cache_buffer = __ec_get_bufferp(value);
+
+        if (likely(cache_buffer->magic == CACHE_BUFFER_MAGIC))
+        {
+            return atomic64_inc_not_zero(&cache_buffer->refcnt);
+        } else
+        {
+            TRACE(DL_ERROR, "%s: Cache entry magic does not match.  Failed to get memory: %p %x", __func__, value, cache_buffer->magic);
+            CB_BUG();
+        }
+    }
+
+    return false;
+}
+
 void ec_mem_cache_put(void *value, ProcessContext *context)
 {
     if (value)
@@ -365,18 +678,21 @@ int ec_mem_cache_show(struct seq_file *m, void *v)
 
     DECLARE_NON_ATOMIC_CONTEXT(context, ec_getpid(current));
 
-    seq_printf(m, "%40s | %6s | %40s | %9s |\n",
-                  "Name", "Alloc", "Cache Name", "Obj. Size");
+    seq_printf(m, "%40s | %6s | %6s | %9s | %40s | %9s |\n",
+                  "Name", "Alloc", "Cached", "Reclaimed", "Cache Name", "Obj. Size");
 
     ec_write_lock(&s_mem_cache.lock, &context);
     list_for_each_entry(cache, &s_mem_cache.list, node) {
             const char *cache_name = cache->kmem_cache ? cache->kmem_cache->name : "";
             int         cache_size = cache->object_size;
             long        count      = percpu_counter_sum_positive(&cache->allocated_count);
+            long        cached     = ec_mem_cache_get_cached_count(cache, &context);
 
-            seq_printf(m, "%40s | %6ld | %40s | %9d |\n",
+            seq_printf(m, "%40s | %6ld | %6ld | %9lld | %40s | %9d |\n",
                        cache->name,
                        count,
+                       cached,
+                       (long long)atomic64_read(&cache->reclaimed),
                        cache_name,
                        cache_size);
             size += count * cache_size;
@@ -5,26 +5,49 @@
 #pragma once
 
 #include <linux/list.h>
+#include <linux/mm.h>
 #include <linux/seq_file.h>
 
+#include "version.h"
 #include "process-context.h"
 #include "percpu-util.h"
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) || RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7, 0)
+#define EC_SHRINKER_COUNT_SCAN
+#endif
+
+#ifndef SHRINK_STOP
+#define SHRINK_STOP            (~0UL)
+#endif
+
 #define CB_MEM_CACHE_NAME_LEN    43
 
 typedef void (*cache_delete_cb)(void *value, ProcessContext *context);
 typedef void (*cache_printval_cb)(void *value, ProcessContext *context);
 
+struct cb_mem_cache_cpu;
+
 typedef struct CB_MEM_CACHE {
     struct list_head   node;
-    struct list_head   allocation_list;
-    uint64_t           lock;
     struct percpu_counter allocated_count;
+
+    // Recently freed objects and the tracked allocations, kept per cpu
+    struct cb_mem_cache_cpu __percpu *cpu_cache;
+
+    // Objects the owner gave up under memory pressure
+    atomic64_t         reclaimed;
     struct kmem_cache *kmem_cache;
     uint32_t           object_size;
+
+    // How many freed objects each cpu keeps, fewer for larger objects
+    uint32_t           magazine_size;
     uint8_t            name[CB_MEM_CACHE_NAME_LEN + 1];
     cache_delete_cb    delete_callback;
     cache_printval_cb  printval_callback;
+
+    // Objects are only freed after an RCU grace period, set before ec_mem_cache_create.
+    //  Lets readers walk lists of objects under rcu_read_lock.
+    bool               free_rcu;
 } CB_MEM_CACHE;
 
 // checkpatch-ignore: COMPLEX_MACRO
@@ -47,6 +70,18 @@ void *ec_mem_cache_alloc(CB_MEM_CACHE *cache, ProcessContext *context);
 void ec_mem_cache_disown(void *value, ProcessContext *context);
 bool ec_mem_cache_is_owned(void *value, ProcessContext *context);
 void ec_mem_cache_get(void *value, ProcessContext *context);
+
+// Takes a reference unless the last one is already gone. Only useful with free_rcu,
+//  where an object may still be seen under rcu_read_lock while it is being freed.
+bool ec_mem_cache_get_unless_zero(void *value, ProcessContext *context);
 void ec_mem_cache_put(void *value, ProcessContext *context);
 int64_t ec_mem_cache_ref_count(void *value, ProcessContext *context);
 int64_t ec_mem_cache_get_allocated_count(CB_MEM_CACHE *cache, ProcessContext *context);
+
+// Returns the recently freed objects every cpu keeps to the kmem cache. A shrinker
+//  does the same for every cache when the system is short of memory.
+void ec_mem_cache_drain(CB_MEM_CACHE *cache, ProcessContext *context);
+int64_t ec_mem_cache_get_cached_count(CB_MEM_CACHE *cache, ProcessContext *context);
+
+// Counts objects the owner freed for a shrinker, shown by ec_mem_cache_show
+void ec_mem_cache_add_reclaimed(CB_MEM_CACHE *cache, uint64_t count);
@@ -53,6 +53,7 @@ static HashTbl __read_mostly s_net_hash_table = {
     .key_len     = sizeof(NET_TBL_KEY),
     .key_offset  = offsetof(NET_TBL_NODE, key),
     .lruSize = NET_LRU_SIZE,
+    .reclaimable = true,
 };
 
 
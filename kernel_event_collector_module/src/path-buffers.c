@@ -2,6 +2,7 @@
 // Copyright (c) 2019-2020 VMware, Inc. All rights reserved.
 // Copyright (c) 2016-2019 Carbon Black, Inc. All rights reserved.
 
+#include "priv.h"
 #include "path-buffers.h"
 #include "mem-cache.h"
 #include "mem-alloc.h"
@@ -9,30 +10,141 @@
 #include "task-helper.h"
 
 #include <linux/limits.h>
+#include <linux/percpu.h>
 
 struct STRING_NODE {
     struct list_head  listEntry;
     char  path[PATH_MAX+1];
 };
 
+// Buffers each cpu keeps ready so a hook does not go to the slab, or fail under
+//  memory pressure. Deep enough for a hook interrupted by another one.
+#define PATH_BUFFERS_PER_CPU  4
+
+struct path_buffer_stack {
+    int                 count;
+    struct STRING_NODE *nodes[PATH_BUFFERS_PER_CPU];
+    uint64_t            fallbacks;  // The stack was empty and the slab was used
+    uint64_t            failures;   // The slab had nothing either
+};
+
 static CB_MEM_CACHE s_string_pool;
+static struct path_buffer_stack __percpu *s_path_stacks;
+
+static struct STRING_NODE *__ec_path_buffer_pop(void)
+{
+    struct path_buffer_stack *stack;
+    struct STRING_NODE       *node = NULL;
+    unsigned long             flags;
+
+    local_irq_save(flags);
+    stack = this_cpu_ptr(s_path_stacks);
+    if (stack->count)
+    {
+        node = stack->nodes[--stack->count];
+    }
+    local_irq_restore(flags);
+
+    return node;
+}
+
+// Any buffer from the pool can go on any stack, returns false when it is full
+static bool __ec_path_buffer_push(struct STRING_NODE *node)
+{
+    struct path_buffer_stack *stack;
+    unsigned long             flags;
+    bool                      pushed = false;
+
+    local_irq_save(flags);
+    stack = this_cpu_ptr(s_path_stacks);
+    if (stack->count < PATH_BUFFERS_PER_CPU)
+    {
+        stack->nodes[stack->count++] = node;
+        pushed = true;
+    }
+    local_irq_restore(flags);
+
+    return pushed;
+}
+
+static void __ec_path_buffers_release(ProcessContext *context)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct path_buffer_stack *stack = per_cpu_ptr(s_path_stacks, cpu);
+
+        while (stack->count)
+        {
+            ec_mem_cache_disown(stack->nodes[--stack->count], context);
+        }
+    }
+}
 
 bool ec_path_buffers_init(ProcessContext *context)
 {
-    return ec_mem_cache_create(&s_string_pool, "path_string_pool", sizeof(struct STRING_NODE), context);
+    int cpu;
+
+    TRY(ec_mem_cache_create(&s_string_pool, "path_string_pool", sizeof(struct STRING_NODE), context));
+
+    s_path_stacks = ec_alloc_percpu(struct path_buffer_stack, GFP_MODE(context));
+    TRY_MSG(s_path_stacks, DL_ERROR, "%s: Failed to allocate path buffer stacks", __func__);
+
+    for_each_possible_cpu(cpu)
+    {
+        struct path_buffer_stack *stack = per_cpu_ptr(s_path_stacks, cpu);
+
+        memset(stack, 0, sizeof(*stack));
+        while (stack->count < PATH_BUFFERS_PER_CPU)
+        {
+            struct STRING_NODE *node = ec_mem_cache_alloc(&s_string_pool, context);
+
+            TRY_MSG(node, DL_ERROR, "%s: Failed to preallocate path buffers", __func__);
+            stack->nodes[stack->count++] = node;
+        }
+    }
+
+    return true;
+
+CATCH_DEFAULT:
+    if (s_path_stacks)
+    {
+        __ec_path_buffers_release(context);
+        free_percpu(s_path_stacks);
+        s_path_stacks = NULL;
+    }
+    ec_mem_cache_destroy(&s_string_pool, context);
+    return false;
 }
 
 void ec_path_buffers_shutdown(ProcessContext *context)
 {
+    if (s_path_stacks)
+    {
+        __ec_path_buffers_release(context);
+        free_percpu(s_path_stacks);
+        s_path_stacks = NULL;
+    }
     ec_mem_cache_destroy(&s_string_pool, context);
 }
 
-// Get a string buffer from the list, or alloc a new one.
+// Get a string buffer from this cpu, or alloc a new one.
 char *ec_get_path_buffer(ProcessContext *context)
 {
     struct STRING_NODE *node   = NULL;
 
-    node = (struct STRING_NODE *)ec_mem_cache_alloc(&s_string_pool, context);
+    node = __ec_path_buffer_pop();
+    if (!node)
+    {
+        this_cpu_inc(s_path_stacks->fallbacks);
+        node = (struct STRING_NODE *)ec_mem_cache_alloc(&s_string_pool, context);
+        if (!node)
+        {
+            this_cpu_inc(s_path_stacks->failures);
+        }
+    }
+
     if (node)
     {
         node->path[0]        = 0;
@@ -54,6 +166,49 @@ void ec_put_path_buffer(char *buffer)
 
     if (buffer)
     {
-        ec_mem_cache_disown(container_of((void *)buffer, struct STRING_NODE, path), &context);
+        struct STRING_NODE *node = container_of((void *)buffer, struct STRING_NODE, path);
+
+        if (!__ec_path_buffer_push(node))
+        {
+            ec_mem_cache_disown(node, &context);
+        }
     }
 }
+
+void ec_path_buffers_get_stats(uint64_t *fallbacks, uint64_t *failures)
+{
+    int cpu;
+
+    *fallbacks = 0;
+    *failures  = 0;
+    for_each_possible_cpu(cpu)
+    {
+        struct path_buffer_stack *stack = per_cpu_ptr(s_path_stacks, cpu);
+
+        *fallbacks += stack->fallbacks;
+        *failures  += stack->failures;
+    }
+}
+
+int ec_path_buffers_show(struct seq_file *m, void *v)
+{
+    uint64_t fallbacks;
+    uint64_t failures;
+    int      ready = 0;
+    int      cpu;
+
+    ec_path_buffers_get_stats(&fallbacks, &failures);
+
+    // Racy, the other cpus keep taking and returning buffers
+    for_each_possible_cpu(cpu)
+    {
+        ready += READ_ONCE(per_cpu_ptr(s_path_stacks, cpu)->count);
+    }
+
+    seq_printf(m, "%20s : %20d\n", "Per CPU", PATH_BUFFERS_PER_CPU);
+    seq_printf(m, "%20s : %20d\n", "Ready", ready);
+    seq_printf(m, "%20s : %20llu\n", "Fallbacks", fallbacks);
+    seq_printf(m, "%20s : %20llu\n", "Failures", failures);
+
+    return 0;
+}
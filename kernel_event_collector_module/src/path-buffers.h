@@ -9,5 +9,11 @@
 
 bool ec_path_buffers_init(ProcessContext *context);
 void ec_path_buffers_shutdown(ProcessContext *context);
+
+// Buffers come from a small stack each cpu keeps, or the slab once it is empty,
+//  and can be taken in atomic context
 char *ec_get_path_buffer(ProcessContext *context);
 void ec_put_path_buffer(char *buffer);
+
+// Counts of gets that found the stack empty and of gets that failed
+void ec_path_buffers_get_stats(uint64_t *fallbacks, uint64_t *failures);
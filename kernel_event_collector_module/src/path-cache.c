@@ -9,6 +9,9 @@
 #include "cb-test.h"
 #include "priv.h"
 #include "mem-alloc.h"
+#include "percpu-util.h"
+
+#include <linux/jhash.h>
 
 uint32_t g_file_path_buckets = 65536;
 bool g_enable_path_cache;
@@ -18,6 +21,8 @@ int __ec_path_cache_print(HashTbl *hashTblp, void *datap, void *priv, ProcessCon
 void __ec_path_cache_print_callback(void *datap, ProcessContext *context);
 bool __ec_path_cache_verify_callback(void *datap, void *key, ProcessContext *context);
 void __ec_path_cache_print_ref(int log_level, const char *calling_func, PathData *path_data, ProcessContext *context);
+void __ec_path_string_delete_callback(void *data, ProcessContext *context);
+bool __ec_path_string_verify_callback(void *datap, void *key, ProcessContext *context);
 
 static HashTbl __read_mostly s_path_cache = {
     .name = "file_path_cache",
@@ -30,6 +35,37 @@ static HashTbl __read_mostly s_path_cache = {
     .lruSize = 8,
 };
 
+// Identical path strings are kept once. An entry holds a reference to the shared
+//  copy and counts the paths using it, it is removed when the last one is put.
+typedef struct path_string_key {
+    uint32_t            hash;
+    uint32_t            len;
+} PathStringKey;
+
+typedef struct path_string {
+    PathStringKey       key;
+    char               *path;
+    atomic_t            users;
+} PathString;
+
+typedef struct path_string_query {
+    PathStringKey       key;
+    const char         *path;
+} PathStringQuery;
+
+static HashTbl __read_mostly s_path_strings = {
+    .name = "path_string_table",
+    .datasize = sizeof(PathString),
+    .key_len     = sizeof(PathStringKey),
+    .key_offset  = offsetof(PathString, key),
+    .delete_callback = __ec_path_string_delete_callback,
+    .find_verify_callback = __ec_path_string_verify_callback,
+    .resizable = true,
+};
+
+// Bytes of path copies that were dropped for a shared one
+static struct percpu_counter s_path_bytes_shared;
+
 bool ec_path_cache_init(ProcessContext *context)
 {
     if (!g_enable_path_cache)
@@ -39,15 +75,144 @@ bool ec_path_cache_init(ProcessContext *context)
     } else
     {
         s_path_cache.numberOfBuckets = g_file_path_buckets;
+        s_path_cache.resizable = true;
+
+        // Same capacity as the per bucket LRU, but paths are evicted by use across
+        //  the whole cache rather than by which bucket they hash to
+        s_path_cache.lruSize = 0;
+        s_path_cache.maxEntries = (uint64_t)g_file_path_buckets * 8;
+        s_path_cache.reclaimable = true;
         TRACE(DL_INIT, "Path cache is enabled");
     }
 
-    return ec_hashtbl_init(&s_path_cache, context);
+    s_path_strings.numberOfBuckets = max(g_file_path_buckets / 8, 1U);
+
+    TRY(!ec_percpu_counter_init(&s_path_bytes_shared, 0, GFP_MODE(context)));
+    TRY_DO(ec_hashtbl_init(&s_path_strings, context), {
+        percpu_counter_destroy(&s_path_bytes_shared);
+    });
+    TRY_DO(ec_hashtbl_init(&s_path_cache, context), {
+        ec_hashtbl_destroy(&s_path_strings, context);
+        percpu_counter_destroy(&s_path_bytes_shared);
+    });
+
+    return true;
+
+CATCH_DEFAULT:
+    return false;
 }
 
 void ec_path_cache_shutdown(ProcessContext *context)
 {
     ec_hashtbl_destroy(&s_path_cache, context);
+    ec_hashtbl_destroy(&s_path_strings, context);
+    percpu_counter_destroy(&s_path_bytes_shared);
+}
+
+static void __ec_path_string_query(PathStringQuery *query, const char *path)
+{
+    query->path     = path;
+    query->key.len  = strnlen(path, ec_mem_size(path));
+    query->key.hash = jhash(path, query->key.len, 0);
+}
+
+// Returns a reference to the shared copy of path, which is path itself the first time
+//  it is seen. The reference the caller has to path is left alone.
+char *ec_path_intern(char *path, ProcessContext *context)
+{
+    PathStringQuery  query;
+    PathString      *entry;
+    char            *shared = NULL;
+
+    CANCEL(path, NULL);
+
+    __ec_path_string_query(&query, path);
+
+    entry = ec_hashtbl_find(&s_path_strings, &query.key, context);
+    if (entry)
+    {
+        // No users means the entry is on its way out, keep this copy instead
+        if (atomic_inc_not_zero(&entry->users))
+        {
+            shared = ec_mem_get(entry->path, context);
+        }
+        ec_hashtbl_put(&s_path_strings, entry, context);
+
+        if (shared && shared != path)
+        {
+            percpu_counter_add(&s_path_bytes_shared, ec_mem_size(path));
+        }
+        return shared ? shared : ec_mem_get(path, context);
+    }
+
+    entry = ec_hashtbl_alloc(&s_path_strings, context);
+    if (entry)
+    {
+        entry->key  = query.key;
+        entry->path = ec_mem_get(path, context);
+        atomic_set(&entry->users, 1);
+
+        // Another cpu added the same string first, or a different one has the same key.
+        //  Either way this copy is not shared.
+        if (ec_hashtbl_add_safe(&s_path_strings, entry, context) < 0)
+        {
+            ec_hashtbl_free(&s_path_strings, entry, context);
+        }
+    }
+
+    return ec_mem_get(path, context);
+}
+
+// Drops a reference returned by ec_path_intern. The string leaves the table with its
+//  last user, only the paths themselves keep it alive.
+void ec_path_intern_put(char *path, ProcessContext *context)
+{
+    PathStringQuery  query;
+    PathString      *entry;
+
+    CANCEL_VOID(path);
+
+    __ec_path_string_query(&query, path);
+
+    entry = ec_hashtbl_find(&s_path_strings, &query.key, context);
+    if (entry)
+    {
+        // Copies that were not shared are not counted
+        if (entry->path == path && atomic_dec_and_test(&entry->users))
+        {
+            ec_hashtbl_del(&s_path_strings, entry, context);
+        }
+        ec_hashtbl_put(&s_path_strings, entry, context);
+    }
+
+    ec_mem_put(path);
+}
+
+bool __ec_path_string_verify_callback(void *datap, void *keyp, ProcessContext *context)
+{
+    PathString *entry = (PathString *)datap;
+    PathStringQuery *verify = container_of(keyp, PathStringQuery, key);
+
+    CANCEL(likely(datap && keyp), false);
+
+    return memcmp(entry->path, verify->path, verify->key.len) == 0;
+}
+
+void __ec_path_string_delete_callback(void *data, ProcessContext *context)
+{
+    if (data)
+    {
+        PathString *entry = (PathString *)data;
+
+        ec_mem_put(entry->path);
+        entry->path = NULL;
+    }
+}
+
+void ec_path_intern_get_stats(uint64_t *strings, uint64_t *bytes_shared, ProcessContext *context)
+{
+    *strings      = ec_hashtbl_get_count(&s_path_strings, context);
+    *bytes_shared = percpu_counter_sum_positive(&s_path_bytes_shared);
 }
 
 PathData *ec_path_cache_find(
@@ -105,7 +270,7 @@ PathData *ec_path_cache_add(
     value->key.ns_id = ns_id;
     value->key.device = device;
     value->key.inode = inode;
-    value->path = ec_mem_get(path, context);
+    value->path = ec_path_intern(path, context);
     value->path_found = !!path; // It is possible that the path will be NULL now but set later
     value->file_id = ec_get_current_time(); // Use this as a unique ID
     value->is_special_file = ec_is_special_file(value->path, ec_mem_size(value->path));
@@ -171,7 +336,7 @@ void __ec_path_cache_delete_callback(void *data, ProcessContext *context)
         PathData *value = (PathData *)data;
 
         __ec_path_cache_print_ref(DL_FILE, __func__, value, context);
-        ec_mem_put(value->path);
+        ec_path_intern_put(value->path, context);
         value->path = NULL;
     }
 }
@@ -185,6 +350,24 @@ int ec_path_cache_show(struct seq_file *m, void *v)
     return 0;
 }
 
+int ec_path_strings_show(struct seq_file *m, void *v)
+{
+    DECLARE_NON_ATOMIC_CONTEXT(context, ec_getpid(current));
+    HashTableStats stats;
+    uint64_t       strings;
+    uint64_t       bytes_shared;
+
+    ec_path_intern_get_stats(&strings, &bytes_shared, &context);
+    ec_hashtbl_get_stats(&s_path_strings, &stats);
+
+    seq_printf(m, "%20s : %20llu\n", "Strings", strings);
+    seq_printf(m, "%20s : %20llu\n", "Shared", stats.hits);
+    seq_printf(m, "%20s : %20llu\n", "Not Shared", stats.misses);
+    seq_printf(m, "%20s : %20llu\n", "Bytes Shared", bytes_shared);
+
+    return 0;
+}
+
 int __ec_path_cache_print(HashTbl *hashTblp, void *datap, void *priv, ProcessContext *context)
 {
     PathData *path_data = (PathData *)datap;
@@ -52,3 +52,9 @@ PathData *ec_path_cache_get(
 void ec_path_cache_put(
     PathData           *path_data,
     ProcessContext     *context);
+
+// Returns a reference to a copy of path shared with every other path that has the
+//  same string. Free with ec_path_intern_put.
+char *ec_path_intern(char *path, ProcessContext *context);
+void ec_path_intern_put(char *path, ProcessContext *context);
+void ec_path_intern_get_stats(uint64_t *strings, uint64_t *bytes_shared, ProcessContext *context);
@@ -55,14 +55,33 @@ extern pid_t    g_cb_ignored_pids[CB_SENSOR_MAX_PIDS];
 extern uid_t    g_cb_ignored_uids[CB_SENSOR_MAX_UIDS];
 extern bool     g_exiting;
 extern uint32_t g_max_queue_size;
+
+// Classes of events the queue holds capacity back for. The reader still gets every
+//  event in the order it was sent.
+typedef enum {
+    EC_EVENT_CLASS_PROCESS,
+    EC_EVENT_CLASS_NETWORK,
+    EC_EVENT_CLASS_DNS,
+    EC_EVENT_CLASS_FILE,
+    EC_EVENT_CLASS_OTHER,
+    EC_EVENT_CLASS_MAX
+} EC_EVENT_CLASS;
+
+extern uint32_t g_event_class_quota[EC_EVENT_CLASS_MAX];
+extern uint32_t g_event_class_rate[EC_EVENT_CLASS_MAX];
+extern uint32_t g_wakeup_batch;
+extern uint32_t g_wakeup_delay_us;
+
+#define EC_READER_SHARDS_MAX 16
+extern uint32_t g_reader_shards;
+
+EC_EVENT_CLASS ec_event_class(CB_EVENT_TYPE eventType);
 extern bool     g_process_tracking_ref_debug;
 extern bool     g_path_cache_ref_debug;
 
 #define MSG_QUEUE_SIZE  8192
 #define DEFAULT_QUEUE_SIZE  (MSG_QUEUE_SIZE * 3)
 
-#define MAX_BULK_COPY_EVENTS 64
-
 //-------------------------------------------------
 
 #define CB__NR_clone                      0x0000000000000001
@@ -141,6 +160,8 @@ int ec_proc_track_show_table(struct seq_file *m, void *v);
 int ec_proc_track_show_stats(struct seq_file *m, void *v);
 int ec_file_track_show_table(struct seq_file *m, void *v);
 int ec_path_cache_show(struct seq_file *m, void *v);
+int ec_path_strings_show(struct seq_file *m, void *v);
+int ec_path_buffers_show(struct seq_file *m, void *v);
 
 int ec_proc_current_memory_avg(struct seq_file *m, void *v);
 int ec_proc_current_memory_det(struct seq_file *m, void *v);
@@ -193,6 +214,10 @@ time_t ec_get_null_time(void);
 extern int     ec_proc_show_events_avg(struct seq_file *m, void *v);
 extern int     ec_proc_show_events_det(struct seq_file *m, void *v);
 extern ssize_t ec_proc_show_events_rst(struct file *file, const char *buf, size_t size, loff_t *ppos);
+extern int     ec_proc_show_events_types(struct seq_file *m, void *v);
+extern int     ec_proc_show_events_classes(struct seq_file *m, void *v);
+extern int     ec_proc_show_events_latency(struct seq_file *m, void *v);
+extern int     ec_proc_show_events_shards(struct seq_file *m, void *v);
 extern ssize_t ec_net_track_purge(struct file *file, const char *buf, size_t size, loff_t *ppos);
 extern int     ec_net_track_show(struct seq_file *m, void *v);
 
@@ -390,6 +415,10 @@ extern CB_RESOLVED_SYMS g_resolvedSymbols;
 typedef struct _CB_EVENT_NODE {
     struct list_head   listEntry;
     struct llist_node  llistEntry;
+    uint64_t           enqueue_time; // ktime in ns, orders events from the per-CPU queues
+    uint8_t            event_class;  // EC_EVENT_CLASS the event was queued under
+    bool               from_shared;  // counted against the shared capacity, not the class quota
+    uint8_t            shard;        // reader shard the event was queued for
     struct CB_EVENT    data;
     uint16_t           payload; // precomputed size of event data to be sent to userspace
 } CB_EVENT_NODE;
@@ -267,6 +267,18 @@ void ec_process_tracking_set_temp_exec_handle(ProcessHandle *process_handle, Exe
 }
 
 void ec_process_tracking_set_event_info(ProcessHandle *process_handle, CB_EVENT_TYPE eventType, PCB_EVENT event, ProcessContext *context)
+{
+    ec_process_tracking_fill_event_info(process_handle, event, context);
+
+    // In some cases we expect this function to be called with a NULL event
+    //  because we still need to free the parent shared data
+    //  Example: This will happen if we are ignoring fork events.
+    ec_process_tracking_set_temp_exec_handle(process_handle, NULL, context);
+}
+
+// Copies the process details into the event without touching the process entry, so
+//  it is safe to use for a process other than current.
+void ec_process_tracking_fill_event_info(ProcessHandle *process_handle, PCB_EVENT event, ProcessContext *context)
 {
     PathData *path_data;
 
@@ -292,10 +304,7 @@ void ec_process_tracking_set_event_info(ProcessHandle *process_handle, CB_EVENT_
     }
 
 CATCH_DEFAULT:
-    // In some cases we expect this function to be called with a NULL event
-    //  because we still need to free the parent shared data
-    //  Example: This will happen if we are ignoring fork events.
-    ec_process_tracking_set_temp_exec_handle(process_handle, NULL, context);
+    return;
 }
 
 char *ec_process_tracking_get_path(ExecIdentity *exec_identity, ProcessContext *context)
@@ -501,6 +510,169 @@ void ec_process_tracking_update_op_cnts(PosixIdentity *posix_identity, CB_EVENT_
     }
 }
 
+// Suppressed events are reported at most this often while the process keeps running
+#define RATE_LIMIT_REPORT_INTERVAL  (10 * NSEC_PER_SEC)
+
+// Takes a token from the bucket for the class of event_type. Each bucket holds one
+//  second worth of events so short bursts still get through. Like the op counters
+//  above this is not locked, a race costs at most a token.
+bool ec_process_tracking_check_rate(ProcessHandle *process_handle, CB_EVENT_TYPE event_type, ProcessContext *context)
+{
+    PosixIdentity   *posix_identity;
+    EventRateBucket *bucket;
+    EC_EVENT_CLASS   event_class = ec_event_class(event_type);
+    uint32_t         rate;
+    uint64_t         now;
+    uint64_t         refill;
+
+    // DNS has no count in the rate limit report, so it is never limited either
+    TRY(process_handle && event_class != EC_EVENT_CLASS_PROCESS && event_class != EC_EVENT_CLASS_DNS);
+    TRY(event_type != CB_EVENT_TYPE_PROCESS_BLOCKED && event_type != CB_EVENT_TYPE_PROCESS_NOT_BLOCKED);
+
+    rate = READ_ONCE(g_event_class_rate[event_class]);
+    TRY(rate && ec_logger_should_log(event_type));
+
+    posix_identity = ec_process_posix_identity(process_handle);
+    bucket         = &posix_identity->rate_bucket[event_class];
+    now            = ktime_to_ns(ktime_get());
+
+    // Anything past a second would overflow the bucket anyway
+    refill = div_u64(min_t(uint64_t, now - bucket->refill_time, NSEC_PER_SEC) * rate, NSEC_PER_SEC);
+    if (refill >= bucket->used)
+    {
+        bucket->used        = 0;
+        bucket->refill_time = now;
+    } else if (refill)
+    {
+        // Keep the part of a token that has not fully refilled yet
+        bucket->used        -= refill;
+        bucket->refill_time += div_u64(refill * NSEC_PER_SEC, rate);
+    }
+
+    if (bucket->used < rate)
+    {
+        bucket->used += 1;
+        return true;
+    }
+
+    if (!posix_identity->rate_suppressed_since)
+    {
+        posix_identity->rate_suppressed_since = ec_get_current_time();
+    }
+    bucket->suppressed += 1;
+    return false;
+
+CATCH_DEFAULT:
+    return true;
+}
+
+// Collects the counts of suppressed events for a rate limit report. Unless flush is
+//  set a report is only due once every RATE_LIMIT_REPORT_INTERVAL. The counts stay
+//  in place until ec_process_tracking_clear_rate_report is called for a report
+//  that was actually sent.
+bool ec_process_tracking_peek_rate_report(ProcessHandle *process_handle, bool flush, CB_EVENT_RATE_LIMIT *report)
+{
+    PosixIdentity   *posix_identity;
+    EventRateBucket *bucket;
+    uint64_t         now;
+
+    TRY(process_handle && report);
+
+    posix_identity = ec_process_posix_identity(process_handle);
+    bucket         = posix_identity->rate_bucket;
+    TRY(posix_identity->rate_suppressed_since);
+
+    now = ktime_to_ns(ktime_get());
+    TRY(flush || now - posix_identity->rate_report_time >= RATE_LIMIT_REPORT_INTERVAL);
+
+    report->since   = posix_identity->rate_suppressed_since;
+    report->network = bucket[EC_EVENT_CLASS_NETWORK].suppressed;
+    report->file    = bucket[EC_EVENT_CLASS_FILE].suppressed;
+    report->other   = bucket[EC_EVENT_CLASS_OTHER].suppressed;
+
+    return true;
+
+CATCH_DEFAULT:
+    return false;
+}
+
+// Takes the counts of a sent report off the buckets. Events suppressed after the
+//  report was collected stay counted for the next one. Like the buckets this is not
+//  locked, a race with the hooks costs at most a count.
+void ec_process_tracking_clear_rate_report(ProcessHandle *process_handle, CB_EVENT_RATE_LIMIT *report)
+{
+    PosixIdentity   *posix_identity;
+    EventRateBucket *bucket;
+
+    TRY(process_handle && report);
+
+    posix_identity = ec_process_posix_identity(process_handle);
+    bucket         = posix_identity->rate_bucket;
+
+    bucket[EC_EVENT_CLASS_NETWORK].suppressed -= min(report->network, bucket[EC_EVENT_CLASS_NETWORK].suppressed);
+    bucket[EC_EVENT_CLASS_FILE].suppressed    -= min(report->file, bucket[EC_EVENT_CLASS_FILE].suppressed);
+    bucket[EC_EVENT_CLASS_OTHER].suppressed   -= min(report->other, bucket[EC_EVENT_CLASS_OTHER].suppressed);
+
+    if (!bucket[EC_EVENT_CLASS_NETWORK].suppressed &&
+        !bucket[EC_EVENT_CLASS_FILE].suppressed &&
+        !bucket[EC_EVENT_CLASS_OTHER].suppressed)
+    {
+        posix_identity->rate_suppressed_since = 0;
+    }
+    posix_identity->rate_report_time = ktime_to_ns(ktime_get());
+
+CATCH_DEFAULT:
+    return;
+}
+
+// Processes with pending reports picked up by one pass of the stats work. Anything
+//  past this waits for the next pass.
+#define RATE_REPORT_FLUSH_MAX  64
+
+typedef struct rate_report_flush {
+    pid_t    pid[RATE_REPORT_FLUSH_MAX];
+    uint32_t count;
+} RateReportFlush;
+
+static int __ec_collect_rate_report(HashTbl *hashTblp, void *datap, void *priv, ProcessContext *context)
+{
+    PosixIdentity   *posix_identity = (PosixIdentity *)datap;
+    RateReportFlush *flush          = (RateReportFlush *)priv;
+
+    // posix_identity is NULL for the last call after iterating
+    if (posix_identity && posix_identity->rate_suppressed_since)
+    {
+        flush->pid[flush->count++] = posix_identity->pt_key.pid;
+    }
+
+    return flush->count < RATE_REPORT_FLUSH_MAX ? ACTION_CONTINUE : ACTION_STOP;
+}
+
+// Sends the reports that are due for processes which stopped generating events after
+//  being limited. A process that keeps running reports from the factory instead.
+void ec_process_tracking_flush_rate_reports(ProcessContext *context)
+{
+    RateReportFlush  flush = { .count = 0 };
+    ProcessHandle   *process_handle;
+    uint32_t         i;
+
+    // Same as discovery, this sends events so keep the module from being disabled
+    MODULE_GET_AND_BEGIN_MODULE_DISABLE_CHECK_IF_DISABLED_GOTO(context, CATCH_DEFAULT);
+
+    // The table is only read here, the events are sent once the lock is released
+    ec_hashtbl_read_for_each(&g_process_tracking_data.table, __ec_collect_rate_report, &flush, context);
+
+    for (i = 0; i < flush.count; ++i)
+    {
+        process_handle = ec_process_tracking_get_handle(flush.pid[i], context);
+        ec_event_send_rate_limit(process_handle, false, context);
+        ec_process_tracking_put_handle(process_handle, context);
+    }
+
+CATCH_DEFAULT:
+    MODULE_PUT_AND_FINISH_MODULE_DISABLE_CHECK(context);
+}
+
 PosixIdentity *ec_process_posix_identity(ProcessHandle *process_handle)
 {
     return process_handle ? process_handle->posix_identity : NULL;
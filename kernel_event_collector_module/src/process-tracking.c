@@ -224,6 +224,9 @@ ProcessHandle *ec_process_tracking_create_process(
         posix_identity->exec_identity              = NULL;
         posix_identity->exec_blocked               = false;
         memset(&posix_identity->temp_exec_handle, 0, sizeof(posix_identity->temp_exec_handle));
+        memset(&posix_identity->rate_bucket, 0, sizeof(posix_identity->rate_bucket));
+        posix_identity->rate_report_time           = 0;
+        posix_identity->rate_suppressed_since      = 0;
 
         posix_identity->posix_details.pid         = pid;
         posix_identity->posix_details.device      = ec_exec_identity(&exec_handle)->exec_details.device;
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <linux/sched.h>
+#include "priv.h"
 #include "hash-table.h"
 #include "rbtree-helper.h"
 #include "raw_event.h"
@@ -65,6 +66,13 @@ typedef struct ExecIdentity_handle {
     char         *cmdline;
 } ExecHandle;
 
+// Token bucket for one EC_EVENT_CLASS of a process. A zeroed bucket is full.
+typedef struct event_rate_bucket {
+    uint64_t    refill_time;
+    uint32_t    used;         // Tokens taken since the bucket was last full
+    uint32_t    suppressed;   // Events left out since the last rate limit report
+} EventRateBucket;
+
 typedef struct posix_identity {
     PT_TBL_KEY        pt_key;
 
@@ -103,6 +111,10 @@ typedef struct posix_identity {
 
     uint64_t    childproc_cnt;
 
+    EventRateBucket rate_bucket[EC_EVENT_CLASS_MAX];
+    uint64_t        rate_report_time;
+    time_t          rate_suppressed_since;
+
     ExecIdentity   *exec_identity;
 
     // This holds a temporary handle to the exec_identity that will be referenced by the next event created for
@@ -173,8 +185,13 @@ void ec_process_exec_handle_clone(ExecHandle *from, ExecHandle *to, ProcessConte
 
 // Event Helper
 void ec_process_tracking_set_event_info(ProcessHandle *process_handle, CB_EVENT_TYPE eventType, PCB_EVENT event, ProcessContext *context);
+void ec_process_tracking_fill_event_info(ProcessHandle *process_handle, PCB_EVENT event, ProcessContext *context);
 bool ec_process_tracking_should_track_user(void);
 bool ec_process_tracking_has_active_process(PosixIdentity *posix_identity, ProcessContext *context);
+bool ec_process_tracking_check_rate(ProcessHandle *process_handle, CB_EVENT_TYPE event_type, ProcessContext *context);
+bool ec_process_tracking_peek_rate_report(ProcessHandle *process_handle, bool flush, CB_EVENT_RATE_LIMIT *report);
+void ec_process_tracking_clear_rate_report(ProcessHandle *process_handle, CB_EVENT_RATE_LIMIT *report);
+void ec_process_tracking_flush_rate_reports(ProcessContext *context);
 
 // File helpers
 typedef void (*process_tracking_for_each_tree_callback)(void *tree, void *priv, ProcessContext *context);
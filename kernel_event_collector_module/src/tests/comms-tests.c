@@ -5,16 +5,24 @@
 #include "path-buffers.h"
 #include "dns-parser-private.h"
 #include "mem-alloc.h"
+#include "compact-event.h"
+
+#include <linux/mman.h>
 
 #include "run-tests.h"
 
-int ec_obtain_next_cbevent(struct CB_EVENT **cb_event, size_t count, ProcessContext *context);
+int ec_obtain_next_cbevent(uint32_t shard_id, struct CB_EVENT **cb_event, size_t count, ProcessContext *context);
 bool __ec_connect_reader(ProcessContext *context);
 void ec_user_comm_clear_queue(ProcessContext *context);
+int __ec_serialize_event(struct CB_EVENT *msg, uint16_t payload, char *buf);
+ssize_t ec_read_events(uint32_t shard_id, char __user *ubuf, size_t count, ProcessContext *context);
 
 bool __init test__oversize_payload(ProcessContext *context);
 bool __init test__normal_payload(ProcessContext *context);
 bool __init test__parse_large_dns(ProcessContext *context);
+bool __init test__serialize_event(ProcessContext *context);
+bool __init test__bulk_read(ProcessContext *context);
+bool __init test__compact_serialize(ProcessContext *context);
 
 bool __init test__comms(ProcessContext *context)
 {
@@ -29,6 +37,9 @@ bool __init test__comms(ProcessContext *context)
     RUN_TEST(test__oversize_payload(context));
     RUN_TEST(test__normal_payload(context));
     RUN_TEST(test__parse_large_dns(context));
+    RUN_TEST(test__serialize_event(context));
+    RUN_TEST(test__bulk_read(context));
+    RUN_TEST(test__compact_serialize(context));
 
     g_traceLevel = origTraceLevel;
 
@@ -93,7 +104,7 @@ bool __init test__oversize_payload(ProcessContext *context)
     ec_disconnect_reader(context->pid, context);
     DISABLE_SEND_EVENTS(context);
 
-    rc = ec_obtain_next_cbevent(&msg, sizeof(struct CB_EVENT_UM_BLOB), context);
+    rc = ec_obtain_next_cbevent(0, &msg, sizeof(struct CB_EVENT_UM_BLOB), context);
     ASSERT_TRY_MSG(rc == -EAGAIN, "%d", rc);
 
     passed = true;
@@ -167,7 +178,7 @@ bool __init test__normal_payload(ProcessContext *context)
     ec_disconnect_reader(context->pid, context);
     DISABLE_SEND_EVENTS(context);
 
-    rc = ec_obtain_next_cbevent(&msg, sizeof(struct CB_EVENT_UM_BLOB), context);
+    rc = ec_obtain_next_cbevent(0, &msg, sizeof(struct CB_EVENT_UM_BLOB), context);
 
     ASSERT_TRY_MSG(rc == sizeof(struct CB_EVENT_UM_BLOB), "%d", rc);
 
@@ -267,3 +278,281 @@ CATCH_DEFAULT:
     return passed;
 }
 
+
+// The ring carries events serialized at send time, make sure they look the same as read() output
+bool __init test__serialize_event(ProcessContext *context)
+{
+    bool               passed     = false;
+    struct task_struct *task      = current;
+    pid_t              pid        = ec_getpid(task);
+    pid_t              tid        = ec_gettid(task);
+    uid_t              uid        = GET_UID();
+    uid_t              euid       = GET_EUID();
+    struct CB_EVENT    *msg       = NULL;
+    struct CB_EVENT_UM *msg_um    = NULL;
+    char               *buf       = NULL;
+    struct timespec    start_time = { 0, 0 };
+    char               *pathname  = NULL;
+    PathData           *path_data = NULL;
+    ProcessHandle      *proch     = NULL;
+    int                rc;
+
+    buf = ec_mem_alloc(sizeof(struct CB_EVENT_UM_BLOB), context);
+    ASSERT_TRY(buf);
+
+    pathname = ec_mem_strdup("/tmp/serialize-test", context);
+    ASSERT_TRY(pathname);
+
+    path_data = ec_path_cache_add(0, 0, 0, pathname, 0, context);
+    ASSERT_TRY(path_data);
+
+    proch = ec_process_tracking_update_process(
+        pid,
+        tid,
+        uid,
+        euid,
+        path_data,
+        ec_to_windows_timestamp(&start_time),
+        CB_PROCESS_START_BY_EXEC,
+        task,
+        CB_EVENT_TYPE_PROCESS_START_EXEC,
+        FAKE_START,
+        context);
+
+    ASSERT_TRY(proch);
+
+    ENABLE_SEND_EVENTS(context);
+    __ec_connect_reader(context);
+
+    ec_event_send_file(
+        proch,
+        CB_EVENT_TYPE_FILE_WRITE,
+        path_data,
+        context);
+
+    ec_disconnect_reader(context->pid, context);
+    DISABLE_SEND_EVENTS(context);
+
+    rc = ec_obtain_next_cbevent(0, &msg, sizeof(struct CB_EVENT_UM_BLOB), context);
+    ASSERT_TRY_MSG(rc > 0, "%d", rc);
+
+    ASSERT_TRY_MSG(__ec_serialize_event(msg, (uint16_t)rc, buf) == rc, "%d", rc);
+
+    msg_um = (struct CB_EVENT_UM *)buf;
+    ASSERT_TRY(msg_um->payload == rc);
+    ASSERT_TRY(msg_um->event.fileGeneric.path == NULL);
+    ASSERT_TRY(msg_um->event.procInfo.path == NULL);
+    ASSERT_TRY(msg_um->event.fileGeneric.path_offset + msg_um->event.fileGeneric.path_size <= rc);
+    ASSERT_TRY(strcmp(buf + msg_um->event.fileGeneric.path_offset, pathname) == 0);
+
+    passed = true;
+
+CATCH_DEFAULT:
+    ec_process_tracking_remove_process(proch, context);
+    ec_process_tracking_put_handle(proch, context);
+    ec_path_cache_delete(path_data, context);
+    ec_path_cache_put(path_data, context);
+    ec_mem_put(pathname);
+    ec_mem_free(buf);
+    ec_free_event(msg, context);
+    ec_user_comm_clear_queue(context);
+
+    return passed;
+}
+
+// Reads a burst of events the way the reader does and reports how many read calls
+//  it took and how fast the bytes came out.
+bool __init test__bulk_read(ProcessContext *context)
+{
+    bool               passed     = false;
+    const int          EVENT_COUNT = 1000;
+    const size_t       BUFFER_SIZE = 1024 * 1024;
+    unsigned long      ubuf       = 0;
+    int                sent       = 0;
+    int                read_calls = 0;
+    size_t             total      = 0;
+    size_t             offset;
+    int                received   = 0;
+    uint64_t           start_ns;
+    uint64_t           elapsed_ns;
+    ssize_t            rc;
+    int                i;
+
+    // The self-tests run in the context of insmod, so borrow its address space for a user buffer
+    ubuf = vm_mmap(NULL, 0, BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0);
+    ASSERT_TRY_MSG(!IS_ERR_VALUE(ubuf), "%ld", (long)ubuf);
+
+    ENABLE_SEND_EVENTS(context);
+    __ec_connect_reader(context);
+
+    for (i = 0; i < EVENT_COUNT; ++i)
+    {
+        PCB_EVENT event = ec_alloc_event(CB_EVENT_TYPE_HEARTBEAT, context);
+
+        if (event && ec_send_event(event, context) == 0)
+        {
+            ++sent;
+        }
+    }
+
+    start_ns = ktime_to_ns(ktime_get());
+    while (true)
+    {
+        rc = ec_read_events(0, (char __user *)ubuf, BUFFER_SIZE, context);
+        if (rc <= 0)
+        {
+            break;
+        }
+
+        ++read_calls;
+        total += rc;
+
+        // Walk the records to make sure they are whole
+        for (offset = 0; offset < (size_t)rc; )
+        {
+            uint16_t payload;
+
+            ASSERT_TRY(!get_user(payload, (uint16_t __user *)(ubuf + offset)));
+            ASSERT_TRY_MSG(payload >= sizeof(struct CB_EVENT_UM) && offset + payload <= rc,
+                           "offset: %zu, payload: %u", offset, payload);
+            offset += payload;
+            ++received;
+        }
+    }
+    elapsed_ns = ktime_to_ns(ktime_get()) - start_ns;
+
+    ASSERT_TRY_MSG(rc == -EAGAIN, "%zd", rc);
+    ASSERT_TRY_MSG(received == sent, "received: %d, sent: %d", received, sent);
+    ASSERT_TRY_MSG(sent > 0, "sent: %d", sent);
+
+    TRACE(DL_INFO, "%s: %d events, %zu bytes in %d reads (%d reads per 1k events), %llu bytes/sec",
+          __func__, received, total, read_calls, read_calls * 1000 / received,
+          elapsed_ns ? (uint64_t)total * NSEC_PER_SEC / elapsed_ns : 0);
+
+    passed = true;
+
+CATCH_DEFAULT:
+    // The reader has to stay connected while reading, so disconnect here
+    ec_disconnect_reader(context->pid, context);
+    DISABLE_SEND_EVENTS(context);
+
+    if (!IS_ERR_VALUE(ubuf) && ubuf)
+    {
+        vm_munmap(ubuf, BUFFER_SIZE);
+    }
+    ec_user_comm_clear_queue(context);
+
+    return passed;
+}
+
+// The first event defines the shared process and file path, the second only
+//  refers to it by id.
+bool __init test__compact_serialize(ProcessContext *context)
+{
+    bool                            passed     = false;
+    struct task_struct             *task       = current;
+    pid_t                           pid        = ec_getpid(task);
+    pid_t                           tid        = ec_gettid(task);
+    uid_t                           uid        = GET_UID();
+    uid_t                           euid       = GET_EUID();
+    struct CB_EVENT                *msg        = NULL;
+    CompactPathTable               *paths      = NULL;
+    const struct CB_COMPACT_RECORD *record;
+    const struct CB_COMPACT_EVENT  *event;
+    const struct CB_COMPACT_FILE   *file;
+    char                           *buf        = NULL;
+    struct timespec                 start_time = { 0, 0 };
+    char                           *pathname   = NULL;
+    PathData                       *path_data  = NULL;
+    ProcessHandle                  *proch      = NULL;
+    uint16_t                        path_id    = 0;
+    size_t                          size;
+    int                             rc;
+    int                             i;
+
+    buf = ec_mem_alloc(sizeof(struct CB_EVENT_UM_BLOB), context);
+    ASSERT_TRY(buf);
+
+    paths = ec_compact_paths_alloc(context);
+    ASSERT_TRY(paths);
+
+    pathname = ec_mem_strdup("/tmp/compact-test", context);
+    ASSERT_TRY(pathname);
+
+    path_data = ec_path_cache_add(0, 0, 0, pathname, 0, context);
+    ASSERT_TRY(path_data);
+
+    proch = ec_process_tracking_update_process(
+        pid,
+        tid,
+        uid,
+        euid,
+        path_data,
+        ec_to_windows_timestamp(&start_time),
+        CB_PROCESS_START_BY_EXEC,
+        task,
+        CB_EVENT_TYPE_PROCESS_START_EXEC,
+        FAKE_START,
+        context);
+
+    ASSERT_TRY(proch);
+
+    ENABLE_SEND_EVENTS(context);
+    __ec_connect_reader(context);
+
+    ec_event_send_file(proch, CB_EVENT_TYPE_FILE_WRITE, path_data, context);
+    ec_event_send_file(proch, CB_EVENT_TYPE_FILE_CLOSE, path_data, context);
+
+    ec_disconnect_reader(context->pid, context);
+    DISABLE_SEND_EVENTS(context);
+
+    for (i = 0; i < 2; ++i)
+    {
+        rc = ec_obtain_next_cbevent(0, &msg, sizeof(struct CB_EVENT_UM_BLOB), context);
+        ASSERT_TRY_MSG(rc > 0, "%d", rc);
+
+        rc = ec_compact_serialize_event(paths, msg, buf, rc, context);
+        ASSERT_TRY_MSG(rc > 0, "%d", rc);
+
+        ec_free_event(msg, context);
+        msg = NULL;
+
+        record = cb_compact_record(buf, rc);
+        ASSERT_TRY(record);
+
+        if (i == 0)
+        {
+            const char *path = cb_compact_tail(record, sizeof(struct CB_COMPACT_PATH), &size);
+
+            ASSERT_TRY(record->type == CB_COMPACT_TYPE_PATH);
+            ASSERT_TRY(path && strcmp(path, pathname) == 0);
+            path_id = ((const struct CB_COMPACT_PATH *)record)->id;
+
+            record = cb_compact_record(buf + record->size, rc - record->size);
+            ASSERT_TRY(record);
+        }
+
+        ASSERT_TRY_MSG(record->type == (i == 0 ? CB_EVENT_TYPE_FILE_WRITE : CB_EVENT_TYPE_FILE_CLOSE), "%d", record->type);
+        ASSERT_TRY((const char *)record + record->size == buf + rc);
+
+        event = (const struct CB_COMPACT_EVENT *)record;
+        file  = cb_compact_body(record, sizeof(*file));
+        ASSERT_TRY(file);
+        ASSERT_TRY_MSG(event->path_id == path_id && file->path_id == path_id, "%u %u %u", event->path_id, file->path_id, path_id);
+    }
+
+    passed = true;
+
+CATCH_DEFAULT:
+    ec_process_tracking_remove_process(proch, context);
+    ec_process_tracking_put_handle(proch, context);
+    ec_path_cache_delete(path_data, context);
+    ec_path_cache_put(path_data, context);
+    ec_mem_put(pathname);
+    ec_compact_paths_free(paths, context);
+    ec_mem_free(buf);
+    ec_free_event(msg, context);
+    ec_user_comm_clear_queue(context);
+
+    return passed;
+}
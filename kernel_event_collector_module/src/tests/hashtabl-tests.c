@@ -4,6 +4,8 @@
 #include "run-tests.h"
 #include "mem-alloc.h"
 
+#include <linux/kthread.h>
+
 typedef struct table_key {
     uint64_t id;
 } TableKey;
@@ -43,6 +45,13 @@ bool __init test__hashtbl_lru_lookup(ProcessContext *context);
 bool __init test__hashtbl_lru_one_bucket(ProcessContext *context);
 bool __init test__hashtbl_lru_many_buckets(ProcessContext *context);
 bool __init test__hashtbl_lru_one_bucket_activity(ProcessContext *context);
+bool __init test__hashtbl_lookup_stress(ProcessContext *context);
+bool __init test__hashtbl_resize(ProcessContext *context);
+bool __init test__hashtbl_bucket_locks(ProcessContext *context);
+bool __init test__hashtbl_key_functions(ProcessContext *context);
+bool __init test__hashtbl_clock_eviction(ProcessContext *context);
+bool __init test__hashtbl_stats(ProcessContext *context);
+bool __init test__hashtbl_shrinker(ProcessContext *context);
 
 static void __init __vprintk(void *, const char *, ...);
 static void __init __ec_test_hashtbl_delete_callback(void *data, ProcessContext *context);
@@ -64,6 +73,13 @@ bool __init test__hash_table(ProcessContext *context)
     RUN_TEST(test__hashtbl_lru_one_bucket(context));
     RUN_TEST(test__hashtbl_lru_many_buckets(context));
     RUN_TEST(test__hashtbl_lru_one_bucket_activity(context));
+    RUN_TEST(test__hashtbl_lookup_stress(context));
+    RUN_TEST(test__hashtbl_resize(context));
+    RUN_TEST(test__hashtbl_bucket_locks(context));
+    RUN_TEST(test__hashtbl_key_functions(context));
+    RUN_TEST(test__hashtbl_clock_eviction(context));
+    RUN_TEST(test__hashtbl_stats(context));
+    RUN_TEST(test__hashtbl_shrinker(context));
     RETURN_RESULT();
 }
 
@@ -588,7 +604,7 @@ bool __init test__hashtbl_lru_one_bucket_activity(ProcessContext *context)
     // Add a new entry
     ASSERT_TRY(__add_entry(4, &hash_table, context));
 
-    // Item 1 should have been moved to the top of the list and should not have been evicted
+    // Item 1 is the most active and should not have been evicted
     ASSERT_TRY(__check_entry_exists(&hash_table, 1, context));
 
     passed = true;
@@ -647,6 +663,588 @@ CATCH_DEFAULT:
     return passed;
 }
 
+#define STRESS_KEYS        4096
+#define STRESS_READERS_MAX 8
+#define STRESS_RUN_MS      1000
+
+typedef struct stress_reader {
+    HashTbl  *hash_table;
+    uint64_t  lookups;
+    uint64_t  bad;
+} StressReader;
+
+static int __hashtbl_stress_reader(void *data)
+{
+    StressReader *reader = (StressReader *)data;
+    uint64_t      id     = 0;
+
+    DECLARE_NON_ATOMIC_CONTEXT(context, ec_getpid(current));
+
+    while (!kthread_should_stop())
+    {
+        TableKey tkey  = { .id = id++ % STRESS_KEYS };
+        Entry   *tdata = ec_hashtbl_find(reader->hash_table, &tkey, &context);
+
+        if (tdata)
+        {
+            if (tdata->key.id != tkey.id)
+            {
+                ++reader->bad;
+            }
+            ec_hashtbl_put(reader->hash_table, tdata, &context);
+        }
+        ++reader->lookups;
+
+        if ((reader->lookups & 0xfff) == 0)
+        {
+            cond_resched();
+        }
+    }
+
+    return 0;
+}
+
+// Lookups from several threads while another thread keeps deleting and adding
+//  entries must never return the wrong entry
+bool __init test__hashtbl_lookup_stress(ProcessContext *context)
+{
+    bool                passed     = false;
+    HashTbl             hash_table = HASH_TBL_INIT();
+    StressReader        reader[STRESS_READERS_MAX] = {};
+    struct task_struct *task[STRESS_READERS_MAX]   = {};
+    int                 nr_readers = min_t(int, num_online_cpus(), STRESS_READERS_MAX);
+    uint64_t            churn      = 0;
+    unsigned long       end;
+    int                 i;
+
+    hash_table.numberOfBuckets = STRESS_KEYS / 4;
+    hash_table.delete_callback = NULL;
+
+    ASSERT_TRY(ec_hashtbl_init(&hash_table, context));
+
+    for (i = 0; i < STRESS_KEYS; ++i)
+    {
+        ASSERT_TRY(__add_entry(i, &hash_table, context));
+    }
+
+    for (i = 0; i < nr_readers; ++i)
+    {
+        reader[i].hash_table = &hash_table;
+        task[i] = kthread_run(&__hashtbl_stress_reader, &reader[i], "hashtbl_stress/%d", i);
+        if (IS_ERR(task[i]))
+        {
+            task[i] = NULL;
+            break;
+        }
+    }
+    nr_readers = i;
+
+    end = jiffies + msecs_to_jiffies(STRESS_RUN_MS);
+    while (time_before(jiffies, end))
+    {
+        TableKey tkey  = { .id = churn++ % STRESS_KEYS };
+        Entry   *tdata = ec_hashtbl_find(&hash_table, &tkey, context);
+
+        if (tdata)
+        {
+            ec_hashtbl_del(&hash_table, tdata, context);
+            ec_hashtbl_put(&hash_table, tdata, context);
+        }
+        __add_entry(tkey.id, &hash_table, context);
+
+        if ((churn & 0xff) == 0)
+        {
+            cond_resched();
+        }
+    }
+
+    for (i = 0; i < nr_readers; ++i)
+    {
+        kthread_stop(task[i]);
+        task[i] = NULL;
+    }
+
+    for (i = 0; i < nr_readers; ++i)
+    {
+        ASSERT_TRY_MSG(reader[i].bad == 0, "reader %d found %llu wrong entries", i, reader[i].bad);
+    }
+
+    ASSERT_TRY(ec_hashtbl_get_count(&hash_table, context) == STRESS_KEYS);
+
+    passed = true;
+
+CATCH_DEFAULT:
+    for (i = 0; i < nr_readers; ++i)
+    {
+        if (task[i])
+        {
+            kthread_stop(task[i]);
+        }
+    }
+    ec_hashtbl_destroy(&hash_table, context);
+    return passed;
+}
+
+#define RESIZE_KEYS        4096
+
+// Grows the table while it is being filled and shrinks it again once most entries
+//  are gone. Earlier keys are looked up while buckets are being moved.
+bool __init test__hashtbl_resize(ProcessContext *context)
+{
+    bool     passed     = false;
+    HashTbl  hash_table = HASH_TBL_INIT();
+    uint64_t size;
+    int      i;
+
+    hash_table.numberOfBuckets = 64;
+    hash_table.resizable       = true;
+    hash_table.minBuckets      = 16;
+    hash_table.maxBuckets      = RESIZE_KEYS;
+    hash_table.delete_callback = NULL;
+
+    ASSERT_TRY(ec_hashtbl_init(&hash_table, context));
+    ASSERT_TRY(hash_table.numberOfLocks == 16);
+
+    for (i = 0; i < RESIZE_KEYS; ++i)
+    {
+        ASSERT_TRY(__add_entry(i, &hash_table, context));
+        ASSERT_TRY_MSG(__check_entry_exists(&hash_table, i / 2, context), "key %d missing after adding %d", i / 2, i);
+    }
+
+    // The last resize may have been sized before the last entries were added
+    flush_work(&hash_table.resizeWork);
+    ASSERT_TRY(__add_entry(RESIZE_KEYS, &hash_table, context));
+    flush_work(&hash_table.resizeWork);
+
+    size = hash_table.numberOfBuckets;
+    ASSERT_TRY_MSG(size >= RESIZE_KEYS / 4, "buckets: %llu", size);
+    ASSERT_TRY(hash_table.resizeCount > 0);
+
+    for (i = 0; i <= RESIZE_KEYS; ++i)
+    {
+        ASSERT_TRY_MSG(__check_entry_exists(&hash_table, i, context), "key %d missing after grow", i);
+    }
+
+    for (i = 8; i <= RESIZE_KEYS; ++i)
+    {
+        TableKey tkey  = { .id = i };
+        Entry   *tdata = ec_hashtbl_del_by_key(&hash_table, &tkey, context);
+
+        ASSERT_TRY(tdata);
+        ec_hashtbl_put(&hash_table, tdata, context);
+    }
+    flush_work(&hash_table.resizeWork);
+
+    // As above, one more delete to pick up anything the last resize missed
+    {
+        TableKey tkey  = { .id = 7 };
+        Entry   *tdata = ec_hashtbl_del_by_key(&hash_table, &tkey, context);
+
+        ASSERT_TRY(tdata);
+        ec_hashtbl_put(&hash_table, tdata, context);
+        ASSERT_TRY(__add_entry(7, &hash_table, context));
+    }
+    flush_work(&hash_table.resizeWork);
+
+    ASSERT_TRY_MSG(hash_table.numberOfBuckets < size, "buckets: %llu", hash_table.numberOfBuckets);
+    ASSERT_TRY(hash_table.numberOfBuckets >= hash_table.minBuckets);
+    ASSERT_TRY(ec_hashtbl_get_count(&hash_table, context) == 8);
+
+    for (i = 0; i < 8; ++i)
+    {
+        ASSERT_TRY_MSG(__check_entry_exists(&hash_table, i, context), "key %d missing after shrink", i);
+    }
+
+    TRACE(DL_INFO, "hashtbl resize: %llu resizes, %llu buckets at most",
+        hash_table.resizeCount, size);
+
+    passed = true;
+
+CATCH_DEFAULT:
+    ec_hashtbl_destroy(&hash_table, context);
+    return passed;
+}
+
+#define BUCKET_LOCK_BUCKETS  1024
+#define BUCKET_LOCK_KEYS     256
+
+// The bucket locks live in the lock array itself, base_size counts them and
+//  holding a bucket through the lookup API really holds its lock
+bool __init test__hashtbl_bucket_locks(ProcessContext *context)
+{
+    bool         passed     = false;
+    HashTbl      hash_table = HASH_TBL_INIT();
+    int          i;
+
+    hash_table.numberOfBuckets = BUCKET_LOCK_BUCKETS;
+    hash_table.delete_callback = NULL;
+
+    ASSERT_TRY(ec_hashtbl_init(&hash_table, context));
+
+    ASSERT_TRY(sizeof(HashTableBkt) == sizeof(ec_spinlock_t));
+    ASSERT_TRY_MSG(hash_table.base_size >= sizeof(HashTbl) + hash_table.numberOfLocks * sizeof(ec_spinlock_t),
+                   "base_size %zu misses the %llu bucket locks", hash_table.base_size, hash_table.numberOfLocks);
+
+    for (i = 0; i < BUCKET_LOCK_KEYS; ++i)
+    {
+        ASSERT_TRY(__add_entry(i, &hash_table, context));
+    }
+
+    for (i = 0; i < BUCKET_LOCK_KEYS; ++i)
+    {
+        TableKey      tkey   = { .id = i };
+        Entry        *tdata  = NULL;
+        HashTableBkt *bkt    = NULL;
+        bool          locked;
+
+        ASSERT_TRY(ec_hashtbl_read_bkt_lock(&hash_table, &tkey, (void **)&tdata, &bkt, context));
+        locked = ec_write_trylock_inline(&bkt->lock, context);
+        if (locked)
+        {
+            ec_write_unlock_inline(&bkt->lock, context);
+        }
+        ec_hashtbl_read_bkt_unlock(bkt, context);
+
+        ASSERT_TRY_MSG(tdata && tdata->key.id == i, "key %d not found under its bucket lock", i);
+        ASSERT_TRY_MSG(!locked, "bucket of key %d was not locked", i);
+
+        ASSERT_TRY(ec_write_trylock_inline(&bkt->lock, context));
+        ec_write_unlock_inline(&bkt->lock, context);
+    }
+
+    passed = true;
+
+CATCH_DEFAULT:
+    ec_hashtbl_destroy(&hash_table, context);
+    return passed;
+}
+
+#define KEY_FN_KEYS        4096
+
+static u32 __test_jhash_key(const void *key, int key_len, u32 secret)
+{
+    return jhash(key, key_len, secret);
+}
+
+static bool __test_memcmp_key(const void *key, const void *other, int key_len)
+{
+    return memcmp(key, other, key_len) == 0;
+}
+
+// Fills a table with key_len byte keys and looks every one of them up. A key that
+//  only differs in its last word must not match any of them.
+static bool __init __test__hashtbl_key_lookup(int key_len, bool generic, ProcessContext *context)
+{
+    bool     passed     = false;
+    uint64_t key[3];
+    void    *datap;
+    int      ret;
+    HashTbl  hash_table = {
+        .numberOfBuckets = KEY_FN_KEYS,
+        .name            = "hash_table_key_fn",
+        .datasize        = sizeof(key),
+        .key_len         = key_len,
+        .key_offset      = 0,
+    };
+    int      i;
+
+    if (generic)
+    {
+        hash_table.hash_callback    = __test_jhash_key;
+        hash_table.compare_callback = __test_memcmp_key;
+    }
+
+    ASSERT_TRY(ec_hashtbl_init(&hash_table, context));
+    ASSERT_TRY_MSG(generic || hash_table.word_keys, "key_len %d has no built in functions", key_len);
+
+    for (i = 0; i < KEY_FN_KEYS; ++i)
+    {
+        uint64_t *entry = ec_hashtbl_alloc(&hash_table, context);
+
+        ASSERT_TRY(entry);
+        memset(entry, 0, sizeof(key));
+        // Vary every word so no key function can get away with looking at one, and
+        //  both halves of the first so a 4 byte key is unique on any byte order
+        entry[0] = ((uint64_t)i << 32) | i;
+        entry[1] = i * 3;
+        entry[2] = i * 7;
+        ret = ec_hashtbl_add_safe(&hash_table, entry, context);
+        if (ret != 0)
+        {
+            ec_hashtbl_free(&hash_table, entry, context);
+        }
+        ASSERT_TRY_MSG(ret == 0, "key_len %d key %d not added (%d)", key_len, i, ret);
+        ec_hashtbl_put(&hash_table, entry, context);
+    }
+
+    for (i = 0; i < KEY_FN_KEYS; ++i)
+    {
+        memset(key, 0, sizeof(key));
+        key[0] = ((uint64_t)i << 32) | i;
+        key[1] = i * 3;
+        key[2] = i * 7;
+        datap = ec_hashtbl_find(&hash_table, key, context);
+        ASSERT_TRY_MSG(datap, "key_len %d key %d not found", key_len, i);
+        ret = memcmp(datap, key, key_len);
+        ec_hashtbl_put(&hash_table, datap, context);
+        ASSERT_TRY_MSG(ret == 0, "key_len %d key %d found a different key", key_len, i);
+
+        // Change the last word of the key only, for a 4 byte key that is its top bit
+        ((uint32_t *)key)[key_len / sizeof(uint32_t) - 1] ^= 0x80000000;
+        datap = ec_hashtbl_find(&hash_table, key, context);
+        if (datap)
+        {
+            ec_hashtbl_put(&hash_table, datap, context);
+        }
+        ASSERT_TRY_MSG(!datap, "key_len %d key %d matched a different key", key_len, i);
+    }
+
+    passed = true;
+
+CATCH_DEFAULT:
+    ec_hashtbl_destroy(&hash_table, context);
+    return passed;
+}
+
+// The built in key functions find the same keys as jhash and memcmp for each size
+bool __init test__hashtbl_key_functions(ProcessContext *context)
+{
+    bool passed      = false;
+    int  key_lens[]  = { 4, 8, 16, 24 };
+    int  i;
+
+    for (i = 0; i < ARRAY_SIZE(key_lens); ++i)
+    {
+        ASSERT_TRY(__test__hashtbl_key_lookup(key_lens[i], false, context));
+        ASSERT_TRY(__test__hashtbl_key_lookup(key_lens[i], true, context));
+    }
+
+    passed = true;
+
+CATCH_DEFAULT:
+    return passed;
+}
+
+#define REPLAY_BUCKETS     64
+#define REPLAY_LRU_SIZE    4
+#define REPLAY_HOT_KEYS    128
+#define REPLAY_COLD_KEYS   16384
+#define REPLAY_ACCESSES    65536
+#define REPLAY_SEED        0x5eed
+
+// Replays the same accesses against a table, a miss adds the key like the caches
+//  do. Most accesses go to a small hot set and the rest scatter over many cold keys
+//  that are rarely seen twice. Returns the hit rate in tenths of a percent.
+static int __init __test__hashtbl_replay(HashTbl *hash_table, uint64_t *max_count, ProcessContext *context)
+{
+    uint64_t seed = REPLAY_SEED;
+    uint64_t hits = 0;
+    int      i;
+
+    *max_count = 0;
+    for (i = 0; i < REPLAY_ACCESSES; ++i)
+    {
+        uint64_t r;
+        int      key;
+        int64_t  count;
+
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        r    = seed >> 33;
+        key  = (r % 100 < 80) ? (r >> 8) % REPLAY_HOT_KEYS : REPLAY_HOT_KEYS + (r >> 8) % REPLAY_COLD_KEYS;
+
+        if (__check_entry_exists(hash_table, key, context))
+        {
+            ++hits;
+        } else if (!__add_entry(key, hash_table, context))
+        {
+            return -1;
+        }
+
+        count = ec_hashtbl_get_count(hash_table, context);
+        *max_count = max_t(uint64_t, *max_count, count);
+    }
+
+    return hits * 1000 / REPLAY_ACCESSES;
+}
+
+// Compares LRU per bucket with a CLOCK budget of the same capacity on one workload
+bool __init test__hashtbl_clock_eviction(ProcessContext *context)
+{
+    bool     passed    = false;
+    HashTbl  lru_table = HASH_TBL_INIT();
+    HashTbl  clk_table = HASH_TBL_INIT();
+    uint64_t budget    = REPLAY_BUCKETS * REPLAY_LRU_SIZE;
+    uint64_t lru_max;
+    uint64_t clk_max;
+    int      lru_rate;
+    int      clk_rate;
+
+    lru_table.numberOfBuckets = REPLAY_BUCKETS;
+    lru_table.lruSize         = REPLAY_LRU_SIZE;
+    lru_table.delete_callback = NULL;
+
+    clk_table.numberOfBuckets = REPLAY_BUCKETS;
+    clk_table.maxEntries      = budget;
+    clk_table.delete_callback = NULL;
+
+    ASSERT_TRY(ec_hashtbl_init(&lru_table, context));
+    ASSERT_TRY(ec_hashtbl_init(&clk_table, context));
+    ASSERT_TRY(clk_table.entryBudget == budget);
+
+    lru_rate = __test__hashtbl_replay(&lru_table, &lru_max, context);
+    clk_rate = __test__hashtbl_replay(&clk_table, &clk_max, context);
+
+    ASSERT_TRY(lru_rate >= 0 && clk_rate >= 0);
+    ASSERT_TRY_MSG(lru_max <= budget, "lru max: %llu", lru_max);
+
+    // A sweep may find every entry referenced and leave the table over the budget
+    //  until the next add, but never by much
+    ASSERT_TRY_MSG(clk_max <= budget + budget / 8, "clock max: %llu", clk_max);
+
+    TRACE(DL_INFO, "hashtbl replay: capacity=%llu lru hit=%d.%d%% max=%llu clock hit=%d.%d%% max=%llu",
+        budget, lru_rate / 10, lru_rate % 10, lru_max, clk_rate / 10, clk_rate % 10, clk_max);
+
+    passed = true;
+
+CATCH_DEFAULT:
+    ec_hashtbl_destroy(&clk_table, context);
+    ec_hashtbl_destroy(&lru_table, context);
+    return passed;
+}
+
+#define STATS_KEYS         256
+
+bool __init test__hashtbl_stats(ProcessContext *context)
+{
+    bool           passed     = false;
+    HashTbl        hash_table = HASH_TBL_INIT();
+    HashTableStats stats;
+    uint64_t       sampled    = 0;
+    Entry         *tdata      = NULL;
+    int            i;
+
+    hash_table.numberOfBuckets = 16;
+    hash_table.lruSize         = 4;
+    hash_table.delete_callback = NULL;
+
+    ASSERT_TRY(ec_hashtbl_init(&hash_table, context));
+
+    // Room for 64 entries, so the rest are evicted
+    for (i = 0; i < STATS_KEYS; ++i)
+    {
+        ASSERT_TRY(__add_entry(i, &hash_table, context));
+    }
+    for (i = 0; i < STATS_KEYS; ++i)
+    {
+        __check_entry_exists(&hash_table, i, context);
+    }
+
+    tdata = (Entry *)ec_hashtbl_alloc(&hash_table, context);
+    ASSERT_TRY(tdata);
+    tdata->key.id = STATS_KEYS - 1;
+    ASSERT_TRY(ec_hashtbl_add_safe(&hash_table, tdata, context) == -EEXIST);
+
+    ec_hashtbl_get_stats(&hash_table, &stats);
+    for (i = 0; i < HASHTBL_CHAIN_BINS; ++i)
+    {
+        sampled += stats.chain[i];
+    }
+
+    TRACE(DL_INFO, "hashtbl stats: lookups=%llu hits=%llu misses=%llu inserts=%llu exists=%llu evictions=%llu contended=%llu sampled=%llu",
+        stats.lookups, stats.hits, stats.misses, stats.inserts, stats.exists, stats.evictions, stats.contended, sampled);
+
+    ASSERT_TRY_MSG(stats.lookups == STATS_KEYS, "lookups: %llu", stats.lookups);
+    ASSERT_TRY(stats.hits + stats.misses == stats.lookups);
+    ASSERT_TRY_MSG(stats.hits == ec_hashtbl_get_count(&hash_table, context), "hits: %llu", stats.hits);
+    ASSERT_TRY_MSG(stats.inserts == STATS_KEYS, "inserts: %llu", stats.inserts);
+    ASSERT_TRY_MSG(stats.exists == 1, "exists: %llu", stats.exists);
+    ASSERT_TRY_MSG(stats.evictions == STATS_KEYS - stats.hits, "evictions: %llu", stats.evictions);
+    ASSERT_TRY(sampled <= stats.lookups);
+
+    ec_hashtbl_reset_stats(&hash_table);
+    ec_hashtbl_get_stats(&hash_table, &stats);
+    ASSERT_TRY(stats.lookups == 0 && stats.inserts == 0 && stats.evictions == 0);
+
+    passed = true;
+
+CATCH_DEFAULT:
+    if (tdata)
+    {
+        ec_hashtbl_free(&hash_table, tdata, context);
+    }
+    ec_hashtbl_destroy(&hash_table, context);
+    return passed;
+}
+
+#define SHRINK_KEYS        512
+#define SHRINK_HOT_KEYS    64
+#define SHRINK_SCAN        256
+
+static unsigned long __init __test__hashtbl_shrink(HashTbl *hash_table, unsigned long nr_to_scan, ProcessContext *context)
+{
+    struct shrink_control sc = {
+        .gfp_mask   = GFP_KERNEL,
+        .nr_to_scan = nr_to_scan,
+    };
+
+#ifdef EC_SHRINKER_COUNT_SCAN
+    return hash_table->shrinker.scan_objects(&hash_table->shrinker, &sc);
+#else
+    int64_t before = ec_hashtbl_get_count(hash_table, context);
+
+    hash_table->shrinker.shrink(&hash_table->shrinker, &sc);
+    return before - ec_hashtbl_get_count(hash_table, context);
+#endif
+}
+
+// Calls the shrinker the way reclaim would, the entries that were looked up should
+//  outlive the ones that were not
+bool __init test__hashtbl_shrinker(ProcessContext *context)
+{
+    bool           passed     = false;
+    HashTbl        hash_table = HASH_TBL_INIT();
+    HashTableStats stats;
+    unsigned long  reclaimed;
+    int            i;
+
+    hash_table.numberOfBuckets = 64;
+    hash_table.reclaimable     = true;
+    hash_table.delete_callback = NULL;
+
+    ASSERT_TRY(ec_hashtbl_init(&hash_table, context));
+
+    for (i = 0; i < SHRINK_KEYS; ++i)
+    {
+        ASSERT_TRY(__add_entry(i, &hash_table, context));
+    }
+    for (i = 0; i < SHRINK_HOT_KEYS; ++i)
+    {
+        ASSERT_TRY(__check_entry_exists(&hash_table, i * (SHRINK_KEYS / SHRINK_HOT_KEYS), context));
+    }
+
+    // There are more cold entries than asked for, so the hand does not come round
+    //  to a hot entry twice
+    reclaimed = __test__hashtbl_shrink(&hash_table, SHRINK_SCAN, context);
+    ASSERT_TRY_MSG(reclaimed == SHRINK_SCAN, "reclaimed: %lu", reclaimed);
+    ASSERT_TRY(ec_hashtbl_get_count(&hash_table, context) == SHRINK_KEYS - SHRINK_SCAN);
+
+    for (i = 0; i < SHRINK_HOT_KEYS; ++i)
+    {
+        ASSERT_TRY_MSG(__check_entry_exists(&hash_table, i * (SHRINK_KEYS / SHRINK_HOT_KEYS), context),
+            "hot key %d reclaimed", i * (SHRINK_KEYS / SHRINK_HOT_KEYS));
+    }
+
+    ec_hashtbl_get_stats(&hash_table, &stats);
+    ASSERT_TRY_MSG(stats.reclaimed == SHRINK_SCAN, "reclaimed: %llu", stats.reclaimed);
+    ASSERT_TRY(atomic64_read(&hash_table.hash_cache.reclaimed) == SHRINK_SCAN);
+
+    passed = true;
+
+CATCH_DEFAULT:
+    ec_hashtbl_destroy(&hash_table, context);
+    return passed;
+}
+
 static void __init __ec_test_hashtbl_delete_callback(void *data, ProcessContext *context)
 {
     ++_delete_callback_called;
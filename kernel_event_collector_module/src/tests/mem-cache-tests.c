@@ -7,6 +7,7 @@ bool __init test__mem_cache_create_destroy(ProcessContext *context);
 bool __init test__mem_cache_alloc(ProcessContext *context);
 bool __init test__mem_cache_get_put(ProcessContext *context);
 bool __init test__mem_cache_delete_cb(ProcessContext *context);
+bool __init test__mem_cache_magazine(ProcessContext *context);
 
 bool __init test__mem_cache(ProcessContext *context)
 {
@@ -16,6 +17,7 @@ bool __init test__mem_cache(ProcessContext *context)
     RUN_TEST(test__mem_cache_alloc(context));
     RUN_TEST(test__mem_cache_get_put(context));
     RUN_TEST(test__mem_cache_delete_cb(context));
+    RUN_TEST(test__mem_cache_magazine(context));
 
     RETURN_RESULT();
 }
@@ -131,4 +133,80 @@ bool __init test__mem_cache_delete_cb(ProcessContext *context)
 
 CATCH_DEFAULT:
     return false;
-}
\ No newline at end of file
+}
+
+#define MAGAZINE_OBJECTS   64
+
+// A freed object is kept by its cpu and comes back from the next alloc there, and
+//  objects too big for the magazine go straight back to the kmem cache
+bool __init test__mem_cache_magazine(ProcessContext *context)
+{
+    bool          passed    = false;
+    CB_MEM_CACHE  mem_cache = CB_MEM_CACHE_INIT();
+    CB_MEM_CACHE  big_cache = CB_MEM_CACHE_INIT();
+    void         *values[MAGAZINE_OBJECTS] = { NULL };
+    void         *value = NULL;
+    void         *again = NULL;
+    int64_t       cached_after_free = 0;
+    int64_t       cached_after_alloc = 0;
+    unsigned long flags;
+    int           i;
+
+    DECLARE_ATOMIC_CONTEXT(atomic_context, ec_getpid(current));
+
+    ASSERT_TRY(ec_mem_cache_create(&mem_cache, "test cache", 256, context));
+    ASSERT_TRY(ec_mem_cache_create(&big_cache, "test big cache", PATH_MAX, context));
+
+    // Stay on one cpu so the free and the alloc use the same magazine
+    local_irq_save(flags);
+    value = ec_mem_cache_alloc(&mem_cache, &atomic_context);
+    if (value)
+    {
+        ec_mem_cache_disown(value, &atomic_context);
+        cached_after_free = ec_mem_cache_get_cached_count(&mem_cache, &atomic_context);
+        again = ec_mem_cache_alloc(&mem_cache, &atomic_context);
+        cached_after_alloc = ec_mem_cache_get_cached_count(&mem_cache, &atomic_context);
+    }
+    local_irq_restore(flags);
+
+    ASSERT_TRY(value && again);
+    ASSERT_TRY_MSG(again == value, "freed %p but got %p", value, again);
+    ASSERT_TRY(cached_after_free == 1 && cached_after_alloc == 0);
+    ec_mem_cache_disown(again, context);
+    again = NULL;
+
+    // More than a cpu keeps, the rest go back to the kmem cache
+    for (i = 0; i < MAGAZINE_OBJECTS; ++i)
+    {
+        values[i] = ec_mem_cache_alloc(&mem_cache, context);
+        ASSERT_TRY(values[i]);
+    }
+    for (i = 0; i < MAGAZINE_OBJECTS; ++i)
+    {
+        ec_mem_cache_disown(values[i], context);
+        values[i] = NULL;
+    }
+    ASSERT_TRY(ec_mem_cache_get_allocated_count(&mem_cache, context) == 0);
+    ASSERT_TRY(ec_mem_cache_get_cached_count(&mem_cache, context) < MAGAZINE_OBJECTS);
+
+    ec_mem_cache_drain(&mem_cache, context);
+    ASSERT_TRY(ec_mem_cache_get_cached_count(&mem_cache, context) == 0);
+
+    value = ec_mem_cache_alloc(&big_cache, context);
+    ASSERT_TRY(value);
+    ec_mem_cache_disown(value, context);
+    ASSERT_TRY(ec_mem_cache_get_cached_count(&big_cache, context) == 0);
+
+    passed = true;
+
+CATCH_DEFAULT:
+    ec_mem_cache_disown(again, context);
+    for (i = 0; i < MAGAZINE_OBJECTS; ++i)
+    {
+        ec_mem_cache_disown(values[i], context);
+    }
+    ec_mem_cache_destroy(&big_cache, context);
+    ec_mem_cache_destroy(&mem_cache, context);
+
+    return passed;
+}
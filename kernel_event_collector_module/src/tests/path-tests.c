@@ -1,6 +1,7 @@
 /* Copyright 2022 VMWare, Inc.  All rights reserved. */
 
 #include "path-buffers.h"
+#include "path-cache.h"
 #include "mem-alloc.h"
 
 #include "run-tests.h"
@@ -13,6 +14,8 @@ struct file *__ec_get_file_from_mm(struct mm_struct *mm);
 bool __init test__task_get_path_data__use_comm(ProcessContext *context);
 bool __init test__path_cache_add__ignored_fs(ProcessContext *context);
 bool __init test__get_path_data__invalid(ProcessContext *context);
+bool __init test__path_buffers__latency(ProcessContext *context);
+bool __init test__path_intern__deep_tree(ProcessContext *context);
 
 bool __init test__paths(ProcessContext *context)
 {
@@ -21,6 +24,8 @@ bool __init test__paths(ProcessContext *context)
     RUN_TEST(test__task_get_path_data__use_comm(context));
     RUN_TEST(test__path_cache_add__ignored_fs(context));
     RUN_TEST(test__get_path_data__invalid(context));
+    RUN_TEST(test__path_buffers__latency(context));
+    RUN_TEST(test__path_intern__deep_tree(context));
 
     RETURN_RESULT();
 }
@@ -114,4 +119,174 @@ CATCH_DEFAULT:
     ec_path_cache_put(path_data, context);
 
     return passed;
-}
\ No newline at end of file
+}
+
+#define PATH_BUFFER_ROUNDS  4096
+#define PATH_BUFFER_NESTED  8
+
+// Times a get and put pair from the per cpu stack, and from the slab once more are
+//  held than a cpu keeps. Interrupts are off while timing so the same stack is used.
+bool __init test__path_buffers__latency(ProcessContext *context)
+{
+    bool          passed = false;
+    char         *buffers[PATH_BUFFER_NESTED] = { NULL };
+    uint64_t      fallbacks_before;
+    uint64_t      failures_before;
+    uint64_t      fallbacks;
+    uint64_t      failures;
+    uint64_t      start_ns;
+    uint64_t      stack_ns;
+    uint64_t      nested_ns;
+    unsigned long flags;
+    int           i;
+    int           j;
+
+    DECLARE_ATOMIC_CONTEXT(atomic_context, ec_getpid(current));
+
+    ec_path_buffers_get_stats(&fallbacks_before, &failures_before);
+
+    local_irq_save(flags);
+    start_ns = ktime_to_ns(ktime_get());
+    for (i = 0; i < PATH_BUFFER_ROUNDS; ++i)
+    {
+        buffers[0] = ec_get_path_buffer(&atomic_context);
+        if (!buffers[0])
+        {
+            break;
+        }
+        ec_put_path_buffer(buffers[0]);
+        buffers[0] = NULL;
+    }
+    stack_ns = (ktime_to_ns(ktime_get()) - start_ns) / PATH_BUFFER_ROUNDS;
+
+    ec_path_buffers_get_stats(&fallbacks, &failures);
+    local_irq_restore(flags);
+
+    ASSERT_TRY_MSG(i == PATH_BUFFER_ROUNDS, "get failed after %d rounds", i);
+    ASSERT_TRY_MSG(fallbacks == fallbacks_before, "%llu fallbacks", fallbacks - fallbacks_before);
+
+    start_ns = ktime_to_ns(ktime_get());
+    for (i = 0; i < PATH_BUFFER_ROUNDS / PATH_BUFFER_NESTED; ++i)
+    {
+        for (j = 0; j < PATH_BUFFER_NESTED; ++j)
+        {
+            buffers[j] = ec_get_path_buffer(context);
+            ASSERT_TRY(buffers[j]);
+            ASSERT_TRY(buffers[j][0] == 0 && buffers[j][PATH_MAX] == 0);
+        }
+        for (j = PATH_BUFFER_NESTED - 1; j >= 0; --j)
+        {
+            ec_put_path_buffer(buffers[j]);
+            buffers[j] = NULL;
+        }
+    }
+    nested_ns = (ktime_to_ns(ktime_get()) - start_ns) / (PATH_BUFFER_ROUNDS / PATH_BUFFER_NESTED * PATH_BUFFER_NESTED);
+
+    // Not every round has to fall back, the task may move to a cpu with a full stack
+    ec_path_buffers_get_stats(&fallbacks, &failures);
+    ASSERT_TRY(failures == failures_before);
+
+    TRACE(DL_INFO, "path buffer get and put: %lluns from the cpu stack, %lluns with %d held (%llu fallbacks)",
+        stack_ns, nested_ns, PATH_BUFFER_NESTED, fallbacks - fallbacks_before);
+
+    passed = true;
+
+CATCH_DEFAULT:
+    for (j = 0; j < PATH_BUFFER_NESTED; ++j)
+    {
+        ec_put_path_buffer(buffers[j]);
+    }
+    return passed;
+}
+
+#define PATH_TREE_FANOUT    4
+#define PATH_TREE_DEPTH     5
+#define PATH_TREE_LEAVES    1024    // PATH_TREE_FANOUT ^ PATH_TREE_DEPTH
+#define PATH_TREE_COPIES    4
+
+static char *__init __path_tree_leaf(int leaf, ProcessContext *context)
+{
+    char name[128];
+    int  len = snprintf(name, sizeof(name), "/srv/ec-intern-test");
+    int  d;
+
+    for (d = 0; d < PATH_TREE_DEPTH; ++d, leaf /= PATH_TREE_FANOUT)
+    {
+        len += snprintf(name + len, sizeof(name) - len, "/dir%d", leaf % PATH_TREE_FANOUT);
+    }
+    snprintf(name + len, sizeof(name) - len, "/data.bin");
+
+    return ec_mem_strdup(name, context);
+}
+
+// Every leaf of a synthetic directory tree is interned PATH_TREE_COPIES times, each
+//  time from a fresh copy the way a path is read for a new inode. Every copy after
+//  the first has to get the first one back, and once all of them are put the
+//  strings have to be gone from the table.
+bool __init test__path_intern__deep_tree(ProcessContext *context)
+{
+    bool      passed = false;
+    char    **shared = NULL;
+    char     *copy = NULL;
+    char     *again = NULL;
+    uint64_t  strings_before;
+    uint64_t  strings;
+    uint64_t  bytes_before;
+    uint64_t  bytes;
+    int       i;
+    int       r;
+
+    shared = ec_mem_valloc(PATH_TREE_LEAVES * PATH_TREE_COPIES * sizeof(char *), context);
+    ASSERT_TRY(shared);
+    memset(shared, 0, PATH_TREE_LEAVES * PATH_TREE_COPIES * sizeof(char *));
+
+    ec_path_intern_get_stats(&strings_before, &bytes_before, context);
+
+    for (r = 0; r < PATH_TREE_COPIES; ++r)
+    {
+        for (i = 0; i < PATH_TREE_LEAVES; ++i)
+        {
+            copy = __path_tree_leaf(i, context);
+            ASSERT_TRY(copy);
+
+            shared[r * PATH_TREE_LEAVES + i] = ec_path_intern(copy, context);
+            ASSERT_TRY(shared[r * PATH_TREE_LEAVES + i]);
+            ASSERT_TRY(strcmp(shared[r * PATH_TREE_LEAVES + i], copy) == 0);
+            ASSERT_TRY(shared[r * PATH_TREE_LEAVES + i] == (r ? shared[i] : copy));
+
+            ec_mem_put(copy);
+            copy = NULL;
+        }
+    }
+
+    ec_path_intern_get_stats(&strings, &bytes, context);
+    ASSERT_TRY(bytes > bytes_before);
+
+    TRACE(DL_INFO, "path intern: %d paths %d times share %llu strings, %llu bytes of copies dropped",
+        PATH_TREE_LEAVES, PATH_TREE_COPIES, strings - strings_before, bytes - bytes_before);
+
+    for (i = 0; i < PATH_TREE_LEAVES * PATH_TREE_COPIES; ++i)
+    {
+        ec_path_intern_put(shared[i], context);
+        shared[i] = NULL;
+    }
+
+    // With the last user gone the next copy is not given the old string
+    copy = __path_tree_leaf(0, context);
+    ASSERT_TRY(copy);
+    again = ec_path_intern(copy, context);
+    ASSERT_TRY(again == copy);
+
+    passed = true;
+
+CATCH_DEFAULT:
+    ec_path_intern_put(again, context);
+    ec_mem_put(copy);
+    for (i = 0; shared && i < PATH_TREE_LEAVES * PATH_TREE_COPIES; ++i)
+    {
+        ec_path_intern_put(shared[i], context);
+    }
+    ec_mem_free(shared);
+
+    return passed;
+}